@@ -1,12 +1,26 @@
+#define _GNU_SOURCE
 #include "matrix.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <float.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <complex.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
-#define RAND_MAX 0x7fffffff
 #define EPSILON 1e-10
 
+//large matrices get one placed mapping, see the memory placement section
+static int alloc_region(mat* m);
+
 //for allocating a new matrix
 mat* new_mat(unsigned int num_rows, unsigned int num_cols){
   if(num_rows == 0 || num_cols == 0){
@@ -18,6 +32,7 @@ mat* new_mat(unsigned int num_rows, unsigned int num_cols){
   m->num_rows = num_rows;
   m->num_cols = num_cols;
   m->is_square = (num_rows == num_cols) ? 1 : 0;
+  if(alloc_region(m)) return m;
   //allocates memory for the column array
   m->values = calloc(m->num_rows, sizeof(*m->values));
   for(int i =0; i < m->num_rows; ++i){
@@ -30,8 +45,28 @@ mat* new_mat(unsigned int num_rows, unsigned int num_cols){
   return m;
 }
 
+//random number streams, defined with the random numbers section below
+static void default_rng_take(mat_rng* rng, unsigned long long n);
+static void rng_fill_mat(mat_rng* rng, mat* m, double min, double max);
+static void rng_normal_fill(mat_rng* rng, double* dst, size_t n, double mean, double stddev);
+static void rng_normal_mat(mat_rng* rng, mat* m, double mean, double stddev);
+
+//row-parallel elementwise kernels, defined after the parallel execution section
+enum { EW_COPY, EW_FILL, EW_ADD, EW_SUB, EW_SCALE };
+static void elementwise(int op, mat* dst, mat* src, double value);
+static void rows_copy(double** dst, double** src, unsigned int num_rows, unsigned int num_cols, unsigned int col0);
+static void transpose_into(mat* dst, mat* src);
+
 //freeing the matrix
 void free_mat(mat* matrix){
+  if(matrix->map_base != NULL || matrix->region_base != NULL){
+    //rows live in one mapping: a file (mat_map_binary) or a large matrix's pages
+    if(matrix->map_base != NULL) munmap(matrix->map_base, matrix->map_len);
+    else munmap(matrix->region_base, matrix->region_len);
+    free(matrix->values);
+    free(matrix);
+    return;
+  }
   for(int i  = 0; i < matrix->num_rows; ++i){
     free(matrix->values[i]); //free each row's data
   }
@@ -39,22 +74,23 @@ void free_mat(mat* matrix){
   free(matrix); //freee the matrix struct
 }
 
-//for generating random values
+//for generating random values, drawn from the library's default stream
+//(see the random numbers section); thread-safe, unlike rand()
 double rand_interval(double min, double max){
-  double d;
-  d = (double)rand()/((double)RAND_MAX + 1);
-  return (min + d*(max-min));
+  mat_rng rng;
+  default_rng_take(&rng, 1);
+  return min + mat_rng_uniform(&rng)*(max-min);
 }
 
 
-//creating random matrices
+//creating random matrices, filled in parallel from the default stream; the
+//values only depend on the seed and on the calls made before, never on the
+//number of threads
 mat* random_mat(unsigned int num_rows, unsigned int num_cols, double min, double max){
   mat* random_matrix = new_mat(num_rows, num_cols);
-  for(int i = 0; i< num_rows; i++){
-    for(int j = 0; j < num_cols; j++){
-      random_matrix->values[i][j] = rand_interval(min,max);
-    }
-  }
+  mat_rng rng;
+  default_rng_take(&rng, (unsigned long long)num_rows*num_cols);
+  rng_fill_mat(&rng, random_matrix, min, max);
   return random_matrix;
 }
 
@@ -82,30 +118,21 @@ mat* eye_mat(unsigned int size){
 //copying a matrix
 mat* mat_cp(mat* matrix){
   mat* new_matrix = new_mat(matrix->num_rows,matrix->num_cols);
-  for(int i = 0; i < matrix->num_rows; i++){
-    for(int j = 0; j < matrix->num_cols; j++){
-      new_matrix->values[i][j] = matrix -> values[i][j];
-    }
-  }
+  elementwise(EW_COPY, new_matrix, matrix, 0.0);
   return new_matrix;
 }
 
-//reading from file
-mat* read_from_filef(FILE* f){
-  int i,j;
-  unsigned int num_rows = 0, num_cols = 0;
-  printf("enter the number of rows\n");
-  fscanf(f, "%d", &num_rows);
-  printf("enter the number of cols\n");
-  fscanf(f, "%d", &num_cols);
-  mat* matrix = new_mat(num_rows, num_cols);
-  for(i = 0; i < matrix->num_rows; i++){
-    for(j = 0; j < matrix->num_cols; j++){
-      fscanf(f, "%lf", &matrix->values[i][j]);
+//reading from file: "rows cols" followed by the values, separated by
+//whitespace or commas. Reads exactly one matrix and leaves the stream after
+//it. Parsed by the bulk text reader below.
+static mat* text_read_with_header(FILE* f);
 
-    }
+mat* read_from_filef(FILE* f){
+  if(f == NULL){
+    fprintf(stderr, "Cannot read a matrix from a NULL stream\n");
+    return NULL;
   }
-  return matrix;
+  return text_read_with_header(f);
 }
 
 
@@ -135,16 +162,13 @@ void mat_print(mat* matrix){
   mat_printf(matrix, "%lf\t\t");
 }
 
-//printing the matrix elements
+//printing the matrix elements, formatted in parallel row blocks and
+//written to stdout in large pieces (see the text output section)
+static int text_write_rows(mat* m, FILE* f, int fd, const char* fmt, char delim);
+
 void mat_printf(mat* matrix, const char* fmt){
-  int i,j;
   fprintf(stdout, "\n");
-  for(i = 0; i < matrix->num_rows; i++){
-    for(j = 0; j < matrix->num_cols; j++){
-      fprintf(stdout, fmt, matrix->values[i][j]);
-    }
-    fprintf(stdout, "\n");
-  }
+  text_write_rows(matrix, stdout, -1, fmt, 0);
   fprintf(stdout,"\n");
 }
 
@@ -178,11 +202,7 @@ mat* get_row_mat(mat* matrix,unsigned int row){
 
 //setting all the cells of the matrix to a particular value
 void set_mat_val(mat* matrix, double value){
-  for(int i=0; i < matrix->num_rows; i++){
-    for(int j = 0; j < matrix->num_cols; j++){
-      matrix->values[i][j] = value;
-    }
-  }
+  elementwise(EW_FILL, matrix, NULL, value);
 }
 
 //setting the diagonal of a sq matrix to a particular value
@@ -283,12 +303,7 @@ mat* mat_smult(mat* matrix, double num){
 }
 
 int mat_smult_r(mat* matrix, double num){
-  for(int i = 0; i < matrix->num_rows; i++){
-    for(int j = 0; j < matrix->num_cols; j++){
-      matrix->values[i][j] *= num;
-    }
-
-  }
+  elementwise(EW_SCALE, matrix, NULL, num);
   return 1;
 }
 
@@ -413,27 +428,16 @@ mat* mat_hor_cat(unsigned int mnum, mat** marr){
   }
   mat* new_matrix = new_mat(total_rows, total_cols);
 
-  //copy data from all matrics
-  for(int i = 0; i < total_rows; i++){
-    int current_matrix = 0;
-    int cols_copied = 0; //how many columns we have filled so far
-
-    for(int j =0; j < total_cols; j++){
-      int col_in_current_matrix = j - cols_copied;
-      if(col_in_current_matrix >= marr[current_matrix]->num_cols){
-        cols_copied += marr[current_matrix]->num_cols;
-        current_matrix++;
-        col_in_current_matrix = 0;
-
-      }
-      new_matrix->values[i][j] = marr[current_matrix]->values[i][col_in_current_matrix];
-    }
+  //copy data from all matrics, each one into its column range
+  unsigned int cols_copied = 0;
+  for(unsigned int k = 0; k < mnum; k++){
+    rows_copy(new_matrix->values, marr[k]->values, total_rows, marr[k]->num_cols, cols_copied);
+    cols_copied += marr[k]->num_cols;
   }
   return new_matrix;
 }
 
 //vertical concatenation
-//TODO REWRITE
 mat* mat_vert_cat(unsigned int mnum, mat** marr){
   //handle edge case
   if(mnum == 0) return NULL;
@@ -457,18 +461,12 @@ mat* mat_vert_cat(unsigned int mnum, mat** marr){
   }
   //create new matrix
   mat* new_matrix = new_mat(total_rows, total_cols);
-  int dest_row = 0;
+  unsigned int dest_row = 0;
   for(unsigned int k = 0; k < mnum; k++){
-    for(unsigned int i = 0; i < marr[k]->num_rows; i++){
-      for(unsigned int j = 0; j < total_cols; j++){
-        new_matrix->values[dest_row][j] = marr[k]->values[i][j];
-      }
-      dest_row++;
-    }
-
-  } 
-  return new_matrix;  
-  
+    rows_copy(new_matrix->values + dest_row, marr[k]->values, marr[k]->num_rows, total_cols, 0);
+    dest_row += marr[k]->num_rows;
+  }
+  return new_matrix;
 }
 
 
@@ -478,11 +476,7 @@ int mat_add_r(mat* mat1, mat* mat2){
     fprintf(stderr, "not of saem dimensions");
     return 0;
   }
-  for(int i =0; i < mat1->num_rows; i++){
-    for(int j = 0; j < mat2->num_cols; j++){
-      mat1->values[i][j]+= mat2->values[i][j];
-    }
-  }
+  elementwise(EW_ADD, mat1, mat2, 0.0);
   return 1;
 }
 
@@ -501,11 +495,7 @@ int mat_sub_r(mat* mat1, mat* mat2){
     fprintf(stderr, "not of saem dimensions");
     return 0;
   }
-  for(int i =0; i < mat1->num_rows; i++){
-    for(int j = 0; j < mat2->num_cols; j++){
-      mat1->values[i][j]-= mat2->values[i][j];
-    }
-  }
+  elementwise(EW_SUB, mat1, mat2, 0.0);
   return 1;
 }
 
@@ -519,6 +509,9 @@ mat* mat_sub(mat* mat1, mat* mat2){
 }
 
 //dot multiplication of two matrices
+//blocked, threaded C = A*B kernel, defined with the matrix functions below
+static void gemm(double** c, double** a, double** b, unsigned int m, unsigned int k, unsigned int n);
+
 mat* mat_dot_r(mat* mat1, mat* mat2){
   if(mat1->num_cols != mat2->num_rows){
     fprintf(stderr, "cannot muliply. ");
@@ -526,13 +519,7 @@ mat* mat_dot_r(mat* mat1, mat* mat2){
   }
   
   mat* new_matrix = new_mat(mat1->num_rows, mat2->num_cols);
-  for(int i = 0; i < new_matrix->num_rows; i++){
-    for(int j = 0; j < new_matrix->num_cols; j++){
-      for(int k = 0; k < mat1->num_cols; k++){
-        new_matrix->values [i][j] += mat1->values[i][k] * mat2->values[k][j];
-      }
-    }
-  }
+  gemm(new_matrix->values, mat1->values, mat2->values, mat1->num_rows, mat1->num_cols, mat2->num_cols);
   return new_matrix;
 }
 
@@ -828,13 +815,7 @@ mat* mat_transpose(mat* matrix) {
   }
   
   mat* transposed = new_mat(matrix->num_cols, matrix->num_rows);
-  
-  for (unsigned int i = 0; i < matrix->num_rows; i++) {
-    for (unsigned int j = 0; j < matrix->num_cols; j++) {
-      transposed->values[j][i] = matrix->values[i][j];
-    }
-  }
-  
+  transpose_into(transposed, matrix);
   return transposed;
 }
 
@@ -963,4 +944,7871 @@ mat* mat_qr_solve(mat* Q, mat* R, mat* b) {
   free_mat(QtB);
   
   return x;
-}
\ No newline at end of file
+}
+
+// ---------------------------------------------------------------------------
+// Iterative (Krylov) solvers
+// ---------------------------------------------------------------------------
+
+// dense vector helpers shared by the iterative solvers
+static double vec_dot(const double* x, const double* y, unsigned int n) {
+  double sum = 0.0;
+  for (unsigned int i = 0; i < n; i++) {
+    sum += x[i] * y[i];
+  }
+  return sum;
+}
+
+static double vec_norm(const double* x, unsigned int n) {
+  return sqrt(vec_dot(x, x, n));
+}
+
+// y = y + alpha * x
+static void vec_axpy(double* y, double alpha, const double* x, unsigned int n) {
+  for (unsigned int i = 0; i < n; i++) {
+    y[i] += alpha * x[i];
+  }
+}
+
+// copies an n x 1 column matrix into a plain array
+static void vec_from_col(double* dst, mat* col) {
+  for (unsigned int i = 0; i < col->num_rows; i++) {
+    dst[i] = col->values[i][0];
+  }
+}
+
+static mat* col_from_vec(const double* src, unsigned int n) {
+  mat* col = new_mat(n, 1);
+  for (unsigned int i = 0; i < n; i++) {
+    col->values[i][0] = src[i];
+  }
+  return col;
+}
+
+// y = A*x for a dense mat
+static void mat_op_dense_apply(void* ctx, const double* x, double* y) {
+  mat* A = (mat*)ctx;
+  for (unsigned int i = 0; i < A->num_rows; i++) {
+    const double* row = A->values[i];
+    double sum = 0.0;
+    for (unsigned int j = 0; j < A->num_cols; j++) {
+      sum += row[j] * x[j];
+    }
+    y[i] = sum;
+  }
+}
+
+// Wrap a square matrix as a linear operator
+mat_op mat_op_from_mat(mat* A) {
+  mat_op op;
+  op.n = A ? A->num_rows : 0;
+  op.apply = mat_op_dense_apply;
+  op.ctx = A;
+  op.destroy = NULL;
+  if (!A || !A->is_square) {
+    fprintf(stderr, "operator requires a square matrix\n");
+    op.n = 0;
+  }
+  return op;
+}
+
+// Jacobi preconditioner: M^-1 = diag(A)^-1
+typedef struct {
+  unsigned int n;
+  double* inv_diag;
+} precond_jacobi;
+
+static void precond_jacobi_apply(void* ctx, const double* x, double* y) {
+  precond_jacobi* pj = (precond_jacobi*)ctx;
+  for (unsigned int i = 0; i < pj->n; i++) {
+    y[i] = pj->inv_diag[i] * x[i];
+  }
+}
+
+static void precond_jacobi_free(void* ctx) {
+  precond_jacobi* pj = (precond_jacobi*)ctx;
+  free(pj->inv_diag);
+  free(pj);
+}
+
+int mat_precond_jacobi(mat* A, mat_op* M) {
+  if (!A || !M || !A->is_square) {
+    fprintf(stderr, "Jacobi preconditioner requires a square matrix\n");
+    return 0;
+  }
+  unsigned int n = A->num_rows;
+  precond_jacobi* pj = malloc(sizeof(*pj));
+  pj->n = n;
+  pj->inv_diag = malloc(n * sizeof(*pj->inv_diag));
+  for (unsigned int i = 0; i < n; i++) {
+    if (fabs(A->values[i][i]) < EPSILON) {
+      fprintf(stderr, "Jacobi preconditioner needs a nonzero diagonal (row %u)\n", i);
+      precond_jacobi_free(pj);
+      return 0;
+    }
+    pj->inv_diag[i] = 1.0 / A->values[i][i];
+  }
+  M->n = n;
+  M->apply = precond_jacobi_apply;
+  M->ctx = pj;
+  M->destroy = precond_jacobi_free;
+  return 1;
+}
+
+// ILU(0) preconditioner: incomplete LU restricted to the nonzero pattern of A,
+// stored in CSR form so applying it costs O(nnz)
+typedef struct {
+  unsigned int n;
+  unsigned int* row_ptr;
+  unsigned int* col_idx;
+  unsigned int* diag_pos;  // position of the diagonal entry in each row
+  double* val;             // unit lower L below the diagonal, U on and above
+} precond_ilu0;
+
+static void precond_ilu0_apply(void* ctx, const double* x, double* y) {
+  precond_ilu0* p = (precond_ilu0*)ctx;
+  unsigned int n = p->n;
+  // forward substitution with unit lower L
+  for (unsigned int i = 0; i < n; i++) {
+    double sum = x[i];
+    for (unsigned int k = p->row_ptr[i]; k < p->diag_pos[i]; k++) {
+      sum -= p->val[k] * y[p->col_idx[k]];
+    }
+    y[i] = sum;
+  }
+  // backward substitution with U
+  for (unsigned int i = n; i-- > 0;) {
+    double sum = y[i];
+    for (unsigned int k = p->diag_pos[i] + 1; k < p->row_ptr[i + 1]; k++) {
+      sum -= p->val[k] * y[p->col_idx[k]];
+    }
+    y[i] = sum / p->val[p->diag_pos[i]];
+  }
+}
+
+static void precond_ilu0_free(void* ctx) {
+  precond_ilu0* p = (precond_ilu0*)ctx;
+  free(p->row_ptr);
+  free(p->col_idx);
+  free(p->diag_pos);
+  free(p->val);
+  free(p);
+}
+
+int mat_precond_ilu0(mat* A, mat_op* M) {
+  if (!A || !M || !A->is_square) {
+    fprintf(stderr, "ILU(0) preconditioner requires a square matrix\n");
+    return 0;
+  }
+  unsigned int n = A->num_rows;
+  precond_ilu0* p = calloc(1, sizeof(*p));
+  p->n = n;
+  p->row_ptr = malloc((n + 1) * sizeof(*p->row_ptr));
+  p->diag_pos = malloc(n * sizeof(*p->diag_pos));
+
+  // Step 1: build the CSR pattern (the diagonal is always kept)
+  unsigned int nnz = 0;
+  for (unsigned int i = 0; i < n; i++) {
+    for (unsigned int j = 0; j < n; j++) {
+      if (A->values[i][j] != 0.0 || i == j) nnz++;
+    }
+  }
+  p->col_idx = malloc(nnz * sizeof(*p->col_idx));
+  p->val = malloc(nnz * sizeof(*p->val));
+  nnz = 0;
+  for (unsigned int i = 0; i < n; i++) {
+    p->row_ptr[i] = nnz;
+    for (unsigned int j = 0; j < n; j++) {
+      if (A->values[i][j] != 0.0 || i == j) {
+        if (i == j) p->diag_pos[i] = nnz;
+        p->col_idx[nnz] = j;
+        p->val[nnz] = A->values[i][j];
+        nnz++;
+      }
+    }
+  }
+  p->row_ptr[n] = nnz;
+
+  // Step 2: IKJ incomplete factorization, dropping fill outside the pattern
+  int* pos = malloc(n * sizeof(*pos));
+  for (unsigned int j = 0; j < n; j++) pos[j] = -1;
+  for (unsigned int i = 0; i < n; i++) {
+    for (unsigned int k = p->row_ptr[i]; k < p->row_ptr[i + 1]; k++) {
+      pos[p->col_idx[k]] = (int)k;
+    }
+    for (unsigned int k = p->row_ptr[i]; k < p->diag_pos[i]; k++) {
+      unsigned int col = p->col_idx[k];
+      double pivot = p->val[p->diag_pos[col]];
+      if (fabs(pivot) < EPSILON) {
+        fprintf(stderr, "ILU(0) breakdown: zero pivot in row %u\n", col);
+        free(pos);
+        precond_ilu0_free(p);
+        return 0;
+      }
+      double factor = p->val[k] / pivot;
+      p->val[k] = factor;
+      for (unsigned int kk = p->diag_pos[col] + 1; kk < p->row_ptr[col + 1]; kk++) {
+        int target = pos[p->col_idx[kk]];
+        if (target >= 0) {
+          p->val[target] -= factor * p->val[kk];
+        }
+      }
+    }
+    for (unsigned int k = p->row_ptr[i]; k < p->row_ptr[i + 1]; k++) {
+      pos[p->col_idx[k]] = -1;
+    }
+  }
+  free(pos);
+  if (fabs(p->val[p->diag_pos[n - 1]]) < EPSILON) {
+    fprintf(stderr, "ILU(0) breakdown: zero pivot in row %u\n", n - 1);
+    precond_ilu0_free(p);
+    return 0;
+  }
+
+  M->n = n;
+  M->apply = precond_ilu0_apply;
+  M->ctx = p;
+  M->destroy = precond_ilu0_free;
+  return 1;
+}
+
+void mat_precond_free(mat_op* M) {
+  if (M && M->destroy) {
+    M->destroy(M->ctx);
+    M->ctx = NULL;
+    M->destroy = NULL;
+  }
+}
+
+// fills in defaults for unset solver options
+static mat_krylov_opts krylov_opts_resolve(const mat_krylov_opts* opts, unsigned int n) {
+  mat_krylov_opts o;
+  o.max_iter = (opts && opts->max_iter) ? opts->max_iter : (n > 1000 ? n : 1000);
+  o.restart = (opts && opts->restart) ? opts->restart : 30;
+  o.tol = (opts && opts->tol > 0.0) ? opts->tol : 1e-10;
+  if (o.restart > n) o.restart = n;
+  return o;
+}
+
+// validates arguments shared by all solvers and sets up x and r = b - A*x
+static int krylov_setup(mat_op* A, mat* b, mat* x0, mat_op* M, const char* name,
+                        double** x, double** r, double* bnorm, mat_krylov_stats* st) {
+  if (!A || !A->apply || A->n == 0 || !b) {
+    fprintf(stderr, "%s: invalid operator or right-hand side\n", name);
+    return 0;
+  }
+  unsigned int n = A->n;
+  if (b->num_rows != n || b->num_cols != 1 ||
+      (x0 && (x0->num_rows != n || x0->num_cols != 1))) {
+    fprintf(stderr, "%s: dimensions incompatible with operator\n", name);
+    return 0;
+  }
+  if (M && M->n != n) {
+    fprintf(stderr, "%s: preconditioner size does not match the operator\n", name);
+    return 0;
+  }
+  memset(st, 0, sizeof(*st));
+  *x = calloc(n, sizeof(**x));
+  *r = malloc(n * sizeof(**r));
+  vec_from_col(*r, b);
+  *bnorm = vec_norm(*r, n);
+  if (*bnorm == 0.0) *bnorm = 1.0;
+  if (x0) {
+    // warm start: r = b - A*x0
+    double* ax = malloc(n * sizeof(*ax));
+    vec_from_col(*x, x0);
+    A->apply(A->ctx, *x, ax);
+    st->matvecs++;
+    vec_axpy(*r, -1.0, ax, n);
+    free(ax);
+  }
+  return 1;
+}
+
+// records the true final residual and converts x to a column matrix
+static mat* krylov_finish(mat_op* A, mat* b, double* x, double bnorm, double tol,
+                          mat_krylov_stats* st) {
+  unsigned int n = A->n;
+  double* r = malloc(n * sizeof(*r));
+  A->apply(A->ctx, x, r);
+  st->matvecs++;
+  for (unsigned int i = 0; i < n; i++) {
+    r[i] = b->values[i][0] - r[i];
+  }
+  st->residual = vec_norm(r, n);
+  st->rel_residual = st->residual / bnorm;
+  // allow a little slack for rounding between the recurrence and the true residual
+  st->converged = st->rel_residual <= 10.0 * tol;
+  free(r);
+  return col_from_vec(x, n);
+}
+
+// applies M^-1 (or the identity when no preconditioner is given)
+static void precond_apply(mat_op* M, const double* x, double* y, unsigned int n) {
+  if (M && M->apply) {
+    M->apply(M->ctx, x, y);
+  } else {
+    memcpy(y, x, n * sizeof(*y));
+  }
+}
+
+// Preconditioned conjugate gradient for symmetric positive definite operators
+mat* mat_cg(mat_op* A, mat* b, mat* x0, mat_op* M,
+            const mat_krylov_opts* opts, mat_krylov_stats* stats) {
+  mat_krylov_stats local;
+  mat_krylov_stats* st = stats ? stats : &local;
+  double *x, *r, bnorm;
+  if (!krylov_setup(A, b, x0, M, "CG", &x, &r, &bnorm, st)) return NULL;
+  unsigned int n = A->n;
+  mat_krylov_opts o = krylov_opts_resolve(opts, n);
+
+  double* z = malloc(n * sizeof(*z));
+  double* p = malloc(n * sizeof(*p));
+  double* ap = malloc(n * sizeof(*ap));
+  precond_apply(M, r, z, n);
+  memcpy(p, z, n * sizeof(*p));
+  double rz = vec_dot(r, z, n);
+
+  while (st->iterations < o.max_iter && vec_norm(r, n) > o.tol * bnorm) {
+    A->apply(A->ctx, p, ap);
+    st->matvecs++;
+    double pap = vec_dot(p, ap, n);
+    if (pap <= 0.0) {
+      fprintf(stderr, "CG: operator is not positive definite\n");
+      break;
+    }
+    double alpha = rz / pap;
+    vec_axpy(x, alpha, p, n);
+    vec_axpy(r, -alpha, ap, n);
+    st->iterations++;
+
+    precond_apply(M, r, z, n);
+    double rz_new = vec_dot(r, z, n);
+    double beta = rz_new / rz;
+    rz = rz_new;
+    for (unsigned int i = 0; i < n; i++) {
+      p[i] = z[i] + beta * p[i];
+    }
+  }
+
+  mat* result = krylov_finish(A, b, x, bnorm, o.tol, st);
+  free(x);
+  free(r);
+  free(z);
+  free(p);
+  free(ap);
+  return result;
+}
+
+// Right-preconditioned BiCGSTAB for general nonsymmetric operators
+mat* mat_bicgstab(mat_op* A, mat* b, mat* x0, mat_op* M,
+                  const mat_krylov_opts* opts, mat_krylov_stats* stats) {
+  mat_krylov_stats local;
+  mat_krylov_stats* st = stats ? stats : &local;
+  double *x, *r, bnorm;
+  if (!krylov_setup(A, b, x0, M, "BiCGSTAB", &x, &r, &bnorm, st)) return NULL;
+  unsigned int n = A->n;
+  mat_krylov_opts o = krylov_opts_resolve(opts, n);
+
+  double* r0 = malloc(n * sizeof(*r0));
+  double* p = calloc(n, sizeof(*p));
+  double* v = calloc(n, sizeof(*v));
+  double* ph = malloc(n * sizeof(*ph));
+  double* s = malloc(n * sizeof(*s));
+  double* sh = malloc(n * sizeof(*sh));
+  double* t = malloc(n * sizeof(*t));
+  memcpy(r0, r, n * sizeof(*r0));
+  double rho = 1.0, alpha = 1.0, omega = 1.0;
+
+  while (st->iterations < o.max_iter && vec_norm(r, n) > o.tol * bnorm) {
+    double rho_new = vec_dot(r0, r, n);
+    if (fabs(rho_new) < 1e-300) {
+      fprintf(stderr, "BiCGSTAB: breakdown (rho = 0)\n");
+      break;
+    }
+    double beta = (rho_new / rho) * (alpha / omega);
+    rho = rho_new;
+    for (unsigned int i = 0; i < n; i++) {
+      p[i] = r[i] + beta * (p[i] - omega * v[i]);
+    }
+    precond_apply(M, p, ph, n);
+    A->apply(A->ctx, ph, v);
+    st->matvecs++;
+    double r0v = vec_dot(r0, v, n);
+    if (fabs(r0v) < 1e-300) {
+      fprintf(stderr, "BiCGSTAB: breakdown (r0 . v = 0)\n");
+      break;
+    }
+    alpha = rho / r0v;
+    for (unsigned int i = 0; i < n; i++) {
+      s[i] = r[i] - alpha * v[i];
+    }
+    st->iterations++;
+    if (vec_norm(s, n) <= o.tol * bnorm) {
+      // the half step already converged
+      vec_axpy(x, alpha, ph, n);
+      memcpy(r, s, n * sizeof(*r));
+      break;
+    }
+    precond_apply(M, s, sh, n);
+    A->apply(A->ctx, sh, t);
+    st->matvecs++;
+    double tt = vec_dot(t, t, n);
+    omega = (tt > 0.0) ? vec_dot(t, s, n) / tt : 0.0;
+    for (unsigned int i = 0; i < n; i++) {
+      x[i] += alpha * ph[i] + omega * sh[i];
+      r[i] = s[i] - omega * t[i];
+    }
+    if (omega == 0.0) {
+      fprintf(stderr, "BiCGSTAB: breakdown (omega = 0)\n");
+      break;
+    }
+  }
+
+  mat* result = krylov_finish(A, b, x, bnorm, o.tol, st);
+  free(x);
+  free(r);
+  free(r0);
+  free(p);
+  free(v);
+  free(ph);
+  free(s);
+  free(sh);
+  free(t);
+  return result;
+}
+
+// Restarted GMRES(m) with right preconditioning; the least squares problem
+// is kept triangular with Givens rotations so the residual is known each step
+mat* mat_gmres(mat_op* A, mat* b, mat* x0, mat_op* M,
+               const mat_krylov_opts* opts, mat_krylov_stats* stats) {
+  mat_krylov_stats local;
+  mat_krylov_stats* st = stats ? stats : &local;
+  double *x, *r, bnorm;
+  if (!krylov_setup(A, b, x0, M, "GMRES", &x, &r, &bnorm, st)) return NULL;
+  unsigned int n = A->n;
+  mat_krylov_opts o = krylov_opts_resolve(opts, n);
+  unsigned int m = o.restart;
+
+  double* V = malloc((size_t)(m + 1) * n * sizeof(*V));     // Krylov basis, one vector per row
+  double* H = calloc((size_t)(m + 1) * m, sizeof(*H));       // Hessenberg matrix, H[i*m + j]
+  double* cs = malloc(m * sizeof(*cs));
+  double* sn = malloc(m * sizeof(*sn));
+  double* g = malloc((m + 1) * sizeof(*g));
+  double* y = malloc(m * sizeof(*y));
+  double* w = malloc(n * sizeof(*w));
+  double* z = malloc(n * sizeof(*z));
+
+  double beta = vec_norm(r, n);
+  while (st->iterations < o.max_iter && beta > o.tol * bnorm) {
+    for (unsigned int i = 0; i < n; i++) {
+      V[i] = r[i] / beta;
+    }
+    memset(g, 0, (m + 1) * sizeof(*g));
+    g[0] = beta;
+
+    unsigned int k = 0;
+    while (k < m && st->iterations < o.max_iter) {
+      double* vk = V + (size_t)k * n;
+      double* vnext = V + (size_t)(k + 1) * n;
+      precond_apply(M, vk, z, n);
+      A->apply(A->ctx, z, w);
+      st->matvecs++;
+
+      // modified Gram-Schmidt against the current basis
+      for (unsigned int i = 0; i <= k; i++) {
+        double h = vec_dot(w, V + (size_t)i * n, n);
+        H[i * m + k] = h;
+        vec_axpy(w, -h, V + (size_t)i * n, n);
+      }
+      double hnext = vec_norm(w, n);
+      H[(k + 1) * m + k] = hnext;
+      if (hnext > 0.0) {
+        for (unsigned int i = 0; i < n; i++) {
+          vnext[i] = w[i] / hnext;
+        }
+      }
+
+      // apply the previous rotations to the new column, then eliminate H[k+1][k]
+      for (unsigned int i = 0; i < k; i++) {
+        double h0 = H[i * m + k];
+        double h1 = H[(i + 1) * m + k];
+        H[i * m + k] = cs[i] * h0 + sn[i] * h1;
+        H[(i + 1) * m + k] = -sn[i] * h0 + cs[i] * h1;
+      }
+      double denom = hypot(H[k * m + k], hnext);
+      cs[k] = (denom > 0.0) ? H[k * m + k] / denom : 1.0;
+      sn[k] = (denom > 0.0) ? hnext / denom : 0.0;
+      H[k * m + k] = denom;
+      H[(k + 1) * m + k] = 0.0;
+      g[k + 1] = -sn[k] * g[k];
+      g[k] = cs[k] * g[k];
+
+      k++;
+      st->iterations++;
+      if (fabs(g[k]) <= o.tol * bnorm || hnext == 0.0) break;
+    }
+
+    // solve the k x k triangular system and update x += M^-1 * V * y
+    for (unsigned int i = k; i-- > 0;) {
+      double sum = g[i];
+      for (unsigned int j = i + 1; j < k; j++) {
+        sum -= H[i * m + j] * y[j];
+      }
+      y[i] = (H[i * m + i] != 0.0) ? sum / H[i * m + i] : 0.0;
+    }
+    memset(w, 0, n * sizeof(*w));
+    for (unsigned int j = 0; j < k; j++) {
+      vec_axpy(w, y[j], V + (size_t)j * n, n);
+    }
+    precond_apply(M, w, z, n);
+    vec_axpy(x, 1.0, z, n);
+
+    // explicit residual for the restart
+    A->apply(A->ctx, x, w);
+    st->matvecs++;
+    for (unsigned int i = 0; i < n; i++) {
+      r[i] = b->values[i][0] - w[i];
+    }
+    double new_beta = vec_norm(r, n);
+    if (k == 0 || new_beta >= beta) {
+      // no progress over a whole cycle: stagnation
+      beta = new_beta;
+      break;
+    }
+    beta = new_beta;
+  }
+
+  mat* result = krylov_finish(A, b, x, bnorm, o.tol, st);
+  free(x);
+  free(r);
+  free(V);
+  free(H);
+  free(cs);
+  free(sn);
+  free(g);
+  free(y);
+  free(w);
+  free(z);
+  return result;
+}
+
+
+// ---------------------------------------------------------------------------
+// Mixed-precision iterative refinement
+// ---------------------------------------------------------------------------
+
+// In-place LU with partial pivoting of a rows x cols row-major block (rows >= cols).
+// On return piv[k] is the row that was swapped with row k. Returns 0 if a zero
+// pivot was met (the factorization is still completed).
+static int lu_factor_d(double* a, unsigned int rows, unsigned int cols, size_t lda,
+                       unsigned int* piv) {
+  int ok = 1;
+  for (unsigned int k = 0; k < cols; k++) {
+    unsigned int p = k;
+    double maxval = fabs(a[k * lda + k]);
+    for (unsigned int i = k + 1; i < rows; i++) {
+      double v = fabs(a[i * lda + k]);
+      if (v > maxval) {
+        maxval = v;
+        p = i;
+      }
+    }
+    piv[k] = p;
+    if (p != k) {
+      for (unsigned int j = 0; j < cols; j++) {
+        double tmp = a[k * lda + j];
+        a[k * lda + j] = a[p * lda + j];
+        a[p * lda + j] = tmp;
+      }
+    }
+    double pivot = a[k * lda + k];
+    if (pivot == 0.0) {
+      ok = 0;
+      continue;
+    }
+    const double* urow = a + k * lda;
+    for (unsigned int i = k + 1; i < rows; i++) {
+      double* row = a + i * lda;
+      double l = row[k] / pivot;
+      row[k] = l;
+      for (unsigned int j = k + 1; j < cols; j++) {
+        row[j] -= l * urow[j];
+      }
+    }
+  }
+  return ok;
+}
+
+// solves (LU) x = Pb in place for a factorization from lu_factor_d
+static void lu_solve_d(const double* lu, unsigned int n, size_t lda, const unsigned int* piv,
+                       double* x) {
+  for (unsigned int k = 0; k < n; k++) {
+    if (piv[k] != k) {
+      double tmp = x[k];
+      x[k] = x[piv[k]];
+      x[piv[k]] = tmp;
+    }
+  }
+  for (unsigned int i = 0; i < n; i++) {
+    double sum = x[i];
+    for (unsigned int j = 0; j < i; j++) {
+      sum -= lu[i * lda + j] * x[j];
+    }
+    x[i] = sum;
+  }
+  for (unsigned int i = n; i-- > 0;) {
+    double sum = x[i];
+    for (unsigned int j = i + 1; j < n; j++) {
+      sum -= lu[i * lda + j] * x[j];
+    }
+    x[i] = sum / lu[i * lda + i];
+  }
+}
+
+// single precision counterparts of lu_factor_d / lu_solve_d (square only).
+// lu_factor_f stops at a zero or non-finite pivot, and success needs n > 0,
+// so a successful return always means every factor and pivot was written.
+static int lu_factor_f(float* a, unsigned int n, unsigned int* piv) {
+  for (unsigned int k = 0; k < n; k++) {
+    unsigned int p = k;
+    float maxval = fabsf(a[(size_t)k * n + k]);
+    for (unsigned int i = k + 1; i < n; i++) {
+      float v = fabsf(a[(size_t)i * n + k]);
+      if (v > maxval) {
+        maxval = v;
+        p = i;
+      }
+    }
+    piv[k] = p;
+    if (p != k) {
+      for (unsigned int j = 0; j < n; j++) {
+        float tmp = a[(size_t)k * n + j];
+        a[(size_t)k * n + j] = a[(size_t)p * n + j];
+        a[(size_t)p * n + j] = tmp;
+      }
+    }
+    float pivot = a[(size_t)k * n + k];
+    if (pivot == 0.0f || !isfinite(pivot)) {
+      return 0;
+    }
+    const float* urow = a + (size_t)k * n;
+    for (unsigned int i = k + 1; i < n; i++) {
+      float* row = a + (size_t)i * n;
+      float l = row[k] / pivot;
+      row[k] = l;
+      for (unsigned int j = k + 1; j < n; j++) {
+        row[j] -= l * urow[j];
+      }
+    }
+  }
+  return n > 0;
+}
+
+static void lu_solve_f(const float* lu, unsigned int n, const unsigned int* piv, float* x) {
+  for (unsigned int k = 0; k < n; k++) {
+    if (piv[k] != k) {
+      float tmp = x[k];
+      x[k] = x[piv[k]];
+      x[piv[k]] = tmp;
+    }
+  }
+  for (unsigned int i = 0; i < n; i++) {
+    float sum = x[i];
+    for (unsigned int j = 0; j < i; j++) {
+      sum -= lu[(size_t)i * n + j] * x[j];
+    }
+    x[i] = sum;
+  }
+  for (unsigned int i = n; i-- > 0;) {
+    float sum = x[i];
+    for (unsigned int j = i + 1; j < n; j++) {
+      sum -= lu[(size_t)i * n + j] * x[j];
+    }
+    x[i] = sum / lu[(size_t)i * n + i];
+  }
+}
+
+// Solve Ax = b by factoring A in single precision and refining x with residuals
+// computed in double against the original A. Falls back to a double precision
+// factorization if refinement stalls. *iterations (optional) receives the number
+// of refinement steps, or -1 when the fallback was used.
+mat* mat_lup_solve_mixed(mat* A, mat* b, int* iterations) {
+  if (!A || !b) {
+    fprintf(stderr, "Invalid input matrices for mixed precision solve\n");
+    return NULL;
+  }
+  if (!A->is_square || b->num_rows != A->num_rows || b->num_cols != 1) {
+    fprintf(stderr, "Matrix dimensions incompatible for mixed precision solve\n");
+    return NULL;
+  }
+
+  const unsigned int max_iter = 30;
+  unsigned int n = A->num_rows;
+  unsigned int* piv = malloc(n * sizeof(*piv));
+  float* af = malloc((size_t)n * n * sizeof(*af));
+  float* df = malloc(n * sizeof(*df));
+  double* x = malloc(n * sizeof(*x));
+  double* r = malloc(n * sizeof(*r));
+  int steps = -1;
+
+  // Step 1: demote A and factor it in single precision
+  double anorm = 0.0;
+  for (unsigned int i = 0; i < n; i++) {
+    double rowsum = 0.0;
+    for (unsigned int j = 0; j < n; j++) {
+      double v = A->values[i][j];
+      rowsum += fabs(v);
+      af[(size_t)i * n + j] = (float)v;
+    }
+    if (rowsum > anorm) anorm = rowsum;
+  }
+  int ok = lu_factor_f(af, n, piv);
+
+  if (ok) {
+    // Step 2: initial single precision solve
+    for (unsigned int i = 0; i < n; i++) df[i] = (float)b->values[i][0];
+    lu_solve_f(af, n, piv, df);
+    for (unsigned int i = 0; i < n; i++) x[i] = df[i];
+
+    // Step 3: refine with double precision residuals until x is accurate to
+    // double precision (the LAPACK dsgesv stopping test)
+    double cte = anorm * DBL_EPSILON * sqrt((double)n);
+    double prev_rnorm = HUGE_VAL;
+    for (unsigned int it = 0; it <= max_iter; it++) {
+      double rnorm = 0.0, xnorm = 0.0;
+      for (unsigned int i = 0; i < n; i++) {
+        const double* row = A->values[i];
+        double sum = b->values[i][0];
+        for (unsigned int j = 0; j < n; j++) {
+          sum -= row[j] * x[j];
+        }
+        r[i] = sum;
+        if (fabs(sum) > rnorm) rnorm = fabs(sum);
+        if (fabs(x[i]) > xnorm) xnorm = fabs(x[i]);
+      }
+      if (!isfinite(rnorm)) break;
+      if (rnorm <= xnorm * cte) {
+        steps = (int)it;
+        break;
+      }
+      // refinement stalled: fall back to double precision
+      if (it == max_iter || rnorm > 0.5 * prev_rnorm) break;
+      prev_rnorm = rnorm;
+
+      for (unsigned int i = 0; i < n; i++) df[i] = (float)r[i];
+      lu_solve_f(af, n, piv, df);
+      for (unsigned int i = 0; i < n; i++) x[i] += df[i];
+    }
+  }
+
+  if (steps < 0) {
+    // Fallback: full double precision factorization
+    double* ad = malloc((size_t)n * n * sizeof(*ad));
+    for (unsigned int i = 0; i < n; i++) {
+      memcpy(ad + (size_t)i * n, A->values[i], n * sizeof(*ad));
+    }
+    if (!lu_factor_d(ad, n, n, n, piv)) {
+      fprintf(stderr, "Matrix is singular - cannot solve system\n");
+      free(ad);
+      free(piv);
+      free(af);
+      free(df);
+      free(x);
+      free(r);
+      return NULL;
+    }
+    vec_from_col(x, b);
+    lu_solve_d(ad, n, n, piv, x);
+    free(ad);
+  }
+
+  if (iterations) *iterations = steps;
+  mat* result = col_from_vec(x, n);
+  free(piv);
+  free(af);
+  free(df);
+  free(x);
+  free(r);
+  return result;
+}
+
+
+// ---------------------------------------------------------------------------
+// Symmetric eigensolver
+// ---------------------------------------------------------------------------
+
+// Generates an elementary reflector H = I - tau*v*v^T with v[0] = 1 such that
+// H * [alpha; x] = [beta; 0]. On return *alpha holds beta and x holds v[1:].
+static double householder_gen(double* alpha, double* x, size_t len, size_t incx) {
+  double xnorm = 0.0;
+  for (size_t i = 0; i < len; i++) {
+    xnorm = hypot(xnorm, x[i * incx]);
+  }
+  if (xnorm == 0.0) {
+    return 0.0;
+  }
+  double beta = -copysign(hypot(*alpha, xnorm), *alpha);
+  double tau = (beta - *alpha) / beta;
+  double scale = 1.0 / (*alpha - beta);
+  for (size_t i = 0; i < len; i++) {
+    x[i * incx] *= scale;
+  }
+  *alpha = beta;
+  return tau;
+}
+
+// Blocked Householder reduction of a symmetric matrix to tridiagonal form.
+// a is column-major n x n holding both triangles; on return d/e hold the
+// tridiagonal and the reflectors are stored below the subdiagonal of a.
+#define SYTRD_BLOCK 32
+static void sym_tridiag(double* a, unsigned int n, double* d, double* e, double* tau) {
+  size_t lda = n;
+  unsigned int nb = SYTRD_BLOCK;
+  unsigned int i0 = 0;
+  double* W = malloc((size_t)n * nb * sizeof(*W));
+
+  // blocked panels: reduce nb columns, accumulating W so that the trailing
+  // matrix is updated once per panel with a rank-2k update
+  while (n - i0 > 2 * nb) {
+    unsigned int nt = n - i0;
+    double* A = a + i0 + i0 * lda;
+    size_t ldw = nt;
+    for (unsigned int i = 0; i < nb; i++) {
+      double* ai = A + i * lda;
+      double* wi = W + i * ldw;
+      // bring column i up to date with the previous reflectors of the panel
+      for (unsigned int k = 0; k < i; k++) {
+        double wik = W[i + k * ldw];
+        double aik = A[i + k * lda];
+        const double* ak = A + k * lda;
+        const double* wk = W + k * ldw;
+        for (unsigned int r = i; r < nt; r++) {
+          ai[r] -= ak[r] * wik + wk[r] * aik;
+        }
+      }
+      tau[i0 + i] = householder_gen(&ai[i + 1], &ai[i + 2], nt - i - 2, 1);
+      e[i0 + i] = ai[i + 1];
+      ai[i + 1] = 1.0;
+      const double* v = ai;  // v lives in rows i+1..nt-1
+
+      // w = A22 * v on the (still untouched) trailing block
+      for (unsigned int r = i + 1; r < nt; r++) wi[r] = 0.0;
+      for (unsigned int c = i + 1; c < nt; c++) {
+        const double* col = A + c * lda;
+        double vc = v[c];
+        for (unsigned int r = i + 1; r < nt; r++) {
+          wi[r] += col[r] * vc;
+        }
+      }
+      // w -= V*(W^T v) + W*(V^T v), using rows 0..i-1 of wi as scratch
+      for (unsigned int k = 0; k < i; k++) {
+        wi[k] = vec_dot(W + k * ldw + i + 1, v + i + 1, nt - i - 1);
+      }
+      for (unsigned int k = 0; k < i; k++) {
+        vec_axpy(wi + i + 1, -wi[k], A + k * lda + i + 1, nt - i - 1);
+      }
+      for (unsigned int k = 0; k < i; k++) {
+        wi[k] = vec_dot(A + k * lda + i + 1, v + i + 1, nt - i - 1);
+      }
+      for (unsigned int k = 0; k < i; k++) {
+        vec_axpy(wi + i + 1, -wi[k], W + k * ldw + i + 1, nt - i - 1);
+      }
+      double t = tau[i0 + i];
+      for (unsigned int r = i + 1; r < nt; r++) wi[r] *= t;
+      double alpha = -0.5 * t * vec_dot(wi + i + 1, v + i + 1, nt - i - 1);
+      vec_axpy(wi + i + 1, alpha, v + i + 1, nt - i - 1);
+    }
+
+    // trailing update A22 -= V*W^T + W*V^T (both triangles)
+    for (unsigned int c = nb; c < nt; c++) {
+      double* col = A + c * lda;
+      for (unsigned int k = 0; k < nb; k++) {
+        const double* ak = A + k * lda;
+        const double* wk = W + k * ldw;
+        double vck = ak[c];
+        double wck = wk[c];
+        for (unsigned int r = nb; r < nt; r++) {
+          col[r] -= ak[r] * wck + wk[r] * vck;
+        }
+      }
+    }
+    for (unsigned int k = 0; k < nb; k++) {
+      A[k + 1 + k * lda] = e[i0 + k];
+      d[i0 + k] = A[k + k * lda];
+    }
+    i0 += nb;
+  }
+  free(W);
+
+  // unblocked reduction of the remaining block
+  double* x = malloc(n * sizeof(*x));
+  for (unsigned int i = i0; i + 1 < n; i++) {
+    double* ai = a + i * lda;
+    double t = householder_gen(&ai[i + 1], &ai[i + 2], n - i - 2, 1);
+    e[i] = ai[i + 1];
+    tau[i] = t;
+    if (t != 0.0) {
+      ai[i + 1] = 1.0;
+      const double* v = ai;
+      for (unsigned int r = i + 1; r < n; r++) x[r] = 0.0;
+      for (unsigned int c = i + 1; c < n; c++) {
+        vec_axpy(x + i + 1, t * v[c], a + c * lda + i + 1, n - i - 1);
+      }
+      double alpha = -0.5 * t * vec_dot(x + i + 1, v + i + 1, n - i - 1);
+      vec_axpy(x + i + 1, alpha, v + i + 1, n - i - 1);
+      for (unsigned int c = i + 1; c < n; c++) {
+        double* col = a + c * lda;
+        double vc = v[c], xc = x[c];
+        for (unsigned int r = i + 1; r < n; r++) {
+          col[r] -= v[r] * xc + x[r] * vc;
+        }
+      }
+      ai[i + 1] = e[i];
+    }
+    d[i] = ai[i];
+  }
+  d[n - 1] = a[(n - 1) + (n - 1) * lda];
+  free(x);
+}
+
+// forms Q = H(0)*H(1)*...*H(n-2) from the reflectors left by sym_tridiag
+static void sym_tridiag_q(const double* a, unsigned int n, const double* tau, double* q) {
+  size_t ld = n;
+  memset(q, 0, (size_t)n * n * sizeof(*q));
+  for (unsigned int i = 0; i < n; i++) q[i + i * ld] = 1.0;
+  for (unsigned int k = n - 1; k-- > 0;) {
+    if (tau[k] == 0.0) continue;
+    const double* v = a + k * ld;  // v[k+1] = 1 implicitly, v[k+2:] stored
+    for (unsigned int c = k + 1; c < n; c++) {
+      double* col = q + c * ld;
+      double s = col[k + 1];
+      for (unsigned int r = k + 2; r < n; r++) s += v[r] * col[r];
+      s *= tau[k];
+      col[k + 1] -= s;
+      for (unsigned int r = k + 2; r < n; r++) col[r] -= s * v[r];
+    }
+  }
+}
+
+// sorts eigenvalues ascending, permuting the columns of z (if given) alongside
+static void eig_sort(double* d, double* z, unsigned int n, size_t ldz) {
+  for (unsigned int i = 0; i + 1 < n; i++) {
+    unsigned int k = i;
+    for (unsigned int j = i + 1; j < n; j++) {
+      if (d[j] < d[k]) k = j;
+    }
+    if (k != i) {
+      double tmp = d[i];
+      d[i] = d[k];
+      d[k] = tmp;
+      if (z) {
+        for (unsigned int r = 0; r < n; r++) {
+          tmp = z[r + i * ldz];
+          z[r + i * ldz] = z[r + k * ldz];
+          z[r + k * ldz] = tmp;
+        }
+      }
+    }
+  }
+}
+
+// Implicit QL iteration on a symmetric tridiagonal matrix (diagonal d, off-diagonal
+// e[0..n-2], e needs room for n entries). When z is non-NULL the rotations are
+// accumulated into its columns (column-major, leading dimension ldz).
+static int tridiag_ql(double* d, double* e, unsigned int n, double* z, size_t ldz) {
+  if (n == 0) return 1;
+  e[n - 1] = 0.0;
+  double f = 0.0, tst1 = 0.0;
+  for (unsigned int l = 0; l < n; l++) {
+    tst1 = fmax(tst1, fabs(d[l]) + fabs(e[l]));
+    unsigned int m = l;
+    while (m < n - 1 && fabs(e[m]) > DBL_EPSILON * tst1) m++;
+    if (m > l) {
+      unsigned int iter = 0;
+      do {
+        if (++iter > 30 * n) {
+          fprintf(stderr, "tridiagonal QL iteration did not converge\n");
+          return 0;
+        }
+        // Wilkinson-style shift from the leading 2x2 block
+        double g = d[l];
+        double p = (d[l + 1] - g) / (2.0 * e[l]);
+        double r = copysign(hypot(p, 1.0), p);
+        d[l] = e[l] / (p + r);
+        d[l + 1] = e[l] * (p + r);
+        double dl1 = d[l + 1];
+        double h = g - d[l];
+        for (unsigned int i = l + 2; i < n; i++) d[i] -= h;
+        f += h;
+
+        // implicit QL sweep from m back to l
+        p = d[m];
+        double c = 1.0, c2 = 1.0, c3 = 1.0;
+        double el1 = e[l + 1];
+        double s = 0.0, s2 = 0.0;
+        for (unsigned int i = m; i-- > l;) {
+          c3 = c2;
+          c2 = c;
+          s2 = s;
+          g = c * e[i];
+          h = c * p;
+          r = hypot(p, e[i]);
+          e[i + 1] = s * r;
+          s = e[i] / r;
+          c = p / r;
+          p = c * d[i] - s * g;
+          d[i + 1] = h + s * (c * g + s * d[i]);
+          if (z) {
+            double* zi = z + i * ldz;
+            double* zi1 = z + (i + 1) * ldz;
+            for (unsigned int k = 0; k < n; k++) {
+              h = zi1[k];
+              zi1[k] = s * zi[k] + c * h;
+              zi[k] = c * zi[k] - s * h;
+            }
+          }
+        }
+        p = -s * s2 * c3 * el1 * e[l] / dl1;
+        e[l] = s * p;
+        d[l] = c * p;
+      } while (fabs(e[l]) > DBL_EPSILON * tst1);
+    }
+    d[l] += f;
+    e[l] = 0.0;
+  }
+  eig_sort(d, z, n, ldz);
+  return 1;
+}
+
+// Finds root j of the secular equation 1 + rho * sum(z_i^2 / (d_i - x)) = 0 for
+// sorted poles d[0..k-1] and rho > 0. The root is returned as d[*origin] + tau so
+// that the differences d_i - root can be formed without cancellation.
+static double secular_root(const double* d, const double* z, unsigned int k, double rho,
+                           unsigned int j, unsigned int* origin) {
+  double lo, hi;
+  unsigned int o;
+  if (j + 1 < k) {
+    // decide which pole the root is closer to from the sign at the midpoint
+    double mid = 0.5 * (d[j + 1] - d[j]);
+    double fmid = 1.0;
+    for (unsigned int i = 0; i < k; i++) {
+      fmid += rho * z[i] * z[i] / ((d[i] - d[j]) - mid);
+    }
+    if (fmid >= 0.0) {
+      o = j;
+      lo = 0.0;
+      hi = mid;
+    } else {
+      o = j + 1;
+      lo = -mid;
+      hi = 0.0;
+    }
+  } else {
+    double zz = vec_dot(z, z, k);
+    o = j;
+    lo = 0.0;
+    hi = rho * zz;
+  }
+
+  double tau = 0.5 * (lo + hi);
+  for (unsigned int iter = 0; iter < 200; iter++) {
+    double f = 1.0, df = 0.0;
+    for (unsigned int i = 0; i < k; i++) {
+      double delta = (d[i] - d[o]) - tau;
+      double t = z[i] / delta;
+      f += rho * z[i] * t;
+      df += rho * t * t;
+    }
+    if (f == 0.0) break;
+    if (f < 0.0) {
+      lo = tau;
+    } else {
+      hi = tau;
+    }
+    // Newton step, bisection whenever it leaves the bracket
+    double next = tau - f / df;
+    if (!(next > lo && next < hi)) next = 0.5 * (lo + hi);
+    if (fabs(next - tau) <= 2.0 * DBL_EPSILON * fabs(next) ||
+        hi - lo <= 2.0 * DBL_EPSILON * fmax(fabs(lo), fabs(hi))) {
+      tau = next;
+      break;
+    }
+    tau = next;
+  }
+  *origin = o;
+  return tau;
+}
+
+// Cuppen's divide and conquer on a symmetric tridiagonal matrix. q receives the
+// eigenvectors (column-major, leading dimension ldq), d the eigenvalues ascending.
+#define TRIDIAG_DC_CUTOFF 32
+static int tridiag_dc(double* d, double* e, unsigned int n, double* q, size_t ldq) {
+  if (n <= TRIDIAG_DC_CUTOFF) {
+    for (unsigned int c = 0; c < n; c++) {
+      memset(q + c * ldq, 0, n * sizeof(*q));
+      q[c + c * ldq] = 1.0;
+    }
+    double* work = malloc(n * sizeof(*work));
+    if (n > 1) memcpy(work, e, (n - 1) * sizeof(*work));
+    int ok = tridiag_ql(d, work, n, q, ldq);
+    free(work);
+    return ok;
+  }
+
+  // Step 1: tear T into two halves plus a rank-one correction rho*u*u^T
+  unsigned int m = n / 2;
+  double beta = e[m - 1];
+  double rho = fabs(beta);
+  double sgn = (beta < 0.0) ? -1.0 : 1.0;
+  d[m - 1] -= rho;
+  d[m] -= rho;
+
+  // Step 2: solve both halves recursively into the diagonal blocks of q
+  for (unsigned int c = 0; c < n; c++) memset(q + c * ldq, 0, n * sizeof(*q));
+  if (!tridiag_dc(d, e, m, q, ldq) ||
+      !tridiag_dc(d + m, e + m, n - m, q + m + m * ldq, ldq)) {
+    return 0;
+  }
+
+  // Step 3: z = [last row of Q1, sgn * first row of Q2], normalized into rho
+  double* z = malloc(n * sizeof(*z));
+  for (unsigned int c = 0; c < m; c++) z[c] = q[(m - 1) + c * ldq];
+  for (unsigned int c = m; c < n; c++) z[c] = sgn * q[m + c * ldq];
+  double znorm = vec_norm(z, n);
+  for (unsigned int i = 0; i < n; i++) z[i] /= znorm;
+  rho *= znorm * znorm;
+
+  // sort the merged poles, remembering which column of q each belongs to
+  unsigned int* perm = malloc(n * sizeof(*perm));
+  for (unsigned int i = 0; i < n; i++) perm[i] = i;
+  for (unsigned int i = 1; i < n; i++) {
+    unsigned int p = perm[i];
+    unsigned int j = i;
+    while (j > 0 && d[perm[j - 1]] > d[p]) {
+      perm[j] = perm[j - 1];
+      j--;
+    }
+    perm[j] = p;
+  }
+
+  // Step 4: deflation of negligible z components and of (nearly) equal poles
+  double dmax = 0.0;
+  for (unsigned int i = 0; i < n; i++) dmax = fmax(dmax, fabs(d[i]));
+  double tol = 8.0 * DBL_EPSILON * fmax(dmax, rho);
+  unsigned int* keep = malloc(n * sizeof(*keep));   // columns entering the secular equation
+  unsigned int nkeep = 0;
+  double* dk = malloc(n * sizeof(*dk));
+  double* zk = malloc(n * sizeof(*zk));
+  for (unsigned int s = 0; s < n; s++) {
+    unsigned int c = perm[s];
+    if (rho * fabs(z[c]) <= tol) continue;  // deflated: (d[c], q[:,c]) is already an eigenpair
+    if (nkeep > 0) {
+      unsigned int p = keep[nkeep - 1];
+      double t = hypot(z[p], z[c]);
+      double cs = z[c] / t;
+      double sn = -z[p] / t;
+      if (fabs((d[c] - d[p]) * cs * sn) <= tol) {
+        // rotate the two columns so that z[p] becomes zero and p deflates
+        double* qp = q + p * ldq;
+        double* qc = q + c * ldq;
+        for (unsigned int r = 0; r < n; r++) {
+          double a0 = qp[r], a1 = qc[r];
+          qp[r] = cs * a0 + sn * a1;
+          qc[r] = -sn * a0 + cs * a1;
+        }
+        double dp = d[p] * cs * cs + d[c] * sn * sn;
+        double dc = d[p] * sn * sn + d[c] * cs * cs;
+        d[p] = dp;
+        d[c] = dc;
+        z[c] = t;
+        z[p] = 0.0;
+        keep[nkeep - 1] = c;
+        continue;
+      }
+    }
+    keep[nkeep++] = c;
+  }
+  // the rotations may have disturbed the ordering slightly
+  for (unsigned int i = 1; i < nkeep; i++) {
+    unsigned int c = keep[i];
+    unsigned int j = i;
+    while (j > 0 && d[keep[j - 1]] > d[c]) {
+      keep[j] = keep[j - 1];
+      j--;
+    }
+    keep[j] = c;
+  }
+  for (unsigned int i = 0; i < nkeep; i++) {
+    dk[i] = d[keep[i]];
+    zk[i] = z[keep[i]];
+  }
+
+  if (nkeep > 0) {
+    // Step 5: roots of the secular equation
+    unsigned int* origin = malloc(nkeep * sizeof(*origin));
+    double* tau = malloc(nkeep * sizeof(*tau));
+    for (unsigned int j = 0; j < nkeep; j++) {
+      tau[j] = secular_root(dk, zk, nkeep, rho, j, &origin[j]);
+    }
+
+    // Step 6: recompute z from the computed roots (Gu-Eisenstat) so that the
+    // eigenvectors come out numerically orthogonal
+    for (unsigned int i = 0; i < nkeep; i++) {
+      double prod = -((dk[i] - dk[origin[nkeep - 1]]) - tau[nkeep - 1]) / rho;
+      for (unsigned int j = 0; j < i; j++) {
+        prod *= ((dk[i] - dk[origin[j]]) - tau[j]) / (dk[i] - dk[j]);
+      }
+      for (unsigned int j = i; j + 1 < nkeep; j++) {
+        prod *= ((dk[i] - dk[origin[j]]) - tau[j]) / (dk[i] - dk[j + 1]);
+      }
+      zk[i] = copysign(sqrt(fabs(prod)), zk[i]);
+    }
+
+    // Step 7: eigenvectors of D + rho*z*z^T, then rotate back with q
+    double* u = malloc((size_t)nkeep * nkeep * sizeof(*u));
+    for (unsigned int j = 0; j < nkeep; j++) {
+      double* uj = u + (size_t)j * nkeep;
+      for (unsigned int i = 0; i < nkeep; i++) {
+        uj[i] = zk[i] / ((dk[i] - dk[origin[j]]) - tau[j]);
+      }
+      double nrm = vec_norm(uj, nkeep);
+      for (unsigned int i = 0; i < nkeep; i++) uj[i] /= nrm;
+    }
+    double* qk = malloc((size_t)n * nkeep * sizeof(*qk));
+    for (unsigned int i = 0; i < nkeep; i++) {
+      memcpy(qk + (size_t)i * n, q + keep[i] * ldq, n * sizeof(*qk));
+    }
+    for (unsigned int j = 0; j < nkeep; j++) {
+      double* dst = q + keep[j] * ldq;
+      const double* uj = u + (size_t)j * nkeep;
+      memset(dst, 0, n * sizeof(*dst));
+      for (unsigned int i = 0; i < nkeep; i++) {
+        vec_axpy(dst, uj[i], qk + (size_t)i * n, n);
+      }
+    }
+    for (unsigned int j = 0; j < nkeep; j++) {
+      d[keep[j]] = dk[origin[j]] + tau[j];
+    }
+    free(origin);
+    free(tau);
+    free(u);
+    free(qk);
+  }
+
+  free(z);
+  free(perm);
+  free(keep);
+  free(dk);
+  free(zk);
+  eig_sort(d, q, n, ldq);
+  return 1;
+}
+
+// Eigen decomposition of a symmetric matrix: A = V * diag(evals) * V^T.
+// Only the lower triangle of A is referenced. evals is n x 1 in ascending order,
+// evecs (columns are eigenvectors) is skipped entirely when evecs == NULL.
+int mat_sym_eig(mat* A, mat** evals, mat** evecs) {
+  if (!A || !evals) {
+    fprintf(stderr, "symmetric eigensolver requires non-NULL arguments\n");
+    return 0;
+  }
+  if (!A->is_square) {
+    fprintf(stderr, "symmetric eigensolver requires a square matrix\n");
+    return 0;
+  }
+
+  unsigned int n = A->num_rows;
+  double* a = malloc((size_t)n * n * sizeof(*a));
+  for (unsigned int j = 0; j < n; j++) {
+    for (unsigned int i = j; i < n; i++) {
+      a[i + (size_t)j * n] = A->values[i][j];
+      a[j + (size_t)i * n] = A->values[i][j];
+    }
+  }
+  double* d = malloc(n * sizeof(*d));
+  double* e = calloc(n, sizeof(*e));
+  double* tau = calloc(n, sizeof(*tau));
+
+  // Step 1: reduce to tridiagonal form
+  sym_tridiag(a, n, d, e, tau);
+
+  int ok;
+  if (!evecs) {
+    // Step 2a: eigenvalues only, no vector accumulation
+    ok = tridiag_ql(d, e, n, NULL, 0);
+  } else {
+    // Step 2b: divide and conquer, then back-transform with Q
+    double* z = malloc((size_t)n * n * sizeof(*z));
+    double* q = malloc((size_t)n * n * sizeof(*q));
+    ok = tridiag_dc(d, e, n, z, n);
+    if (ok) {
+      sym_tridiag_q(a, n, tau, q);
+      // V = Q*Z, with Z transposed in place of a so rows are contiguous
+      for (unsigned int k = 0; k < n; k++) {
+        for (unsigned int j = 0; j < n; j++) {
+          a[(size_t)k * n + j] = z[k + (size_t)j * n];
+        }
+      }
+      *evecs = new_mat(n, n);
+      for (unsigned int i = 0; i < n; i++) {
+        double* row = (*evecs)->values[i];
+        for (unsigned int k = 0; k < n; k++) {
+          double qik = q[i + (size_t)k * n];
+          if (qik == 0.0) continue;
+          vec_axpy(row, qik, a + (size_t)k * n, n);
+        }
+      }
+    }
+    free(z);
+    free(q);
+  }
+
+  if (ok) {
+    *evals = col_from_vec(d, n);
+  }
+  free(a);
+  free(d);
+  free(e);
+  free(tau);
+  return ok;
+}
+
+
+// ---------------------------------------------------------------------------
+// Nonsymmetric eigenvalues (Hessenberg reduction + Francis double-shift QR)
+// ---------------------------------------------------------------------------
+
+// Householder reduction of the row-major n x n array h to upper Hessenberg form.
+// When v is non-NULL it receives the orthogonal Q with A = Q * H * Q^T.
+static void hessenberg_reduce(double* h, double* v, unsigned int n) {
+  double* ort = calloc(n, sizeof(*ort));
+  for (unsigned int m = 1; m + 1 < n; m++) {
+    double scale = 0.0;
+    for (unsigned int i = m; i < n; i++) scale += fabs(h[i * n + m - 1]);
+    if (scale == 0.0) continue;
+
+    // Householder vector for column m-1, scaled to avoid under/overflow
+    double hh = 0.0;
+    for (unsigned int i = n; i-- > m;) {
+      ort[i] = h[i * n + m - 1] / scale;
+      hh += ort[i] * ort[i];
+    }
+    double g = sqrt(hh);
+    if (ort[m] > 0) g = -g;
+    hh -= ort[m] * g;
+    ort[m] -= g;
+
+    // H = (I - u*u^T/h) * H * (I - u*u^T/h)
+    for (unsigned int j = m; j < n; j++) {
+      double f = 0.0;
+      for (unsigned int i = m; i < n; i++) f += ort[i] * h[i * n + j];
+      f /= hh;
+      for (unsigned int i = m; i < n; i++) h[i * n + j] -= f * ort[i];
+    }
+    for (unsigned int i = 0; i < n; i++) {
+      double* row = h + (size_t)i * n;
+      double f = 0.0;
+      for (unsigned int j = m; j < n; j++) f += ort[j] * row[j];
+      f /= hh;
+      for (unsigned int j = m; j < n; j++) row[j] -= f * ort[j];
+    }
+    ort[m] *= scale;
+    h[m * n + m - 1] = scale * g;
+  }
+
+  if (v) {
+    // accumulate the transformations backwards
+    memset(v, 0, (size_t)n * n * sizeof(*v));
+    for (unsigned int i = 0; i < n; i++) v[i * n + i] = 1.0;
+    for (unsigned int m = n - 1; m-- > 1;) {
+      if (h[m * n + m - 1] == 0.0) continue;
+      for (unsigned int i = m + 1; i < n; i++) ort[i] = h[i * n + m - 1];
+      for (unsigned int j = m; j < n; j++) {
+        double g = 0.0;
+        for (unsigned int i = m; i < n; i++) g += ort[i] * v[i * n + j];
+        g = (g / ort[m]) / h[m * n + m - 1];
+        for (unsigned int i = m; i < n; i++) v[i * n + j] += g * ort[i];
+      }
+    }
+  }
+  // clear the annihilated part below the subdiagonal
+  for (unsigned int i = 2; i < n; i++) {
+    for (unsigned int j = 0; j + 1 < i; j++) h[i * n + j] = 0.0;
+  }
+  free(ort);
+}
+
+// Francis double-shift QR iteration on an upper Hessenberg matrix (row-major).
+// wr/wi receive the eigenvalues. With wantt the full real Schur form is kept in h,
+// otherwise only the active window is updated. Schur vectors are accumulated
+// into v when it is non-NULL.
+static int hessenberg_qr(double* h, double* v, unsigned int nn, double* wr, double* wi, int wantt) {
+#define H(i, j) h[(size_t)(i) * nn + (j)]
+#define V(i, j) v[(size_t)(i) * nn + (j)]
+  int n = (int)nn - 1;
+  const int low = 0;
+  double exshift = 0.0;
+  double p = 0, q = 0, r = 0, s = 0, z = 0, w, x, y;
+  unsigned int iter = 0, total = 0;
+
+  double norm = 0.0;
+  for (int i = 0; i < (int)nn; i++) {
+    for (int j = (i > 0 ? i - 1 : 0); j < (int)nn; j++) norm += fabs(H(i, j));
+  }
+
+  while (n >= low) {
+    // look for a single small subdiagonal element
+    int l = n;
+    while (l > low) {
+      s = fabs(H(l - 1, l - 1)) + fabs(H(l, l));
+      if (s == 0.0) s = norm;
+      if (fabs(H(l, l - 1)) < DBL_EPSILON * s) break;
+      l--;
+    }
+    if (l > low) H(l, l - 1) = 0.0;
+
+    if (l == n) {
+      // one root found
+      H(n, n) += exshift;
+      wr[n] = H(n, n);
+      wi[n] = 0.0;
+      n--;
+      iter = 0;
+    } else if (l == n - 1) {
+      // two roots found
+      w = H(n, n - 1) * H(n - 1, n);
+      p = (H(n - 1, n - 1) - H(n, n)) / 2.0;
+      q = p * p + w;
+      z = sqrt(fabs(q));
+      H(n, n) += exshift;
+      H(n - 1, n - 1) += exshift;
+      x = H(n, n);
+      if (q >= 0) {
+        // real pair: rotate the 2x2 block to upper triangular form
+        z = (p >= 0) ? p + z : p - z;
+        wr[n - 1] = x + z;
+        wr[n] = (z != 0.0) ? x - w / z : wr[n - 1];
+        wi[n - 1] = 0.0;
+        wi[n] = 0.0;
+        x = H(n, n - 1);
+        s = fabs(x) + fabs(z);
+        p = x / s;
+        q = z / s;
+        r = sqrt(p * p + q * q);
+        p /= r;
+        q /= r;
+        int jlast = wantt ? (int)nn - 1 : n;
+        for (int j = n - 1; j <= jlast; j++) {
+          z = H(n - 1, j);
+          H(n - 1, j) = q * z + p * H(n, j);
+          H(n, j) = q * H(n, j) - p * z;
+        }
+        for (int i = wantt ? 0 : l; i <= n; i++) {
+          z = H(i, n - 1);
+          H(i, n - 1) = q * z + p * H(i, n);
+          H(i, n) = q * H(i, n) - p * z;
+        }
+        H(n, n - 1) = 0.0;
+        if (v) {
+          for (int i = 0; i < (int)nn; i++) {
+            z = V(i, n - 1);
+            V(i, n - 1) = q * z + p * V(i, n);
+            V(i, n) = q * V(i, n) - p * z;
+          }
+        }
+      } else {
+        // complex conjugate pair
+        wr[n - 1] = x + p;
+        wr[n] = x + p;
+        wi[n - 1] = z;
+        wi[n] = -z;
+      }
+      n -= 2;
+      iter = 0;
+    } else {
+      // no convergence yet: form the shift
+      x = H(n, n);
+      y = 0.0;
+      w = 0.0;
+      if (l < n) {
+        y = H(n - 1, n - 1);
+        w = H(n, n - 1) * H(n - 1, n);
+      }
+      if (iter == 10) {
+        // Wilkinson's exceptional shift
+        exshift += x;
+        for (int i = low; i <= n; i++) H(i, i) -= x;
+        s = fabs(H(n, n - 1)) + fabs(H(n - 1, n - 2));
+        x = y = 0.75 * s;
+        w = -0.4375 * s * s;
+      }
+      if (iter == 30) {
+        s = (y - x) / 2.0;
+        s = s * s + w;
+        if (s > 0) {
+          s = sqrt(s);
+          if (y < x) s = -s;
+          s = x - w / ((y - x) / 2.0 + s);
+          for (int i = low; i <= n; i++) H(i, i) -= s;
+          exshift += s;
+          x = y = w = 0.964;
+        }
+      }
+      iter++;
+      if (++total > 30 * nn) {
+        fprintf(stderr, "QR iteration did not converge\n");
+        return 0;
+      }
+
+      // look for two consecutive small subdiagonal elements
+      int m = n - 2;
+      while (m >= l) {
+        z = H(m, m);
+        r = x - z;
+        s = y - z;
+        p = (r * s - w) / H(m + 1, m) + H(m, m + 1);
+        q = H(m + 1, m + 1) - z - r - s;
+        r = H(m + 2, m + 1);
+        s = fabs(p) + fabs(q) + fabs(r);
+        p /= s;
+        q /= s;
+        r /= s;
+        if (m == l) break;
+        if (fabs(H(m, m - 1)) * (fabs(q) + fabs(r)) <
+            DBL_EPSILON * (fabs(p) * (fabs(H(m - 1, m - 1)) + fabs(z) + fabs(H(m + 1, m + 1))))) {
+          break;
+        }
+        m--;
+      }
+      for (int i = m + 2; i <= n; i++) {
+        H(i, i - 2) = 0.0;
+        if (i > m + 2) H(i, i - 3) = 0.0;
+      }
+
+      // double QR step on rows l:n and columns m:n, chasing the bulge down
+      for (int k = m; k <= n - 1; k++) {
+        int notlast = (k != n - 1);
+        if (k != m) {
+          p = H(k, k - 1);
+          q = H(k + 1, k - 1);
+          r = notlast ? H(k + 2, k - 1) : 0.0;
+          x = fabs(p) + fabs(q) + fabs(r);
+          if (x == 0.0) continue;
+          p /= x;
+          q /= x;
+          r /= x;
+        }
+        s = sqrt(p * p + q * q + r * r);
+        if (p < 0) s = -s;
+        if (s == 0.0) continue;
+        if (k != m) {
+          // the reflector annihilates the bulge below the subdiagonal
+          H(k, k - 1) = -s * x;
+          H(k + 1, k - 1) = 0.0;
+          if (notlast) H(k + 2, k - 1) = 0.0;
+        } else if (l != m) {
+          H(k, k - 1) = -H(k, k - 1);
+        }
+        p += s;
+        x = p / s;
+        y = q / s;
+        z = r / s;
+        q /= p;
+        r /= p;
+
+        int jlast = wantt ? (int)nn - 1 : n;
+        for (int j = k; j <= jlast; j++) {
+          p = H(k, j) + q * H(k + 1, j);
+          if (notlast) {
+            p += r * H(k + 2, j);
+            H(k + 2, j) -= p * z;
+          }
+          H(k, j) -= p * x;
+          H(k + 1, j) -= p * y;
+        }
+        int ilast = (n < k + 3) ? n : k + 3;
+        for (int i = wantt ? 0 : l; i <= ilast; i++) {
+          p = x * H(i, k) + y * H(i, k + 1);
+          if (notlast) {
+            p += z * H(i, k + 2);
+            H(i, k + 2) -= p * r;
+          }
+          H(i, k) -= p;
+          H(i, k + 1) -= p * q;
+        }
+        if (v) {
+          for (int i = 0; i < (int)nn; i++) {
+            p = x * V(i, k) + y * V(i, k + 1);
+            if (notlast) {
+              p += z * V(i, k + 2);
+              V(i, k + 2) -= p * r;
+            }
+            V(i, k) -= p;
+            V(i, k + 1) -= p * q;
+          }
+        }
+      }
+    }
+  }
+  return 1;
+#undef H
+#undef V
+}
+
+static double* mat_to_array(mat* A) {
+  double* a = malloc((size_t)A->num_rows * A->num_cols * sizeof(*a));
+  for (unsigned int i = 0; i < A->num_rows; i++) {
+    memcpy(a + (size_t)i * A->num_cols, A->values[i], A->num_cols * sizeof(*a));
+  }
+  return a;
+}
+
+static mat* mat_from_array(const double* a, unsigned int rows, unsigned int cols) {
+  mat* m = new_mat(rows, cols);
+  for (unsigned int i = 0; i < rows; i++) {
+    memcpy(m->values[i], a + (size_t)i * cols, cols * sizeof(*a));
+  }
+  return m;
+}
+
+// Hessenberg reduction A = Q * H * Q^T, Q is optional
+int mat_hessenberg(mat* A, mat** H, mat** Q) {
+  if (!A || !H || !A->is_square) {
+    fprintf(stderr, "Hessenberg reduction requires a square matrix\n");
+    return 0;
+  }
+  unsigned int n = A->num_rows;
+  double* h = mat_to_array(A);
+  double* v = Q ? malloc((size_t)n * n * sizeof(*v)) : NULL;
+  hessenberg_reduce(h, v, n);
+  *H = mat_from_array(h, n, n);
+  if (Q) *Q = mat_from_array(v, n, n);
+  free(h);
+  free(v);
+  return 1;
+}
+
+// Eigenvalues of a general square matrix. evals is n x 2 holding the real and
+// imaginary parts; complex conjugate pairs appear next to each other with the
+// positive imaginary part first. T and Z are optional and receive the real Schur
+// form A = Z * T * Z^T (T quasi upper triangular with 1x1 and 2x2 blocks).
+int mat_eig(mat* A, mat** evals, mat** T, mat** Z) {
+  if (!A || !evals || !A->is_square) {
+    fprintf(stderr, "eigenvalue computation requires a square matrix\n");
+    return 0;
+  }
+  unsigned int n = A->num_rows;
+  double* h = mat_to_array(A);
+  double* v = Z ? malloc((size_t)n * n * sizeof(*v)) : NULL;
+  double* wr = malloc(n * sizeof(*wr));
+  double* wi = malloc(n * sizeof(*wi));
+
+  hessenberg_reduce(h, v, n);
+  int ok = hessenberg_qr(h, v, n, wr, wi, T != NULL);
+  if (ok) {
+    *evals = new_mat(n, 2);
+    for (unsigned int i = 0; i < n; i++) {
+      (*evals)->values[i][0] = wr[i];
+      (*evals)->values[i][1] = wi[i];
+    }
+    if (T) *T = mat_from_array(h, n, n);
+    if (Z) *Z = mat_from_array(v, n, n);
+  }
+  free(h);
+  free(v);
+  free(wr);
+  free(wi);
+  return ok;
+}
+
+
+// ---------------------------------------------------------------------------
+// Parallel execution
+// ---------------------------------------------------------------------------
+
+typedef void (*range_fn)(void* ctx, unsigned int begin, unsigned int end);
+
+// One process-wide pool of persistent workers serves every parallel kernel.
+// Its size comes from mat_runtime_init, else JABR_NUM_THREADS, else the
+// online CPUs, and counts the calling thread, which always runs the first
+// range itself. Only one parallel_for owns the pool at a time: a call made
+// while it is busy (another caller, or nested inside a running range) runs
+// inline on its own thread, so the CPU budget is never oversubscribed.
+typedef struct {
+  pthread_mutex_t owner;      // held by the parallel_for using the workers
+  pthread_mutex_t lock;       // protects the fields below
+  pthread_cond_t work;        // workers wait here for a new generation
+  pthread_cond_t done;        // the owner waits here for the workers
+  pthread_t* threads;
+  unsigned int size;          // threads including the caller, 0 when not started
+  int pin;
+  int quit;
+  unsigned long long generation;
+  range_fn fn;
+  void* ctx;
+  unsigned int count;
+  unsigned int ntasks;
+  unsigned int pending;       // worker ranges still running
+} thread_pool;
+
+static thread_pool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                           PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, 0, NULL, NULL, 0, 0, 0};
+
+// per-thread flags: inside a parallel range, and opted out by mat_runtime_serial
+static pthread_key_t in_parallel_key;
+static pthread_key_t serial_key;
+static pthread_once_t runtime_keys_once = PTHREAD_ONCE_INIT;
+
+// A forked child has only the forking thread: the workers are gone and the
+// locks may have been copied while held. The child starts from an empty
+// pool, which the next parallel kernel starts again.
+static void pool_atfork_child(void) {
+  pthread_mutex_init(&pool.owner, NULL);
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.work, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  free(pool.threads);
+  pool.threads = NULL;
+  pool.size = 0;
+  pool.quit = 0;
+  pool.generation = 0;
+  pool.pending = 0;
+  pthread_setspecific(in_parallel_key, NULL);
+}
+
+static void runtime_keys_init(void) {
+  pthread_key_create(&in_parallel_key, NULL);
+  pthread_key_create(&serial_key, NULL);
+  pthread_atfork(NULL, NULL, pool_atfork_child);
+}
+
+typedef struct {
+  unsigned int index;
+  int cpu;                    // core to pin to, -1 for none
+} pool_worker_arg;
+
+static void* pool_worker(void* arg) {
+  pool_worker_arg* wa = (pool_worker_arg*)arg;
+  unsigned int index = wa->index;
+  if (wa->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(wa->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  free(wa);
+  pthread_setspecific(in_parallel_key, (void*)1);
+  unsigned long long seen = 0;
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    while (!pool.quit && pool.generation == seen) pthread_cond_wait(&pool.work, &pool.lock);
+    if (pool.quit) break;
+    seen = pool.generation;
+    if (index >= pool.ntasks) continue;
+    range_fn fn = pool.fn;
+    void* ctx = pool.ctx;
+    unsigned int begin = (unsigned int)((unsigned long long)pool.count * index / pool.ntasks);
+    unsigned int end = (unsigned int)((unsigned long long)pool.count * (index + 1) / pool.ntasks);
+    pthread_mutex_unlock(&pool.lock);
+    fn(ctx, begin, end);
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.pending == 0) pthread_cond_signal(&pool.done);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
+
+// requested size, else JABR_NUM_THREADS, else the online CPUs
+static unsigned int runtime_default_threads(unsigned int requested) {
+  if (requested > 0) return requested;
+  const char* env = getenv("JABR_NUM_THREADS");
+  if (env) {
+    char* end;
+    unsigned long n = strtoul(env, &end, 10);
+    if (end != env && *end == '\0' && n > 0 && n <= 4096) return (unsigned int)n;
+  }
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (unsigned int)n : 1;
+}
+
+// starts the workers; the caller holds pool.owner
+static void pool_start(unsigned int size, int pin) {
+  pthread_once(&runtime_keys_once, runtime_keys_init);
+  // workers are pinned round-robin over the cores this process may use
+  int cpus[CPU_SETSIZE];
+  int ncpus = 0;
+  cpu_set_t allowed;
+  if (pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+      if (CPU_ISSET(c, &allowed)) cpus[ncpus++] = c;
+    }
+  }
+  pool.threads = malloc((size > 1 ? size - 1 : 1) * sizeof(*pool.threads));
+  pool.generation = 0;
+  pool.quit = 0;
+  pool.pin = pin;
+  unsigned int started = 0;
+  for (unsigned int t = 1; t < size; t++) {
+    pool_worker_arg* wa = malloc(sizeof(*wa));
+    wa->index = started + 1;
+    wa->cpu = ncpus > 0 ? cpus[(started + 1) % ncpus] : -1;
+    if (pthread_create(&pool.threads[started], NULL, pool_worker, wa) != 0) {
+      free(wa);
+      break;
+    }
+    started++;
+  }
+  pthread_mutex_lock(&pool.lock);
+  pool.size = started + 1;
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// joins the workers; the caller holds pool.owner
+static void pool_stop(void) {
+  if (pool.size == 0) return;
+  pthread_mutex_lock(&pool.lock);
+  pool.quit = 1;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+  for (unsigned int t = 0; t + 1 < pool.size; t++) pthread_join(pool.threads[t], NULL);
+  free(pool.threads);
+  pool.threads = NULL;
+  pthread_mutex_lock(&pool.lock);
+  pool.size = 0;
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// Inside a parallel range the owner lock is held, by this thread or by the
+// one waiting on this worker, so changing the pool there would deadlock.
+static int runtime_in_parallel(const char* what) {
+  pthread_once(&runtime_keys_once, runtime_keys_init);
+  if (!pthread_getspecific(in_parallel_key)) return 0;
+  fprintf(stderr, "%s cannot be called from inside a parallel kernel\n", what);
+  return 1;
+}
+
+// (Re)starts the pool with num_threads threads including the caller (0 picks
+// the default) and optional core pinning; waits for a running kernel first.
+// Returns 0 when called from inside a parallel kernel.
+int mat_runtime_init(unsigned int num_threads, int pin) {
+  if (runtime_in_parallel("mat_runtime_init")) return 0;
+  pthread_mutex_lock(&pool.owner);
+  pool_stop();
+  const char* env = getenv("JABR_PIN");
+  pool_start(runtime_default_threads(num_threads), pin || (env && strcmp(env, "1") == 0));
+  pthread_mutex_unlock(&pool.owner);
+  return 1;
+}
+
+// stops the workers; the next parallel kernel starts them again with the
+// defaults. Does nothing when called from inside a parallel kernel.
+void mat_runtime_shutdown(void) {
+  if (runtime_in_parallel("mat_runtime_shutdown")) return;
+  pthread_mutex_lock(&pool.owner);
+  pool_stop();
+  pthread_mutex_unlock(&pool.owner);
+}
+
+unsigned int mat_runtime_threads(void) {
+  pthread_mutex_lock(&pool.lock);
+  unsigned int size = pool.size;
+  pthread_mutex_unlock(&pool.lock);
+  return size ? size : runtime_default_threads(0);
+}
+
+// With serial set, parallel kernels called from this thread run on it alone.
+// Returns the previous setting so calls can be bracketed.
+int mat_runtime_serial(int serial) {
+  pthread_once(&runtime_keys_once, runtime_keys_init);
+  int previous = pthread_getspecific(serial_key) != NULL;
+  pthread_setspecific(serial_key, serial ? (void*)1 : NULL);
+  return previous;
+}
+
+// Runs fn over [0, count) split into contiguous ranges of at least grain items,
+// one range per pool thread. The calling thread works on the first range itself.
+static void parallel_for(unsigned int count, unsigned int grain, range_fn fn, void* ctx) {
+  if (count == 0) return;
+  if (grain == 0) grain = 1;
+  pthread_once(&runtime_keys_once, runtime_keys_init);
+  unsigned int max_tasks = (count + grain - 1) / grain;
+  if (max_tasks <= 1 || pthread_getspecific(in_parallel_key) || pthread_getspecific(serial_key)) {
+    fn(ctx, 0, count);
+    return;
+  }
+  if (pthread_mutex_trylock(&pool.owner) != 0) {
+    // another thread is using the workers
+    fn(ctx, 0, count);
+    return;
+  }
+  if (pool.size == 0) {
+    const char* env = getenv("JABR_PIN");
+    pool_start(runtime_default_threads(0), env && strcmp(env, "1") == 0);
+  }
+  unsigned int ntasks = pool.size < max_tasks ? pool.size : max_tasks;
+  if (ntasks <= 1) {
+    pthread_mutex_unlock(&pool.owner);
+    fn(ctx, 0, count);
+    return;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.fn = fn;
+  pool.ctx = ctx;
+  pool.count = count;
+  pool.ntasks = ntasks;
+  pool.pending = ntasks - 1;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+
+  pthread_setspecific(in_parallel_key, (void*)1);
+  fn(ctx, 0, (unsigned int)((unsigned long long)count / ntasks));
+  pthread_setspecific(in_parallel_key, NULL);
+
+  pthread_mutex_lock(&pool.lock);
+  while (pool.pending > 0) pthread_cond_wait(&pool.done, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+  pthread_mutex_unlock(&pool.owner);
+}
+
+
+// ---------------------------------------------------------------------------
+// Elementwise kernels
+// ---------------------------------------------------------------------------
+
+// These O(n^2) loops are memory bound. A range is only handed to another
+// thread when it moves at least this many elements, so small matrices run
+// inline and never pay for waking the pool.
+#define ELEMENTWISE_TASK_ITEMS (1u << 17)
+
+static unsigned int elementwise_grain(unsigned int num_cols) {
+  return (unsigned int)(ELEMENTWISE_TASK_ITEMS / ((unsigned long long)num_cols + 1)) + 1;
+}
+
+typedef struct {
+  int op;
+  double** dst;
+  double** src;
+  double value;
+  unsigned int num_cols;
+} elementwise_job;
+
+static void elementwise_range(void* ctx, unsigned int begin, unsigned int end) {
+  elementwise_job* job = (elementwise_job*)ctx;
+  unsigned int n = job->num_cols;
+  double value = job->value;
+  for (unsigned int i = begin; i < end; i++) {
+    double* d = job->dst[i];
+    const double* s = job->src ? job->src[i] : NULL;
+    switch (job->op) {
+      case EW_COPY: memcpy(d, s, n * sizeof(*d)); break;
+      case EW_FILL: for (unsigned int j = 0; j < n; j++) d[j] = value; break;
+      case EW_ADD: for (unsigned int j = 0; j < n; j++) d[j] += s[j]; break;
+      case EW_SUB: for (unsigned int j = 0; j < n; j++) d[j] -= s[j]; break;
+      case EW_SCALE: for (unsigned int j = 0; j < n; j++) d[j] *= value; break;
+    }
+  }
+}
+
+// dst op= src (or value) over the whole of dst; src has dst's shape
+static void elementwise(int op, mat* dst, mat* src, double value) {
+  elementwise_job job = {op, dst->values, src ? src->values : NULL, value, dst->num_cols};
+  parallel_for(dst->num_rows, elementwise_grain(dst->num_cols), elementwise_range, &job);
+}
+
+typedef struct {
+  double** dst;
+  double** src;
+  unsigned int num_cols;
+  unsigned int col0;
+} rows_copy_job;
+
+static void rows_copy_range(void* ctx, unsigned int begin, unsigned int end) {
+  rows_copy_job* job = (rows_copy_job*)ctx;
+  for (unsigned int i = begin; i < end; i++) {
+    memcpy(job->dst[i] + job->col0, job->src[i], job->num_cols * sizeof(**job->dst));
+  }
+}
+
+// copies num_rows x num_cols from src into dst starting at column col0
+static void rows_copy(double** dst, double** src, unsigned int num_rows, unsigned int num_cols, unsigned int col0) {
+  rows_copy_job job = {dst, src, num_cols, col0};
+  parallel_for(num_rows, elementwise_grain(num_cols), rows_copy_range, &job);
+}
+
+// tiles keep both the rows read and the rows written in cache
+#define TRANSPOSE_TILE 32
+
+typedef struct {
+  mat* dst;
+  mat* src;
+} transpose_job;
+
+// fills destination rows [begin, end), i.e. source columns
+static void transpose_range(void* ctx, unsigned int begin, unsigned int end) {
+  transpose_job* job = (transpose_job*)ctx;
+  double** d = job->dst->values;
+  double** s = job->src->values;
+  unsigned int rows = job->src->num_rows;
+  for (unsigned int jj = begin; jj < end; jj += TRANSPOSE_TILE) {
+    unsigned int jend = jj + TRANSPOSE_TILE < end ? jj + TRANSPOSE_TILE : end;
+    for (unsigned int ii = 0; ii < rows; ii += TRANSPOSE_TILE) {
+      unsigned int iend = ii + TRANSPOSE_TILE < rows ? ii + TRANSPOSE_TILE : rows;
+      for (unsigned int j = jj; j < jend; j++) {
+        double* dj = d[j];
+        for (unsigned int i = ii; i < iend; i++) dj[i] = s[i][j];
+      }
+    }
+  }
+}
+
+// dst = src^T, dst already allocated with the transposed shape
+static void transpose_into(mat* dst, mat* src) {
+  transpose_job job = {dst, src};
+  parallel_for(dst->num_rows, elementwise_grain(dst->num_cols), transpose_range, &job);
+}
+
+
+// ---------------------------------------------------------------------------
+// Memory placement
+// ---------------------------------------------------------------------------
+
+// Matrices of at least alloc_min_bytes are allocated as one anonymous mapping
+// instead of a calloc per row. The mapping can be backed by transparent huge
+// pages and placed on NUMA nodes: by default its pages are first touched by
+// the pool, each row range on the thread that the row-parallel kernels give
+// it, so data ends up on the socket that works on it. free_mat unmaps it
+// like a file mapping.
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static int alloc_policy = MAT_ALLOC_FIRST_TOUCH;
+static int alloc_node = 0;
+static size_t alloc_min_bytes = (size_t)1 << 22;
+static int alloc_huge = 1;
+
+#define HUGE_PAGE_BYTES ((size_t)2 << 20)
+#define NODE_MASK_BITS 1024
+
+// kernel memory policy modes, as in <numaif.h>
+#define MEMPOLICY_PREFERRED 1
+#define MEMPOLICY_INTERLEAVE 3
+#define MEMPOLICY_MEMS_ALLOWED 4
+
+typedef struct {
+  unsigned long bits[NODE_MASK_BITS / (8 * sizeof(unsigned long))];
+} node_mask;
+
+// nodes this process may allocate on; node 0 alone without NUMA support
+static void allowed_nodes(node_mask* mask) {
+  memset(mask, 0, sizeof(*mask));
+#ifdef SYS_get_mempolicy
+  int mode;
+  if (syscall(SYS_get_mempolicy, &mode, mask->bits, (unsigned long)NODE_MASK_BITS, NULL,
+              (unsigned long)MEMPOLICY_MEMS_ALLOWED) == 0) {
+    return;
+  }
+#endif
+  mask->bits[0] = 1;
+}
+
+static int node_allowed(const node_mask* mask, int node) {
+  const unsigned int word_bits = 8 * sizeof(unsigned long);
+  return node >= 0 && node < NODE_MASK_BITS && ((mask->bits[node / word_bits] >> (node % word_bits)) & 1);
+}
+
+// Chooses where the pages of large matrices go: MAT_ALLOC_FIRST_TOUCH,
+// MAT_ALLOC_INTERLEAVE over the allowed nodes, or MAT_ALLOC_NODE (node).
+int mat_alloc_policy(int policy, int node) {
+  if (policy != MAT_ALLOC_FIRST_TOUCH && policy != MAT_ALLOC_INTERLEAVE && policy != MAT_ALLOC_NODE) {
+    fprintf(stderr, "Unknown allocation policy %d\n", policy);
+    return 0;
+  }
+  if (policy == MAT_ALLOC_NODE) {
+    node_mask mask;
+    allowed_nodes(&mask);
+    if (!node_allowed(&mask, node)) {
+      fprintf(stderr, "NUMA node %d is not available\n", node);
+      return 0;
+    }
+  }
+  pthread_mutex_lock(&alloc_lock);
+  alloc_policy = policy;
+  alloc_node = node;
+  pthread_mutex_unlock(&alloc_lock);
+  return 1;
+}
+
+// Matrices of at least min_bytes use the placed allocation, with transparent
+// huge pages when huge_pages is set. 0 turns the placed allocation off.
+int mat_alloc_large(size_t min_bytes, int huge_pages) {
+  pthread_mutex_lock(&alloc_lock);
+  alloc_min_bytes = min_bytes ? min_bytes : (size_t)-1;
+  alloc_huge = huge_pages;
+  pthread_mutex_unlock(&alloc_lock);
+  return 1;
+}
+
+typedef struct {
+  double** rows;
+  size_t row_bytes;
+  size_t page;
+} touch_job;
+
+// writes one word per page so that the page is faulted in by this thread
+static void touch_range(void* ctx, unsigned int begin, unsigned int end) {
+  touch_job* job = (touch_job*)ctx;
+  char* first = (char*)job->rows[begin];
+  char* last = (char*)job->rows[end - 1] + job->row_bytes;
+  for (char* p = first; p < last; p += job->page) *(volatile char*)p = 0;
+}
+
+static int alloc_region(mat* m) {
+  size_t row_bytes = (size_t)m->num_cols * sizeof(double);
+  size_t bytes = (size_t)m->num_rows * row_bytes;
+  pthread_mutex_lock(&alloc_lock);
+  int policy = alloc_policy;
+  int node = alloc_node;
+  int huge = alloc_huge;
+  size_t min_bytes = alloc_min_bytes;
+  pthread_mutex_unlock(&alloc_lock);
+  if (bytes < min_bytes) return 0;
+
+  // huge pages need the data aligned to the huge page size
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t align = huge ? HUGE_PAGE_BYTES : page;
+  size_t len = bytes + align;
+  void* base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) return 0;
+  char* data = (char*)(((uintptr_t)base + align - 1) & ~(uintptr_t)(align - 1));
+#ifdef MADV_HUGEPAGE
+  if (huge) madvise(data, bytes, MADV_HUGEPAGE);
+#endif
+#ifdef SYS_mbind
+  // best effort: without NUMA support the pages are placed as usual
+  if (policy == MAT_ALLOC_INTERLEAVE || policy == MAT_ALLOC_NODE) {
+    node_mask mask;
+    if (policy == MAT_ALLOC_INTERLEAVE) {
+      allowed_nodes(&mask);
+    } else {
+      memset(&mask, 0, sizeof(mask));
+      mask.bits[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+    }
+    syscall(SYS_mbind, data, bytes, (unsigned long)(policy == MAT_ALLOC_INTERLEAVE ? MEMPOLICY_INTERLEAVE : MEMPOLICY_PREFERRED),
+            mask.bits, (unsigned long)NODE_MASK_BITS, 0ul);
+  }
+#endif
+
+  m->values = malloc(m->num_rows * sizeof(*m->values));
+  for (unsigned int i = 0; i < m->num_rows; i++) m->values[i] = (double*)(data + (size_t)i * row_bytes);
+  m->region_base = base;
+  m->region_len = len;
+  if (policy == MAT_ALLOC_FIRST_TOUCH) {
+    touch_job job = {m->values, row_bytes, page};
+    parallel_for(m->num_rows, elementwise_grain(m->num_cols), touch_range, &job);
+  }
+  return 1;
+}
+
+
+// ---------------------------------------------------------------------------
+// Singular value decomposition (one-sided Jacobi)
+// ---------------------------------------------------------------------------
+
+typedef struct {
+  double* g;              // working columns, column-major m x n
+  double* v;              // right singular vectors, column-major n x n, or NULL
+  double* sq;             // squared column norms, kept up to date by the rotations
+  unsigned int m;
+  unsigned int n;
+  const unsigned int* pi; // pair (pi[k], pj[k]) for this round
+  const unsigned int* pj;
+  unsigned char* rotated; // set per pair when a rotation was applied
+  double tol;
+  double negligible;      // squared norm below which a column counts as zero
+} jacobi_round;
+
+// orthogonalizes the column pairs [begin, end) of one round; pairs within a
+// round touch disjoint columns so ranges can run concurrently
+static void jacobi_round_range(void* arg, unsigned int begin, unsigned int end) {
+  jacobi_round* jr = (jacobi_round*)arg;
+  unsigned int m = jr->m;
+  for (unsigned int k = begin; k < end; k++) {
+    jr->rotated[k] = 0;
+    unsigned int i = jr->pi[k], j = jr->pj[k];
+    if (i >= jr->n || j >= jr->n) continue;  // bye in an odd tournament
+    double* gi = jr->g + (size_t)i * m;
+    double* gj = jr->g + (size_t)j * m;
+    double alpha = jr->sq[i];
+    double beta = jr->sq[j];
+    // a column at roundoff level is already in the null space: the relative
+    // test below would keep rotating it against the others forever
+    if (alpha <= jr->negligible || beta <= jr->negligible) continue;
+    double gamma = vec_dot(gi, gj, m);
+    if (gamma == 0.0 || fabs(gamma) <= jr->tol * sqrt(alpha * beta)) continue;
+
+    // rotation that makes columns i and j orthogonal
+    double zeta = (beta - alpha) / (2.0 * gamma);
+    double t = copysign(1.0, zeta) / (fabs(zeta) + sqrt(1.0 + zeta * zeta));
+    double c = 1.0 / sqrt(1.0 + t * t);
+    double s = c * t;
+    for (unsigned int r = 0; r < m; r++) {
+      double a = gi[r], b = gj[r];
+      gi[r] = c * a - s * b;
+      gj[r] = s * a + c * b;
+    }
+    jr->sq[i] = alpha - t * gamma;
+    jr->sq[j] = beta + t * gamma;
+    if (jr->v) {
+      double* vi = jr->v + (size_t)i * jr->n;
+      double* vj = jr->v + (size_t)j * jr->n;
+      for (unsigned int r = 0; r < jr->n; r++) {
+        double a = vi[r], b = vj[r];
+        vi[r] = c * a - s * b;
+        vj[r] = s * a + c * b;
+      }
+    }
+    jr->rotated[k] = 1;
+  }
+}
+
+// In-place Householder QR of a column-major m x n array (m >= n); the
+// reflectors are left below the diagonal with their scalars in tau
+static void householder_qr(double* a, unsigned int m, unsigned int n, double* tau) {
+  for (unsigned int k = 0; k < n; k++) {
+    double* ck = a + (size_t)k * m;
+    tau[k] = householder_gen(&ck[k], &ck[k + 1], m - k - 1, 1);
+    if (tau[k] == 0.0) continue;
+    for (unsigned int c = k + 1; c < n; c++) {
+      double* cc = a + (size_t)c * m;
+      double s = cc[k];
+      for (unsigned int i = k + 1; i < m; i++) s += ck[i] * cc[i];
+      s *= tau[k];
+      cc[k] -= s;
+      for (unsigned int i = k + 1; i < m; i++) cc[i] -= s * ck[i];
+    }
+  }
+}
+
+// x = H(0)*H(1)*...*H(r-1)*x for reflectors stored by householder_qr
+static void householder_apply_q(const double* a, unsigned int m, unsigned int r,
+                                const double* tau, double* x) {
+  for (unsigned int k = r; k-- > 0;) {
+    if (tau[k] == 0.0) continue;
+    const double* ck = a + (size_t)k * m;
+    double s = x[k];
+    for (unsigned int i = k + 1; i < m; i++) s += ck[i] * x[i];
+    s *= tau[k];
+    x[k] -= s;
+    for (unsigned int i = k + 1; i < m; i++) x[i] -= s * ck[i];
+  }
+}
+
+// Extends the first r orthonormal columns of the column-major m x cols array u
+// (cols <= m) with orthonormal columns r..cols-1, using a Householder QR of
+// the given columns. Returns 0 if the workspace cannot be allocated.
+static int orth_complete(double* u, unsigned int m, unsigned int r, unsigned int cols) {
+  if (r >= cols) return 1;
+  double* qr = malloc(((size_t)m * r + 1) * sizeof(*qr));
+  double* tau = malloc((r + 1) * sizeof(*tau));
+  if (!qr || !tau) {
+    free(qr);
+    free(tau);
+    return 0;
+  }
+  memcpy(qr, u, (size_t)m * r * sizeof(*qr));
+  householder_qr(qr, m, r, tau);
+  // columns r.. of Q = H(0)...H(r-1) are orthogonal to the given ones
+  for (unsigned int c = r; c < cols; c++) {
+    double* uc = u + (size_t)c * m;
+    memset(uc, 0, m * sizeof(*uc));
+    uc[c] = 1.0;
+    householder_apply_q(qr, m, r, tau, uc);
+  }
+  free(qr);
+  free(tau);
+  return 1;
+}
+
+// Singular value decomposition A = U * diag(S) * V^T by one-sided Jacobi.
+// Column pairs are processed in round-robin order so the rotations of one round
+// run in parallel. S is k x 1 (k = min(m, n)) in descending order. With full == 0
+// U is m x k and V is n x k, otherwise U is m x m and V is n x n. Passing NULL
+// for both U and V computes the singular values only.
+int mat_svd(mat* A, mat** U, mat** S, mat** V, int full) {
+  if (!A || !S) {
+    fprintf(stderr, "SVD requires non-NULL arguments\n");
+    return 0;
+  }
+  // work on the tall orientation; a wide A is handled through A^T
+  int transposed = A->num_rows < A->num_cols;
+  unsigned int m = transposed ? A->num_cols : A->num_rows;
+  unsigned int n = transposed ? A->num_rows : A->num_cols;
+  mat** Ut = transposed ? V : U;   // left vectors of the tall problem
+  mat** Vt = transposed ? U : V;   // right vectors of the tall problem
+
+  double* g = malloc((size_t)m * n * sizeof(*g));
+  for (unsigned int i = 0; i < A->num_rows; i++) {
+    for (unsigned int j = 0; j < A->num_cols; j++) {
+      if (transposed) {
+        g[(size_t)i * m + j] = A->values[i][j];
+      } else {
+        g[(size_t)j * m + i] = A->values[i][j];
+      }
+    }
+  }
+
+  // Step 1: for tall matrices run Jacobi on the n x n R of A = QR, which
+  // makes every rotation m/n times cheaper
+  double* qr = NULL;
+  double* tau = NULL;
+  unsigned int rows = m;
+  if (m > n) {
+    qr = g;
+    tau = malloc(n * sizeof(*tau));
+    householder_qr(qr, m, n, tau);
+    g = calloc((size_t)n * n, sizeof(*g));
+    for (unsigned int c = 0; c < n; c++) {
+      memcpy(g + (size_t)c * n, qr + (size_t)c * m, (c + 1) * sizeof(*g));
+    }
+    rows = n;
+  }
+
+  double* v = NULL;
+  if (Vt) {
+    v = calloc((size_t)n * n, sizeof(*v));
+    for (unsigned int i = 0; i < n; i++) v[(size_t)i * n + i] = 1.0;
+  }
+
+  // Step 2: Jacobi sweeps in round-robin tournament order
+  unsigned int players = n + (n & 1);
+  unsigned int npairs = players / 2;
+  unsigned int* order = malloc(players * sizeof(*order));
+  unsigned int* pi = malloc((npairs + 1) * sizeof(*pi));
+  unsigned int* pj = malloc((npairs + 1) * sizeof(*pj));
+  unsigned char* rotated = malloc(npairs + 1);
+  double* sq = malloc(n * sizeof(*sq));
+  for (unsigned int i = 0; i < players; i++) order[i] = i;  // index n is the bye
+
+  jacobi_round jr = { g, v, sq, rows, n, pi, pj, rotated, rows * DBL_EPSILON, 0.0 };
+  // only go parallel when a task carries enough work to amortize the threads
+  unsigned int grain = 8192 / (rows + n) + 1;
+  const unsigned int max_sweeps = 60;
+  int converged = (n < 2);
+  for (unsigned int sweep = 0; sweep < max_sweeps && !converged; sweep++) {
+    // refresh the norms each sweep so the running updates cannot drift
+    for (unsigned int j = 0; j < n; j++) {
+      const double* gj = g + (size_t)j * rows;
+      sq[j] = vec_dot(gj, gj, rows);
+    }
+    // same cutoff as the zero singular values in step 4 (dgesvj skips such
+    // columns the same way)
+    double maxsq = 0.0;
+    for (unsigned int j = 0; j < n; j++) {
+      if (sq[j] > maxsq) maxsq = sq[j];
+    }
+    jr.negligible = maxsq * ((double)m * DBL_EPSILON) * ((double)m * DBL_EPSILON);
+    int any = 0;
+    for (unsigned int round = 0; round + 1 < players; round++) {
+      for (unsigned int k = 0; k < npairs; k++) {
+        pi[k] = order[k];
+        pj[k] = order[players - 1 - k];
+      }
+      parallel_for(npairs, grain, jacobi_round_range, &jr);
+      for (unsigned int k = 0; k < npairs; k++) any |= rotated[k];
+      // keep player 0 fixed and rotate the others one position
+      unsigned int last = order[players - 1];
+      memmove(order + 2, order + 1, (players - 2) * sizeof(*order));
+      order[1] = last;
+    }
+    converged = !any;
+  }
+  free(order);
+  free(pi);
+  free(pj);
+  free(rotated);
+  free(sq);
+  if (!converged) {
+    fprintf(stderr, "SVD: Jacobi sweeps did not converge\n");
+    free(g);
+    free(v);
+    free(qr);
+    free(tau);
+    return 0;
+  }
+
+  // Step 3: singular values are the column norms, sorted descending
+  double* sigma = malloc(n * sizeof(*sigma));
+  unsigned int* idx = malloc(n * sizeof(*idx));
+  for (unsigned int j = 0; j < n; j++) {
+    sigma[j] = vec_norm(g + (size_t)j * rows, rows);
+    idx[j] = j;
+  }
+  for (unsigned int i = 1; i < n; i++) {
+    unsigned int c = idx[i];
+    unsigned int j = i;
+    while (j > 0 && sigma[idx[j - 1]] < sigma[c]) {
+      idx[j] = idx[j - 1];
+      j--;
+    }
+    idx[j] = c;
+  }
+  // Step 4 workspace: only as many left vectors as are returned, so a thin
+  // SVD of a tall matrix never needs m x m storage
+  unsigned int ucols = full ? m : n;
+  double* u = NULL;
+  if (Ut) {
+    u = calloc((size_t)m * ucols, sizeof(*u));
+    if (!u) {
+      fprintf(stderr, "SVD: cannot allocate the %u x %u left vectors\n", m, ucols);
+      free(sigma);
+      free(idx);
+      free(g);
+      free(v);
+      free(qr);
+      free(tau);
+      return 0;
+    }
+  }
+  *S = new_mat(n, 1);
+  for (unsigned int j = 0; j < n; j++) (*S)->values[j][0] = sigma[idx[j]];
+
+  if (Ut) {
+    // Step 4: left vectors are the normalized columns (mapped back through Q),
+    // with the basis completed where sigma vanishes or a full U is wanted
+    double small = (n > 0 ? sigma[idx[0]] : 0.0) * m * DBL_EPSILON;
+    unsigned int r = 0;
+    for (unsigned int j = 0; j < n; j++) {
+      double sj = sigma[idx[j]];
+      if (sj <= small || sj == 0.0) break;
+      const double* gj = g + (size_t)idx[j] * rows;
+      double* uj = u + (size_t)r * m;
+      for (unsigned int i = 0; i < rows; i++) uj[i] = gj[i] / sj;
+      if (qr) householder_apply_q(qr, m, n, tau, uj);
+      r++;
+    }
+    if (!orth_complete(u, m, r, ucols)) {
+      fprintf(stderr, "SVD: cannot allocate the basis completion workspace\n");
+      free_mat(*S);
+      *S = NULL;
+      free(u);
+      free(sigma);
+      free(idx);
+      free(g);
+      free(v);
+      free(qr);
+      free(tau);
+      return 0;
+    }
+    *Ut = new_mat(m, ucols);
+    for (unsigned int i = 0; i < m; i++) {
+      for (unsigned int j = 0; j < ucols; j++) (*Ut)->values[i][j] = u[(size_t)j * m + i];
+    }
+    free(u);
+  }
+  if (Vt) {
+    *Vt = new_mat(n, n);
+    for (unsigned int i = 0; i < n; i++) {
+      for (unsigned int j = 0; j < n; j++) (*Vt)->values[i][j] = v[(size_t)idx[j] * n + i];
+    }
+  }
+  free(sigma);
+  free(idx);
+  free(g);
+  free(v);
+  free(qr);
+  free(tau);
+  return 1;
+}
+
+
+// ---------------------------------------------------------------------------
+// Tall-skinny QR (TSQR)
+// ---------------------------------------------------------------------------
+
+#define TSQR_BLOCK_ROWS 256
+
+// Folds a block of rows into an upper triangular factor: on return r (n x n,
+// row-major) is the R factor of [r; c]. c (rows x n, row-major) is destroyed.
+// The reflector for column j only touches row j of r and the rows of c, so the
+// cost is O(rows * n^2) no matter how many rows have been absorbed before.
+static void tsqr_absorb(double* r, unsigned int n, double* c, unsigned int rows, double* w) {
+  for (unsigned int j = 0; j < n; j++) {
+    double norm2 = 0.0;
+    for (unsigned int i = 0; i < rows; i++) {
+      double x = c[(size_t)i * n + j];
+      norm2 += x * x;
+    }
+    if (norm2 == 0.0) continue;
+    double alpha = r[(size_t)j * n + j];
+    double beta = -copysign(sqrt(alpha * alpha + norm2), alpha);
+    double tau = (beta - alpha) / beta;
+    double scale = 1.0 / (alpha - beta);
+    for (unsigned int i = 0; i < rows; i++) c[(size_t)i * n + j] *= scale;
+    r[(size_t)j * n + j] = beta;
+
+    // w = r[j, j+1:] + v^T c[:, j+1:], accumulated row by row
+    for (unsigned int k = j + 1; k < n; k++) w[k] = r[(size_t)j * n + k];
+    for (unsigned int i = 0; i < rows; i++) {
+      const double* ci = c + (size_t)i * n;
+      double vi = ci[j];
+      for (unsigned int k = j + 1; k < n; k++) w[k] += vi * ci[k];
+    }
+    for (unsigned int k = j + 1; k < n; k++) {
+      w[k] *= tau;
+      r[(size_t)j * n + k] -= w[k];
+    }
+    for (unsigned int i = 0; i < rows; i++) {
+      double* ci = c + (size_t)i * n;
+      double vi = ci[j];
+      for (unsigned int k = j + 1; k < n; k++) ci[k] -= w[k] * vi;
+    }
+  }
+}
+
+// absorbs rows [row0, row0 + rows) of [A b] into r, TSQR_BLOCK_ROWS at a time
+static void tsqr_absorb_rows(double* r, unsigned int ncols, mat* A, mat* b,
+                             unsigned int row0, unsigned int rows, double* scratch, double* w) {
+  unsigned int nrhs = b ? b->num_cols : 0;
+  unsigned int n = ncols + nrhs;
+  for (unsigned int start = 0; start < rows; start += TSQR_BLOCK_ROWS) {
+    unsigned int count = rows - start < TSQR_BLOCK_ROWS ? rows - start : TSQR_BLOCK_ROWS;
+    for (unsigned int i = 0; i < count; i++) {
+      double* dst = scratch + (size_t)i * n;
+      memcpy(dst, A->values[row0 + start + i], ncols * sizeof(*dst));
+      if (nrhs) memcpy(dst + ncols, b->values[row0 + start + i], nrhs * sizeof(*dst));
+    }
+    tsqr_absorb(r, n, scratch, count, w);
+  }
+}
+
+typedef struct {
+  mat* A;
+  mat* b;
+  unsigned int ncols;
+  unsigned int n;            // ncols + number of right-hand sides
+  unsigned int block_rows;   // rows per leaf
+  unsigned int nrows;
+  double** leaf_r;           // one R per leaf range, indexed by its first leaf
+  double** level;            // factors being reduced in the tree
+  unsigned int stride;       // distance between partners in the current tree level
+} tsqr_job;
+
+// each range of leaves is factored sequentially into one local R
+static void tsqr_leaf_range(void* arg, unsigned int begin, unsigned int end) {
+  tsqr_job* job = (tsqr_job*)arg;
+  unsigned int n = job->n;
+  double* r = calloc((size_t)n * n, sizeof(*r));
+  double* scratch = malloc((size_t)TSQR_BLOCK_ROWS * n * sizeof(*scratch));
+  double* w = malloc(n * sizeof(*w));
+  unsigned int row0 = begin * job->block_rows;
+  unsigned int row1 = end * job->block_rows;
+  if (row1 > job->nrows) row1 = job->nrows;
+  tsqr_absorb_rows(r, job->ncols, job->A, job->b, row0, row1 - row0, scratch, w);
+  job->leaf_r[begin] = r;
+  free(scratch);
+  free(w);
+}
+
+// one level of the reduction tree: factor k absorbs its partner k + stride
+static void tsqr_tree_range(void* arg, unsigned int begin, unsigned int end) {
+  tsqr_job* job = (tsqr_job*)arg;
+  unsigned int n = job->n;
+  double* w = malloc(n * sizeof(*w));
+  for (unsigned int p = begin; p < end; p++) {
+    unsigned int k = p * 2 * job->stride;
+    double* partner = job->level[k + job->stride];
+    tsqr_absorb(job->level[k], n, partner, n, w);
+    free(partner);
+    job->level[k + job->stride] = NULL;
+  }
+  free(w);
+}
+
+// TSQR of [A b]: leaves in parallel, then a binary tree over their R factors.
+// Returns the (ncols + nrhs)^2 row-major triangular factor.
+static double* tsqr_factor(mat* A, mat* b) {
+  unsigned int nrhs = b ? b->num_cols : 0;
+  tsqr_job job;
+  job.A = A;
+  job.b = b;
+  job.ncols = A->num_cols;
+  job.n = A->num_cols + nrhs;
+  job.block_rows = TSQR_BLOCK_ROWS;
+  job.nrows = A->num_rows;
+  unsigned int leaves = (A->num_rows + TSQR_BLOCK_ROWS - 1) / TSQR_BLOCK_ROWS;
+  job.leaf_r = calloc(leaves, sizeof(*job.leaf_r));
+  parallel_for(leaves, 4, tsqr_leaf_range, &job);
+
+  // gather the local factors and reduce them pairwise
+  unsigned int count = 0;
+  for (unsigned int i = 0; i < leaves; i++) {
+    if (job.leaf_r[i]) job.leaf_r[count++] = job.leaf_r[i];
+  }
+  job.level = job.leaf_r;
+  for (job.stride = 1; job.stride < count; job.stride *= 2) {
+    unsigned int pairs = 0;
+    while ((2 * pairs + 1) * job.stride < count) pairs++;
+    parallel_for(pairs, 1, tsqr_tree_range, &job);
+  }
+  double* r = job.leaf_r[0];
+  free(job.leaf_r);
+  return r;
+}
+
+// back substitution R x = Q^T b on the augmented factor
+static mat* tsqr_backsolve(const double* r, unsigned int ncols, unsigned int nrhs) {
+  unsigned int n = ncols + nrhs;
+  for (unsigned int i = 0; i < ncols; i++) {
+    if (fabs(r[(size_t)i * n + i]) < EPSILON) {
+      fprintf(stderr, "R matrix is singular - cannot solve system\n");
+      return NULL;
+    }
+  }
+  mat* x = new_mat(ncols, nrhs);
+  for (unsigned int c = 0; c < nrhs; c++) {
+    for (unsigned int i = ncols; i-- > 0;) {
+      double sum = r[(size_t)i * n + ncols + c];
+      for (unsigned int j = i + 1; j < ncols; j++) {
+        sum -= r[(size_t)i * n + j] * x->values[j][c];
+      }
+      x->values[i][c] = sum / r[(size_t)i * n + i];
+    }
+  }
+  return x;
+}
+
+static mat* tsqr_r_mat(const double* r, unsigned int ncols, unsigned int n) {
+  mat* R = new_mat(ncols, ncols);
+  for (unsigned int i = 0; i < ncols; i++) {
+    for (unsigned int j = i; j < ncols; j++) R->values[i][j] = r[(size_t)i * n + j];
+  }
+  return R;
+}
+
+// R factor of a tall-skinny A (m >= n) computed with TSQR, Q is never formed
+int mat_tsqr_decomp(mat* A, mat** R) {
+  if (!A || !R) {
+    fprintf(stderr, "TSQR requires non-NULL matrix\n");
+    return 0;
+  }
+  if (A->num_rows < A->num_cols) {
+    fprintf(stderr, "TSQR requires m >= n (rows >= cols)\n");
+    return 0;
+  }
+  double* r = tsqr_factor(A, NULL);
+  *R = tsqr_r_mat(r, A->num_cols, A->num_cols);
+  free(r);
+  return 1;
+}
+
+// Least squares min ||Ax - b|| via TSQR of [A b]: the last columns of the
+// triangular factor hold Q^T b, so Q is never formed. b may have several columns.
+mat* mat_tsqr_lstsq(mat* A, mat* b) {
+  if (!A || !b) {
+    fprintf(stderr, "Invalid input matrices for TSQR least squares\n");
+    return NULL;
+  }
+  if (A->num_rows < A->num_cols || b->num_rows != A->num_rows) {
+    fprintf(stderr, "Matrix dimensions incompatible for TSQR least squares\n");
+    return NULL;
+  }
+  double* r = tsqr_factor(A, b);
+  mat* x = tsqr_backsolve(r, A->num_cols, b->num_cols);
+  free(r);
+  return x;
+}
+
+// Streaming TSQR: row chunks are folded into the running factor as they arrive
+mat_tsqr* mat_tsqr_begin(unsigned int num_cols, unsigned int num_rhs) {
+  if (num_cols == 0) {
+    fprintf(stderr, "TSQR requires at least one column\n");
+    return NULL;
+  }
+  mat_tsqr* state = calloc(1, sizeof(*state));
+  unsigned int n = num_cols + num_rhs;
+  state->num_cols = num_cols;
+  state->num_rhs = num_rhs;
+  state->r = calloc((size_t)n * n, sizeof(*state->r));
+  return state;
+}
+
+int mat_tsqr_push(mat_tsqr* state, mat* A_rows, mat* b_rows) {
+  if (!state || !A_rows) {
+    fprintf(stderr, "Invalid input for TSQR push\n");
+    return 0;
+  }
+  if (A_rows->num_cols != state->num_cols ||
+      (state->num_rhs && (!b_rows || b_rows->num_cols != state->num_rhs ||
+                          b_rows->num_rows != A_rows->num_rows))) {
+    fprintf(stderr, "Chunk dimensions incompatible with TSQR state\n");
+    return 0;
+  }
+  unsigned int n = state->num_cols + state->num_rhs;
+  double* scratch = malloc((size_t)TSQR_BLOCK_ROWS * n * sizeof(*scratch));
+  double* w = malloc(n * sizeof(*w));
+  tsqr_absorb_rows(state->r, state->num_cols, A_rows, state->num_rhs ? b_rows : NULL,
+                   0, A_rows->num_rows, scratch, w);
+  state->rows_seen += A_rows->num_rows;
+  free(scratch);
+  free(w);
+  return 1;
+}
+
+mat* mat_tsqr_r(mat_tsqr* state) {
+  if (!state) return NULL;
+  return tsqr_r_mat(state->r, state->num_cols, state->num_cols + state->num_rhs);
+}
+
+mat* mat_tsqr_solve(mat_tsqr* state) {
+  if (!state || state->num_rhs == 0) {
+    fprintf(stderr, "TSQR state has no right-hand side to solve for\n");
+    return NULL;
+  }
+  if (state->rows_seen < state->num_cols) {
+    fprintf(stderr, "TSQR needs at least as many rows as columns\n");
+    return NULL;
+  }
+  return tsqr_backsolve(state->r, state->num_cols, state->num_rhs);
+}
+
+void mat_tsqr_free(mat_tsqr* state) {
+  if (!state) return;
+  free(state->r);
+  free(state);
+}
+
+
+// ---------------------------------------------------------------------------
+// Cholesky decomposition and low-rank factor updates
+// ---------------------------------------------------------------------------
+
+// Cholesky decomposition A = L * L^T, reads the lower triangle of A
+int mat_chol_decomp(mat* A, mat** L) {
+  if (!A || !L || !A->is_square) {
+    fprintf(stderr, "Cholesky decomposition requires square matrix\n");
+    return 0;
+  }
+  unsigned int n = A->num_rows;
+  mat* l = new_mat(n, n);
+  for (unsigned int j = 0; j < n; j++) {
+    double d = A->values[j][j];
+    for (unsigned int k = 0; k < j; k++) d -= l->values[j][k] * l->values[j][k];
+    if (d <= 0.0) {
+      fprintf(stderr, "Matrix is not positive definite - Cholesky failed\n");
+      free_mat(l);
+      return 0;
+    }
+    d = sqrt(d);
+    l->values[j][j] = d;
+    for (unsigned int i = j + 1; i < n; i++) {
+      double sum = A->values[i][j];
+      const double* li = l->values[i];
+      const double* lj = l->values[j];
+      for (unsigned int k = 0; k < j; k++) sum -= li[k] * lj[k];
+      l->values[i][j] = sum / d;
+    }
+  }
+  *L = l;
+  return 1;
+}
+
+// Solve A x = b with A = L * L^T: L y = b, then L^T x = y
+mat* mat_chol_solve(mat* L, mat* b) {
+  if (!L || !b) {
+    fprintf(stderr, "Invalid input matrices for Cholesky solve\n");
+    return NULL;
+  }
+  if (!L->is_square || b->num_rows != L->num_rows) {
+    fprintf(stderr, "Matrix dimensions incompatible for Cholesky solve\n");
+    return NULL;
+  }
+  unsigned int n = L->num_rows;
+  for (unsigned int i = 0; i < n; i++) {
+    if (fabs(L->values[i][i]) < EPSILON) {
+      fprintf(stderr, "Matrix is singular - cannot solve system\n");
+      return NULL;
+    }
+  }
+  mat* x = mat_cp(b);
+  for (unsigned int c = 0; c < b->num_cols; c++) {
+    for (unsigned int i = 0; i < n; i++) {
+      double sum = x->values[i][c];
+      for (unsigned int k = 0; k < i; k++) sum -= L->values[i][k] * x->values[k][c];
+      x->values[i][c] = sum / L->values[i][i];
+    }
+    for (unsigned int i = n; i-- > 0;) {
+      double sum = x->values[i][c];
+      for (unsigned int k = i + 1; k < n; k++) sum -= L->values[k][i] * x->values[k][c];
+      x->values[i][c] = sum / L->values[i][i];
+    }
+  }
+  return x;
+}
+
+static int chol_update_check(mat* L, mat* x) {
+  if (!L || !x) {
+    fprintf(stderr, "Invalid input matrices for Cholesky update\n");
+    return 0;
+  }
+  if (!L->is_square || x->num_rows != L->num_rows || x->num_cols != 1) {
+    fprintf(stderr, "Matrix dimensions incompatible for Cholesky update\n");
+    return 0;
+  }
+  return 1;
+}
+
+// L * L^T + x * x^T in place, O(n^2)
+int mat_chol_update(mat* L, mat* x) {
+  if (!chol_update_check(L, x)) return 0;
+  unsigned int n = L->num_rows;
+  double* w = malloc(n * sizeof(*w));
+  vec_from_col(w, x);
+  for (unsigned int k = 0; k < n; k++) {
+    double lkk = L->values[k][k];
+    double r = hypot(lkk, w[k]);
+    double c = r / lkk;
+    double s = w[k] / lkk;
+    L->values[k][k] = r;
+    for (unsigned int i = k + 1; i < n; i++) {
+      double lik = (L->values[i][k] + s * w[i]) / c;
+      L->values[i][k] = lik;
+      w[i] = c * w[i] - s * lik;
+    }
+  }
+  free(w);
+  return 1;
+}
+
+// L * L^T - x * x^T in place, O(n^2). Returns 0 and leaves L untouched if the
+// result would not be positive definite (LINPACK dchdd).
+int mat_chol_downdate(mat* L, mat* x) {
+  if (!chol_update_check(L, x)) return 0;
+  unsigned int n = L->num_rows;
+  double* p = malloc(n * sizeof(*p));
+  double* c = malloc(n * sizeof(*c));
+  double* s = malloc(n * sizeof(*s));
+
+  // p = L^-1 x, the downdate is possible iff ||p|| < 1
+  for (unsigned int i = 0; i < n; i++) {
+    double sum = x->values[i][0];
+    for (unsigned int k = 0; k < i; k++) sum -= L->values[i][k] * p[k];
+    p[i] = sum / L->values[i][i];
+  }
+  double norm = vec_norm(p, n);
+  if (!(norm < 1.0)) {
+    fprintf(stderr, "Downdated matrix is not positive definite\n");
+    free(p);
+    free(c);
+    free(s);
+    return 0;
+  }
+  double alpha = sqrt((1.0 - norm) * (1.0 + norm));
+
+  // rotations that annihilate p against alpha, from the bottom up
+  for (unsigned int i = n; i-- > 0;) {
+    double scale = alpha + fabs(p[i]);
+    double a = alpha / scale;
+    double b = p[i] / scale;
+    double r = sqrt(a * a + b * b);
+    c[i] = a / r;
+    s[i] = b / r;
+    alpha = scale * r;
+  }
+
+  // apply them to each row of L (column of R = L^T)
+  for (unsigned int j = 0; j < n; j++) {
+    double carry = 0.0;
+    for (unsigned int i = j + 1; i-- > 0;) {
+      double lji = L->values[j][i];
+      double t = c[i] * carry + s[i] * lji;
+      L->values[j][i] = c[i] * lji - s[i] * carry;
+      carry = t;
+    }
+  }
+  free(p);
+  free(c);
+  free(s);
+  return 1;
+}
+
+// Rank-one update of P*A = L*U to P*(A + u*v^T) = L'*U' in place, O(n^2)
+// (Bennett's algorithm). There is no re-pivoting: if a pivot of the updated U
+// vanishes it returns 0 and L, U must be recomputed with mat_lup_decomp.
+int mat_lup_update(mat* L, mat* U, mat* P, mat* u, mat* v) {
+  if (!L || !U || !P || !u || !v) {
+    fprintf(stderr, "Invalid input matrices for LUP update\n");
+    return 0;
+  }
+  unsigned int n = L->num_rows;
+  if (!L->is_square || !U->is_square || !P->is_square ||
+      U->num_rows != n || P->num_rows != n ||
+      u->num_rows != n || u->num_cols != 1 || v->num_rows != n || v->num_cols != 1) {
+    fprintf(stderr, "Matrix dimensions incompatible for LUP update\n");
+    return 0;
+  }
+  double* x = calloc(n, sizeof(*x));
+  double* y = malloc(n * sizeof(*y));
+  // x = P * u (P has a single one per row)
+  for (unsigned int i = 0; i < n; i++) {
+    for (unsigned int j = 0; j < n; j++) {
+      if (P->values[i][j] != 0.0) {
+        x[i] = P->values[i][j] * u->values[j][0];
+        break;
+      }
+    }
+  }
+  vec_from_col(y, v);
+
+  int ok = 1;
+  for (unsigned int i = 0; i < n; i++) {
+    double* ui = U->values[i];
+    ui[i] += x[i] * y[i];
+    if (fabs(ui[i]) < EPSILON) {
+      fprintf(stderr, "Pivot vanished during LUP update - refactor the matrix\n");
+      ok = 0;
+      break;
+    }
+    double gamma = y[i] / ui[i];
+    for (unsigned int j = i + 1; j < n; j++) {
+      ui[j] += x[i] * y[j];
+      x[j] -= x[i] * L->values[j][i];
+      L->values[j][i] += gamma * x[j];
+      y[j] -= gamma * ui[j];
+    }
+  }
+  free(x);
+  free(y);
+  return ok;
+}
+
+// Givens rotation with c*a + s*b = r and -s*a + c*b = 0
+static void givens(double a, double b, double* c, double* s) {
+  if (b == 0.0) {
+    *c = 1.0;
+    *s = 0.0;
+    return;
+  }
+  double r = hypot(a, b);
+  *c = a / r;
+  *s = b / r;
+}
+
+// rows i, k of r (row-major, ld columns) from column start: (ri, rk) <- G (ri, rk)
+static void rot_rows(double* ri, double* rk, unsigned int start, unsigned int cols, double c, double s) {
+  for (unsigned int j = start; j < cols; j++) {
+    double a = ri[j];
+    double b = rk[j];
+    ri[j] = c * a + s * b;
+    rk[j] = -s * a + c * b;
+  }
+}
+
+// columns i, k of q (row-major, ldq) over all rows: (qi, qk) <- (qi, qk) G^T
+static void rot_cols(double* q, unsigned int rows, size_t ldq, unsigned int i, unsigned int k, double c, double s) {
+  for (unsigned int r = 0; r < rows; r++) {
+    double* qr = q + r * ldq;
+    double a = qr[i];
+    double b = qr[k];
+    qr[i] = c * a + s * b;
+    qr[k] = -s * a + c * b;
+  }
+}
+
+static int qr_factors_check(mat* Q, mat* R) {
+  if (!Q || !R) {
+    fprintf(stderr, "Invalid QR factors\n");
+    return 0;
+  }
+  if (!R->is_square || Q->num_cols != R->num_rows || Q->num_rows < Q->num_cols) {
+    fprintf(stderr, "Matrix dimensions incompatible for QR update\n");
+    return 0;
+  }
+  return 1;
+}
+
+// Rank-one update of a thin QR: Q*R + u*v^T = Q'*R' in place, O(mn + n^2).
+// The part of u outside range(Q) is carried in an extra column while R is
+// restored to triangular form, then dropped.
+int mat_qr_update(mat* Q, mat* R, mat* u, mat* v) {
+  if (!qr_factors_check(Q, R)) return 0;
+  unsigned int m = Q->num_rows;
+  unsigned int n = Q->num_cols;
+  if (!u || !v || u->num_rows != m || u->num_cols != 1 || v->num_rows != n || v->num_cols != 1) {
+    fprintf(stderr, "Matrix dimensions incompatible for QR update\n");
+    return 0;
+  }
+  unsigned int k = n + 1;
+  double* q = malloc((size_t)m * k * sizeof(*q));     // [Q z], row-major
+  double* r = calloc((size_t)k * n, sizeof(*r));      // [R; 0]
+  double* w = calloc(k, sizeof(*w));
+  for (unsigned int i = 0; i < m; i++) memcpy(q + (size_t)i * k, Q->values[i], n * sizeof(*q));
+  for (unsigned int i = 0; i < n; i++) memcpy(r + (size_t)i * n, R->values[i], n * sizeof(*r));
+
+  // w = Q^T u, z = (u - Q w) / ||u - Q w||
+  for (unsigned int i = 0; i < m; i++) {
+    double ui = u->values[i][0];
+    for (unsigned int j = 0; j < n; j++) w[j] += Q->values[i][j] * ui;
+  }
+  double rho2 = 0.0;
+  for (unsigned int i = 0; i < m; i++) {
+    double zi = u->values[i][0];
+    for (unsigned int j = 0; j < n; j++) zi -= Q->values[i][j] * w[j];
+    q[(size_t)i * k + n] = zi;
+    rho2 += zi * zi;
+  }
+  double rho = sqrt(rho2);
+  if (m == n || rho <= DBL_EPSILON * vec_norm(w, n)) {
+    k = n;   // u lies in range(Q)
+  } else {
+    for (unsigned int i = 0; i < m; i++) q[(size_t)i * (n + 1) + n] /= rho;
+    w[n] = rho;
+  }
+  size_t ldq = n + 1;
+
+  // reduce w to a multiple of e1, turning [R; 0] upper Hessenberg
+  for (unsigned int i = k - 1; i-- > 0;) {
+    double c, s;
+    givens(w[i], w[i + 1], &c, &s);
+    w[i] = c * w[i] + s * w[i + 1];
+    w[i + 1] = 0.0;
+    rot_rows(r + (size_t)i * n, r + (size_t)(i + 1) * n, i, n, c, s);
+    rot_cols(q, m, ldq, i, i + 1, c, s);
+  }
+  for (unsigned int j = 0; j < n; j++) r[j] += w[0] * v->values[j][0];
+
+  // chase the subdiagonal back out
+  for (unsigned int i = 0; i + 1 < k && i < n; i++) {
+    double c, s;
+    givens(r[(size_t)i * n + i], r[(size_t)(i + 1) * n + i], &c, &s);
+    rot_rows(r + (size_t)i * n, r + (size_t)(i + 1) * n, i, n, c, s);
+    r[(size_t)(i + 1) * n + i] = 0.0;
+    rot_cols(q, m, ldq, i, i + 1, c, s);
+  }
+
+  for (unsigned int i = 0; i < m; i++) memcpy(Q->values[i], q + (size_t)i * ldq, n * sizeof(*q));
+  for (unsigned int i = 0; i < n; i++) {
+    memset(R->values[i], 0, i * sizeof(*r));
+    memcpy(R->values[i] + i, r + (size_t)i * n + i, (n - i) * sizeof(*r));
+  }
+  free(q);
+  free(r);
+  free(w);
+  return 1;
+}
+
+// Inserts the row a^T (1 x n or n x 1) into A = Q*R before row `row`.
+// Q grows to (m+1) x n; the old Q and R are freed and replaced. O(mn).
+int mat_qr_insert_row(mat** Q, mat** R, unsigned int row, mat* a) {
+  if (!Q || !R || !qr_factors_check(*Q, *R)) return 0;
+  unsigned int m = (*Q)->num_rows;
+  unsigned int n = (*Q)->num_cols;
+  if (!a || a->num_rows * a->num_cols != n || (a->num_rows != 1 && a->num_cols != 1) || row > m) {
+    fprintf(stderr, "Matrix dimensions incompatible for QR row insertion\n");
+    return 0;
+  }
+  size_t ldq = n + 1;
+  // [A; a^T] = [Q 0; 0 1] [R; a^T]
+  double* q = calloc((size_t)(m + 1) * ldq, sizeof(*q));
+  double* r = malloc((size_t)(n + 1) * n * sizeof(*r));
+  for (unsigned int i = 0; i < m; i++) memcpy(q + (size_t)i * ldq, (*Q)->values[i], n * sizeof(*q));
+  q[(size_t)m * ldq + n] = 1.0;
+  for (unsigned int i = 0; i < n; i++) memcpy(r + (size_t)i * n, (*R)->values[i], n * sizeof(*r));
+  for (unsigned int j = 0; j < n; j++) r[(size_t)n * n + j] = a->num_rows == 1 ? a->values[0][j] : a->values[j][0];
+
+  // rotate the new row into each diagonal in turn
+  for (unsigned int j = 0; j < n; j++) {
+    double c, s;
+    givens(r[(size_t)j * n + j], r[(size_t)n * n + j], &c, &s);
+    rot_rows(r + (size_t)j * n, r + (size_t)n * n, j, n, c, s);
+    r[(size_t)n * n + j] = 0.0;
+    rot_cols(q, m + 1, ldq, j, n, c, s);
+  }
+
+  mat* Qn = new_mat(m + 1, n);
+  mat* Rn = new_mat(n, n);
+  for (unsigned int i = 0; i <= m; i++) {
+    // the appended row moves to position `row`
+    unsigned int src = i < row ? i : (i == row ? m : i - 1);
+    memcpy(Qn->values[i], q + (size_t)src * ldq, n * sizeof(*q));
+  }
+  for (unsigned int i = 0; i < n; i++) memcpy(Rn->values[i] + i, r + (size_t)i * n + i, (n - i) * sizeof(*r));
+  free(q);
+  free(r);
+  free_mat(*Q);
+  free_mat(*R);
+  *Q = Qn;
+  *R = Rn;
+  return 1;
+}
+
+// z = (I - Q Q^T) z for column n of the row-major m x (n+1) array q, done
+// twice so z stays orthogonal to Q; returns ||z||
+static double qr_orth_last(double* q, unsigned int m, unsigned int n, double* h) {
+  size_t ldq = n + 1;
+  for (int pass = 0; pass < 2; pass++) {
+    memset(h, 0, n * sizeof(*h));
+    for (unsigned int i = 0; i < m; i++) {
+      const double* qi = q + (size_t)i * ldq;
+      for (unsigned int j = 0; j < n; j++) h[j] += qi[j] * qi[n];
+    }
+    for (unsigned int i = 0; i < m; i++) {
+      double* qi = q + (size_t)i * ldq;
+      for (unsigned int j = 0; j < n; j++) qi[n] -= qi[j] * h[j];
+    }
+  }
+  double norm = 0.0;
+  for (unsigned int i = 0; i < m; i++) norm += q[(size_t)i * ldq + n] * q[(size_t)i * ldq + n];
+  return sqrt(norm);
+}
+
+// Deletes row `row` of A = Q*R. Q shrinks to (m-1) x n, which needs m > n.
+// Q is extended by z = (I - Q Q^T) e_row / nu, nu = ||(I - Q Q^T) e_row||, so
+// that row `row` of [Q z] has unit norm; rotations then turn that row into
+// e_{n+1}, after which the row and z separate out. When nu vanishes the row
+// lies in range(Q): the rotations then stay inside Q, leaving one column of Q
+// equal to e_row, and that column is replaced by any unit vector orthogonal to
+// the rest with a zero row of R. O(mn).
+int mat_qr_delete_row(mat** Q, mat** R, unsigned int row) {
+  if (!Q || !R || !qr_factors_check(*Q, *R)) return 0;
+  unsigned int m = (*Q)->num_rows;
+  unsigned int n = (*Q)->num_cols;
+  if (row >= m || m <= n) {
+    fprintf(stderr, "QR row deletion requires a valid row and more rows than columns\n");
+    return 0;
+  }
+  size_t ldq = n + 1;
+  double* q = malloc((size_t)m * ldq * sizeof(*q));
+  double* r = calloc((size_t)(n + 1) * n, sizeof(*r));
+  double* h = malloc(n * sizeof(*h));
+  for (unsigned int i = 0; i < m; i++) memcpy(q + (size_t)i * ldq, (*Q)->values[i], n * sizeof(*q));
+  for (unsigned int i = 0; i < n; i++) memcpy(r + (size_t)i * n, (*R)->values[i], n * sizeof(*r));
+
+  for (unsigned int i = 0; i < m; i++) q[(size_t)i * ldq + n] = (i == row) ? 1.0 : 0.0;
+  double nu = qr_orth_last(q, m, n, h);
+  // z loses about eps/nu of accuracy to cancellation, while treating the row
+  // as inside range(Q) costs about nu; sqrt(eps) balances the two
+  int in_range = nu <= sqrt(DBL_EPSILON);
+  double* qk = q + (size_t)row * ldq;
+  mat* Qn = new_mat(m - 1, n);
+  mat* Rn = new_mat(n, n);
+
+  if (!in_range) {
+    for (unsigned int i = 0; i < m; i++) q[(size_t)i * ldq + n] /= nu;
+    // zero row `row` of [Q z] except its last entry, rotating columns (j, n)
+    for (unsigned int j = n; j-- > 0;) {
+      double c, s;
+      givens(qk[n], qk[j], &c, &s);
+      // column j <- c*col_j - s*col_n, column n <- s*col_j + c*col_n
+      rot_cols(q, m, ldq, n, j, c, s);
+      rot_rows(r + (size_t)n * n, r + (size_t)j * n, j, n, c, s);
+      qk[j] = 0.0;
+    }
+    for (unsigned int i = 0, d = 0; i < m; i++) {
+      if (i == row) continue;
+      memcpy(Qn->values[d++], q + (size_t)i * ldq, n * sizeof(*q));
+    }
+    for (unsigned int i = 0; i < n; i++) memcpy(Rn->values[i] + i, r + (size_t)i * n + i, (n - i) * sizeof(*r));
+  } else {
+    // rotate row `row` of Q onto column 0; R becomes upper Hessenberg
+    for (unsigned int j = n - 1; j > 0; j--) {
+      double c, s;
+      givens(qk[j - 1], qk[j], &c, &s);
+      rot_cols(q, m, ldq, j - 1, j, c, s);
+      rot_rows(r + (size_t)(j - 1) * n, r + (size_t)j * n, j - 1, n, c, s);
+      qk[j] = 0.0;
+    }
+    // column 0 is now +-e_row, so A without the row is Q(:, 1:n-1) * R(1:n-1, :),
+    // whose rows of R are already triangular; the last column of Q' is free
+    double* w = malloc((size_t)(m - 1) * n * sizeof(*w));
+    for (unsigned int i = 0, d = 0; i < m; i++) {
+      if (i == row) continue;
+      memcpy(w + (size_t)d * n, q + (size_t)i * ldq + 1, (n - 1) * sizeof(*w));
+      d++;
+    }
+    double best = -1.0;
+    double* bestz = malloc((m - 1) * sizeof(*bestz));
+    for (unsigned int t = 0; t < m - 1 && best < 0.5; t++) {
+      for (unsigned int i = 0; i < m - 1; i++) w[(size_t)i * n + n - 1] = (i == t) ? 1.0 : 0.0;
+      double norm = qr_orth_last(w, m - 1, n - 1, h);
+      if (norm > best) {
+        best = norm;
+        for (unsigned int i = 0; i < m - 1; i++) bestz[i] = w[(size_t)i * n + n - 1] / norm;
+      }
+    }
+    for (unsigned int i = 0; i < m - 1; i++) {
+      memcpy(Qn->values[i], w + (size_t)i * n, (n - 1) * sizeof(*w));
+      Qn->values[i][n - 1] = bestz[i];
+    }
+    for (unsigned int i = 0; i + 1 < n; i++) {
+      memcpy(Rn->values[i] + i, r + (size_t)(i + 1) * n + i, (n - i) * sizeof(*r));
+    }
+    free(w);
+    free(bestz);
+  }
+  free(q);
+  free(r);
+  free(h);
+  free_mat(*Q);
+  free_mat(*R);
+  *Q = Qn;
+  *R = Rn;
+  return 1;
+}
+
+
+// ---------------------------------------------------------------------------
+// Rank-revealing QR with column pivoting (QP3)
+// ---------------------------------------------------------------------------
+
+#define QP3_BLOCK 32
+
+// One panel of blocked QR with column pivoting (LAPACK dlaqps) on the
+// column-major m x n array a, starting at column/row j0. Reflectors are
+// accumulated in f (n x nb, ld n) so the trailing columns only see one
+// rank-kb update per panel; only the pivot row is updated eagerly so the
+// column norms can be downdated. The panel stops early when a downdated norm
+// becomes unreliable; those norms are recomputed. Returns the columns done.
+static unsigned int qp3_panel(double* a, unsigned int m, unsigned int n, unsigned int j0, unsigned int nb,
+                              unsigned int* jpvt, double* tau, double* vn1, double* vn2,
+                              double* auxv, double* f) {
+  size_t lda = m;
+  size_t ldf = n;
+  unsigned int lastrk = m < n ? m : n;
+  double tol3z = sqrt(DBL_EPSILON);
+  int lsticc = -1;   // linked list (through vn2) of columns needing a fresh norm
+  unsigned int k = 0;
+
+  while (k < nb && lsticc < 0) {
+    unsigned int j = j0 + k;
+    unsigned int rk = j;
+
+    // bring the column with the largest remaining norm forward
+    unsigned int pvt = j;
+    for (unsigned int c = j + 1; c < n; c++) {
+      if (vn1[c] > vn1[pvt]) pvt = c;
+    }
+    if (pvt != j) {
+      double* cp = a + pvt * lda;
+      double* cj = a + j * lda;
+      for (unsigned int i = 0; i < m; i++) {
+        double t = cp[i];
+        cp[i] = cj[i];
+        cj[i] = t;
+      }
+      for (unsigned int kk = 0; kk < k; kk++) {
+        double t = f[(pvt - j0) + kk * ldf];
+        f[(pvt - j0) + kk * ldf] = f[(j - j0) + kk * ldf];
+        f[(j - j0) + kk * ldf] = t;
+      }
+      unsigned int t = jpvt[pvt];
+      jpvt[pvt] = jpvt[j];
+      jpvt[j] = t;
+      vn1[pvt] = vn1[j];
+      vn2[pvt] = vn2[j];
+    }
+
+    // apply the panel's earlier reflectors to the pivot column
+    double* cj = a + j * lda;
+    for (unsigned int kk = 0; kk < k; kk++) {
+      double fjk = f[(j - j0) + kk * ldf];
+      if (fjk == 0.0) continue;
+      const double* vk = a + (j0 + kk) * lda;
+      for (unsigned int i = rk; i < m; i++) cj[i] -= vk[i] * fjk;
+    }
+
+    tau[j] = (rk + 1 < m) ? householder_gen(&cj[rk], &cj[rk + 1], m - rk - 1, 1) : 0.0;
+    double akk = cj[rk];
+    cj[rk] = 1.0;
+
+    // column k of f: tau * A(rk:, j+1:)^T v, corrected for the earlier reflectors
+    for (unsigned int c = j0; c <= j; c++) f[(c - j0) + k * ldf] = 0.0;
+    for (unsigned int c = j + 1; c < n; c++) {
+      f[(c - j0) + k * ldf] = tau[j] * vec_dot(a + c * lda + rk, cj + rk, m - rk);
+    }
+    if (k > 0) {
+      for (unsigned int kk = 0; kk < k; kk++) {
+        auxv[kk] = -tau[j] * vec_dot(a + (j0 + kk) * lda + rk, cj + rk, m - rk);
+      }
+      for (unsigned int c = 0; c < n - j0; c++) {
+        double sum = 0.0;
+        for (unsigned int kk = 0; kk < k; kk++) sum += f[c + kk * ldf] * auxv[kk];
+        f[c + k * ldf] += sum;
+      }
+    }
+
+    // update the pivot row of the trailing columns
+    for (unsigned int c = j + 1; c < n; c++) {
+      double sum = 0.0;
+      for (unsigned int kk = 0; kk <= k; kk++) sum += a[rk + (j0 + kk) * lda] * f[(c - j0) + kk * ldf];
+      a[rk + c * lda] -= sum;
+    }
+
+    // downdate the partial column norms
+    if (rk + 1 < lastrk) {
+      for (unsigned int c = j + 1; c < n; c++) {
+        if (vn1[c] == 0.0) continue;
+        double t = fabs(a[rk + c * lda]) / vn1[c];
+        t = (1.0 + t) * (1.0 - t);
+        if (t < 0.0) t = 0.0;
+        double ratio = vn1[c] / vn2[c];
+        if (t * ratio * ratio <= tol3z) {
+          vn2[c] = (double)lsticc;
+          lsticc = (int)c;
+        } else {
+          vn1[c] *= sqrt(t);
+        }
+      }
+    }
+    cj[rk] = akk;
+    k++;
+  }
+
+  // block update of the trailing submatrix
+  unsigned int rk = j0 + k;
+  if (rk < n && rk < m) {
+    for (unsigned int c = rk; c < n; c++) {
+      double* cc = a + c * lda;
+      for (unsigned int kk = 0; kk < k; kk++) {
+        double fck = f[(c - j0) + kk * ldf];
+        if (fck == 0.0) continue;
+        const double* vk = a + (j0 + kk) * lda;
+        for (unsigned int i = rk; i < m; i++) cc[i] -= vk[i] * fck;
+      }
+    }
+  }
+
+  while (lsticc >= 0) {
+    int next = (int)vn2[lsticc];
+    vn1[lsticc] = rk < m ? vec_norm(a + (size_t)lsticc * lda + rk, m - rk) : 0.0;
+    vn2[lsticc] = vn1[lsticc];
+    lsticc = next;
+  }
+  return k;
+}
+
+// A*P = Q*R with column pivoting on the column-major m x n array a; the
+// reflectors are left below the diagonal (householder_apply_q layout)
+static void qp3_factor(double* a, unsigned int m, unsigned int n, unsigned int* jpvt, double* tau) {
+  unsigned int minmn = m < n ? m : n;
+  double* vn1 = malloc(n * sizeof(*vn1));
+  double* vn2 = malloc(n * sizeof(*vn2));
+  double* auxv = malloc(QP3_BLOCK * sizeof(*auxv));
+  double* f = malloc((size_t)n * QP3_BLOCK * sizeof(*f));
+  for (unsigned int j = 0; j < n; j++) {
+    jpvt[j] = j;
+    vn1[j] = vec_norm(a + (size_t)j * m, m);
+    vn2[j] = vn1[j];
+  }
+  for (unsigned int j = 0; j < minmn;) {
+    unsigned int nb = minmn - j < QP3_BLOCK ? minmn - j : QP3_BLOCK;
+    j += qp3_panel(a, m, n, j, nb, jpvt, tau, vn1, vn2, auxv, f);
+  }
+  free(vn1);
+  free(vn2);
+  free(auxv);
+  free(f);
+}
+
+// Rank-revealing QR: A*P = Q*R with Q m x k, R k x n (k = min(m, n)) and
+// |R[0][0]| >= |R[1][1]| >= ... The numerical rank counts the diagonal entries
+// above max(m, n) * eps * |R[0][0]|.
+int mat_qrcp_decomp(mat* A, mat** Q, mat** R, mat** P, unsigned int* rank) {
+  if (!A || !Q || !R || !P) {
+    fprintf(stderr, "QRCP decomposition requires non-NULL matrix\n");
+    return 0;
+  }
+  unsigned int m = A->num_rows;
+  unsigned int n = A->num_cols;
+  unsigned int k = m < n ? m : n;
+  double* a = malloc((size_t)m * n * sizeof(*a));
+  double* tau = calloc(k, sizeof(*tau));
+  unsigned int* jpvt = malloc(n * sizeof(*jpvt));
+  for (unsigned int i = 0; i < m; i++) {
+    for (unsigned int j = 0; j < n; j++) a[i + (size_t)j * m] = A->values[i][j];
+  }
+  qp3_factor(a, m, n, jpvt, tau);
+
+  *R = new_mat(k, n);
+  for (unsigned int i = 0; i < k; i++) {
+    for (unsigned int j = i; j < n; j++) (*R)->values[i][j] = a[i + (size_t)j * m];
+  }
+  *Q = new_mat(m, k);
+  double* x = malloc(m * sizeof(*x));
+  for (unsigned int j = 0; j < k; j++) {
+    memset(x, 0, m * sizeof(*x));
+    x[j] = 1.0;
+    householder_apply_q(a, m, k, tau, x);
+    for (unsigned int i = 0; i < m; i++) (*Q)->values[i][j] = x[i];
+  }
+  *P = new_mat(n, n);
+  for (unsigned int j = 0; j < n; j++) (*P)->values[jpvt[j]][j] = 1.0;
+
+  if (rank) {
+    double tol = (m > n ? m : n) * DBL_EPSILON * (k ? fabs((*R)->values[0][0]) : 0.0);
+    unsigned int r = 0;
+    while (r < k && fabs((*R)->values[r][r]) > tol) r++;
+    *rank = r;
+  }
+  free(a);
+  free(tau);
+  free(jpvt);
+  free(x);
+  return 1;
+}
+
+// Basic least-squares solution from A*P = Q*R: solves R11 z = (Q^T b)[0:rank],
+// sets the remaining components to zero and returns x = P*z, which has at most
+// rank nonzero entries. b may have several columns.
+mat* mat_qrcp_solve(mat* Q, mat* R, mat* P, unsigned int rank, mat* b) {
+  if (!Q || !R || !P || !b) {
+    fprintf(stderr, "Invalid input matrices for QRCP solve\n");
+    return NULL;
+  }
+  unsigned int m = Q->num_rows;
+  unsigned int k = Q->num_cols;
+  unsigned int n = R->num_cols;
+  if (R->num_rows != k || !P->is_square || P->num_rows != n || b->num_rows != m || rank > k) {
+    fprintf(stderr, "Matrix dimensions incompatible for QRCP solve\n");
+    return NULL;
+  }
+  for (unsigned int i = 0; i < rank; i++) {
+    if (fabs(R->values[i][i]) < EPSILON) {
+      fprintf(stderr, "R matrix is singular - cannot solve system\n");
+      return NULL;
+    }
+  }
+  mat* x = new_mat(n, b->num_cols);
+  double* z = malloc((rank + 1) * sizeof(*z));
+  for (unsigned int c = 0; c < b->num_cols; c++) {
+    for (unsigned int i = 0; i < rank; i++) {
+      double sum = 0.0;
+      for (unsigned int r = 0; r < m; r++) sum += Q->values[r][i] * b->values[r][c];
+      z[i] = sum;
+    }
+    for (unsigned int i = rank; i-- > 0;) {
+      double sum = z[i];
+      for (unsigned int j = i + 1; j < rank; j++) sum -= R->values[i][j] * z[j];
+      z[i] = sum / R->values[i][i];
+    }
+    // x = P * [z; 0]
+    for (unsigned int i = 0; i < n; i++) {
+      for (unsigned int j = 0; j < rank; j++) {
+        if (P->values[i][j] != 0.0) x->values[i][c] = P->values[i][j] * z[j];
+      }
+    }
+  }
+  free(z);
+  return x;
+}
+
+
+// ---------------------------------------------------------------------------
+// Condition number estimation (Hager/Higham 1-norm estimator)
+// ---------------------------------------------------------------------------
+
+// 1-norm: maximum absolute column sum
+double mat_norm1(mat* A) {
+  if (!A) {
+    fprintf(stderr, "Cannot take norm of NULL matrix\n");
+    return 0.0;
+  }
+  double* sums = calloc(A->num_cols, sizeof(*sums));
+  for (unsigned int i = 0; i < A->num_rows; i++) {
+    for (unsigned int j = 0; j < A->num_cols; j++) sums[j] += fabs(A->values[i][j]);
+  }
+  double norm = 0.0;
+  for (unsigned int j = 0; j < A->num_cols; j++) {
+    if (sums[j] > norm) norm = sums[j];
+  }
+  free(sums);
+  return norm;
+}
+
+// solves A x = b (trans == 0) or A^T x = b in place
+typedef void (*inv_solve_fn)(void* ctx, double* x, int trans);
+
+// Estimates ||A^-1||_1 from solves with A and A^T (Higham's refinement of
+// Hager's method, LAPACK dlacn2). Usually exact, never an overestimate.
+static double inv_norm1_est(unsigned int n, inv_solve_fn solve, void* ctx) {
+  double* x = malloc(n * sizeof(*x));
+  double* xi = malloc(n * sizeof(*xi));
+  for (unsigned int i = 0; i < n; i++) x[i] = 1.0 / n;
+  solve(ctx, x, 0);
+  double est = 0.0;
+  for (unsigned int i = 0; i < n; i++) est += fabs(x[i]);
+
+  if (n > 1) {
+    for (unsigned int i = 0; i < n; i++) xi[i] = x[i] >= 0.0 ? 1.0 : -1.0;
+    memcpy(x, xi, n * sizeof(*x));
+    solve(ctx, x, 1);
+    unsigned int j = 0;
+    for (unsigned int i = 1; i < n; i++) {
+      if (fabs(x[i]) > fabs(x[j])) j = i;
+    }
+    for (unsigned int iter = 2; iter <= 5; iter++) {
+      memset(x, 0, n * sizeof(*x));
+      x[j] = 1.0;
+      solve(ctx, x, 0);
+      double old = est;
+      est = 0.0;
+      int same = 1;
+      for (unsigned int i = 0; i < n; i++) {
+        est += fabs(x[i]);
+        double s = x[i] >= 0.0 ? 1.0 : -1.0;
+        if (s != xi[i]) same = 0;
+        xi[i] = s;
+      }
+      // repeated sign vector or no progress: converged
+      if (same || est <= old) {
+        if (est < old) est = old;
+        break;
+      }
+      memcpy(x, xi, n * sizeof(*x));
+      solve(ctx, x, 1);
+      unsigned int jlast = j;
+      j = 0;
+      for (unsigned int i = 1; i < n; i++) {
+        if (fabs(x[i]) > fabs(x[j])) j = i;
+      }
+      if (fabs(x[jlast]) == fabs(x[j])) break;
+    }
+
+    // alternating test vector guards against the estimate getting stuck
+    for (unsigned int i = 0; i < n; i++) {
+      x[i] = (i % 2 ? -1.0 : 1.0) * (1.0 + (double)i / (n - 1));
+    }
+    solve(ctx, x, 0);
+    double alt = 0.0;
+    for (unsigned int i = 0; i < n; i++) alt += fabs(x[i]);
+    alt = 2.0 * alt / (3.0 * n);
+    if (alt > est) est = alt;
+  }
+  free(x);
+  free(xi);
+  return est;
+}
+
+// x <- T^-1 x for a triangular T stored in a mat; lower selects L,
+// trans solves with T^T instead
+static void tri_solve(mat* T, int lower, int trans, int unit, double* x) {
+  unsigned int n = T->num_rows;
+  if (lower != trans) {
+    // forward substitution
+    for (unsigned int i = 0; i < n; i++) {
+      double sum = x[i];
+      for (unsigned int k = 0; k < i; k++) sum -= (trans ? T->values[k][i] : T->values[i][k]) * x[k];
+      x[i] = unit ? sum : sum / T->values[i][i];
+    }
+  } else {
+    for (unsigned int i = n; i-- > 0;) {
+      double sum = x[i];
+      for (unsigned int k = i + 1; k < n; k++) sum -= (trans ? T->values[k][i] : T->values[i][k]) * x[k];
+      x[i] = unit ? sum : sum / T->values[i][i];
+    }
+  }
+}
+
+typedef struct {
+  mat* L;
+  mat* U;
+  unsigned int* perm;   // (P*b)[i] = b[perm[i]]
+  double* tmp;
+} lup_solve_ctx;
+
+// A = P^T L U: A x = b is L U x = P b; A^T x = b is U^T L^T (P x) = b
+static void lup_inv_solve(void* arg, double* x, int trans) {
+  lup_solve_ctx* c = (lup_solve_ctx*)arg;
+  unsigned int n = c->L->num_rows;
+  if (!trans) {
+    for (unsigned int i = 0; i < n; i++) c->tmp[i] = x[c->perm[i]];
+    tri_solve(c->L, 1, 0, 1, c->tmp);
+    tri_solve(c->U, 0, 0, 0, c->tmp);
+    memcpy(x, c->tmp, n * sizeof(*x));
+  } else {
+    tri_solve(c->U, 0, 1, 0, x);
+    tri_solve(c->L, 1, 1, 1, x);
+    for (unsigned int i = 0; i < n; i++) c->tmp[c->perm[i]] = x[i];
+    memcpy(x, c->tmp, n * sizeof(*x));
+  }
+}
+
+static void chol_inv_solve(void* arg, double* x, int trans) {
+  (void)trans;
+  mat* L = (mat*)arg;
+  tri_solve(L, 1, 0, 0, x);
+  tri_solve(L, 1, 1, 0, x);
+}
+
+static void upper_inv_solve(void* arg, double* x, int trans) {
+  tri_solve((mat*)arg, 0, trans, 0, x);
+}
+
+static int tri_nonsingular(mat* T) {
+  for (unsigned int i = 0; i < T->num_rows; i++) {
+    if (T->values[i][i] == 0.0) return 0;
+  }
+  return 1;
+}
+
+static double rcond_from(double anorm, double ainvnorm) {
+  if (anorm == 0.0 || ainvnorm == 0.0) return 0.0;
+  return 1.0 / (anorm * ainvnorm);
+}
+
+// Reciprocal 1-norm condition estimate 1 / (||A||_1 * ||A^-1||_1) from
+// P*A = L*U in O(n^2). anorm is mat_norm1(A), taken before factoring.
+// Returns 0 for an exactly singular U, -1 on invalid input.
+double mat_lup_rcond(mat* L, mat* U, mat* P, double anorm) {
+  if (!L || !U || !P || !L->is_square || !U->is_square || !P->is_square ||
+      U->num_rows != L->num_rows || P->num_rows != L->num_rows) {
+    fprintf(stderr, "Invalid LUP factors for condition estimate\n");
+    return -1.0;
+  }
+  unsigned int n = L->num_rows;
+  if (!tri_nonsingular(U)) return 0.0;
+  lup_solve_ctx ctx;
+  ctx.L = L;
+  ctx.U = U;
+  ctx.perm = malloc(n * sizeof(*ctx.perm));
+  ctx.tmp = malloc(n * sizeof(*ctx.tmp));
+  for (unsigned int i = 0; i < n; i++) {
+    ctx.perm[i] = 0;
+    for (unsigned int j = 0; j < n; j++) {
+      if (P->values[i][j] != 0.0) {
+        ctx.perm[i] = j;
+        break;
+      }
+    }
+  }
+  double est = inv_norm1_est(n, lup_inv_solve, &ctx);
+  free(ctx.perm);
+  free(ctx.tmp);
+  return rcond_from(anorm, est);
+}
+
+// same for A = L*L^T
+double mat_chol_rcond(mat* L, double anorm) {
+  if (!L || !L->is_square) {
+    fprintf(stderr, "Invalid Cholesky factor for condition estimate\n");
+    return -1.0;
+  }
+  if (!tri_nonsingular(L)) return 0.0;
+  return rcond_from(anorm, inv_norm1_est(L->num_rows, chol_inv_solve, L));
+}
+
+// Reciprocal 1-norm condition estimate of the triangular R of A = Q*R. It
+// equals A's in the 2-norm, so it needs no norm of A; in the 1-norm it
+// agrees with A's to within a factor of n.
+double mat_qr_rcond(mat* R) {
+  if (!R || !R->is_square) {
+    fprintf(stderr, "Invalid R factor for condition estimate\n");
+    return -1.0;
+  }
+  if (!tri_nonsingular(R)) return 0.0;
+  double rnorm = 0.0;
+  for (unsigned int j = 0; j < R->num_cols; j++) {
+    double sum = 0.0;
+    for (unsigned int i = 0; i <= j; i++) sum += fabs(R->values[i][j]);
+    if (sum > rnorm) rnorm = sum;
+  }
+  return rcond_from(rnorm, inv_norm1_est(R->num_rows, upper_inv_solve, R));
+}
+
+
+// ---------------------------------------------------------------------------
+// Matrix products, powers and the exponential
+// ---------------------------------------------------------------------------
+
+#define GEMM_KBLOCK 128
+#define GEMM_JBLOCK 512
+#define GEMM_TASK_FLOPS (1u << 20)
+
+typedef struct {
+  double** c;
+  double** a;
+  double** b;
+  unsigned int k;
+  unsigned int n;
+} gemm_job;
+
+// rows [begin, end) of C = A*B in i-k-j order: the inner loop streams a row of
+// B into a row of C, and the k/j tiles keep that panel of B in cache while
+// every row of the range passes over it. Each c[i][j] still sums over k in
+// order, so the result matches the naive triple loop.
+static void gemm_range(void* arg, unsigned int begin, unsigned int end) {
+  gemm_job* job = (gemm_job*)arg;
+  unsigned int k = job->k;
+  unsigned int n = job->n;
+  for (unsigned int i = begin; i < end; i++) memset(job->c[i], 0, n * sizeof(**job->c));
+  for (unsigned int j0 = 0; j0 < n; j0 += GEMM_JBLOCK) {
+    unsigned int j1 = n - j0 < GEMM_JBLOCK ? n : j0 + GEMM_JBLOCK;
+    for (unsigned int k0 = 0; k0 < k; k0 += GEMM_KBLOCK) {
+      unsigned int k1 = k - k0 < GEMM_KBLOCK ? k : k0 + GEMM_KBLOCK;
+      for (unsigned int i = begin; i < end; i++) {
+        double* ci = job->c[i];
+        const double* ai = job->a[i];
+        for (unsigned int p = k0; p < k1; p++) {
+          double aip = ai[p];
+          const double* bp = job->b[p];
+          for (unsigned int j = j0; j < j1; j++) ci[j] += aip * bp[j];
+        }
+      }
+    }
+  }
+}
+
+// C = A*B for row-pointer storage; c must not alias a or b
+static void gemm(double** c, double** a, double** b, unsigned int m, unsigned int k, unsigned int n) {
+  gemm_job job = {c, a, b, k, n};
+  unsigned long long row_flops = (unsigned long long)k * n;
+  unsigned int grain = row_flops >= GEMM_TASK_FLOPS ? 1 : (unsigned int)(GEMM_TASK_FLOPS / (row_flops + 1)) + 1;
+  parallel_for(m, grain, gemm_range, &job);
+}
+
+// A^p by left-to-right binary exponentiation: below the leading bit of p
+// square, and multiply by A where the bit is set. A itself is the other
+// factor, so the products ping-pong between just two buffers.
+mat* mat_pow(mat* A, unsigned int p) {
+  if (!A || !A->is_square) {
+    fprintf(stderr, "Matrix power requires square matrix\n");
+    return NULL;
+  }
+  unsigned int n = A->num_rows;
+  if (p == 0) return eye_mat(n);
+  mat* result = mat_cp(A);
+  if (p == 1) return result;
+  mat* tmp = new_mat(n, n);
+  mat* swap;
+  unsigned int bit = 1u << 31;
+  while (!(p & bit)) bit >>= 1;
+  for (bit >>= 1; bit; bit >>= 1) {
+    gemm(tmp->values, result->values, result->values, n, n, n);
+    swap = result; result = tmp; tmp = swap;
+    if (p & bit) {
+      gemm(tmp->values, result->values, A->values, n, n, n);
+      swap = result; result = tmp; tmp = swap;
+    }
+  }
+  free_mat(tmp);
+  return result;
+}
+
+// c = sum coef[i] * terms[i] (+ coef_eye * I), all n x n
+static void mat_lincomb(mat* c, unsigned int count, mat** terms, const double* coef, double coef_eye) {
+  unsigned int n = c->num_rows;
+  for (unsigned int i = 0; i < n; i++) {
+    double* ci = c->values[i];
+    for (unsigned int j = 0; j < n; j++) {
+      double sum = 0.0;
+      for (unsigned int t = 0; t < count; t++) sum += coef[t] * terms[t]->values[i][j];
+      ci[j] = sum;
+    }
+    ci[i] += coef_eye;
+  }
+}
+
+// Matrix exponential by scaling and squaring with a [m/m] Pade approximant
+// (Higham 2005): the smallest degree in {3, 5, 7, 9, 13} whose error bound
+// covers ||A||_1 is used, otherwise A is scaled by 2^-s for degree 13 and the
+// result squared s times. The Pade quotient is one LU solve with n right-hand sides.
+mat* mat_expm(mat* A) {
+  if (!A || !A->is_square) {
+    fprintf(stderr, "Matrix exponential requires square matrix\n");
+    return NULL;
+  }
+  static const double theta[] = {1.495585217958292e-2, 2.539398330063230e-1,
+                                 9.504178996162932e-1, 2.097847961257068e0, 5.371920351148152e0};
+  static const unsigned int degree[] = {3, 5, 7, 9, 13};
+  static const double b3[] = {120.0, 60.0, 12.0, 1.0};
+  static const double b5[] = {30240.0, 15120.0, 3360.0, 420.0, 30.0, 1.0};
+  static const double b7[] = {17297280.0, 8648640.0, 1995840.0, 277200.0, 25200.0, 1512.0, 56.0, 1.0};
+  static const double b9[] = {17643225600.0, 8821612800.0, 2075673600.0, 302702400.0, 30270240.0,
+                              2162160.0, 110880.0, 3960.0, 90.0, 1.0};
+  static const double b13[] = {64764752532480000.0, 32382376266240000.0, 7771770303897600.0,
+                               1187353796428800.0, 129060195264000.0, 10559470521600.0,
+                               670442572800.0, 33522128640.0, 1323241920.0, 40840800.0,
+                               960960.0, 16380.0, 182.0, 1.0};
+  static const double* bcoef[] = {b3, b5, b7, b9, b13};
+
+  unsigned int n = A->num_rows;
+  for (unsigned int i = 0; i < n; i++) {
+    for (unsigned int j = 0; j < n; j++) {
+      if (!isfinite(A->values[i][j])) {
+        fprintf(stderr, "Matrix exponential requires finite entries\n");
+        return NULL;
+      }
+    }
+  }
+  double norm = mat_norm1(A);
+  unsigned int choice = 4;
+  for (unsigned int i = 0; i < 4; i++) {
+    if (norm <= theta[i]) {
+      choice = i;
+      break;
+    }
+  }
+  unsigned int s = 0;
+  if (choice == 4 && norm > theta[4]) {
+    s = (unsigned int)ceil(log2(norm / theta[4]));
+  }
+  const double* b = bcoef[choice];
+  unsigned int m = degree[choice];
+
+  mat* As = mat_cp(A);
+  if (s) {
+    double scale = ldexp(1.0, -(int)s);
+    for (unsigned int i = 0; i < n; i++) {
+      for (unsigned int j = 0; j < n; j++) As->values[i][j] *= scale;
+    }
+  }
+
+  // even powers A^2, A^4, ... (as many as the degree needs, at most A^8)
+  mat* pw[4];
+  unsigned int npw = (m == 13) ? 3 : (m - 1) / 2;
+  pw[0] = new_mat(n, n);
+  gemm(pw[0]->values, As->values, As->values, n, n, n);
+  for (unsigned int i = 1; i < npw; i++) {
+    pw[i] = new_mat(n, n);
+    gemm(pw[i]->values, pw[i - 1]->values, pw[0]->values, n, n, n);
+  }
+
+  mat* U = new_mat(n, n);
+  mat* V = new_mat(n, n);
+  mat* W = new_mat(n, n);
+  if (m == 13) {
+    double cu[3] = {b[13], b[11], b[9]};
+    double cv[3] = {b[12], b[10], b[8]};
+    mat* terms[3] = {pw[2], pw[1], pw[0]};
+    // W = A6*(b13 A6 + b11 A4 + b9 A2) + b7 A6 + b5 A4 + b3 A2 + b1 I
+    mat_lincomb(U, 3, terms, cu, 0.0);
+    gemm(W->values, pw[2]->values, U->values, n, n, n);
+    double cu2[3] = {b[7], b[5], b[3]};
+    mat_lincomb(U, 3, terms, cu2, b[1]);
+    mat_add_r(W, U);
+    // V = A6*(b12 A6 + b10 A4 + b8 A2) + b6 A6 + b4 A4 + b2 A2 + b0 I
+    mat_lincomb(U, 3, terms, cv, 0.0);
+    gemm(V->values, pw[2]->values, U->values, n, n, n);
+    double cv2[3] = {b[6], b[4], b[2]};
+    mat_lincomb(U, 3, terms, cv2, b[0]);
+    mat_add_r(V, U);
+  } else {
+    // W = sum b[2i+1] A^2i, V = sum b[2i] A^2i
+    mat* terms[4];
+    double cu[4], cv[4];
+    unsigned int half = (m + 1) / 2;
+    for (unsigned int i = 1; i < half; i++) {
+      terms[i - 1] = pw[i - 1];
+      cu[i - 1] = b[2 * i + 1];
+      cv[i - 1] = b[2 * i];
+    }
+    mat_lincomb(W, half - 1, terms, cu, b[1]);
+    mat_lincomb(V, half - 1, terms, cv, b[0]);
+  }
+  // U = A*W
+  gemm(U->values, As->values, W->values, n, n, n);
+
+  // solve (V - U) X = (V + U)
+  double* q = malloc((size_t)n * n * sizeof(*q));
+  double* x = malloc(n * sizeof(*x));
+  unsigned int* piv = malloc(n * sizeof(*piv));
+  for (unsigned int i = 0; i < n; i++) {
+    for (unsigned int j = 0; j < n; j++) q[(size_t)i * n + j] = V->values[i][j] - U->values[i][j];
+  }
+  int ok = lu_factor_d(q, n, n, n, piv);
+  for (unsigned int i = 0; ok && i < n; i++) ok = isfinite(q[(size_t)i * n + i]);
+  if (!ok) {
+    fprintf(stderr, "Matrix exponential: singular Pade denominator\n");
+    free(q);
+    free(x);
+    free(piv);
+    for (unsigned int i = 0; i < npw; i++) free_mat(pw[i]);
+    free_mat(As);
+    free_mat(U);
+    free_mat(V);
+    free_mat(W);
+    return NULL;
+  }
+  mat* X = new_mat(n, n);
+  for (unsigned int j = 0; j < n; j++) {
+    for (unsigned int i = 0; i < n; i++) x[i] = V->values[i][j] + U->values[i][j];
+    lu_solve_d(q, n, n, piv, x);
+    for (unsigned int i = 0; i < n; i++) X->values[i][j] = x[i];
+  }
+
+  // undo the scaling by repeated squaring
+  for (unsigned int i = 0; i < s; i++) {
+    gemm(W->values, X->values, X->values, n, n, n);
+    mat* swap = X; X = W; W = swap;
+  }
+
+  free(q);
+  free(x);
+  free(piv);
+  for (unsigned int i = 0; i < npw; i++) free_mat(pw[i]);
+  free_mat(As);
+  free_mat(U);
+  free_mat(V);
+  free_mat(W);
+  return X;
+}
+
+
+// ---------------------------------------------------------------------------
+// Randomized low-rank approximation (Halko, Martinsson & Tropp)
+// ---------------------------------------------------------------------------
+
+typedef struct {
+  double** c;
+  double** a;
+  double** b;
+  unsigned int m;
+  unsigned int n;
+} gemm_tn_job;
+
+// rows [begin, end) of C = A^T * B: row j of C accumulates a[i][j] * b[i]
+static void gemm_tn_range(void* arg, unsigned int begin, unsigned int end) {
+  gemm_tn_job* job = (gemm_tn_job*)arg;
+  unsigned int n = job->n;
+  for (unsigned int j = begin; j < end; j++) memset(job->c[j], 0, n * sizeof(**job->c));
+  for (unsigned int i = 0; i < job->m; i++) {
+    const double* ai = job->a[i];
+    const double* bi = job->b[i];
+    for (unsigned int j = begin; j < end; j++) {
+      double aij = ai[j];
+      double* cj = job->c[j];
+      for (unsigned int p = 0; p < n; p++) cj[p] += aij * bi[p];
+    }
+  }
+}
+
+// C = A^T * B without forming A^T: A is m x k, B is m x n, C is k x n
+static void gemm_tn(double** c, double** a, double** b, unsigned int m, unsigned int k, unsigned int n) {
+  gemm_tn_job job = {c, a, b, m, n};
+  unsigned long long row_flops = (unsigned long long)m * n;
+  unsigned int grain = row_flops >= GEMM_TASK_FLOPS ? 1 : (unsigned int)(GEMM_TASK_FLOPS / (row_flops + 1)) + 1;
+  parallel_for(k, grain, gemm_tn_range, &job);
+}
+
+// replaces the m x l matrix Y (m >= l) by an orthonormal basis of its range
+static void orthonormalize(mat* Y) {
+  unsigned int m = Y->num_rows;
+  unsigned int l = Y->num_cols;
+  double* a = malloc((size_t)m * l * sizeof(*a));
+  double* tau = malloc(l * sizeof(*tau));
+  double* x = malloc(m * sizeof(*x));
+  for (unsigned int i = 0; i < m; i++) {
+    for (unsigned int j = 0; j < l; j++) a[i + (size_t)j * m] = Y->values[i][j];
+  }
+  householder_qr(a, m, l, tau);
+  for (unsigned int j = 0; j < l; j++) {
+    memset(x, 0, m * sizeof(*x));
+    x[j] = 1.0;
+    householder_apply_q(a, m, l, tau, x);
+    for (unsigned int i = 0; i < m; i++) Y->values[i][j] = x[i];
+  }
+  free(a);
+  free(tau);
+  free(x);
+}
+
+static const mat_rsvd_opts rsvd_defaults = {10, 2, 0};
+
+// Orthonormal m x l basis Q with A ~= Q*Q^T*A: Q = orth(A*Omega) for a
+// Gaussian n x l Omega, refined by power iterations (A*A^T)^q that are
+// re-orthonormalized after every product to keep small singular values.
+mat* mat_range_finder(mat* A, unsigned int l, const mat_rsvd_opts* opts) {
+  if (!A) {
+    fprintf(stderr, "Range finder requires non-NULL matrix\n");
+    return NULL;
+  }
+  unsigned int m = A->num_rows;
+  unsigned int n = A->num_cols;
+  if (l == 0 || l > m || l > n) {
+    fprintf(stderr, "Sketch size must be between 1 and min(rows, cols)\n");
+    return NULL;
+  }
+  if (!opts) opts = &rsvd_defaults;
+  // the sketch comes from stream 0 of the seed, like mat_rng_seed(seed, 0)
+  mat* omega = new_mat(n, l);
+  mat_rng rng;
+  mat_rng_seed(&rng, opts->seed, 0);
+  rng_normal_mat(&rng, omega, 0.0, 1.0);
+  mat* Q = new_mat(m, l);
+  gemm(Q->values, A->values, omega->values, m, n, l);
+  orthonormalize(Q);
+  for (unsigned int it = 0; it < opts->power_iters; it++) {
+    gemm_tn(omega->values, A->values, Q->values, m, n, l);
+    orthonormalize(omega);
+    gemm(Q->values, A->values, omega->values, m, n, l);
+    orthonormalize(Q);
+  }
+  free_mat(omega);
+  return Q;
+}
+
+// Truncated SVD A ~= U*S*V^T of rank k from a sketch of k + oversample
+// columns: B = Q^T*A is small, so its SVD (mat_svd) is cheap, and U = Q*U_B.
+// B is l x n and usually very wide, so it is formed and factored as the tall
+// B^T = A^T*Q, whose thin SVD needs only n x l workspace.
+// U is m x k, S is k x 1 (descending), V is n x k.
+int mat_rsvd(mat* A, unsigned int k, const mat_rsvd_opts* opts, mat** U, mat** S, mat** V) {
+  if (!A || !U || !S || !V) {
+    fprintf(stderr, "Randomized SVD requires non-NULL arguments\n");
+    return 0;
+  }
+  unsigned int m = A->num_rows;
+  unsigned int n = A->num_cols;
+  unsigned int minmn = m < n ? m : n;
+  if (k == 0 || k > minmn) {
+    fprintf(stderr, "Rank must be between 1 and min(rows, cols)\n");
+    return 0;
+  }
+  if (!opts) opts = &rsvd_defaults;
+  unsigned int l = k + opts->oversample;
+  if (l > minmn) l = minmn;
+
+  mat* Q = mat_range_finder(A, l, opts);
+  mat* Bt = new_mat(n, l);
+  gemm_tn(Bt->values, A->values, Q->values, m, n, l);
+  // B^T = V_B * S * U_B^T
+  mat* Ub = NULL, * Sb = NULL, * Vb = NULL;
+  if (!mat_svd(Bt, &Vb, &Sb, &Ub, 0)) {
+    free_mat(Q);
+    free_mat(Bt);
+    return 0;
+  }
+
+  *U = new_mat(m, k);
+  *S = new_mat(k, 1);
+  *V = new_mat(n, k);
+  for (unsigned int i = 0; i < m; i++) {
+    const double* qi = Q->values[i];
+    double* ui = (*U)->values[i];
+    for (unsigned int p = 0; p < l; p++) {
+      double qip = qi[p];
+      const double* ubp = Ub->values[p];
+      for (unsigned int j = 0; j < k; j++) ui[j] += qip * ubp[j];
+    }
+  }
+  for (unsigned int j = 0; j < k; j++) (*S)->values[j][0] = Sb->values[j][0];
+  for (unsigned int i = 0; i < n; i++) memcpy((*V)->values[i], Vb->values[i], k * sizeof(double));
+
+  free_mat(Q);
+  free_mat(Bt);
+  free_mat(Ub);
+  free_mat(Sb);
+  free_mat(Vb);
+  return 1;
+}
+
+
+// ---------------------------------------------------------------------------
+// Restarted Lanczos / Arnoldi eigensolvers
+// ---------------------------------------------------------------------------
+
+// Krylov basis kept row-major n x (m + 1) so a restart can rotate it in place
+// one row at a time; H is the (m + 1) x m projected matrix (row-major).
+typedef struct {
+  mat_op* A;
+  unsigned int n;
+  unsigned int m;
+  size_t ld;
+  double* V;
+  double* H;
+  double* w;
+  double* h;              // scratch for basis_orth
+  unsigned int reorth;
+  mat_rng rng;            // start and restart directions
+  unsigned int matvecs;
+} krylov_basis;
+
+// Classical Gram-Schmidt of w against columns 0..j; h receives the
+// coefficients, returns ||w||. reorth == 2 always makes a second pass ("twice
+// is enough"), reorth == 1 only when the first pass cancelled more than half
+// of w's length (Daniel, Gragg, Kaufman & Stewart).
+static double basis_orth(krylov_basis* kb, unsigned int j, double* w, double* h) {
+  unsigned int n = kb->n;
+  memset(h, 0, (j + 1) * sizeof(*h));
+  double* c = kb->h;   // per-pass coefficients
+  double before = vec_norm(w, n);
+  for (unsigned int pass = 0; pass < 2; pass++) {
+    if (pass == 1 && kb->reorth < 2 && vec_norm(w, n) > M_SQRT1_2 * before) break;
+    memset(c, 0, (j + 1) * sizeof(*c));
+    for (unsigned int i = 0; i < n; i++) {
+      const double* vi = kb->V + i * kb->ld;
+      double wi = w[i];
+      for (unsigned int col = 0; col <= j; col++) c[col] += vi[col] * wi;
+    }
+    for (unsigned int i = 0; i < n; i++) {
+      const double* vi = kb->V + i * kb->ld;
+      double sum = 0.0;
+      for (unsigned int col = 0; col <= j; col++) sum += vi[col] * c[col];
+      w[i] -= sum;
+    }
+    for (unsigned int col = 0; col <= j; col++) h[col] += c[col];
+  }
+  return vec_norm(w, n);
+}
+
+static void basis_set(krylov_basis* kb, unsigned int j, const double* x, double scale) {
+  for (unsigned int i = 0; i < kb->n; i++) kb->V[i * kb->ld + j] = x[i] * scale;
+}
+
+// puts a random unit vector orthogonal to columns 0..j-1 into column j
+static int basis_random(krylov_basis* kb, unsigned int j) {
+  double* h = malloc((j + 1) * sizeof(*h));
+  for (int attempt = 0; attempt < 5; attempt++) {
+    rng_normal_fill(&kb->rng, kb->w, kb->n, 0.0, 1.0);
+    double norm0 = vec_norm(kb->w, kb->n);
+    double norm = j ? basis_orth(kb, j - 1, kb->w, h) : norm0;
+    if (norm > 1e-8 * norm0) {
+      basis_set(kb, j, kb->w, 1.0 / norm);
+      free(h);
+      return 1;
+    }
+  }
+  free(h);
+  return 0;
+}
+
+// Arnoldi steps for columns j0..m-1: H[0..j][j] = V^T A v_j and
+// H[j+1][j] = ||residual||. Column m ends up holding the residual direction.
+static void basis_extend(krylov_basis* kb, unsigned int j0) {
+  unsigned int n = kb->n;
+  unsigned int m = kb->m;
+  double* x = malloc(n * sizeof(*x));
+  double* h = malloc((m + 1) * sizeof(*h));
+  for (unsigned int j = j0; j < m; j++) {
+    for (unsigned int i = 0; i < n; i++) x[i] = kb->V[i * kb->ld + j];
+    kb->A->apply(kb->A->ctx, x, kb->w);
+    kb->matvecs++;
+    double wnorm = vec_norm(kb->w, n);
+    double beta = basis_orth(kb, j, kb->w, h);
+    for (unsigned int i = 0; i <= j; i++) kb->H[(size_t)i * m + j] = h[i];
+    if (beta <= 1e-12 * wnorm || beta == 0.0) {
+      // invariant subspace: continue with a fresh direction, coupling 0
+      kb->H[(size_t)(j + 1) * m + j] = 0.0;
+      if (!basis_random(kb, j + 1)) break;
+    } else {
+      kb->H[(size_t)(j + 1) * m + j] = beta;
+      basis_set(kb, j + 1, kb->w, 1.0 / beta);
+    }
+  }
+  free(x);
+  free(h);
+}
+
+// V[:, 0..p) = V[:, 0..m) * Y (Y row-major m x p) and V[:, p] = V[:, m]
+static void basis_rotate(krylov_basis* kb, const double* Y, unsigned int p) {
+  unsigned int m = kb->m;
+  double* row = malloc(p * sizeof(*row));
+  for (unsigned int i = 0; i < kb->n; i++) {
+    double* vi = kb->V + i * kb->ld;
+    memset(row, 0, p * sizeof(*row));
+    for (unsigned int j = 0; j < m; j++) {
+      double vij = vi[j];
+      const double* yj = Y + (size_t)j * p;
+      for (unsigned int c = 0; c < p; c++) row[c] += vij * yj[c];
+    }
+    memcpy(vi, row, p * sizeof(*row));
+    vi[p] = vi[m];
+  }
+  free(row);
+}
+
+static const mat_eigs_opts eigs_defaults = {0, 500, 2, MAT_EIGS_LARGEST, 1e-10};
+
+static int krylov_basis_init(krylov_basis* kb, mat_op* A, unsigned int k, const mat_eigs_opts* opts,
+                             mat_eigs_opts* o, const char* name) {
+  if (!A || !A->apply || A->n == 0) {
+    fprintf(stderr, "%s: invalid operator\n", name);
+    return 0;
+  }
+  unsigned int n = A->n;
+  if (k == 0 || k >= n) {
+    fprintf(stderr, "%s: number of eigenvalues must be between 1 and n - 1\n", name);
+    return 0;
+  }
+  *o = opts ? *opts : eigs_defaults;
+  if (!o->max_restarts) o->max_restarts = eigs_defaults.max_restarts;
+  if (!o->reorth) o->reorth = eigs_defaults.reorth;
+  if (!(o->tol > 0.0)) o->tol = eigs_defaults.tol;
+  if (!o->basis) o->basis = 2 * k + 1 > 20 ? 2 * k + 1 : 20;
+  if (o->basis < k + 2) o->basis = k + 2;
+  if (o->basis > n) o->basis = n;
+
+  unsigned int m = o->basis;
+  kb->A = A;
+  kb->n = n;
+  kb->m = m;
+  kb->ld = (size_t)m + 1;
+  kb->V = malloc((size_t)n * kb->ld * sizeof(*kb->V));
+  kb->H = calloc((size_t)(m + 1) * m, sizeof(*kb->H));
+  kb->w = malloc(n * sizeof(*kb->w));
+  kb->h = malloc((m + 1) * sizeof(*kb->h));
+  kb->reorth = o->reorth;
+  mat_rng_seed(&kb->rng, 0x5EEDULL, 0);
+  kb->matvecs = 0;
+  basis_random(kb, 0);
+  return 1;
+}
+
+static void krylov_basis_free(krylov_basis* kb) {
+  free(kb->V);
+  free(kb->H);
+  free(kb->w);
+  free(kb->h);
+}
+
+// sort key for the requested end of the spectrum, larger is wanted first
+static double eigs_score(int which, double re, double im) {
+  if (which == MAT_EIGS_SMALLEST) return -re;
+  if (which == MAT_EIGS_LARGEST_MAG) return hypot(re, im);
+  return re;
+}
+
+// orders idx[0..m) by descending score, complex pairs stay together (+im first)
+static void eigs_order(int which, const double* wr, const double* wi, unsigned int* idx, unsigned int m) {
+  for (unsigned int i = 0; i < m; i++) idx[i] = i;
+  for (unsigned int i = 1; i < m; i++) {
+    unsigned int t = idx[i];
+    double st = eigs_score(which, wr[t], wi ? wi[t] : 0.0);
+    unsigned int j = i;
+    while (j > 0) {
+      unsigned int u = idx[j - 1];
+      double su = eigs_score(which, wr[u], wi ? wi[u] : 0.0);
+      if (su > st || (su == st && (!wi || wi[u] >= wi[t]))) break;
+      idx[j] = u;
+      j--;
+    }
+    idx[j] = t;
+  }
+}
+
+// Thick-restart Lanczos (Wu & Simon) for the k eigenpairs of a symmetric
+// operator at the end of the spectrum chosen by opts->which. After each
+// cycle the Ritz vectors of the best k + (m - k)/2 values are kept and the
+// basis is refilled from the residual, so memory stays at n x (m + 1).
+// Eigenvalues are accepted when |beta * y_m| <= tol * max |Ritz value|.
+int mat_lanczos(mat_op* A, unsigned int k, const mat_eigs_opts* opts, mat** evals, mat** evecs,
+                mat_krylov_stats* stats) {
+  mat_krylov_stats local;
+  mat_krylov_stats* st = stats ? stats : &local;
+  memset(st, 0, sizeof(*st));
+  if (!evals) {
+    fprintf(stderr, "Lanczos: evals must be non-NULL\n");
+    return 0;
+  }
+  krylov_basis kb;
+  mat_eigs_opts o;
+  if (!krylov_basis_init(&kb, A, k, opts, &o, "Lanczos")) return 0;
+  unsigned int m = kb.m;
+  unsigned int n = kb.n;
+  unsigned int* idx = malloc(m * sizeof(*idx));
+  double* theta = malloc(m * sizeof(*theta));
+  double* Y = malloc((size_t)m * m * sizeof(*Y));
+  mat* T = new_mat(m, m);
+  unsigned int j0 = 0;
+  int ok = 1;
+
+  for (unsigned int cycle = 0;; cycle++) {
+    basis_extend(&kb, j0);
+    st->iterations = cycle + 1;
+    double beta = kb.H[(size_t)m * m + m - 1];
+
+    // Rayleigh-Ritz on the symmetrized projection
+    for (unsigned int i = 0; i < m; i++) {
+      for (unsigned int j = 0; j < m; j++) {
+        T->values[i][j] = 0.5 * (kb.H[(size_t)i * m + j] + kb.H[(size_t)j * m + i]);
+      }
+    }
+    mat* ev = NULL, * ey = NULL;
+    if (!mat_sym_eig(T, &ev, &ey)) {
+      ok = 0;
+      break;
+    }
+    double tnorm = 0.0;
+    for (unsigned int i = 0; i < m; i++) {
+      theta[i] = ev->values[i][0];
+      if (fabs(theta[i]) > tnorm) tnorm = fabs(theta[i]);
+      for (unsigned int j = 0; j < m; j++) Y[(size_t)i * m + j] = ey->values[i][j];
+    }
+    free_mat(ev);
+    free_mat(ey);
+    eigs_order(o.which, theta, NULL, idx, m);
+
+    double worst = 0.0;
+    for (unsigned int i = 0; i < k; i++) {
+      double res = fabs(beta * Y[(size_t)(m - 1) * m + idx[i]]);
+      if (res > worst) worst = res;
+    }
+    st->residual = worst;
+    st->rel_residual = tnorm > 0.0 ? worst / tnorm : worst;
+    st->converged = worst <= o.tol * tnorm;
+    if (st->converged || cycle + 1 >= o.max_restarts) break;
+
+    // keep p Ritz vectors, the old residual direction becomes column p
+    unsigned int p = k + (m - k) / 2;
+    double* Ysel = malloc((size_t)m * p * sizeof(*Ysel));
+    for (unsigned int j = 0; j < m; j++) {
+      for (unsigned int c = 0; c < p; c++) Ysel[(size_t)j * p + c] = Y[(size_t)j * m + idx[c]];
+    }
+    basis_rotate(&kb, Ysel, p);
+    memset(kb.H, 0, (size_t)(m + 1) * m * sizeof(*kb.H));
+    for (unsigned int c = 0; c < p; c++) {
+      kb.H[(size_t)c * m + c] = theta[idx[c]];
+      kb.H[(size_t)p * m + c] = beta * Ysel[(size_t)(m - 1) * p + c];
+    }
+    free(Ysel);
+    j0 = p;
+  }
+  st->matvecs = kb.matvecs;
+
+  if (ok) {
+    *evals = new_mat(k, 1);
+    for (unsigned int c = 0; c < k; c++) (*evals)->values[c][0] = theta[idx[c]];
+    if (evecs) {
+      *evecs = new_mat(n, k);
+      for (unsigned int i = 0; i < n; i++) {
+        const double* vi = kb.V + i * kb.ld;
+        for (unsigned int c = 0; c < k; c++) {
+          double sum = 0.0;
+          for (unsigned int j = 0; j < m; j++) sum += vi[j] * Y[(size_t)j * m + idx[c]];
+          (*evecs)->values[i][c] = sum;
+        }
+      }
+    }
+  }
+  free(idx);
+  free(theta);
+  free(Y);
+  free_mat(T);
+  krylov_basis_free(&kb);
+  return ok;
+}
+
+// Eigenvector z of the dense row-major m x m h for the eigenvalue lambda by
+// complex inverse iteration; the shift is nudged off lambda so the LU exists.
+static void ritz_vector(const double* h, unsigned int m, double complex lambda, double hnorm,
+                        double complex* z, double complex* lu) {
+  double complex shift = lambda + DBL_EPSILON * (hnorm > 0.0 ? hnorm : 1.0);
+  for (unsigned int i = 0; i < m; i++) {
+    for (unsigned int j = 0; j < m; j++) lu[(size_t)i * m + j] = h[(size_t)i * m + j];
+    lu[(size_t)i * m + i] -= shift;
+  }
+  unsigned int* piv = malloc(m * sizeof(*piv));
+  for (unsigned int c = 0; c < m; c++) {
+    unsigned int p = c;
+    for (unsigned int i = c + 1; i < m; i++) {
+      if (cabs(lu[(size_t)i * m + c]) > cabs(lu[(size_t)p * m + c])) p = i;
+    }
+    piv[c] = p;
+    if (p != c) {
+      for (unsigned int j = 0; j < m; j++) {
+        double complex t = lu[(size_t)c * m + j];
+        lu[(size_t)c * m + j] = lu[(size_t)p * m + j];
+        lu[(size_t)p * m + j] = t;
+      }
+    }
+    if (cabs(lu[(size_t)c * m + c]) == 0.0) lu[(size_t)c * m + c] = DBL_EPSILON * (hnorm > 0.0 ? hnorm : 1.0);
+    for (unsigned int i = c + 1; i < m; i++) {
+      double complex l = lu[(size_t)i * m + c] / lu[(size_t)c * m + c];
+      lu[(size_t)i * m + c] = l;
+      for (unsigned int j = c + 1; j < m; j++) lu[(size_t)i * m + j] -= l * lu[(size_t)c * m + j];
+    }
+  }
+  for (unsigned int i = 0; i < m; i++) z[i] = 1.0;
+  for (int iter = 0; iter < 3; iter++) {
+    for (unsigned int c = 0; c < m; c++) {
+      if (piv[c] != c) {
+        double complex t = z[c];
+        z[c] = z[piv[c]];
+        z[piv[c]] = t;
+      }
+    }
+    for (unsigned int i = 0; i < m; i++) {
+      for (unsigned int j = 0; j < i; j++) z[i] -= lu[(size_t)i * m + j] * z[j];
+    }
+    for (unsigned int i = m; i-- > 0;) {
+      for (unsigned int j = i + 1; j < m; j++) z[i] -= lu[(size_t)i * m + j] * z[j];
+      z[i] /= lu[(size_t)i * m + i];
+    }
+    double norm = 0.0;
+    for (unsigned int i = 0; i < m; i++) norm += creal(z[i] * conj(z[i]));
+    norm = sqrt(norm);
+    for (unsigned int i = 0; i < m; i++) z[i] /= norm;
+  }
+  free(piv);
+}
+
+// Restarted Arnoldi for k eigenvalues of a general operator. Each restart
+// keeps an orthonormal basis Y of the real and imaginary parts of the wanted
+// Ritz vectors; since span(Y) is invariant under H, A*V*Y = V*Y*(Y^T H Y) +
+// residual, a Krylov-Schur style decomposition that Arnoldi then extends.
+// evals is k x 2 (re, im) and evecs n x k, a complex pair occupying two
+// columns (re, im) as in mat_eig. If the k-th value is the first of a
+// conjugate pair its partner is included, giving k + 1 of each.
+int mat_arnoldi(mat_op* A, unsigned int k, const mat_eigs_opts* opts, mat** evals, mat** evecs,
+                mat_krylov_stats* stats) {
+  mat_krylov_stats local;
+  mat_krylov_stats* st = stats ? stats : &local;
+  memset(st, 0, sizeof(*st));
+  if (!evals) {
+    fprintf(stderr, "Arnoldi: evals must be non-NULL\n");
+    return 0;
+  }
+  krylov_basis kb;
+  mat_eigs_opts o;
+  if (!krylov_basis_init(&kb, A, k, opts, &o, "Arnoldi")) return 0;
+  unsigned int m = kb.m;
+  unsigned int n = kb.n;
+  unsigned int* idx = malloc(m * sizeof(*idx));
+  double* wr = malloc(m * sizeof(*wr));
+  double* wi = malloc(m * sizeof(*wi));
+  double* hs = malloc((size_t)m * m * sizeof(*hs));
+  double complex* Z = malloc((size_t)m * m * sizeof(*Z));   // Ritz vectors by column
+  double complex* lu = malloc((size_t)m * m * sizeof(*lu));
+  double complex* z = malloc(m * sizeof(*z));
+  double* Y = malloc((size_t)m * m * sizeof(*Y));
+  double* tau = malloc(m * sizeof(*tau));
+  double* x = malloc(m * sizeof(*x));
+  unsigned int j0 = 0;
+  unsigned int kk = k;
+  int ok = 1;
+
+  for (unsigned int cycle = 0;; cycle++) {
+    basis_extend(&kb, j0);
+    st->iterations = cycle + 1;
+    double beta = kb.H[(size_t)m * m + m - 1];
+
+    // Ritz values of the dense projection
+    memcpy(hs, kb.H, (size_t)m * m * sizeof(*hs));
+    double hnorm = 0.0;
+    for (size_t i = 0; i < (size_t)m * m; i++) {
+      if (fabs(hs[i]) > hnorm) hnorm = fabs(hs[i]);
+    }
+    hessenberg_reduce(hs, NULL, m);
+    if (!hessenberg_qr(hs, NULL, m, wr, wi, 0)) {
+      ok = 0;
+      break;
+    }
+    eigs_order(o.which, wr, wi, idx, m);
+    double rnorm = 0.0;
+    for (unsigned int i = 0; i < m; i++) {
+      double a = hypot(wr[i], wi[i]);
+      if (a > rnorm) rnorm = a;
+    }
+
+    // keep p Ritz values without splitting a conjugate pair
+    kk = k;
+    if (wi[idx[kk - 1]] > 0.0 && kk < m) kk++;
+    unsigned int p = k + (m - k) / 2;
+    if (p < kk) p = kk;
+    if (wi[idx[p - 1]] > 0.0) p = (p + 1 < m) ? p + 1 : p - 1;
+    if (p < kk) p = kk;
+
+    for (unsigned int c = 0; c < p; c++) {
+      unsigned int t = idx[c];
+      if (wi[t] < 0.0 && c > 0 && wi[idx[c - 1]] > 0.0) {
+        for (unsigned int i = 0; i < m; i++) Z[(size_t)i * m + c] = conj(Z[(size_t)i * m + c - 1]);
+        continue;
+      }
+      ritz_vector(kb.H, m, wr[t] + I * wi[t], hnorm, z, lu);
+      for (unsigned int i = 0; i < m; i++) Z[(size_t)i * m + c] = z[i];
+    }
+
+    double worst = 0.0;
+    for (unsigned int c = 0; c < kk; c++) {
+      double res = fabs(beta) * cabs(Z[(size_t)(m - 1) * m + c]);
+      if (res > worst) worst = res;
+    }
+    st->residual = worst;
+    st->rel_residual = rnorm > 0.0 ? worst / rnorm : worst;
+    st->converged = worst <= o.tol * rnorm;
+    if (st->converged || cycle + 1 >= o.max_restarts) break;
+
+    // Y = orth([re z, im z]) column-major m x p, then S = Y^T H Y
+    double* yc = malloc((size_t)m * p * sizeof(*yc));
+    for (unsigned int c = 0; c < p; c++) {
+      unsigned int t = idx[c];
+      int second = wi[t] < 0.0 && c > 0 && wi[idx[c - 1]] > 0.0;
+      for (unsigned int i = 0; i < m; i++) {
+        double complex zi = Z[(size_t)i * m + (second ? c - 1 : c)];
+        yc[i + (size_t)c * m] = second ? cimag(zi) : creal(zi);
+      }
+    }
+    householder_qr(yc, m, p, tau);
+    for (unsigned int c = 0; c < p; c++) {
+      memset(x, 0, m * sizeof(*x));
+      x[c] = 1.0;
+      householder_apply_q(yc, m, p, tau, x);
+      for (unsigned int i = 0; i < m; i++) Y[(size_t)i * p + c] = x[i];
+    }
+    free(yc);
+
+    // HY = H * Y (m x p), S = Y^T * HY
+    double* hy = calloc((size_t)m * p, sizeof(*hy));
+    for (unsigned int i = 0; i < m; i++) {
+      for (unsigned int j = 0; j < m; j++) {
+        double hij = kb.H[(size_t)i * m + j];
+        if (hij == 0.0) continue;
+        for (unsigned int c = 0; c < p; c++) hy[(size_t)i * p + c] += hij * Y[(size_t)j * p + c];
+      }
+    }
+    basis_rotate(&kb, Y, p);
+    double* coupling = malloc(p * sizeof(*coupling));
+    for (unsigned int c = 0; c < p; c++) coupling[c] = beta * Y[(size_t)(m - 1) * p + c];
+    memset(kb.H, 0, (size_t)(m + 1) * m * sizeof(*kb.H));
+    for (unsigned int r = 0; r < p; r++) {
+      for (unsigned int c = 0; c < p; c++) {
+        double sum = 0.0;
+        for (unsigned int i = 0; i < m; i++) sum += Y[(size_t)i * p + r] * hy[(size_t)i * p + c];
+        kb.H[(size_t)r * m + c] = sum;
+      }
+    }
+    for (unsigned int c = 0; c < p; c++) kb.H[(size_t)p * m + c] = coupling[c];
+    free(hy);
+    free(coupling);
+    j0 = p;
+  }
+  st->matvecs = kb.matvecs;
+
+  if (ok) {
+    *evals = new_mat(kk, 2);
+    for (unsigned int c = 0; c < kk; c++) {
+      (*evals)->values[c][0] = wr[idx[c]];
+      (*evals)->values[c][1] = wi[idx[c]];
+    }
+    if (evecs) {
+      // x = V z, a conjugate pair stored as (re, im) in two columns
+      *evecs = new_mat(n, kk);
+      for (unsigned int c = 0; c < kk; c++) {
+        int second = wi[idx[c]] < 0.0 && c > 0 && wi[idx[c - 1]] > 0.0;
+        if (second) continue;
+        int pair = wi[idx[c]] > 0.0 && c + 1 < kk;
+        double norm = 0.0;
+        for (unsigned int i = 0; i < n; i++) {
+          const double* vi = kb.V + i * kb.ld;
+          double complex sum = 0.0;
+          for (unsigned int j = 0; j < m; j++) sum += vi[j] * Z[(size_t)j * m + c];
+          (*evecs)->values[i][c] = creal(sum);
+          if (pair) (*evecs)->values[i][c + 1] = cimag(sum);
+          norm += creal(sum) * creal(sum) + (pair ? cimag(sum) * cimag(sum) : 0.0);
+        }
+        norm = sqrt(norm);
+        for (unsigned int i = 0; i < n && norm > 0.0; i++) {
+          (*evecs)->values[i][c] /= norm;
+          if (pair) (*evecs)->values[i][c + 1] /= norm;
+        }
+      }
+    }
+  }
+  free(idx);
+  free(wr);
+  free(wi);
+  free(hs);
+  free(Z);
+  free(lu);
+  free(z);
+  free(Y);
+  free(tau);
+  free(x);
+  krylov_basis_free(&kb);
+  return ok;
+}
+
+
+// ---------------------------------------------------------------------------
+// Out-of-core LU
+// ---------------------------------------------------------------------------
+
+// The matrix lives in a file as column panels of panel_cols columns; panel p
+// (columns c0..c1) is an n x (c1 - c0) row-major block at byte offset
+// c0 * n * sizeof(double). Left-looking factorization keeps one panel being
+// factored in memory and streams the panels to its left past it.
+
+// The factorization keeps OOC_PANEL_BUFFERS panels in memory. Left-looking
+// traffic is O(n^3 / panel_cols), so panels are made as wide as the memory
+// budget allows; without a budget, half of the available RAM is used.
+#define OOC_PANEL_BUFFERS 5
+#define OOC_DEFAULT_BUDGET ((size_t)320 << 20)
+// rows of the trailing update handed to gemm at a time
+#define OOC_UPDATE_ROWS 1024u
+
+// whole-buffer pread/pwrite, retrying short transfers
+static int ooc_io(int fd, void* buf, size_t len, off_t off, int write_op) {
+  char* p = (char*)buf;
+  while (len > 0) {
+    ssize_t got = write_op ? pwrite(fd, p, len, off) : pread(fd, p, len, off);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) return 0;
+    p += got;
+    off += got;
+    len -= (size_t)got;
+  }
+  return 1;
+}
+
+// one asynchronous transfer on its own thread (read-ahead / write-behind)
+typedef struct {
+  int fd;
+  void* buf;
+  size_t len;
+  off_t off;
+  int write_op;
+  int ok;
+  int running;
+  pthread_t thread;
+} ooc_async;
+
+static void* ooc_async_run(void* arg) {
+  ooc_async* op = (ooc_async*)arg;
+  op->ok = ooc_io(op->fd, op->buf, op->len, op->off, op->write_op);
+  return NULL;
+}
+
+static void ooc_async_start(ooc_async* op, int fd, void* buf, size_t len, off_t off, int write_op) {
+  op->fd = fd;
+  op->buf = buf;
+  op->len = len;
+  op->off = off;
+  op->write_op = write_op;
+  op->running = pthread_create(&op->thread, NULL, ooc_async_run, op) == 0;
+  if (!op->running) op->ok = ooc_io(fd, buf, len, off, write_op);
+}
+
+// waits for the transfer, returns 0 if it failed
+static int ooc_async_wait(ooc_async* op) {
+  if (op->running) {
+    pthread_join(op->thread, NULL);
+    op->running = 0;
+  }
+  return op->ok;
+}
+
+static unsigned int ooc_panel_width(mat_ooc* m, unsigned int c0) {
+  return m->n - c0 < m->panel_cols ? m->n - c0 : m->panel_cols;
+}
+
+static off_t ooc_panel_offset(mat_ooc* m, unsigned int c0) {
+  return (off_t)c0 * m->n * (off_t)sizeof(double);
+}
+
+// half the available physical memory, or OOC_DEFAULT_BUDGET if unknown
+static size_t ooc_default_budget(void) {
+  long pages = sysconf(_SC_AVPHYS_PAGES);
+  long page = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || page <= 0) return OOC_DEFAULT_BUDGET;
+  return (size_t)pages / 2 * (size_t)page;
+}
+
+// Creates (or truncates) the backing file for an n x n matrix. panel_cols == 0
+// sizes the panels from half the available RAM, see mat_ooc_create_budget.
+mat_ooc* mat_ooc_create(const char* path, unsigned int n, unsigned int panel_cols) {
+  if (!path || n == 0) {
+    fprintf(stderr, "Out-of-core matrix needs a path and a non-zero size\n");
+    return NULL;
+  }
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open out-of-core file %s\n", path);
+    return NULL;
+  }
+  if (ftruncate(fd, (off_t)n * n * (off_t)sizeof(double)) != 0) {
+    fprintf(stderr, "Cannot size out-of-core file %s\n", path);
+    close(fd);
+    return NULL;
+  }
+  if (panel_cols == 0) {
+    size_t cols = ooc_default_budget() / OOC_PANEL_BUFFERS / ((size_t)n * sizeof(double));
+    panel_cols = cols == 0 ? 1 : (cols > n ? n : (unsigned int)cols);
+  }
+  if (panel_cols > n) panel_cols = n;
+  mat_ooc* m = calloc(1, sizeof(*m));
+  m->fd = fd;
+  m->n = n;
+  m->panel_cols = panel_cols;
+  m->piv = malloc(n * sizeof(*m->piv));
+  m->path = malloc(strlen(path) + 1);
+  strcpy(m->path, path);
+  return m;
+}
+
+// Like mat_ooc_create with the panels sized so that the factorization and
+// solve stay within mem_bytes of panel buffers.
+mat_ooc* mat_ooc_create_budget(const char* path, unsigned int n, size_t mem_bytes) {
+  if (n == 0) return mat_ooc_create(path, n, 1);
+  size_t cols = mem_bytes / OOC_PANEL_BUFFERS / ((size_t)n * sizeof(double));
+  if (cols == 0) {
+    fprintf(stderr, "Memory budget too small for one out-of-core panel\n");
+    return NULL;
+  }
+  return mat_ooc_create(path, n, cols > n ? n : (unsigned int)cols);
+}
+
+// writes rows [row0, row0 + rows->num_rows) of the matrix
+int mat_ooc_set_rows(mat_ooc* m, unsigned int row0, mat* rows) {
+  if (!m || !rows || rows->num_cols != m->n || row0 + rows->num_rows > m->n) {
+    fprintf(stderr, "Rows do not fit the out-of-core matrix\n");
+    return 0;
+  }
+  unsigned int r = rows->num_rows;
+  double* buf = malloc((size_t)r * m->panel_cols * sizeof(*buf));
+  int ok = 1;
+  for (unsigned int c0 = 0; c0 < m->n && ok; c0 += m->panel_cols) {
+    unsigned int w = ooc_panel_width(m, c0);
+    for (unsigned int i = 0; i < r; i++) memcpy(buf + (size_t)i * w, rows->values[i] + c0, w * sizeof(*buf));
+    ok = ooc_io(m->fd, buf, (size_t)r * w * sizeof(*buf),
+                ooc_panel_offset(m, c0) + (off_t)row0 * w * (off_t)sizeof(*buf), 1);
+  }
+  free(buf);
+  if (!ok) fprintf(stderr, "Write to out-of-core file failed\n");
+  m->factored = 0;
+  return ok;
+}
+
+// reads rows [row0, row0 + count) back into a mat (the LU factors after mat_ooc_lu)
+mat* mat_ooc_get_rows(mat_ooc* m, unsigned int row0, unsigned int count) {
+  if (!m || count == 0 || row0 + count > m->n) {
+    fprintf(stderr, "Rows out of range for the out-of-core matrix\n");
+    return NULL;
+  }
+  mat* rows = new_mat(count, m->n);
+  double* buf = malloc((size_t)count * m->panel_cols * sizeof(*buf));
+  for (unsigned int c0 = 0; c0 < m->n; c0 += m->panel_cols) {
+    unsigned int w = ooc_panel_width(m, c0);
+    if (!ooc_io(m->fd, buf, (size_t)count * w * sizeof(*buf),
+                ooc_panel_offset(m, c0) + (off_t)row0 * w * (off_t)sizeof(*buf), 0)) {
+      fprintf(stderr, "Read from out-of-core file failed\n");
+      free(buf);
+      free_mat(rows);
+      return NULL;
+    }
+    for (unsigned int i = 0; i < count; i++) memcpy(rows->values[i] + c0, buf + (size_t)i * w, w * sizeof(*buf));
+  }
+  free(buf);
+  return rows;
+}
+
+// applies the factored panel at columns k0.. to cur: its row interchanges,
+// the unit lower triangular solve for U_KJ, then the trailing update
+static void ooc_apply_panel(mat_ooc* m, double* cur, unsigned int wj, const double* lk, unsigned int k0) {
+  unsigned int n = m->n;
+  unsigned int wk = ooc_panel_width(m, k0);
+  for (unsigned int k = k0; k < k0 + wk; k++) {
+    unsigned int p = m->piv[k];
+    if (p == k) continue;
+    double* a = cur + (size_t)k * wj;
+    double* b = cur + (size_t)p * wj;
+    for (unsigned int j = 0; j < wj; j++) {
+      double t = a[j];
+      a[j] = b[j];
+      b[j] = t;
+    }
+  }
+  for (unsigned int i = k0 + 1; i < k0 + wk; i++) {
+    double* ci = cur + (size_t)i * wj;
+    const double* li = lk + (size_t)i * wk;
+    for (unsigned int t = 0; t < i - k0; t++) {
+      const double* ut = cur + (size_t)(k0 + t) * wj;
+      for (unsigned int j = 0; j < wj; j++) ci[j] -= li[t] * ut[j];
+    }
+  }
+  // trailing update cur[k1:n] -= L_K[k1:n] * U_KJ through the in-core gemm,
+  // a block of rows at a time so the product needs little extra memory
+  unsigned int k1 = k0 + wk;
+  if (k1 >= n) return;
+  unsigned int block = n - k1 < OOC_UPDATE_ROWS ? n - k1 : OOC_UPDATE_ROWS;
+  double* prod = malloc((size_t)block * wj * sizeof(*prod));
+  double** a = malloc(block * sizeof(*a));
+  double** c = malloc(block * sizeof(*c));
+  double** u = malloc(wk * sizeof(*u));
+  for (unsigned int t = 0; t < wk; t++) u[t] = cur + (size_t)(k0 + t) * wj;
+  for (unsigned int r = 0; r < block; r++) c[r] = prod + (size_t)r * wj;
+  for (unsigned int i0 = k1; i0 < n; i0 += block) {
+    unsigned int rows = n - i0 < block ? n - i0 : block;
+    for (unsigned int r = 0; r < rows; r++) a[r] = (double*)lk + (size_t)(i0 + r) * wk;
+    gemm(c, a, u, rows, wk, wj);
+    for (unsigned int r = 0; r < rows; r++) {
+      double* ci = cur + (size_t)(i0 + r) * wj;
+      const double* pr = c[r];
+      for (unsigned int j = 0; j < wj; j++) ci[j] -= pr[j];
+    }
+  }
+  free(prod);
+  free(a);
+  free(c);
+  free(u);
+}
+
+// Left-looking LU with partial pivoting, in place in the file. For each panel
+// J the panels K < J are streamed from the file (double-buffered read-ahead)
+// and applied; the panel is then factored in memory with lu_factor_d and
+// written back behind the next panel's work. Panel J + 1 is read while J is
+// being processed. Row interchanges are only applied to panels on the right,
+// so the L of each panel stays in the row order it was factored in;
+// mat_ooc_solve replays the interchanges in the same order.
+int mat_ooc_lu(mat_ooc* m) {
+  if (!m) {
+    fprintf(stderr, "Out-of-core LU requires a matrix\n");
+    return 0;
+  }
+  unsigned int n = m->n;
+  unsigned int w = m->panel_cols;
+  size_t panel_len = (size_t)n * w;
+  double* buf[OOC_PANEL_BUFFERS];
+  for (int i = 0; i < OOC_PANEL_BUFFERS; i++) buf[i] = malloc(panel_len * sizeof(double));
+  double* cur = buf[0];
+  double* next = buf[1];
+  double* kbuf[2] = {buf[2], buf[3]};
+  double* done = buf[4];     // previous panel, being written back
+  unsigned int* lpiv = malloc(w * sizeof(*lpiv));
+  ooc_async rd_next, rd_k[2], wr;
+  memset(&wr, 0, sizeof(wr));
+  wr.ok = 1;
+  int ok = 1;
+  int nonsingular = 1;
+
+  ooc_async_start(&rd_next, m->fd, next, (size_t)n * ooc_panel_width(m, 0) * sizeof(double), 0, 0);
+  for (unsigned int c0 = 0; c0 < n; c0 += w) {
+    unsigned int wj = ooc_panel_width(m, c0);
+    ok &= ooc_async_wait(&rd_next);
+    double* t = cur; cur = next; next = t;
+    if (c0 + w < n) {
+      ooc_async_start(&rd_next, m->fd, next, (size_t)n * ooc_panel_width(m, c0 + w) * sizeof(double),
+                      ooc_panel_offset(m, c0 + w), 0);
+    }
+
+    // panels 0 .. J-2 come from the file, J-1 is still in memory
+    unsigned int kfile = c0 >= w ? c0 / w - 1 : 0;
+    if (kfile > 0) {
+      ooc_async_start(&rd_k[0], m->fd, kbuf[0], (size_t)n * w * sizeof(double), 0, 0);
+    }
+    for (unsigned int kp = 0; kp * w < c0; kp++) {
+      unsigned int k0 = kp * w;
+      const double* lk;
+      if (kp < kfile) {
+        ok &= ooc_async_wait(&rd_k[kp % 2]);
+        lk = kbuf[kp % 2];
+        if (kp + 1 < kfile) {
+          ooc_async_start(&rd_k[(kp + 1) % 2], m->fd, kbuf[(kp + 1) % 2], (size_t)n * w * sizeof(double),
+                          ooc_panel_offset(m, k0 + w), 0);
+        }
+      } else {
+        lk = done;
+      }
+      ooc_apply_panel(m, cur, wj, lk, k0);
+    }
+
+    // factor the panel below its diagonal with the in-core kernel
+    if (!lu_factor_d(cur + (size_t)c0 * wj, n - c0, wj, wj, lpiv)) nonsingular = 0;
+    for (unsigned int k = 0; k < wj; k++) m->piv[c0 + k] = c0 + lpiv[k];
+
+    ok &= ooc_async_wait(&wr);
+    t = done; done = cur; cur = t;
+    ooc_async_start(&wr, m->fd, done, (size_t)n * wj * sizeof(double), ooc_panel_offset(m, c0), 1);
+  }
+  ok &= ooc_async_wait(&wr);
+
+  for (int i = 0; i < OOC_PANEL_BUFFERS; i++) free(buf[i]);
+  free(lpiv);
+  if (!ok) {
+    fprintf(stderr, "I/O error during out-of-core LU\n");
+    return 0;
+  }
+  m->factored = 1;
+  if (!nonsingular) fprintf(stderr, "Matrix is singular - zero pivot in out-of-core LU\n");
+  return nonsingular;
+}
+
+// Solves A X = B from the factors of mat_ooc_lu with one forward and one
+// backward pass over the file (panels are read ahead while the previous one
+// is applied). B may have several columns.
+mat* mat_ooc_solve(mat_ooc* m, mat* b) {
+  if (!m || !b || !m->factored || b->num_rows != m->n) {
+    fprintf(stderr, "Out-of-core solve needs a factored matrix and matching right-hand side\n");
+    return NULL;
+  }
+  unsigned int n = m->n;
+  unsigned int w = m->panel_cols;
+  unsigned int nrhs = b->num_cols;
+  unsigned int npanels = (n + w - 1) / w;
+  double* x = malloc((size_t)n * nrhs * sizeof(*x));
+  for (unsigned int i = 0; i < n; i++) memcpy(x + (size_t)i * nrhs, b->values[i], nrhs * sizeof(*x));
+  double* pbuf[2];
+  pbuf[0] = malloc((size_t)n * w * sizeof(double));
+  pbuf[1] = malloc((size_t)n * w * sizeof(double));
+  ooc_async rd[2];
+  int ok = 1;
+
+  // forward: interchanges and unit lower L, panel by panel
+  ooc_async_start(&rd[0], m->fd, pbuf[0], (size_t)n * ooc_panel_width(m, 0) * sizeof(double), 0, 0);
+  for (unsigned int p = 0; p < npanels; p++) {
+    unsigned int k0 = p * w;
+    unsigned int wk = ooc_panel_width(m, k0);
+    ok &= ooc_async_wait(&rd[p % 2]);
+    if (p + 1 < npanels) {
+      ooc_async_start(&rd[(p + 1) % 2], m->fd, pbuf[(p + 1) % 2],
+                      (size_t)n * ooc_panel_width(m, k0 + w) * sizeof(double), ooc_panel_offset(m, k0 + w), 0);
+    }
+    const double* lk = pbuf[p % 2];
+    for (unsigned int k = k0; k < k0 + wk; k++) {
+      unsigned int q = m->piv[k];
+      if (q == k) continue;
+      for (unsigned int c = 0; c < nrhs; c++) {
+        double t = x[(size_t)k * nrhs + c];
+        x[(size_t)k * nrhs + c] = x[(size_t)q * nrhs + c];
+        x[(size_t)q * nrhs + c] = t;
+      }
+    }
+    for (unsigned int i = k0 + 1; i < n; i++) {
+      const double* li = lk + (size_t)i * wk;
+      unsigned int tend = i < k0 + wk ? i - k0 : wk;
+      for (unsigned int t = 0; t < tend; t++) {
+        double l = li[t];
+        if (l == 0.0) continue;
+        for (unsigned int c = 0; c < nrhs; c++) x[(size_t)i * nrhs + c] -= l * x[(size_t)(k0 + t) * nrhs + c];
+      }
+    }
+  }
+
+  // backward: U by columns, last panel first
+  unsigned int last = npanels - 1;
+  ooc_async_start(&rd[last % 2], m->fd, pbuf[last % 2], (size_t)n * ooc_panel_width(m, last * w) * sizeof(double),
+                  ooc_panel_offset(m, last * w), 0);
+  int singular = 0;
+  for (unsigned int p = npanels; p-- > 0;) {
+    unsigned int k0 = p * w;
+    unsigned int wk = ooc_panel_width(m, k0);
+    ok &= ooc_async_wait(&rd[p % 2]);
+    if (p > 0) {
+      ooc_async_start(&rd[(p - 1) % 2], m->fd, pbuf[(p - 1) % 2], (size_t)n * w * sizeof(double),
+                      ooc_panel_offset(m, k0 - w), 0);
+    }
+    const double* uk = pbuf[p % 2];
+    for (unsigned int c = k0 + wk; c-- > k0;) {
+      double d = uk[(size_t)c * wk + (c - k0)];
+      if (d == 0.0) {
+        singular = 1;
+        continue;
+      }
+      for (unsigned int r = 0; r < nrhs; r++) x[(size_t)c * nrhs + r] /= d;
+      for (unsigned int i = 0; i < c; i++) {
+        double u = uk[(size_t)i * wk + (c - k0)];
+        if (u == 0.0) continue;
+        for (unsigned int r = 0; r < nrhs; r++) x[(size_t)i * nrhs + r] -= u * x[(size_t)c * nrhs + r];
+      }
+    }
+  }
+  free(pbuf[0]);
+  free(pbuf[1]);
+  if (!ok || singular) {
+    fprintf(stderr, ok ? "Matrix is singular - cannot solve system\n" : "I/O error during out-of-core solve\n");
+    free(x);
+    return NULL;
+  }
+  mat* result = new_mat(n, nrhs);
+  for (unsigned int i = 0; i < n; i++) memcpy(result->values[i], x + (size_t)i * nrhs, nrhs * sizeof(*x));
+  free(x);
+  return result;
+}
+
+// closes the backing file, removing it when remove_file is set
+void mat_ooc_close(mat_ooc* m, int remove_file) {
+  if (!m) return;
+  close(m->fd);
+  if (remove_file) unlink(m->path);
+  free(m->path);
+  free(m->piv);
+  free(m);
+}
+
+
+// ---------------------------------------------------------------------------
+// Text parsing
+// ---------------------------------------------------------------------------
+
+// The whole input is read into one buffer with large freads and split into
+// ~1 MB chunks at line boundaries. A first parallel pass counts the values
+// (and rows) in each chunk, a prefix sum gives every chunk its starting
+// element, and a second parallel pass parses the values straight into place.
+#define TEXT_CHUNK_BYTES (1u << 20)
+#define TEXT_READ_BYTES (4u << 20)
+
+static const double text_pow10[23] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int text_is_sep(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == ',' || c == '\v' || c == '\f';
+}
+
+// Parses one number starting at *pp and leaves *pp after it. Decimal inputs
+// with at most 19 significant digits whose mantissa fits in 53 bits and whose
+// power of ten is exact (|e| <= 22) are converted with a single correctly
+// rounded multiply or divide (Clinger's fast path); anything else goes to
+// strtod. Returns 0 if the token is not a number.
+static int text_parse_double(const char** pp, double* out) {
+  const char* start = *pp;
+  const char* p = start;
+  int neg = 0;
+  if (*p == '-' || *p == '+') {
+    neg = *p == '-';
+    p++;
+  }
+  unsigned long long mant = 0;
+  int sig = 0;
+  int exp10 = 0;
+  int ndigits = 0;
+  int exact = 1;
+  while (*p >= '0' && *p <= '9') {
+    if (sig < 19) {
+      mant = mant * 10 + (unsigned long long)(*p - '0');
+      if (mant) sig++;
+    } else {
+      exp10++;
+      exact = 0;
+    }
+    ndigits++;
+    p++;
+  }
+  if (*p == '.') {
+    p++;
+    while (*p >= '0' && *p <= '9') {
+      if (sig < 19) {
+        mant = mant * 10 + (unsigned long long)(*p - '0');
+        if (mant) sig++;
+        exp10--;
+      } else {
+        exact = 0;
+      }
+      ndigits++;
+      p++;
+    }
+  }
+  if (ndigits == 0) exact = 0;     // inf, nan, hex floats and junk
+  if (exact && (*p == 'e' || *p == 'E')) {
+    const char* q = p + 1;
+    int eneg = 0;
+    if (*q == '-' || *q == '+') {
+      eneg = *q == '-';
+      q++;
+    }
+    if (*q < '0' || *q > '9') {
+      exact = 0;
+    } else {
+      int e = 0;
+      while (*q >= '0' && *q <= '9') {
+        if (e < 100000) e = e * 10 + (*q - '0');
+        q++;
+      }
+      exp10 += eneg ? -e : e;
+      p = q;
+    }
+  }
+  // the token must end here: "0x1p3" or "1.5q" stop early and go to strtod
+  if (*p != '\0' && *p != '\n' && !text_is_sep(*p)) exact = 0;
+  if (exact && mant <= (1ull << 53) && exp10 >= -22 && exp10 <= 22) {
+    double d = (double)mant;
+    d = exp10 < 0 ? d / text_pow10[-exp10] : d * text_pow10[exp10];
+    *out = neg ? -d : d;
+    *pp = p;
+    return 1;
+  }
+  char* end;
+  *out = strtod(start, &end);
+  if (end == start) return 0;
+  *pp = end;
+  return 1;
+}
+
+typedef struct {
+  const char* text;
+  size_t* bounds;               // chunk c is text[bounds[c] .. bounds[c + 1])
+  unsigned long long* values;   // values per chunk, then the first value index
+  unsigned int* rows;           // non-empty lines per chunk
+  unsigned int num_cols;        // values every line must have, 0 to skip the check
+  int* bad;                     // per chunk: 1 bad number, 2 ragged line
+  mat* result;
+} text_job;
+
+// pass 1: count the values on each line of the chunk
+static void text_count_range(void* arg, unsigned int begin, unsigned int end) {
+  text_job* job = (text_job*)arg;
+  for (unsigned int c = begin; c < end; c++) {
+    const char* p = job->text + job->bounds[c];
+    const char* stop = job->text + job->bounds[c + 1];
+    unsigned long long values = 0;
+    unsigned int rows = 0;
+    unsigned int on_line = 0;
+    while (p < stop) {
+      if (*p == '\n') {
+        if (on_line) {
+          if (job->num_cols && on_line != job->num_cols) job->bad[c] = 2;
+          rows++;
+        }
+        on_line = 0;
+        p++;
+      } else if (text_is_sep(*p)) {
+        p++;
+      } else {
+        on_line++;
+        values++;
+        while (p < stop && *p != '\n' && !text_is_sep(*p)) p++;
+      }
+    }
+    if (on_line) {
+      if (job->num_cols && on_line != job->num_cols) job->bad[c] = 2;
+      rows++;
+    }
+    job->values[c] = values;
+    job->rows[c] = rows;
+  }
+}
+
+// pass 2: parse the chunk's values into the matrix from its first index on
+static void text_parse_range(void* arg, unsigned int begin, unsigned int end) {
+  text_job* job = (text_job*)arg;
+  unsigned int cols = job->result->num_cols;
+  for (unsigned int c = begin; c < end; c++) {
+    const char* p = job->text + job->bounds[c];
+    const char* stop = job->text + job->bounds[c + 1];
+    unsigned long long k = job->values[c];
+    unsigned int i = (unsigned int)(k / cols);
+    unsigned int j = (unsigned int)(k % cols);
+    while (p < stop) {
+      if (*p == '\n' || text_is_sep(*p)) {
+        p++;
+        continue;
+      }
+      double v;
+      if (!text_parse_double(&p, &v) || (p < stop && *p != '\n' && !text_is_sep(*p))) {
+        job->bad[c] = 1;
+        break;
+      }
+      job->result->values[i][j] = v;
+      if (++j == cols) {
+        j = 0;
+        i++;
+      }
+    }
+  }
+}
+
+// Parses text[0 .. len) (text[len] must be '\0') into a matrix. With
+// num_rows == 0 the shape comes from the lines: one row per non-empty line,
+// all with the same number of values. Otherwise the num_rows * num_cols values
+// are read in row-major order regardless of line breaks.
+static mat* text_to_mat(const char* text, size_t len, unsigned int num_rows, unsigned int num_cols) {
+  if (num_rows == 0) {
+    // the first non-empty line fixes the column count
+    const char* p = text;
+    const char* stop = text + len;
+    while (p < stop && num_cols == 0) {
+      if (*p == '\n' || text_is_sep(*p)) {
+        p++;
+      } else {
+        while (p < stop && *p != '\n') {
+          if (text_is_sep(*p)) {
+            p++;
+          } else {
+            num_cols++;
+            while (p < stop && *p != '\n' && !text_is_sep(*p)) p++;
+          }
+        }
+      }
+    }
+    if (num_cols == 0) {
+      fprintf(stderr, "Text matrix is empty\n");
+      return NULL;
+    }
+  }
+
+  unsigned int nchunks = (unsigned int)(len / TEXT_CHUNK_BYTES) + 1;
+  size_t* bounds = malloc((nchunks + 1) * sizeof(*bounds));
+  bounds[0] = 0;
+  for (unsigned int c = 1; c < nchunks; c++) {
+    size_t b = (size_t)((unsigned long long)len * c / nchunks);
+    if (b < bounds[c - 1]) b = bounds[c - 1];
+    while (b > 0 && b < len && text[b - 1] != '\n') b++;
+    bounds[c] = b;
+  }
+  bounds[nchunks] = len;
+  text_job job = {text, bounds, malloc(nchunks * sizeof(*job.values)), malloc(nchunks * sizeof(*job.rows)),
+                  num_rows == 0 ? num_cols : 0, calloc(nchunks, sizeof(*job.bad)), NULL};
+  parallel_for(nchunks, 1, text_count_range, &job);
+
+  unsigned long long total = 0;
+  unsigned long long lines = 0;
+  int bad = 0;
+  for (unsigned int c = 0; c < nchunks; c++) {
+    unsigned long long v = job.values[c];
+    job.values[c] = total;
+    total += v;
+    lines += job.rows[c];
+    if (job.bad[c]) bad = job.bad[c];
+  }
+  if (num_rows == 0 && !bad) {
+    if (lines > 0xffffffffull) {
+      fprintf(stderr, "Text matrix has too many rows\n");
+      bad = -1;
+    } else {
+      num_rows = (unsigned int)lines;
+    }
+  }
+  if (bad == 2) {
+    fprintf(stderr, "Text matrix rows must all have %u values\n", num_cols);
+  } else if (!bad && total != (unsigned long long)num_rows * num_cols) {
+    fprintf(stderr, "Text matrix has %llu values, expected %llu\n", total,
+            (unsigned long long)num_rows * num_cols);
+    bad = -1;
+  }
+  if (!bad) {
+    job.result = new_mat(num_rows, num_cols);
+    parallel_for(nchunks, 1, text_parse_range, &job);
+    for (unsigned int c = 0; c < nchunks; c++) {
+      if (job.bad[c]) bad = job.bad[c];
+    }
+    if (bad) {
+      fprintf(stderr, "Text matrix contains a value that is not a number\n");
+      free_mat(job.result);
+      job.result = NULL;
+    }
+  }
+  free(bounds);
+  free(job.values);
+  free(job.rows);
+  free(job.bad);
+  return job.result;
+}
+
+// reads the rest of the stream into one '\0'-terminated buffer
+static char* text_slurp(FILE* f, size_t* len) {
+  size_t cap = TEXT_READ_BYTES;
+  size_t used = 0;
+  char* buf = malloc(cap + 1);
+  for (;;) {
+    if (cap - used < TEXT_READ_BYTES / 2) {
+      cap *= 2;
+      buf = realloc(buf, cap + 1);
+    }
+    size_t got = fread(buf + used, 1, cap - used, f);
+    used += got;
+    if (got == 0) break;
+  }
+  if (ferror(f)) {
+    fprintf(stderr, "Error reading text matrix\n");
+    free(buf);
+    return NULL;
+  }
+  buf[used] = '\0';
+  *len = used;
+  return buf;
+}
+
+mat* mat_parse_text(const char* text, size_t len) {
+  if (!text) {
+    fprintf(stderr, "Cannot parse a NULL text matrix\n");
+    return NULL;
+  }
+  // the parser relies on a terminator after the last value
+  char* copy = malloc(len + 1);
+  memcpy(copy, text, len);
+  copy[len] = '\0';
+  mat* result = text_to_mat(copy, len, 0, 0);
+  free(copy);
+  return result;
+}
+
+mat* mat_read_text(FILE* f) {
+  if (!f) {
+    fprintf(stderr, "Cannot read a text matrix from a NULL stream\n");
+    return NULL;
+  }
+  size_t len;
+  char* text = text_slurp(f, &len);
+  if (!text) return NULL;
+  mat* result = text_to_mat(text, len, 0, 0);
+  free(text);
+  return result;
+}
+
+// "rows cols" header followed by the values. Exactly rows * cols values are
+// consumed and the stream is left just after the last one, so several
+// matrices can be read one after another from the same stream. The text is
+// gathered with getc_unlocked and then parsed in parallel like mat_read_text.
+static mat* text_read_with_header(FILE* f) {
+  unsigned long dims[2];
+  flockfile(f);
+  int c = getc_unlocked(f);
+  for (int d = 0; d < 2; d++) {
+    while (c == '\n' || (c != EOF && text_is_sep((char)c))) c = getc_unlocked(f);
+    dims[d] = 0;
+    while (c >= '0' && c <= '9' && dims[d] <= 0xffffffffUL) {
+      dims[d] = dims[d] * 10 + (unsigned long)(c - '0');
+      c = getc_unlocked(f);
+    }
+    if (dims[d] == 0 || dims[d] > 0xffffffffUL) {
+      if (c != EOF) ungetc(c, f);
+      funlockfile(f);
+      fprintf(stderr, "Text matrix header needs positive row and column counts\n");
+      return NULL;
+    }
+  }
+
+  // collect tokens until the last value has ended
+  unsigned long long want = (unsigned long long)dims[0] * dims[1];
+  unsigned long long have = 0;
+  size_t cap = 4096;
+  size_t len = 0;
+  char* text = malloc(cap + 1);
+  int in_token = 0;
+  while (c != EOF) {
+    int sep = c == '\n' || text_is_sep((char)c);
+    if (sep && in_token && ++have == want) break;
+    in_token = !sep;
+    if (len == cap) {
+      cap *= 2;
+      text = realloc(text, cap + 1);
+    }
+    text[len++] = (char)c;
+    c = getc_unlocked(f);
+  }
+  if (c == EOF && in_token) have++;
+  // the separator after the last value stays in the stream
+  if (c != EOF) ungetc(c, f);
+  int failed = ferror(f);
+  funlockfile(f);
+  if (failed) {
+    fprintf(stderr, "Error reading text matrix\n");
+    free(text);
+    return NULL;
+  }
+  if (have != want) {
+    fprintf(stderr, "Text matrix has %llu values, expected %llu\n", have, want);
+    free(text);
+    return NULL;
+  }
+  text[len] = '\0';
+  mat* result = text_to_mat(text, len, (unsigned int)dims[0], (unsigned int)dims[1]);
+  free(text);
+  return result;
+}
+
+
+// ---------------------------------------------------------------------------
+// Binary format
+// ---------------------------------------------------------------------------
+
+// A 64 byte header followed, at data_offset, by the values in row-major
+// order as native doubles. The data offset is a multiple of the recorded
+// alignment so a mapping of the file can be used in place. The checksum
+// covers the data only.
+#define MAT_BIN_MAGIC "JABRMAT"
+#define MAT_BIN_VERSION 1u
+#define MAT_BIN_F64 1u
+#define MAT_BIN_ROW_MAJOR 0u
+#define MAT_BIN_ALIGN 64u
+#define MAT_BIN_BYTE_ORDER 0x0102030405060708ull
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t dtype;
+  uint32_t layout;
+  uint32_t alignment;
+  uint64_t rows;
+  uint64_t cols;
+  uint64_t data_offset;
+  uint64_t checksum;
+  uint64_t byte_order;
+} mat_bin_header;
+
+// Four interleaved multiply-xor lanes over the 64-bit words, so the hash of a
+// large file runs near memory speed. Word i always goes to lane i % 4,
+// which lets rows be fed one at a time.
+typedef struct {
+  uint64_t lane[4];
+  uint64_t words;
+} bin_checksum;
+
+static void bin_checksum_init(bin_checksum* c) {
+  for (int i = 0; i < 4; i++) c->lane[i] = 0xcbf29ce484222325ull + (uint64_t)i;
+  c->words = 0;
+}
+
+static void bin_checksum_update(bin_checksum* c, const double* data, size_t n) {
+  size_t i = 0;
+  while (i < n && (c->words + i) % 4 != 0) {
+    uint64_t w;
+    memcpy(&w, data + i, sizeof(w));
+    uint64_t* h = &c->lane[(c->words + i) % 4];
+    *h = (*h ^ w) * 0x100000001b3ull;
+    i++;
+  }
+  uint64_t h0 = c->lane[0], h1 = c->lane[1], h2 = c->lane[2], h3 = c->lane[3];
+  for (; i + 4 <= n; i += 4) {
+    uint64_t w[4];
+    memcpy(w, data + i, sizeof(w));
+    h0 = (h0 ^ w[0]) * 0x100000001b3ull;
+    h1 = (h1 ^ w[1]) * 0x100000001b3ull;
+    h2 = (h2 ^ w[2]) * 0x100000001b3ull;
+    h3 = (h3 ^ w[3]) * 0x100000001b3ull;
+  }
+  c->lane[0] = h0;
+  c->lane[1] = h1;
+  c->lane[2] = h2;
+  c->lane[3] = h3;
+  for (; i < n; i++) {
+    uint64_t w;
+    memcpy(&w, data + i, sizeof(w));
+    uint64_t* h = &c->lane[(c->words + i) % 4];
+    *h = (*h ^ w) * 0x100000001b3ull;
+  }
+  c->words += n;
+}
+
+static uint64_t bin_checksum_final(bin_checksum* c) {
+  uint64_t h = c->words;
+  for (int i = 0; i < 4; i++) {
+    h ^= c->lane[i] + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+  }
+  return h;
+}
+
+// checks everything in the header except the checksum against the file size
+static int bin_header_valid(const mat_bin_header* h, unsigned long long file_size, const char* path) {
+  if (memcmp(h->magic, MAT_BIN_MAGIC, 8) != 0) {
+    fprintf(stderr, "%s is not a binary matrix file\n", path);
+    return 0;
+  }
+  if (h->byte_order != MAT_BIN_BYTE_ORDER) {
+    fprintf(stderr, "%s was written with a different byte order\n", path);
+    return 0;
+  }
+  if (h->version != MAT_BIN_VERSION || h->dtype != MAT_BIN_F64 || h->layout != MAT_BIN_ROW_MAJOR) {
+    fprintf(stderr, "%s uses an unsupported version, type or layout\n", path);
+    return 0;
+  }
+  if (h->rows == 0 || h->cols == 0 || h->rows > UINT32_MAX || h->cols > UINT32_MAX ||
+      h->alignment == 0 || h->data_offset < sizeof(*h) || h->data_offset % h->alignment != 0 ||
+      h->data_offset % sizeof(double) != 0) {
+    fprintf(stderr, "%s has an invalid header\n", path);
+    return 0;
+  }
+  if (file_size < h->data_offset || (file_size - h->data_offset) / sizeof(double) / h->cols < h->rows) {
+    fprintf(stderr, "%s is truncated\n", path);
+    return 0;
+  }
+  return 1;
+}
+
+// wraps row-major doubles inside a file mapping as a mat that free_mat unmaps
+static mat* mat_from_mapping(void* base, size_t len, const double* data, unsigned int rows, unsigned int cols) {
+  mat* matrix = calloc(1, sizeof(*matrix));
+  matrix->num_rows = rows;
+  matrix->num_cols = cols;
+  matrix->is_square = rows == cols;
+  matrix->values = malloc(rows * sizeof(*matrix->values));
+  for (unsigned int i = 0; i < rows; i++) matrix->values[i] = (double*)(data + (size_t)i * cols);
+  matrix->map_base = base;
+  matrix->map_len = len;
+  return matrix;
+}
+
+int mat_save_binary(mat* matrix, const char* path) {
+  if (!matrix || !path) {
+    fprintf(stderr, "Saving a binary matrix needs a matrix and a path\n");
+    return 0;
+  }
+  FILE* f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "Cannot open %s for writing\n", path);
+    return 0;
+  }
+  mat_bin_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MAT_BIN_MAGIC, 8);
+  h.version = MAT_BIN_VERSION;
+  h.dtype = MAT_BIN_F64;
+  h.layout = MAT_BIN_ROW_MAJOR;
+  h.alignment = MAT_BIN_ALIGN;
+  h.rows = matrix->num_rows;
+  h.cols = matrix->num_cols;
+  h.data_offset = (sizeof(h) + MAT_BIN_ALIGN - 1) / MAT_BIN_ALIGN * MAT_BIN_ALIGN;
+  h.byte_order = MAT_BIN_BYTE_ORDER;
+  bin_checksum c;
+  bin_checksum_init(&c);
+  for (unsigned int i = 0; i < matrix->num_rows; i++) bin_checksum_update(&c, matrix->values[i], matrix->num_cols);
+  h.checksum = bin_checksum_final(&c);
+
+  char pad[MAT_BIN_ALIGN] = {0};
+  int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+           fwrite(pad, 1, h.data_offset - sizeof(h), f) == h.data_offset - sizeof(h);
+  for (unsigned int i = 0; ok && i < matrix->num_rows; i++) {
+    ok = fwrite(matrix->values[i], sizeof(double), matrix->num_cols, f) == matrix->num_cols;
+  }
+  if (fclose(f) != 0) ok = 0;
+  if (!ok) fprintf(stderr, "Error writing %s\n", path);
+  return ok;
+}
+
+// reads and checks the whole file into a regular (writable) matrix
+mat* mat_load_binary(const char* path) {
+  if (!path) {
+    fprintf(stderr, "Loading a binary matrix needs a path\n");
+    return NULL;
+  }
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return NULL;
+  }
+  struct stat st;
+  mat_bin_header h;
+  if (fstat(fileno(f), &st) != 0 || fread(&h, sizeof(h), 1, f) != 1 ||
+      !bin_header_valid(&h, (unsigned long long)st.st_size, path) ||
+      fseeko(f, (off_t)h.data_offset, SEEK_SET) != 0) {
+    fclose(f);
+    return NULL;
+  }
+  mat* matrix = new_mat((unsigned int)h.rows, (unsigned int)h.cols);
+  bin_checksum c;
+  bin_checksum_init(&c);
+  int ok = 1;
+  for (unsigned int i = 0; ok && i < matrix->num_rows; i++) {
+    ok = fread(matrix->values[i], sizeof(double), matrix->num_cols, f) == matrix->num_cols;
+    bin_checksum_update(&c, matrix->values[i], matrix->num_cols);
+  }
+  fclose(f);
+  if (!ok || bin_checksum_final(&c) != h.checksum) {
+    fprintf(stderr, ok ? "%s failed its checksum\n" : "Error reading %s\n", path);
+    free_mat(matrix);
+    return NULL;
+  }
+  return matrix;
+}
+
+// Maps the file and points the rows straight into the mapping, so loading
+// costs only the row pointer array; pages are faulted in on first use. The
+// mapping is read-only: writing to the values crashes. free_mat unmaps it.
+// verify reads the whole file once to check the checksum.
+mat* mat_map_binary(const char* path, int verify) {
+  if (!path) {
+    fprintf(stderr, "Mapping a binary matrix needs a path\n");
+    return NULL;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return NULL;
+  }
+  struct stat st;
+  mat_bin_header h;
+  if (fstat(fd, &st) != 0 || !ooc_io(fd, &h, sizeof(h), 0, 0) ||
+      !bin_header_valid(&h, (unsigned long long)st.st_size, path)) {
+    close(fd);
+    return NULL;
+  }
+  size_t len = (size_t)st.st_size;
+  void* base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Cannot map %s\n", path);
+    return NULL;
+  }
+  const double* data = (const double*)((const char*)base + h.data_offset);
+  if (verify) {
+    bin_checksum c;
+    bin_checksum_init(&c);
+    bin_checksum_update(&c, data, (size_t)h.rows * h.cols);
+    if (bin_checksum_final(&c) != h.checksum) {
+      fprintf(stderr, "%s failed its checksum\n", path);
+      munmap(base, len);
+      return NULL;
+    }
+  }
+  return mat_from_mapping(base, len, data, (unsigned int)h.rows, (unsigned int)h.cols);
+}
+
+
+// ---------------------------------------------------------------------------
+// Sparse matrices and Matrix Market files
+// ---------------------------------------------------------------------------
+
+void free_spmat(spmat* A) {
+  if (!A) return;
+  free(A->row_ptr);
+  free(A->col_idx);
+  free(A->values);
+  free(A);
+}
+
+static spmat* spmat_alloc(unsigned int num_rows, unsigned int num_cols, unsigned long long nnz) {
+  spmat* A = calloc(1, sizeof(*A));
+  A->num_rows = num_rows;
+  A->num_cols = num_cols;
+  A->nnz = nnz;
+  A->row_ptr = calloc((size_t)num_rows + 1, sizeof(*A->row_ptr));
+  A->col_idx = malloc((nnz ? nnz : 1) * sizeof(*A->col_idx));
+  A->values = malloc((nnz ? nnz : 1) * sizeof(*A->values));
+  return A;
+}
+
+// CSR copy of the nonzero entries of a dense matrix
+spmat* spmat_from_mat(mat* A) {
+  if (!A) {
+    fprintf(stderr, "Cannot convert a NULL matrix\n");
+    return NULL;
+  }
+  unsigned long long nnz = 0;
+  for (unsigned int i = 0; i < A->num_rows; i++) {
+    for (unsigned int j = 0; j < A->num_cols; j++) nnz += A->values[i][j] != 0.0;
+  }
+  spmat* S = spmat_alloc(A->num_rows, A->num_cols, nnz);
+  unsigned long long k = 0;
+  for (unsigned int i = 0; i < A->num_rows; i++) {
+    for (unsigned int j = 0; j < A->num_cols; j++) {
+      if (A->values[i][j] != 0.0) {
+        S->col_idx[k] = j;
+        S->values[k++] = A->values[i][j];
+      }
+    }
+    S->row_ptr[i + 1] = k;
+  }
+  return S;
+}
+
+mat* spmat_to_mat(spmat* A) {
+  if (!A) {
+    fprintf(stderr, "Cannot convert a NULL sparse matrix\n");
+    return NULL;
+  }
+  mat* D = new_mat(A->num_rows, A->num_cols);
+  for (unsigned int i = 0; i < A->num_rows; i++) {
+    for (unsigned long long k = A->row_ptr[i]; k < A->row_ptr[i + 1]; k++) D->values[i][A->col_idx[k]] += A->values[k];
+  }
+  return D;
+}
+
+typedef struct {
+  spmat* A;
+  double** x;     // rows of the dense operand
+  double** y;
+  unsigned int nrhs;
+} spmat_dot_job;
+
+static void spmat_dot_range(void* arg, unsigned int begin, unsigned int end) {
+  spmat_dot_job* job = (spmat_dot_job*)arg;
+  spmat* A = job->A;
+  for (unsigned int i = begin; i < end; i++) {
+    double* yi = job->y[i];
+    for (unsigned long long k = A->row_ptr[i]; k < A->row_ptr[i + 1]; k++) {
+      double a = A->values[k];
+      const double* xr = job->x[A->col_idx[k]];
+      for (unsigned int c = 0; c < job->nrhs; c++) yi[c] += a * xr[c];
+    }
+  }
+}
+
+// grain so that each task touches about 64K stored entries
+static unsigned int spmat_grain(spmat* A) {
+  unsigned long long per_row = A->nnz / A->num_rows + 1;
+  unsigned long long grain = 65536 / per_row;
+  return grain ? (unsigned int)grain : 1;
+}
+
+// Y = A*B for sparse A and dense B
+mat* spmat_dot(spmat* A, mat* B) {
+  if (!A || !B || A->num_cols != B->num_rows) {
+    fprintf(stderr, "Sparse product needs matching dimensions\n");
+    return NULL;
+  }
+  mat* Y = new_mat(A->num_rows, B->num_cols);
+  spmat_dot_job job = {A, B->values, Y->values, B->num_cols};
+  parallel_for(A->num_rows, spmat_grain(A), spmat_dot_range, &job);
+  return Y;
+}
+
+typedef struct {
+  spmat* A;
+  const double* x;
+  double* y;
+} spmat_apply_job;
+
+static void spmat_apply_range(void* arg, unsigned int begin, unsigned int end) {
+  spmat_apply_job* job = (spmat_apply_job*)arg;
+  spmat* A = job->A;
+  for (unsigned int i = begin; i < end; i++) {
+    double sum = 0.0;
+    for (unsigned long long k = A->row_ptr[i]; k < A->row_ptr[i + 1]; k++) sum += A->values[k] * job->x[A->col_idx[k]];
+    job->y[i] = sum;
+  }
+}
+
+static void spmat_op_apply(void* ctx, const double* x, double* y) {
+  spmat_apply_job job = {(spmat*)ctx, x, y};
+  parallel_for(job.A->num_rows, spmat_grain(job.A), spmat_apply_range, &job);
+}
+
+// Wrap a square sparse matrix as a linear operator for the iterative solvers
+mat_op spmat_op(spmat* A) {
+  mat_op op;
+  op.n = A ? A->num_rows : 0;
+  op.apply = spmat_op_apply;
+  op.ctx = A;
+  op.destroy = NULL;
+  if (!A || A->num_rows != A->num_cols) {
+    fprintf(stderr, "operator requires a square matrix\n");
+    op.n = 0;
+  }
+  return op;
+}
+
+// Line reader over large freads. Lines are returned '\0'-terminated in place
+// inside the buffer, so nothing is copied per line; the pointer is valid
+// until the next call.
+typedef struct {
+  FILE* f;
+  char* buf;
+  size_t cap;
+  size_t start;
+  size_t end;
+  int eof;
+  unsigned long long line_no;
+} mm_stream;
+
+static char* mm_next_line(mm_stream* s) {
+  for (;;) {
+    char* nl = memchr(s->buf + s->start, '\n', s->end - s->start);
+    if (nl || (s->eof && s->start < s->end)) {
+      char* line = s->buf + s->start;
+      size_t len = nl ? (size_t)(nl - line) : s->end - s->start;
+      s->start += nl ? len + 1 : len;
+      if (len > 0 && line[len - 1] == '\r') len--;
+      line[len] = '\0';
+      s->line_no++;
+      return line;
+    }
+    if (s->eof) return NULL;
+    size_t rest = s->end - s->start;
+    memmove(s->buf, s->buf + s->start, rest);
+    s->start = 0;
+    s->end = rest;
+    if (s->end == s->cap) {
+      s->cap *= 2;
+      s->buf = realloc(s->buf, s->cap + 1);
+    }
+    size_t got = fread(s->buf + s->end, 1, s->cap - s->end, s->f);
+    s->end += got;
+    if (got == 0) s->eof = 1;
+  }
+}
+
+// next line that is neither blank nor a % comment
+static char* mm_next_data_line(mm_stream* s) {
+  char* line;
+  while ((line = mm_next_line(s)) != NULL) {
+    char* p = line;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p != '\0' && *p != '%') return p;
+  }
+  return NULL;
+}
+
+static int mm_parse_uint(char** pp, unsigned long long* out) {
+  char* p = *pp;
+  while (*p == ' ' || *p == '\t') p++;
+  if (*p < '0' || *p > '9') return 0;
+  unsigned long long v = 0;
+  while (*p >= '0' && *p <= '9') {
+    if (v > 0xffffffffffffull) return 0;
+    v = v * 10 + (unsigned long long)(*p - '0');
+    p++;
+  }
+  *pp = p;
+  *out = v;
+  return 1;
+}
+
+static int mm_parse_value(char** pp, double* out) {
+  char* p = *pp;
+  while (*p == ' ' || *p == '\t') p++;
+  const char* q = p;
+  if (!text_parse_double(&q, out)) return 0;
+  *pp = (char*)q;
+  return 1;
+}
+
+#define MM_REAL 0
+#define MM_INTEGER 1
+#define MM_PATTERN 2
+#define MM_GENERAL 0
+#define MM_SYMMETRIC 1
+#define MM_SKEW 2
+
+// Reads a Matrix Market stream into a dense matrix, a CSR matrix, or both.
+// Symmetric and skew-symmetric files are expanded to the full matrix and
+// duplicate coordinate entries are summed.
+static int mm_read(FILE* f, mat** dense, spmat** sparse) {
+  if (!f) {
+    fprintf(stderr, "Cannot read Matrix Market data from a NULL stream\n");
+    return 0;
+  }
+  mm_stream s = {f, malloc(TEXT_READ_BYTES + 1), TEXT_READ_BYTES, 0, 0, 0, 0};
+  int ok = 0;
+  unsigned long long* rows = NULL;
+  unsigned int* cols = NULL;
+  double* vals = NULL;
+  mat* D = NULL;
+
+  char object[32], format[32], field[32], symmetry[32];
+  char* line = mm_next_line(&s);
+  if (!line || sscanf(line, "%%%%MatrixMarket %31s %31s %31s %31s", object, format, field, symmetry) != 4 ||
+      strcasecmp(object, "matrix") != 0) {
+    fprintf(stderr, "Missing %%%%MatrixMarket matrix header\n");
+    goto done;
+  }
+  int coordinate = strcasecmp(format, "coordinate") == 0;
+  if (!coordinate && strcasecmp(format, "array") != 0) {
+    fprintf(stderr, "Unsupported Matrix Market format %s\n", format);
+    goto done;
+  }
+  int kind;
+  if (strcasecmp(field, "real") == 0 || strcasecmp(field, "double") == 0) kind = MM_REAL;
+  else if (strcasecmp(field, "integer") == 0) kind = MM_INTEGER;
+  else if (strcasecmp(field, "pattern") == 0 && coordinate) kind = MM_PATTERN;
+  else {
+    fprintf(stderr, "Unsupported Matrix Market field %s\n", field);
+    goto done;
+  }
+  int sym;
+  if (strcasecmp(symmetry, "general") == 0) sym = MM_GENERAL;
+  else if (strcasecmp(symmetry, "symmetric") == 0 || strcasecmp(symmetry, "hermitian") == 0) sym = MM_SYMMETRIC;
+  else if (strcasecmp(symmetry, "skew-symmetric") == 0) sym = MM_SKEW;
+  else {
+    fprintf(stderr, "Unsupported Matrix Market symmetry %s\n", symmetry);
+    goto done;
+  }
+
+  unsigned long long m, n, entries = 0;
+  line = mm_next_data_line(&s);
+  if (!line || !mm_parse_uint(&line, &m) || !mm_parse_uint(&line, &n) ||
+      (coordinate && !mm_parse_uint(&line, &entries)) || m == 0 || n == 0 ||
+      m > 0xffffffffull || n > 0xffffffffull || (sym != MM_GENERAL && m != n)) {
+    fprintf(stderr, "Invalid Matrix Market size line\n");
+    goto done;
+  }
+  if (!coordinate) {
+    // column-major values; symmetric files hold the lower triangle only
+    entries = sym == MM_GENERAL ? m * n : sym == MM_SYMMETRIC ? n * (n + 1) / 2 : n * (n - 1) / 2;
+  }
+  if (dense || !coordinate) D = new_mat((unsigned int)m, (unsigned int)n);
+  unsigned long long stored = 0;
+  if (sparse && coordinate) {
+    unsigned long long cap = sym == MM_GENERAL ? entries : 2 * entries;
+    rows = malloc((cap ? cap : 1) * sizeof(*rows));
+    cols = malloc((cap ? cap : 1) * sizeof(*cols));
+    vals = malloc((cap ? cap : 1) * sizeof(*vals));
+  }
+
+  unsigned long long ai = 0, aj = 0;
+  for (unsigned long long e = 0; e < entries; e++) {
+    line = mm_next_data_line(&s);
+    unsigned long long i, j;
+    double v = 1.0;
+    if (!line) {
+      fprintf(stderr, "Matrix Market data ends after %llu of %llu entries\n", e, entries);
+      goto done;
+    }
+    if (coordinate) {
+      if (!mm_parse_uint(&line, &i) || !mm_parse_uint(&line, &j) || i == 0 || j == 0 || i > m || j > n ||
+          (kind != MM_PATTERN && !mm_parse_value(&line, &v))) {
+        fprintf(stderr, "Invalid Matrix Market entry on line %llu\n", s.line_no);
+        goto done;
+      }
+      i--;
+      j--;
+    } else {
+      if (sym == MM_SKEW && ai == aj) ai++;
+      i = ai;
+      j = aj;
+      if (!mm_parse_value(&line, &v)) {
+        fprintf(stderr, "Invalid Matrix Market entry on line %llu\n", s.line_no);
+        goto done;
+      }
+      if (++ai == m) {
+        aj++;
+        ai = sym == MM_GENERAL ? 0 : aj;
+      }
+    }
+    if (sym != MM_GENERAL && j > i) {
+      fprintf(stderr, "Symmetric Matrix Market entry above the diagonal on line %llu\n", s.line_no);
+      goto done;
+    }
+    double mirror = sym == MM_SKEW ? -v : v;
+    if (D) {
+      D->values[i][j] += v;
+      if (sym != MM_GENERAL && i != j) D->values[j][i] += mirror;
+    }
+    if (rows) {
+      rows[stored] = i;
+      cols[stored] = (unsigned int)j;
+      vals[stored++] = v;
+      if (sym != MM_GENERAL && i != j) {
+        rows[stored] = j;
+        cols[stored] = (unsigned int)i;
+        vals[stored++] = mirror;
+      }
+    }
+  }
+
+  if (sparse) {
+    if (!rows) {
+      *sparse = spmat_from_mat(D);
+    } else {
+      // stable counting sort by column, then by row, so each row comes out
+      // in column order with duplicates in file order: O(entries + m + n)
+      // however the entries are distributed
+      unsigned long long* by_col = malloc((stored ? stored : 1) * sizeof(*by_col));
+      unsigned long long* next = calloc((size_t)(n > m ? n : m) + 1, sizeof(*next));
+      for (unsigned long long k = 0; k < stored; k++) next[cols[k] + 1]++;
+      for (unsigned long long c = 0; c < n; c++) next[c + 1] += next[c];
+      for (unsigned long long k = 0; k < stored; k++) by_col[next[cols[k]]++] = k;
+      spmat* A = spmat_alloc((unsigned int)m, (unsigned int)n, stored);
+      for (unsigned long long k = 0; k < stored; k++) A->row_ptr[rows[k] + 1]++;
+      for (unsigned long long r = 0; r < m; r++) A->row_ptr[r + 1] += A->row_ptr[r];
+      memcpy(next, A->row_ptr, (size_t)m * sizeof(*next));
+      for (unsigned long long t = 0; t < stored; t++) {
+        unsigned long long k = by_col[t];
+        unsigned long long dst = next[rows[k]]++;
+        A->col_idx[dst] = cols[k];
+        A->values[dst] = vals[k];
+      }
+      free(next);
+      free(by_col);
+      // sum duplicates, compacting the rows
+      unsigned long long out = 0;
+      for (unsigned long long r = 0; r < m; r++) {
+        unsigned long long b = A->row_ptr[r];
+        unsigned long long e = A->row_ptr[r + 1];
+        A->row_ptr[r] = out;
+        for (unsigned long long k = b; k < e; k++) {
+          if (out > A->row_ptr[r] && A->col_idx[out - 1] == A->col_idx[k]) {
+            A->values[out - 1] += A->values[k];
+          } else {
+            A->col_idx[out] = A->col_idx[k];
+            A->values[out++] = A->values[k];
+          }
+        }
+      }
+      A->row_ptr[m] = out;
+      A->nnz = out;
+      *sparse = A;
+    }
+  }
+  if (dense) {
+    *dense = D;
+    D = NULL;
+  }
+  ok = 1;
+
+done:
+  if (D) free_mat(D);
+  free(rows);
+  free(cols);
+  free(vals);
+  free(s.buf);
+  return ok;
+}
+
+mat* mat_read_mm(FILE* f) {
+  mat* D = NULL;
+  return mm_read(f, &D, NULL) ? D : NULL;
+}
+
+spmat* spmat_read_mm(FILE* f) {
+  spmat* A = NULL;
+  return mm_read(f, NULL, &A) ? A : NULL;
+}
+
+// dense matrices are written in array format (column-major)
+int mat_write_mm(mat* A, FILE* f) {
+  if (!A || !f) {
+    fprintf(stderr, "Writing Matrix Market data needs a matrix and a stream\n");
+    return 0;
+  }
+  fprintf(f, "%%%%MatrixMarket matrix array real general\n%u %u\n", A->num_rows, A->num_cols);
+  char num[32];
+  for (unsigned int j = 0; j < A->num_cols; j++) {
+    for (unsigned int i = 0; i < A->num_rows; i++) {
+      int len = mat_format_double(A->values[i][j], num);
+      num[len] = '\n';
+      fwrite(num, 1, (size_t)len + 1, f);
+    }
+  }
+  if (ferror(f)) {
+    fprintf(stderr, "Error writing Matrix Market data\n");
+    return 0;
+  }
+  return 1;
+}
+
+// sparse matrices are written in coordinate format, row by row
+int spmat_write_mm(spmat* A, FILE* f) {
+  if (!A || !f) {
+    fprintf(stderr, "Writing Matrix Market data needs a matrix and a stream\n");
+    return 0;
+  }
+  fprintf(f, "%%%%MatrixMarket matrix coordinate real general\n%u %u %llu\n", A->num_rows, A->num_cols, A->nnz);
+  for (unsigned int i = 0; i < A->num_rows; i++) {
+    for (unsigned long long k = A->row_ptr[i]; k < A->row_ptr[i + 1]; k++) {
+      char num[32];
+      mat_format_double(A->values[k], num);
+      fprintf(f, "%u %u %s\n", i + 1, A->col_idx[k] + 1, num);
+    }
+  }
+  if (ferror(f)) {
+    fprintf(stderr, "Error writing Matrix Market data\n");
+    return 0;
+  }
+  return 1;
+}
+
+
+// ---------------------------------------------------------------------------
+// NumPy .npy files
+// ---------------------------------------------------------------------------
+
+// "\x93NUMPY", a version, a little-endian header length (2 bytes in version
+// 1, 4 in versions 2 and 3) and a Python dict literal with descr,
+// fortran_order and shape, padded so the data starts on a 64 byte boundary.
+// One dimensional arrays are read as column vectors.
+typedef struct {
+  size_t data_offset;
+  unsigned int rows;
+  unsigned int cols;
+  int fortran;
+  int elem_size;      // 4 or 8
+  int swap;           // stored with the other byte order
+} npy_info;
+
+static int npy_host_little(void) {
+  const uint16_t one = 1;
+  return *(const unsigned char*)&one == 1;
+}
+
+// the value text that follows 'key': in the header dict
+static const char* npy_dict_value(const char* dict, const char* key) {
+  char quoted[32];
+  snprintf(quoted, sizeof(quoted), "'%s'", key);
+  const char* p = strstr(dict, quoted);
+  if (!p) return NULL;
+  p += strlen(quoted);
+  while (*p == ' ') p++;
+  if (*p != ':') return NULL;
+  p++;
+  while (*p == ' ') p++;
+  return p;
+}
+
+static int npy_parse_header(FILE* f, npy_info* info, const char* path) {
+  unsigned char pre[12];
+  if (fread(pre, 1, 10, f) != 10 || memcmp(pre, "\x93NUMPY", 6) != 0) {
+    fprintf(stderr, "%s is not a .npy file\n", path);
+    return 0;
+  }
+  unsigned long hlen;
+  size_t prefix;
+  if (pre[6] == 1) {
+    hlen = pre[8] | (unsigned long)pre[9] << 8;
+    prefix = 10;
+  } else if (pre[6] == 2 || pre[6] == 3) {
+    if (fread(pre + 10, 1, 2, f) != 2) {
+      fprintf(stderr, "%s is truncated\n", path);
+      return 0;
+    }
+    hlen = pre[8] | (unsigned long)pre[9] << 8 | (unsigned long)pre[10] << 16 | (unsigned long)pre[11] << 24;
+    prefix = 12;
+  } else {
+    fprintf(stderr, "%s uses unsupported .npy version %d\n", path, pre[6]);
+    return 0;
+  }
+  if (hlen > (1ul << 20)) {
+    fprintf(stderr, "%s has an oversized header\n", path);
+    return 0;
+  }
+  char* dict = malloc(hlen + 1);
+  int ok = fread(dict, 1, hlen, f) == hlen;
+  dict[ok ? hlen : 0] = '\0';
+
+  const char* descr = npy_dict_value(dict, "descr");
+  const char* order = npy_dict_value(dict, "fortran_order");
+  const char* shape = npy_dict_value(dict, "shape");
+  char type[8] = {0};
+  if (!ok || !descr || !order || !shape || sscanf(descr, "'%7[^']'", type) != 1) {
+    fprintf(stderr, "%s has an invalid .npy header\n", path);
+    free(dict);
+    return 0;
+  }
+  char byte_order = type[0];
+  int little = npy_host_little();
+  if (strcmp(type + 1, "f8") == 0) info->elem_size = 8;
+  else if (strcmp(type + 1, "f4") == 0) info->elem_size = 4;
+  else info->elem_size = 0;
+  if (!info->elem_size || (byte_order != '<' && byte_order != '>' && byte_order != '=')) {
+    fprintf(stderr, "%s has unsupported dtype %s, only float32 and float64 are read\n", path, type);
+    free(dict);
+    return 0;
+  }
+  info->swap = (byte_order == '<' && !little) || (byte_order == '>' && little);
+  info->fortran = strncmp(order, "True", 4) == 0;
+
+  // shape is (rows,) or (rows, cols)
+  unsigned long long dims[2] = {0, 1};
+  int ndim = 0;
+  const char* p = shape;
+  if (*p == '(') p++;
+  while (ndim < 3) {
+    while (*p == ' ') p++;
+    if (*p == ')') break;
+    char* end;
+    unsigned long long d = strtoull(p, &end, 10);
+    if (end == p) break;
+    if (ndim < 2) dims[ndim] = d;
+    ndim++;
+    p = end;
+    while (*p == ' ') p++;
+    if (*p == ',') p++;
+  }
+  free(dict);
+  if (ndim < 1 || ndim > 2 || dims[0] == 0 || dims[1] == 0 || dims[0] > 0xffffffffull || dims[1] > 0xffffffffull) {
+    fprintf(stderr, "%s must hold a non-empty one or two dimensional array\n", path);
+    return 0;
+  }
+  info->rows = (unsigned int)dims[0];
+  info->cols = (unsigned int)dims[1];
+  info->data_offset = prefix + hlen;
+  return 1;
+}
+
+static double npy_decode(const unsigned char* src, int elem_size, int swap) {
+  unsigned char b[8];
+  for (int i = 0; i < elem_size; i++) b[i] = src[swap ? elem_size - 1 - i : i];
+  if (elem_size == 8) {
+    double d;
+    memcpy(&d, b, 8);
+    return d;
+  }
+  float v;
+  memcpy(&v, b, 4);
+  return v;
+}
+
+// checks that the file holds the whole payload the header promises, so a
+// corrupt shape is reported before anything is allocated for it
+static int npy_size_valid(FILE* f, const npy_info* info, const char* path) {
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0 || (unsigned long long)st.st_size < info->data_offset ||
+      ((unsigned long long)st.st_size - info->data_offset) / (unsigned long long)info->elem_size / info->cols <
+          info->rows) {
+    fprintf(stderr, "%s is truncated\n", path);
+    return 0;
+  }
+  return 1;
+}
+
+// reads (and converts, if needed) the payload into a regular matrix
+static mat* npy_read_payload(FILE* f, const npy_info* info, const char* path) {
+  mat* matrix = new_mat(info->rows, info->cols);
+  // stored lines are rows in C order and columns in Fortran order
+  unsigned int lines = info->fortran ? info->cols : info->rows;
+  unsigned int len = info->fortran ? info->rows : info->cols;
+  int direct = info->elem_size == 8 && !info->swap && !info->fortran;
+  unsigned char* buf = direct ? NULL : malloc((size_t)len * info->elem_size);
+  for (unsigned int l = 0; l < lines; l++) {
+    void* dst = direct ? (void*)matrix->values[l] : (void*)buf;
+    if (fread(dst, info->elem_size, len, f) != len) {
+      fprintf(stderr, "%s is truncated\n", path);
+      free(buf);
+      free_mat(matrix);
+      return NULL;
+    }
+    if (direct) continue;
+    for (unsigned int k = 0; k < len; k++) {
+      double v = npy_decode(buf + (size_t)k * info->elem_size, info->elem_size, info->swap);
+      if (info->fortran) matrix->values[k][l] = v;
+      else matrix->values[l][k] = v;
+    }
+  }
+  free(buf);
+  return matrix;
+}
+
+// writes a C-order float64 array in version 1.0 format
+int mat_save_npy(mat* matrix, const char* path) {
+  if (!matrix || !path) {
+    fprintf(stderr, "Saving a .npy file needs a matrix and a path\n");
+    return 0;
+  }
+  FILE* f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "Cannot open %s for writing\n", path);
+    return 0;
+  }
+  char dict[128];
+  int dlen = snprintf(dict, sizeof(dict), "{'descr': '%cf8', 'fortran_order': False, 'shape': (%u, %u), }",
+                      npy_host_little() ? '<' : '>', matrix->num_rows, matrix->num_cols);
+  size_t total = (10 + (size_t)dlen + 1 + 63) / 64 * 64;
+  size_t hlen = total - 10;
+  unsigned char pre[10] = {0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0, (unsigned char)(hlen & 0xff), (unsigned char)(hlen >> 8)};
+  char header[192];
+  memset(header, ' ', sizeof(header));
+  memcpy(header, dict, (size_t)dlen);
+  header[hlen - 1] = '\n';
+  int ok = fwrite(pre, 1, 10, f) == 10 && fwrite(header, 1, hlen, f) == hlen;
+  for (unsigned int i = 0; ok && i < matrix->num_rows; i++) {
+    ok = fwrite(matrix->values[i], sizeof(double), matrix->num_cols, f) == matrix->num_cols;
+  }
+  if (fclose(f) != 0) ok = 0;
+  if (!ok) fprintf(stderr, "Error writing %s\n", path);
+  return ok;
+}
+
+mat* mat_load_npy(const char* path) {
+  if (!path) {
+    fprintf(stderr, "Loading a .npy file needs a path\n");
+    return NULL;
+  }
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return NULL;
+  }
+  npy_info info;
+  mat* matrix = npy_parse_header(f, &info, path) && npy_size_valid(f, &info, path) ?
+                npy_read_payload(f, &info, path) : NULL;
+  fclose(f);
+  return matrix;
+}
+
+// Maps native-order float64 C-order payloads in place, read-only, like
+// mat_map_binary. Any other dtype or order is converted by a normal load
+// instead, so callers can tell the two apart by map_base.
+mat* mat_map_npy(const char* path) {
+  if (!path) {
+    fprintf(stderr, "Mapping a .npy file needs a path\n");
+    return NULL;
+  }
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return NULL;
+  }
+  npy_info info;
+  if (!npy_parse_header(f, &info, path)) {
+    fclose(f);
+    return NULL;
+  }
+  struct stat st;
+  if (!npy_size_valid(f, &info, path) || fstat(fileno(f), &st) != 0) {
+    fclose(f);
+    return NULL;
+  }
+  if (info.elem_size != 8 || info.swap || info.fortran || info.data_offset % sizeof(double) != 0) {
+    mat* matrix = npy_read_payload(f, &info, path);
+    fclose(f);
+    return matrix;
+  }
+  size_t len = (size_t)st.st_size;
+  void* base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  fclose(f);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Cannot map %s\n", path);
+    return NULL;
+  }
+  return mat_from_mapping(base, len, (const double*)((const char*)base + info.data_offset), info.rows, info.cols);
+}
+
+
+// ---------------------------------------------------------------------------
+// Fast text output
+// ---------------------------------------------------------------------------
+
+// Shortest round-trip formatting with Grisu2 (Loitsch 2010, in the layout of
+// Milo Yip's dtoa): the double and its rounding boundaries are scaled by a
+// cached power of ten into a 64-bit window and the digits are generated with
+// integer arithmetic only. Grisu2 always round-trips and is shortest for
+// nearly all inputs. The 87 cached powers 10^(-348 + 8i) are computed once
+// with exact big integer arithmetic.
+typedef struct {
+  uint64_t f;
+  int e;
+} diy_fp;
+
+#define GRISU_POWERS 87
+#define BIG_WORDS 40
+
+static diy_fp grisu_cached[GRISU_POWERS];
+static pthread_once_t grisu_once = PTHREAD_ONCE_INIT;
+
+typedef struct {
+  uint32_t w[BIG_WORDS];
+} big_uint;
+
+static unsigned int big_bitlen(const big_uint* a) {
+  for (int i = BIG_WORDS - 1; i >= 0; i--) {
+    if (a->w[i]) {
+      unsigned int bits = 32;
+      while (!(a->w[i] & (1u << (bits - 1)))) bits--;
+      return (unsigned int)i * 32 + bits;
+    }
+  }
+  return 0;
+}
+
+static int big_bit(const big_uint* a, unsigned int bit) {
+  return (a->w[bit / 32] >> (bit % 32)) & 1u;
+}
+
+static void big_mul10(big_uint* a) {
+  uint64_t carry = 0;
+  for (int i = 0; i < BIG_WORDS; i++) {
+    uint64_t t = (uint64_t)a->w[i] * 10 + carry;
+    a->w[i] = (uint32_t)t;
+    carry = t >> 32;
+  }
+}
+
+static int big_cmp(const big_uint* a, const big_uint* b) {
+  for (int i = BIG_WORDS - 1; i >= 0; i--) {
+    if (a->w[i] != b->w[i]) return a->w[i] < b->w[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+static void big_sub(big_uint* a, const big_uint* b) {
+  int64_t borrow = 0;
+  for (int i = 0; i < BIG_WORDS; i++) {
+    int64_t t = (int64_t)a->w[i] - b->w[i] - borrow;
+    borrow = t < 0;
+    a->w[i] = (uint32_t)(t + (borrow ? ((int64_t)1 << 32) : 0));
+  }
+}
+
+static void big_shl1(big_uint* a) {
+  for (int i = BIG_WORDS - 1; i > 0; i--) a->w[i] = a->w[i] << 1 | a->w[i - 1] >> 31;
+  a->w[0] <<= 1;
+}
+
+// 10^k rounded to a normalized 64-bit significand
+static diy_fp grisu_pow10(int k) {
+  big_uint d;
+  memset(&d, 0, sizeof(d));
+  d.w[0] = 1;
+  for (int i = 0; i < (k < 0 ? -k : k); i++) big_mul10(&d);
+  unsigned int len = big_bitlen(&d);
+  diy_fp r;
+  if (k >= 0) {
+    uint64_t f = 0;
+    for (unsigned int b = 0; b < 64 && b < len; b++) f |= (uint64_t)big_bit(&d, len - 1 - b) << (63 - b);
+    r.f = f;
+    r.e = (int)len - 64;
+    if (len > 64 && big_bit(&d, len - 65)) {
+      if (++r.f == 0) {
+        r.f = 1ull << 63;
+        r.e++;
+      }
+    }
+    return r;
+  }
+  // 2^s / 10^-k with s chosen so the quotient has exactly 64 bits
+  unsigned int s = len + 63;
+  big_uint rem;
+  memset(&rem, 0, sizeof(rem));
+  uint64_t q = 0;
+  for (int bit = (int)s; bit >= 0; bit--) {
+    big_shl1(&rem);
+    if (bit == (int)s) rem.w[0] |= 1;
+    q <<= 1;
+    if (big_cmp(&rem, &d) >= 0) {
+      big_sub(&rem, &d);
+      q |= 1;
+    }
+  }
+  big_shl1(&rem);
+  r.f = q;
+  r.e = -(int)s;
+  if (big_cmp(&rem, &d) >= 0 && ++r.f == 0) {
+    r.f = 1ull << 63;
+    r.e++;
+  }
+  return r;
+}
+
+static void grisu_init(void) {
+  for (int i = 0; i < GRISU_POWERS; i++) grisu_cached[i] = grisu_pow10(-348 + 8 * i);
+}
+
+static diy_fp diy_mul(diy_fp x, diy_fp y) {
+  const uint64_t m32 = 0xffffffffull;
+  uint64_t a = x.f >> 32, b = x.f & m32, c = y.f >> 32, d = y.f & m32;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+  tmp += 1u << 31;
+  diy_fp r = {ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64};
+  return r;
+}
+
+static diy_fp diy_normalize(diy_fp x) {
+  while (!(x.f & (1ull << 63))) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+static const uint64_t grisu_pow10_int[20] = {
+  1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+  1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+  100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+  1000000000000000000ull, 10000000000000000000ull
+};
+
+static void grisu_round(char* buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+  while (rest < wp_w && delta - rest >= ten_kappa &&
+         (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+static int grisu_digits(diy_fp w, diy_fp mp, uint64_t delta, char* buf, int* k) {
+  diy_fp one = {1ull << -mp.e, mp.e};
+  uint64_t wp_w = mp.f - w.f;
+  uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+  uint64_t p2 = mp.f & (one.f - 1);
+  int kappa = 1;
+  while (kappa < 10 && p1 >= grisu_pow10_int[kappa]) kappa++;
+  int len = 0;
+  while (kappa > 0) {
+    uint32_t div = (uint32_t)grisu_pow10_int[kappa - 1];
+    uint32_t d = p1 / div;
+    p1 %= div;
+    if (d || len) buf[len++] = (char)('0' + d);
+    kappa--;
+    uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+    if (rest <= delta) {
+      *k += kappa;
+      grisu_round(buf, len, delta, rest, grisu_pow10_int[kappa] << -one.e, wp_w);
+      return len;
+    }
+  }
+  for (;;) {
+    p2 *= 10;
+    delta *= 10;
+    char d = (char)(p2 >> -one.e);
+    if (d || len) buf[len++] = (char)('0' + d);
+    p2 &= one.f - 1;
+    kappa--;
+    if (p2 < delta) {
+      *k += kappa;
+      grisu_round(buf, len, delta, p2, one.f, -kappa < 20 ? wp_w * grisu_pow10_int[-kappa] : 0);
+      return len;
+    }
+  }
+}
+
+// digits of a finite positive double, value = digits * 10^k
+static int grisu2(double value, char* buf, int* k) {
+  pthread_once(&grisu_once, grisu_init);
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  const uint64_t hidden = 1ull << 52;
+  int biased = (int)(bits >> 52 & 0x7ff);
+  diy_fp v = {bits & (hidden - 1), 0};
+  if (biased) {
+    v.f += hidden;
+    v.e = biased - 1075;
+  } else {
+    v.e = 1 - 1075;
+  }
+  // boundaries m+ and m- halfway to the neighbouring doubles
+  diy_fp pl = {(v.f << 1) + 1, v.e - 1};
+  while (!(pl.f & (hidden << 1))) {
+    pl.f <<= 1;
+    pl.e--;
+  }
+  pl.f <<= 10;
+  pl.e -= 10;
+  diy_fp mi = (v.f == hidden) ? (diy_fp){(v.f << 2) - 1, v.e - 2} : (diy_fp){(v.f << 1) - 1, v.e - 1};
+  mi.f <<= mi.e - pl.e;
+  mi.e = pl.e;
+
+  double dk = (-61 - pl.e) * 0.30102999566398114 + 347;
+  int ki = (int)dk;
+  if (dk - ki > 0.0) ki++;
+  int index = (ki >> 3) + 1;
+  *k = -(-348 + index * 8);
+  diy_fp c = grisu_cached[index];
+
+  diy_fp w = diy_mul(diy_normalize(v), c);
+  diy_fp wp = diy_mul(pl, c);
+  diy_fp wm = diy_mul(mi, c);
+  wm.f++;
+  wp.f--;
+  return grisu_digits(w, wp, wp.f - wm.f, buf, k);
+}
+
+static char* write_exponent(char* p, int e) {
+  *p++ = 'e';
+  if (e < 0) {
+    *p++ = '-';
+    e = -e;
+  }
+  if (e >= 100) {
+    *p++ = (char)('0' + e / 100);
+    e %= 100;
+    *p++ = (char)('0' + e / 10);
+  } else if (e >= 10) {
+    *p++ = (char)('0' + e / 10);
+  }
+  *p++ = (char)('0' + e % 10);
+  return p;
+}
+
+// Shortest decimal that reads back as the same double: plain notation for
+// exponents from -5 to 20, scientific otherwise. buf needs room for 25 chars
+// plus the terminator; returns the length.
+int mat_format_double(double v, char* buf) {
+  char* p = buf;
+  if (isnan(v)) {
+    memcpy(buf, "nan", 4);
+    return 3;
+  }
+  if (signbit(v)) {
+    *p++ = '-';
+    v = -v;
+  }
+  if (isinf(v)) {
+    memcpy(p, "inf", 4);
+    return (int)(p - buf) + 3;
+  }
+  if (v == 0.0) {
+    *p++ = '0';
+    *p = '\0';
+    return (int)(p - buf);
+  }
+  char digits[24];
+  int k;
+  int len = grisu2(v, digits, &k);
+  int kk = len + k;   // 10^(kk - 1) <= v < 10^kk
+  if (len <= kk && kk <= 21) {
+    memcpy(p, digits, (size_t)len);
+    memset(p + len, '0', (size_t)(kk - len));
+    p += kk;
+  } else if (kk > 0 && kk <= 21) {
+    memcpy(p, digits, (size_t)kk);
+    p[kk] = '.';
+    memcpy(p + kk + 1, digits + kk, (size_t)(len - kk));
+    p += len + 1;
+  } else if (kk > -5 && kk <= 0) {
+    *p++ = '0';
+    *p++ = '.';
+    memset(p, '0', (size_t)-kk);
+    memcpy(p - kk, digits, (size_t)len);
+    p += len - kk;
+  } else {
+    *p++ = digits[0];
+    if (len > 1) {
+      *p++ = '.';
+      memcpy(p, digits + 1, (size_t)(len - 1));
+      p += len - 1;
+    }
+    p = write_exponent(p, kk - 1);
+  }
+  *p = '\0';
+  return (int)(p - buf);
+}
+
+// Rows are formatted in batches: each batch is split into chunks of whole
+// rows that parallel_for formats into private buffers, and the buffers are
+// then written in order, so the output is identical to a serial writer and
+// memory stays bounded by one batch.
+#define TEXT_WRITE_CHUNK_BYTES (64u << 10)
+#define TEXT_WRITE_CHUNKS 64u
+
+typedef struct {
+  mat* m;
+  const char* fmt;      // printf format per element, NULL for mat_format_double
+  char delim;
+  unsigned int row0;
+  unsigned int rows_per_chunk;
+  char** buf;
+  size_t* cap;
+  size_t* len;
+} text_write_job;
+
+static void text_reserve(text_write_job* job, unsigned int c, size_t extra) {
+  if (job->len[c] + extra + 1 > job->cap[c]) {
+    while (job->len[c] + extra + 1 > job->cap[c]) job->cap[c] *= 2;
+    job->buf[c] = realloc(job->buf[c], job->cap[c]);
+  }
+}
+
+static void text_write_range(void* arg, unsigned int begin, unsigned int end) {
+  text_write_job* job = (text_write_job*)arg;
+  mat* m = job->m;
+  for (unsigned int c = begin; c < end; c++) {
+    job->len[c] = 0;
+    unsigned int r0 = job->row0 + c * job->rows_per_chunk;
+    unsigned int r1 = r0 + job->rows_per_chunk < m->num_rows ? r0 + job->rows_per_chunk : m->num_rows;
+    for (unsigned int i = r0; i < r1; i++) {
+      for (unsigned int j = 0; j < m->num_cols; j++) {
+        if (job->fmt) {
+          size_t room = job->cap[c] - job->len[c];
+          int n = snprintf(job->buf[c] + job->len[c], room, job->fmt, m->values[i][j]);
+          if (n < 0) n = 0;
+          if ((size_t)n + 2 > room) {
+            text_reserve(job, c, (size_t)n + 2);
+            snprintf(job->buf[c] + job->len[c], job->cap[c] - job->len[c], job->fmt, m->values[i][j]);
+          }
+          job->len[c] += (size_t)n;
+        } else {
+          text_reserve(job, c, 27);
+          job->len[c] += (size_t)mat_format_double(m->values[i][j], job->buf[c] + job->len[c]);
+          if (j + 1 < m->num_cols) job->buf[c][job->len[c]++] = job->delim;
+        }
+      }
+      text_reserve(job, c, 1);
+      job->buf[c][job->len[c]++] = '\n';
+    }
+  }
+}
+
+// output to a stream or, with f == NULL, to a file descriptor
+static int text_sink_write(FILE* f, int fd, const char* buf, size_t len) {
+  if (f) return fwrite(buf, 1, len, f) == len;
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return 0;
+    buf += n;
+    len -= (size_t)n;
+  }
+  return 1;
+}
+
+static int text_write_rows(mat* m, FILE* f, int fd, const char* fmt, char delim) {
+  size_t row_guess = (size_t)m->num_cols * 24 + 1;
+  unsigned int rows_per_chunk = (unsigned int)(TEXT_WRITE_CHUNK_BYTES / row_guess);
+  if (rows_per_chunk == 0) rows_per_chunk = 1;
+  text_write_job job = {m, fmt, delim, 0, rows_per_chunk, NULL, NULL, NULL};
+  job.buf = malloc(TEXT_WRITE_CHUNKS * sizeof(*job.buf));
+  job.cap = malloc(TEXT_WRITE_CHUNKS * sizeof(*job.cap));
+  job.len = malloc(TEXT_WRITE_CHUNKS * sizeof(*job.len));
+  for (unsigned int c = 0; c < TEXT_WRITE_CHUNKS; c++) {
+    job.cap[c] = (size_t)rows_per_chunk * row_guess + 64;
+    job.buf[c] = malloc(job.cap[c]);
+  }
+  int ok = 1;
+  unsigned long long batch_rows = (unsigned long long)rows_per_chunk * TEXT_WRITE_CHUNKS;
+  for (unsigned long long r = 0; r < m->num_rows && ok; r += batch_rows) {
+    job.row0 = (unsigned int)r;
+    unsigned long long left = m->num_rows - r;
+    unsigned int chunks = (unsigned int)((left + rows_per_chunk - 1) / rows_per_chunk);
+    if (chunks > TEXT_WRITE_CHUNKS) chunks = TEXT_WRITE_CHUNKS;
+    parallel_for(chunks, 1, text_write_range, &job);
+    for (unsigned int c = 0; c < chunks && ok; c++) ok = text_sink_write(f, fd, job.buf[c], job.len[c]);
+  }
+  for (unsigned int c = 0; c < TEXT_WRITE_CHUNKS; c++) free(job.buf[c]);
+  free(job.buf);
+  free(job.cap);
+  free(job.len);
+  return ok;
+}
+
+// one row per line in shortest round-trip form, readable by mat_read_text
+int mat_fwrite_text(mat* matrix, FILE* f, char delim) {
+  if (!matrix || !f || (delim != ' ' && delim != '\t' && delim != ',')) {
+    fprintf(stderr, "Writing a text matrix needs a matrix, a stream and a space, tab or comma delimiter\n");
+    return 0;
+  }
+  if (!text_write_rows(matrix, f, -1, NULL, delim) || fflush(f) != 0) {
+    fprintf(stderr, "Error writing text matrix\n");
+    return 0;
+  }
+  return 1;
+}
+
+int mat_write_text_fd(mat* matrix, int fd, char delim) {
+  if (!matrix || fd < 0 || (delim != ' ' && delim != '\t' && delim != ',')) {
+    fprintf(stderr, "Writing a text matrix needs a matrix, a descriptor and a space, tab or comma delimiter\n");
+    return 0;
+  }
+  if (!text_write_rows(matrix, NULL, fd, NULL, delim)) {
+    fprintf(stderr, "Error writing text matrix\n");
+    return 0;
+  }
+  return 1;
+}
+
+
+// ---------------------------------------------------------------------------
+// Streaming row blocks
+// ---------------------------------------------------------------------------
+
+// A background thread fills one of two block buffers while the caller works
+// on the other. The block returned by mat_reader_next stays valid until the
+// following call, which hands it back to the thread for refilling.
+#define READER_TEXT 0
+#define READER_BINARY 1
+#define READER_NPY 2
+#define READER_HEADERED 3
+
+struct mat_reader {
+  FILE* f;
+  int kind;
+  unsigned int cols;
+  unsigned int block_rows;
+  mat* block[2];
+  unsigned int rows[2];       // rows in each filled block, 0 at the end
+  int full[2];
+  int next;                   // block the caller gets next
+  int held;                   // block the caller holds, -1 for none
+  int stop;
+  int failed;
+  int running;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // source state, only touched by the reader thread
+  mm_stream lines;
+  npy_info npy;
+  unsigned long long rows_total;  // binary, .npy and headered text
+  unsigned long long rows_done;
+  const char* pos;                // headered text: rest of the current line
+  bin_checksum sum;
+  uint64_t expect_sum;
+  unsigned char* raw;
+};
+
+// next value of a headered text source, whose values may wrap lines freely;
+// returns 0 at the end of the file and -1 on a bad value
+static int reader_next_value(mat_reader* r, double* v) {
+  for (;;) {
+    if (!r->pos && !(r->pos = mm_next_line(&r->lines))) return 0;
+    while (text_is_sep(*r->pos)) r->pos++;
+    if (*r->pos != '\0') break;
+    r->pos = NULL;
+  }
+  if (!text_parse_double(&r->pos, v) || (*r->pos != '\0' && !text_is_sep(*r->pos))) {
+    fprintf(stderr, "Bad value on line %llu\n", r->lines.line_no);
+    return -1;
+  }
+  return 1;
+}
+
+// fills up to block_rows rows, returns the count or -1 on a bad source
+static long reader_fill(mat_reader* r, mat* b) {
+  unsigned int n = 0;
+  if (r->kind == READER_TEXT) {
+    char* line;
+    while (n < r->block_rows && (line = mm_next_line(&r->lines)) != NULL) {
+      const char* p = line;
+      unsigned int j = 0;
+      for (;;) {
+        while (text_is_sep(*p)) p++;
+        if (*p == '\0') break;
+        double v;
+        if (j == r->cols || !text_parse_double(&p, &v) || (*p != '\0' && !text_is_sep(*p))) {
+          fprintf(stderr, "Bad value or too many values on line %llu\n", r->lines.line_no);
+          return -1;
+        }
+        b->values[n][j++] = v;
+      }
+      if (j == 0) continue;
+      if (j != r->cols) {
+        fprintf(stderr, "Line %llu has %u values, expected %u\n", r->lines.line_no, j, r->cols);
+        return -1;
+      }
+      n++;
+    }
+    return n;
+  }
+  unsigned long long left = r->rows_total - r->rows_done;
+  n = left < r->block_rows ? (unsigned int)left : r->block_rows;
+  if (r->kind == READER_HEADERED) {
+    for (unsigned int i = 0; i < n; i++) {
+      for (unsigned int j = 0; j < r->cols; j++) {
+        int got = reader_next_value(r, &b->values[i][j]);
+        if (got <= 0) {
+          if (got == 0) fprintf(stderr, "Text matrix has fewer values than its %llu x %u header\n", r->rows_total, r->cols);
+          return -1;
+        }
+      }
+    }
+    double extra;
+    if (r->rows_done + n == r->rows_total && reader_next_value(r, &extra) != 0) {
+      fprintf(stderr, "Text matrix has more values than its %llu x %u header\n", r->rows_total, r->cols);
+      return -1;
+    }
+  } else if (r->kind == READER_BINARY) {
+    for (unsigned int i = 0; i < n; i++) {
+      if (fread(b->values[i], sizeof(double), r->cols, r->f) != r->cols) {
+        fprintf(stderr, "Binary matrix file is truncated\n");
+        return -1;
+      }
+      bin_checksum_update(&r->sum, b->values[i], r->cols);
+    }
+    if (r->rows_done + n == r->rows_total && bin_checksum_final(&r->sum) != r->expect_sum) {
+      fprintf(stderr, "Binary matrix file failed its checksum\n");
+      return -1;
+    }
+  } else if (!r->npy.fortran) {
+    int esz = r->npy.elem_size;
+    for (unsigned int i = 0; i < n; i++) {
+      if (fread(r->raw, (size_t)esz, r->cols, r->f) != r->cols) {
+        fprintf(stderr, ".npy file is truncated\n");
+        return -1;
+      }
+      for (unsigned int j = 0; j < r->cols; j++) b->values[i][j] = npy_decode(r->raw + (size_t)j * esz, esz, r->npy.swap);
+    }
+  } else {
+    // Fortran order: one read per column of the block
+    int esz = r->npy.elem_size;
+    for (unsigned int j = 0; j < r->cols && n > 0; j++) {
+      off_t off = (off_t)(r->npy.data_offset + ((unsigned long long)j * r->rows_total + r->rows_done) * esz);
+      if (fseeko(r->f, off, SEEK_SET) != 0 || fread(r->raw, (size_t)esz, n, r->f) != n) {
+        fprintf(stderr, ".npy file is truncated\n");
+        return -1;
+      }
+      for (unsigned int i = 0; i < n; i++) b->values[i][j] = npy_decode(r->raw + (size_t)i * esz, esz, r->npy.swap);
+    }
+  }
+  r->rows_done += n;
+  return n;
+}
+
+static void* reader_run(void* arg) {
+  mat_reader* r = (mat_reader*)arg;
+  int slot = 0;
+  for (;;) {
+    pthread_mutex_lock(&r->lock);
+    while (r->full[slot] && !r->stop) pthread_cond_wait(&r->cond, &r->lock);
+    int stop = r->stop;
+    pthread_mutex_unlock(&r->lock);
+    if (stop) break;
+    long n = reader_fill(r, r->block[slot]);
+    pthread_mutex_lock(&r->lock);
+    if (n < 0) r->failed = 1;
+    r->rows[slot] = n > 0 ? (unsigned int)n : 0;
+    r->full[slot] = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    if (n <= 0) break;
+    slot ^= 1;
+  }
+  return NULL;
+}
+
+// number of values on a text line
+static unsigned int text_line_width(const char* p) {
+  unsigned int width = 0;
+  while (*p) {
+    if (text_is_sep(*p)) {
+      p++;
+    } else {
+      width++;
+      while (*p && !text_is_sep(*p)) p++;
+    }
+  }
+  return width;
+}
+
+// next line holding any value, NULL at the end of the file
+static char* text_next_nonblank(mm_stream* s) {
+  char* line;
+  while ((line = mm_next_line(s)) != NULL && text_line_width(line) == 0) continue;
+  return line;
+}
+
+// 1 if the line is exactly two positive integers, the "rows cols" header
+// read_from_filef expects
+static int text_line_header(const char* p, unsigned long long dims[2]) {
+  for (int d = 0; d < 2; d++) {
+    while (text_is_sep(*p)) p++;
+    dims[d] = 0;
+    if (*p < '0' || *p > '9') return 0;
+    while (*p >= '0' && *p <= '9' && dims[d] <= UINT32_MAX) dims[d] = dims[d] * 10 + (unsigned long long)(*p++ - '0');
+    if (dims[d] == 0 || dims[d] > UINT32_MAX || (*p != '\0' && !text_is_sep(*p))) return 0;
+  }
+  while (text_is_sep(*p)) p++;
+  return *p == '\0';
+}
+
+// Opens a text, binary (mat_save_binary) or .npy file; the format is
+// detected from its first bytes. Text is either one row per line, or, as for
+// read_from_filef, a "rows cols" line followed by that many values in any
+// layout; a first line of two positive integers with more values after it is
+// taken as that header. block_rows == 0 picks blocks of about 4 MB.
+mat_reader* mat_reader_open(const char* path, unsigned int block_rows) {
+  if (!path) {
+    fprintf(stderr, "Opening a matrix reader needs a path\n");
+    return NULL;
+  }
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return NULL;
+  }
+  mat_reader* r = calloc(1, sizeof(*r));
+  r->f = f;
+  r->held = -1;
+  char magic[8] = {0};
+  size_t got = fread(magic, 1, sizeof(magic), f);
+  rewind(f);
+  int ok = 1;
+  if (got == 8 && memcmp(magic, MAT_BIN_MAGIC, 8) == 0) {
+    mat_bin_header h;
+    struct stat st;
+    r->kind = READER_BINARY;
+    ok = fstat(fileno(f), &st) == 0 && fread(&h, sizeof(h), 1, f) == 1 &&
+         bin_header_valid(&h, (unsigned long long)st.st_size, path) && fseeko(f, (off_t)h.data_offset, SEEK_SET) == 0;
+    if (ok) {
+      r->cols = (unsigned int)h.cols;
+      r->rows_total = h.rows;
+      r->expect_sum = h.checksum;
+      bin_checksum_init(&r->sum);
+    }
+  } else if (got >= 6 && memcmp(magic, "\x93NUMPY", 6) == 0) {
+    r->kind = READER_NPY;
+    ok = npy_parse_header(f, &r->npy, path) && npy_size_valid(f, &r->npy, path);
+    if (ok) {
+      r->cols = r->npy.cols;
+      r->rows_total = r->npy.rows;
+    }
+  } else {
+    // the first non-empty line fixes the width, unless it is a header
+    r->kind = READER_TEXT;
+    r->lines.f = f;
+    r->lines.cap = TEXT_READ_BYTES;
+    r->lines.buf = malloc(TEXT_READ_BYTES + 1);
+    unsigned long long dims[2];
+    int header = 0;
+    char* line = text_next_nonblank(&r->lines);
+    if (line) r->cols = text_line_width(line);
+    if (line && r->cols == 2 && text_line_header(line, dims)) header = text_next_nonblank(&r->lines) != NULL;
+    // start again from the top
+    rewind(f);
+    r->lines.start = r->lines.end = 0;
+    r->lines.eof = 0;
+    r->lines.line_no = 0;
+    if (header) {
+      // skip past the header line
+      r->kind = READER_HEADERED;
+      r->rows_total = dims[0];
+      r->cols = (unsigned int)dims[1];
+      text_next_nonblank(&r->lines);
+    }
+    if (r->cols == 0) {
+      fprintf(stderr, "%s holds no values\n", path);
+      ok = 0;
+    }
+  }
+  if (!ok) {
+    free(r->lines.buf);
+    free(r->raw);
+    fclose(f);
+    free(r);
+    return NULL;
+  }
+  if (block_rows == 0) {
+    block_rows = (unsigned int)((4u << 20) / ((size_t)r->cols * sizeof(double)));
+    if (block_rows == 0) block_rows = 1;
+  }
+  if (r->kind == READER_NPY) {
+    // staging for one stored line: a row, or a column piece in Fortran order
+    r->raw = malloc((size_t)(r->npy.fortran ? block_rows : r->cols) * r->npy.elem_size);
+  }
+  r->block_rows = block_rows;
+  r->block[0] = new_mat(block_rows, r->cols);
+  r->block[1] = new_mat(block_rows, r->cols);
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  r->running = pthread_create(&r->thread, NULL, reader_run, r) == 0;
+  if (!r->running) {
+    fprintf(stderr, "Cannot start matrix reader thread\n");
+    mat_reader_close(r);
+    return NULL;
+  }
+  return r;
+}
+
+unsigned int mat_reader_cols(mat_reader* r) {
+  return r ? r->cols : 0;
+}
+
+// Next block of rows (the last one may be shorter), or NULL at the end of
+// the source or after an error; mat_reader_close tells the two apart.
+mat* mat_reader_next(mat_reader* r) {
+  if (!r) return NULL;
+  pthread_mutex_lock(&r->lock);
+  if (r->held >= 0) {
+    r->full[r->held] = 0;
+    r->held = -1;
+    pthread_cond_broadcast(&r->cond);
+  }
+  int slot = r->next;
+  while (!r->full[slot]) pthread_cond_wait(&r->cond, &r->lock);
+  unsigned int n = r->rows[slot];
+  if (n == 0) {
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+  }
+  r->held = slot;
+  r->next = slot ^ 1;
+  pthread_mutex_unlock(&r->lock);
+  mat* b = r->block[slot];
+  b->num_rows = n;
+  b->is_square = n == b->num_cols;
+  return b;
+}
+
+// stops the reader; returns 1 if no error was seen in the rows delivered
+int mat_reader_close(mat_reader* r) {
+  if (!r) return 0;
+  if (r->running) {
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+  }
+  int ok = !r->failed;
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->cond);
+  for (int k = 0; k < 2; k++) {
+    // blocks were handed out with their filled row count
+    r->block[k]->num_rows = r->block_rows;
+    free_mat(r->block[k]);
+  }
+  free(r->lines.buf);
+  free(r->raw);
+  fclose(r->f);
+  free(r);
+  return ok;
+}
+
+
+// ---------------------------------------------------------------------------
+// Compressed binary format
+// ---------------------------------------------------------------------------
+
+// The rows are cut into blocks that are compressed independently, so blocks
+// can be decoded in parallel and a row range only touches its own blocks.
+// Within a block every row is XORed with the row above (smooth columns then
+// leave mostly zero high bytes), the 8 byte planes of the words are split
+// apart (byte shuffle) and the result goes through a small LZ77 coder with an
+// LZ4-style sequence layout. Blocks that do not shrink are stored raw. An
+// index after the blocks gives each block's offset, size and checksum.
+#define MAT_CMP_MAGIC "JABRMTZ"
+#define MAT_CMP_VERSION 1u
+#define MAT_CMP_BLOCK_BYTES (256u << 10)
+#define MAT_CMP_BATCH 32u
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+// most bytes one stored byte can decode to (a 255 length byte); bounds the
+// matrix a file of a given size can describe
+#define LZ_MAX_EXPANSION 255u
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_rows;
+  uint64_t rows;
+  uint64_t cols;
+  uint64_t num_blocks;
+  uint64_t index_offset;
+  uint64_t byte_order;
+  uint64_t reserved;
+} mat_cmp_header;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t size;
+  uint64_t checksum;    // of the block's values
+  uint32_t raw;         // stored without LZ
+  uint32_t reserved;
+} mat_cmp_entry;
+
+static uint32_t lz_load32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static unsigned char* lz_put_length(unsigned char* op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+static unsigned char* lz_put_sequence(unsigned char* op, const unsigned char* lit, size_t lit_len,
+                                      size_t offset, size_t match_len) {
+  size_t m = match_len ? match_len - LZ_MIN_MATCH : 0;
+  *op++ = (unsigned char)((lit_len < 15 ? lit_len : 15) << 4 | (m < 15 ? m : 15));
+  if (lit_len >= 15) op = lz_put_length(op, lit_len - 15);
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+  if (match_len) {
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+    if (m >= 15) op = lz_put_length(op, m - 15);
+  }
+  return op;
+}
+
+// greedy single-probe hash matcher over a 64 KB window; dst needs
+// n + n / 255 + 16 bytes. Returns the compressed size.
+static size_t lz_compress(const unsigned char* src, size_t n, unsigned char* dst) {
+  uint32_t* table = malloc(((size_t)1 << LZ_HASH_BITS) * sizeof(*table));
+  memset(table, 0xff, ((size_t)1 << LZ_HASH_BITS) * sizeof(*table));
+  unsigned char* op = dst;
+  size_t ip = 0;
+  size_t anchor = 0;
+  while (ip + LZ_MIN_MATCH <= n) {
+    uint32_t v = lz_load32(src + ip);
+    uint32_t h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+    uint32_t cand = table[h];
+    table[h] = (uint32_t)ip;
+    if (cand != UINT32_MAX && ip - cand <= 0xffff && lz_load32(src + cand) == v) {
+      size_t len = LZ_MIN_MATCH;
+      while (ip + len < n && src[cand + len] == src[ip + len]) len++;
+      op = lz_put_sequence(op, src + anchor, ip - anchor, ip - cand, len);
+      ip += len;
+      anchor = ip;
+    } else {
+      // skip faster through data that keeps failing to match
+      ip += 1 + ((ip - anchor) >> 6);
+    }
+  }
+  op = lz_put_sequence(op, src + anchor, n - anchor, 0, 0);
+  free(table);
+  return (size_t)(op - dst);
+}
+
+static int lz_get_length(const unsigned char* src, size_t n, size_t* ip, size_t* len) {
+  unsigned char b;
+  do {
+    if (*ip >= n) return 0;
+    b = src[(*ip)++];
+    *len += b;
+  } while (b == 255);
+  return 1;
+}
+
+// returns 1 if src decodes to exactly out_len bytes; every read and copy is bounds checked
+static int lz_decompress(const unsigned char* src, size_t n, unsigned char* dst, size_t out_len) {
+  size_t ip = 0;
+  size_t op = 0;
+  while (ip < n) {
+    unsigned char token = src[ip++];
+    size_t lit = token >> 4;
+    if (lit == 15 && !lz_get_length(src, n, &ip, &lit)) return 0;
+    if (lit > n - ip || lit > out_len - op) return 0;
+    memcpy(dst + op, src + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == n) break;
+    if (n - ip < 2) return 0;
+    size_t offset = src[ip] | (size_t)src[ip + 1] << 8;
+    ip += 2;
+    size_t len = token & 15;
+    if (len == 15 && !lz_get_length(src, n, &ip, &len)) return 0;
+    len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > op || len > out_len - op) return 0;
+    for (size_t k = 0; k < len; k++, op++) dst[op] = dst[op - offset];
+  }
+  return op == out_len;
+}
+
+typedef struct {
+  mat* m;
+  unsigned int block_rows;
+  unsigned int block0;        // first block of the batch
+  unsigned char** out;        // compressed (or raw) bytes per batch slot
+  mat_cmp_entry* entries;     // index entries of the whole matrix
+} cmp_save_job;
+
+static void cmp_save_range(void* arg, unsigned int begin, unsigned int end) {
+  cmp_save_job* job = (cmp_save_job*)arg;
+  mat* m = job->m;
+  unsigned int cols = m->num_cols;
+  for (unsigned int s = begin; s < end; s++) {
+    unsigned int b = job->block0 + s;
+    unsigned int r0 = b * job->block_rows;
+    unsigned int nr = m->num_rows - r0 < job->block_rows ? m->num_rows - r0 : job->block_rows;
+    size_t words = (size_t)nr * cols;
+    size_t bytes = words * sizeof(double);
+    uint64_t* w = malloc(bytes);
+    bin_checksum c;
+    bin_checksum_init(&c);
+    for (unsigned int i = 0; i < nr; i++) {
+      memcpy(w + (size_t)i * cols, m->values[r0 + i], cols * sizeof(double));
+      bin_checksum_update(&c, m->values[r0 + i], cols);
+    }
+    for (size_t t = words; t-- > cols;) w[t] ^= w[t - cols];
+    unsigned char* shuffled = malloc(bytes);
+    for (size_t t = 0; t < words; t++) {
+      for (int k = 0; k < 8; k++) shuffled[(size_t)k * words + t] = (unsigned char)(w[t] >> (8 * k));
+    }
+    free(w);
+    unsigned char* out = malloc(bytes + bytes / 255 + 16);
+    size_t size = lz_compress(shuffled, bytes, out);
+    mat_cmp_entry* e = &job->entries[b];
+    e->checksum = bin_checksum_final(&c);
+    e->raw = size >= bytes;
+    if (e->raw) {
+      memcpy(out, shuffled, bytes);
+      size = bytes;
+    }
+    e->size = size;
+    free(shuffled);
+    job->out[s] = out;
+  }
+}
+
+// block_rows == 0 picks blocks of about 256 KB of values
+int mat_save_compressed(mat* matrix, const char* path, unsigned int block_rows) {
+  if (!matrix || !path) {
+    fprintf(stderr, "Saving a compressed matrix needs a matrix and a path\n");
+    return 0;
+  }
+  if (block_rows == 0) {
+    block_rows = (unsigned int)(MAT_CMP_BLOCK_BYTES / ((size_t)matrix->num_cols * sizeof(double)));
+    if (block_rows == 0) block_rows = 1;
+  }
+  FILE* f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "Cannot open %s for writing\n", path);
+    return 0;
+  }
+  mat_cmp_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MAT_CMP_MAGIC, 8);
+  h.version = MAT_CMP_VERSION;
+  h.block_rows = block_rows;
+  h.rows = matrix->num_rows;
+  h.cols = matrix->num_cols;
+  h.num_blocks = (matrix->num_rows + (uint64_t)block_rows - 1) / block_rows;
+  h.byte_order = MAT_BIN_BYTE_ORDER;
+  int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+  cmp_save_job job = {matrix, block_rows, 0, malloc(MAT_CMP_BATCH * sizeof(*job.out)),
+                      calloc(h.num_blocks, sizeof(*job.entries))};
+  uint64_t offset = sizeof(h);
+  for (unsigned int b0 = 0; b0 < h.num_blocks && ok; b0 += MAT_CMP_BATCH) {
+    unsigned int count = h.num_blocks - b0 < MAT_CMP_BATCH ? (unsigned int)(h.num_blocks - b0) : MAT_CMP_BATCH;
+    job.block0 = b0;
+    parallel_for(count, 1, cmp_save_range, &job);
+    for (unsigned int s = 0; s < count; s++) {
+      mat_cmp_entry* e = &job.entries[b0 + s];
+      e->offset = offset;
+      offset += e->size;
+      if (ok) ok = fwrite(job.out[s], 1, e->size, f) == e->size;
+      free(job.out[s]);
+    }
+  }
+  h.index_offset = offset;
+  if (ok) ok = fwrite(job.entries, sizeof(*job.entries), h.num_blocks, f) == h.num_blocks;
+  if (ok) ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+  if (fclose(f) != 0) ok = 0;
+  free(job.out);
+  free(job.entries);
+  if (!ok) fprintf(stderr, "Error writing %s\n", path);
+  return ok;
+}
+
+typedef struct {
+  int fd;
+  const mat_cmp_header* h;
+  const mat_cmp_entry* entries;
+  unsigned int block0;
+  unsigned int row0;          // first requested row
+  mat* result;
+  int* bad;                   // per block
+} cmp_load_job;
+
+static void cmp_load_range(void* arg, unsigned int begin, unsigned int end) {
+  cmp_load_job* job = (cmp_load_job*)arg;
+  unsigned int cols = (unsigned int)job->h->cols;
+  for (unsigned int s = begin; s < end; s++) {
+    unsigned int b = job->block0 + s;
+    const mat_cmp_entry* e = &job->entries[b];
+    unsigned long long r0 = (unsigned long long)b * job->h->block_rows;
+    unsigned int nr = (unsigned int)(job->h->rows - r0 < job->h->block_rows ? job->h->rows - r0 : job->h->block_rows);
+    size_t words = (size_t)nr * cols;
+    size_t bytes = words * sizeof(double);
+    if ((e->raw && e->size != bytes) || e->size > bytes + bytes / 255 + 16 ||
+        (!e->raw && e->size < (bytes + LZ_MAX_EXPANSION - 1) / LZ_MAX_EXPANSION)) {
+      job->bad[s] = 1;
+      continue;
+    }
+    unsigned char* packed = malloc(e->size ? e->size : 1);
+    unsigned char* shuffled = e->raw ? packed : malloc(bytes);
+    int ok = packed && shuffled && ooc_io(job->fd, packed, e->size, (off_t)e->offset, 0) &&
+             (e->raw || lz_decompress(packed, e->size, shuffled, bytes));
+    uint64_t* w = ok ? malloc(bytes) : NULL;
+    if (!w) ok = 0;
+    if (ok) {
+      for (size_t t = 0; t < words; t++) {
+        uint64_t v = 0;
+        for (int k = 0; k < 8; k++) v |= (uint64_t)shuffled[(size_t)k * words + t] << (8 * k);
+        w[t] = v;
+      }
+      for (size_t t = cols; t < words; t++) w[t] ^= w[t - cols];
+      bin_checksum c;
+      bin_checksum_init(&c);
+      bin_checksum_update(&c, (const double*)w, words);
+      ok = bin_checksum_final(&c) == e->checksum;
+    }
+    if (ok) {
+      // copy the rows of this block that fall into the requested range
+      unsigned long long first = r0 > job->row0 ? r0 : job->row0;
+      unsigned long long last = r0 + nr < (unsigned long long)job->row0 + job->result->num_rows
+                                ? r0 + nr : (unsigned long long)job->row0 + job->result->num_rows;
+      for (unsigned long long r = first; r < last; r++) {
+        memcpy(job->result->values[r - job->row0], w + (size_t)(r - r0) * cols, cols * sizeof(double));
+      }
+    }
+    if (!ok) job->bad[s] = 1;
+    free(w);
+    if (shuffled != packed) free(shuffled);
+    free(packed);
+  }
+}
+
+// decodes rows [row0, row0 + count); count == 0 means to the end
+static mat* cmp_load(const char* path, unsigned int row0, unsigned int count) {
+  if (!path) {
+    fprintf(stderr, "Loading a compressed matrix needs a path\n");
+    return NULL;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return NULL;
+  }
+  mat_cmp_header h;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !ooc_io(fd, &h, sizeof(h), 0, 0) || memcmp(h.magic, MAT_CMP_MAGIC, 8) != 0) {
+    fprintf(stderr, "%s is not a compressed matrix file\n", path);
+    close(fd);
+    return NULL;
+  }
+  unsigned long long file_size = (unsigned long long)st.st_size;
+  if (h.byte_order != MAT_BIN_BYTE_ORDER || h.version != MAT_CMP_VERSION || h.rows == 0 || h.cols == 0 ||
+      h.rows > UINT32_MAX || h.cols > UINT32_MAX || h.block_rows == 0 ||
+      h.num_blocks != (h.rows + h.block_rows - 1) / h.block_rows || h.index_offset < sizeof(h) ||
+      h.index_offset > file_size || (file_size - h.index_offset) / sizeof(mat_cmp_entry) < h.num_blocks) {
+    fprintf(stderr, "%s has an invalid or unsupported header\n", path);
+    close(fd);
+    return NULL;
+  }
+  // the stored blocks decode to at most LZ_MAX_EXPANSION times their size,
+  // which bounds rows * cols before anything is allocated
+  uint64_t payload = h.index_offset - sizeof(h);
+  uint64_t max_values = payload > UINT64_MAX / LZ_MAX_EXPANSION
+                        ? UINT64_MAX : payload * LZ_MAX_EXPANSION / sizeof(double);
+  if (h.cols > max_values / h.rows) {
+    fprintf(stderr, "%s is too short for a %llu x %llu matrix\n", path,
+            (unsigned long long)h.rows, (unsigned long long)h.cols);
+    close(fd);
+    return NULL;
+  }
+  if (count == 0 && row0 < h.rows) count = (unsigned int)(h.rows - row0);
+  if (count == 0 || (unsigned long long)row0 + count > h.rows) {
+    fprintf(stderr, "Rows out of range for %s\n", path);
+    close(fd);
+    return NULL;
+  }
+  unsigned int b0 = row0 / h.block_rows;
+  unsigned int b1 = (unsigned int)(((unsigned long long)row0 + count - 1) / h.block_rows);
+  unsigned int nblocks = b1 - b0 + 1;
+  mat_cmp_entry* entries = malloc((size_t)h.num_blocks * sizeof(*entries));
+  int ok = entries && ooc_io(fd, entries, (size_t)h.num_blocks * sizeof(*entries), (off_t)h.index_offset, 0);
+  for (unsigned int b = b0; ok && b <= b1; b++) {
+    ok = entries[b].offset <= h.index_offset && entries[b].size <= h.index_offset - entries[b].offset;
+  }
+  mat* result = NULL;
+  if (ok) {
+    result = new_mat(count, (unsigned int)h.cols);
+    cmp_load_job job = {fd, &h, entries, b0, row0, result, calloc(nblocks, sizeof(int))};
+    parallel_for(nblocks, 1, cmp_load_range, &job);
+    for (unsigned int s = 0; s < nblocks; s++) ok = ok && !job.bad[s];
+    free(job.bad);
+  }
+  if (!ok) {
+    fprintf(stderr, "%s is corrupted\n", path);
+    if (result) free_mat(result);
+    result = NULL;
+  }
+  free(entries);
+  close(fd);
+  return result;
+}
+
+mat* mat_load_compressed(const char* path) {
+  return cmp_load(path, 0, 0);
+}
+
+// decodes only the blocks that hold rows [row0, row0 + count)
+mat* mat_load_compressed_rows(const char* path, unsigned int row0, unsigned int count) {
+  if (count == 0) {
+    fprintf(stderr, "Row count must be positive\n");
+    return NULL;
+  }
+  return cmp_load(path, row0, count);
+}
+
+
+// ---------------------------------------------------------------------------
+// Random numbers
+// ---------------------------------------------------------------------------
+
+// Philox4x32-10 (Salmon et al., SC'11): a counter-based generator, so value
+// number k of a stream is a pure function of (seed, stream, k). Jumping ahead
+// is setting the position, and a matrix can be filled by any number of
+// threads, each starting at its own element, with identical results. Each
+// counter yields 128 bits, i.e. two doubles with 53 random bits.
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+static void philox_block(uint64_t key, uint64_t stream, uint64_t ctr, uint64_t out[2]) {
+  uint32_t c0 = (uint32_t)ctr, c1 = (uint32_t)(ctr >> 32);
+  uint32_t c2 = (uint32_t)stream, c3 = (uint32_t)(stream >> 32);
+  uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32);
+  for (int round = 0; round < 10; round++) {
+    uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+    uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+    uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+    uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+    c1 = (uint32_t)p1;
+    c3 = (uint32_t)p0;
+    c0 = n0;
+    c2 = n2;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+  out[0] = (uint64_t)c0 << 32 | c1;
+  out[1] = (uint64_t)c2 << 32 | c3;
+}
+
+static double rng_to_double(uint64_t bits) {
+  return (double)(bits >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// seed selects the key, stream an independent sequence under the same seed
+void mat_rng_seed(mat_rng* rng, unsigned long long seed, unsigned long long stream) {
+  rng->key = seed;
+  rng->stream = stream;
+  rng->position = 0;
+}
+
+// uniform in [0, 1)
+double mat_rng_uniform(mat_rng* rng) {
+  uint64_t out[2];
+  philox_block(rng->key, rng->stream, rng->position >> 1, out);
+  return rng_to_double(out[rng->position++ & 1]);
+}
+
+// jumps ahead by n values
+void mat_rng_skip(mat_rng* rng, unsigned long long n) {
+  rng->position += n;
+}
+
+// n values uniform in [min, max), identical to n calls of mat_rng_uniform
+void mat_rng_fill(mat_rng* rng, double* dst, size_t n, double min, double max) {
+  double scale = max - min;
+  uint64_t out[2];
+  size_t i = 0;
+  if (n > 0 && (rng->position & 1)) {
+    philox_block(rng->key, rng->stream, rng->position >> 1, out);
+    dst[i++] = min + rng_to_double(out[1]) * scale;
+  }
+  uint64_t ctr = (rng->position + i) >> 1;
+  // four independent counters per step keep the multipliers busy
+  for (; i + 8 <= n; i += 8, ctr += 4) {
+    uint64_t o[4][2];
+    for (int b = 0; b < 4; b++) philox_block(rng->key, rng->stream, ctr + b, o[b]);
+    for (int b = 0; b < 4; b++) {
+      dst[i + 2 * b] = min + rng_to_double(o[b][0]) * scale;
+      dst[i + 2 * b + 1] = min + rng_to_double(o[b][1]) * scale;
+    }
+  }
+  for (; i < n; i += 2, ctr++) {
+    philox_block(rng->key, rng->stream, ctr, out);
+    dst[i] = min + rng_to_double(out[0]) * scale;
+    if (i + 1 < n) dst[i + 1] = min + rng_to_double(out[1]) * scale;
+  }
+  rng->position += n;
+}
+
+typedef struct {
+  mat_rng rng;      // positioned at element (0, 0)
+  mat* m;
+  double min;
+  double max;
+} rng_fill_job;
+
+static void rng_fill_range(void* arg, unsigned int begin, unsigned int end) {
+  rng_fill_job* job = (rng_fill_job*)arg;
+  unsigned int cols = job->m->num_cols;
+  mat_rng rng = job->rng;
+  mat_rng_skip(&rng, (unsigned long long)begin * cols);
+  for (unsigned int i = begin; i < end; i++) mat_rng_fill(&rng, job->m->values[i], cols, job->min, job->max);
+}
+
+// row i starts at element i * cols of the stream, whichever thread fills it
+static void rng_fill_mat(mat_rng* rng, mat* m, double min, double max) {
+  rng_fill_job job = {*rng, m, min, max};
+  unsigned int grain = (unsigned int)(65536 / m->num_cols) + 1;
+  parallel_for(m->num_rows, grain, rng_fill_range, &job);
+  mat_rng_skip(rng, (unsigned long long)m->num_rows * m->num_cols);
+}
+
+mat* mat_random_rng(mat_rng* rng, unsigned int num_rows, unsigned int num_cols, double min, double max) {
+  if (!rng) {
+    fprintf(stderr, "Random matrix needs a generator\n");
+    return NULL;
+  }
+  mat* m = new_mat(num_rows, num_cols);
+  rng_fill_mat(rng, m, min, max);
+  return m;
+}
+
+// the default stream behind random_mat and rand_interval
+static mat_rng default_rng = {0x853c49e6748fea9bull, 0, 0};
+static pthread_mutex_t default_rng_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// reserves the next n values of the default stream for the caller
+static void default_rng_take(mat_rng* rng, unsigned long long n) {
+  pthread_mutex_lock(&default_rng_lock);
+  *rng = default_rng;
+  default_rng.position += n;
+  pthread_mutex_unlock(&default_rng_lock);
+}
+
+// restarts the default stream, making random_mat sequences reproducible
+void mat_seed(unsigned long long seed) {
+  pthread_mutex_lock(&default_rng_lock);
+  mat_rng_seed(&default_rng, seed, 0);
+  pthread_mutex_unlock(&default_rng_lock);
+}
+
+
+// ---------------------------------------------------------------------------
+// Structured random matrices
+// ---------------------------------------------------------------------------
+
+// All generators draw from a mat_rng and advance it by the number of values
+// they consume, so a (seed, stream) pair reproduces a whole benchmark suite.
+// Element k of a filled array always uses stream positions derived from k,
+// which keeps the parallel fills independent of the thread count.
+
+// Standard normals by Box-Muller: value k uses the two uniforms of Philox
+// block k / 2 and takes the cosine or sine branch by parity, so both halves
+// of every block are used and the value at position k is fixed.
+static void rng_normal_fill(mat_rng* rng, double* dst, size_t n, double mean, double stddev) {
+  const double two_pi = 6.283185307179586476925286766559;
+  uint64_t out[2];
+  uint64_t block = UINT64_MAX;
+  double r = 0.0, theta = 0.0;
+  for (size_t t = 0; t < n; t++) {
+    uint64_t k = rng->position + t;
+    if ((k >> 1) != block) {
+      block = k >> 1;
+      philox_block(rng->key, rng->stream, block, out);
+      r = sqrt(-2.0 * log(1.0 - rng_to_double(out[0])));
+      theta = two_pi * rng_to_double(out[1]);
+    }
+    dst[t] = mean + stddev * r * ((k & 1) ? sin(theta) : cos(theta));
+  }
+  rng->position += n;
+}
+
+typedef struct {
+  mat_rng rng;      // positioned at element (0, 0)
+  mat* m;
+  double mean;
+  double stddev;
+} normal_fill_job;
+
+static void normal_fill_range(void* arg, unsigned int begin, unsigned int end) {
+  normal_fill_job* job = (normal_fill_job*)arg;
+  unsigned int cols = job->m->num_cols;
+  mat_rng rng = job->rng;
+  mat_rng_skip(&rng, (unsigned long long)begin * cols);
+  for (unsigned int i = begin; i < end; i++) rng_normal_fill(&rng, job->m->values[i], cols, job->mean, job->stddev);
+}
+
+static void rng_normal_mat(mat_rng* rng, mat* m, double mean, double stddev) {
+  normal_fill_job job = {*rng, m, mean, stddev};
+  parallel_for(m->num_rows, (unsigned int)(16384 / m->num_cols) + 1, normal_fill_range, &job);
+  mat_rng_skip(rng, (unsigned long long)m->num_rows * m->num_cols);
+}
+
+// entries drawn from N(mean, stddev^2)
+mat* mat_random_normal(mat_rng* rng, unsigned int num_rows, unsigned int num_cols, double mean, double stddev) {
+  if (!rng || stddev < 0.0) {
+    fprintf(stderr, "Normal random matrix needs a generator and a non-negative deviation\n");
+    return NULL;
+  }
+  mat* m = new_mat(num_rows, num_cols);
+  rng_normal_mat(rng, m, mean, stddev);
+  return m;
+}
+
+typedef struct {
+  const double* a;      // reflectors, column-major m x k
+  const double* tau;
+  unsigned int m;
+  unsigned int k;
+  mat* q;
+} haar_job;
+
+// column c of Q = H(0)...H(k-1) e_c, with the sign of R(c, c) folded in
+static void haar_range(void* arg, unsigned int begin, unsigned int end) {
+  haar_job* job = (haar_job*)arg;
+  double* x = malloc(job->m * sizeof(*x));
+  for (unsigned int c = begin; c < end; c++) {
+    memset(x, 0, job->m * sizeof(*x));
+    x[c] = job->a[c + (size_t)c * job->m] < 0.0 ? -1.0 : 1.0;
+    householder_apply_q(job->a, job->m, job->k, job->tau, x);
+    for (unsigned int i = 0; i < job->m; i++) job->q->values[i][c] = x[i];
+  }
+  free(x);
+}
+
+// m x k with orthonormal columns, uniformly (Haar) distributed: the Q factor
+// of a Gaussian matrix with R's diagonal made positive (Mezzadri 2007)
+static mat* haar_columns(mat_rng* rng, unsigned int m, unsigned int k) {
+  mat* g = new_mat(m, k);
+  rng_normal_mat(rng, g, 0.0, 1.0);
+  double* a = malloc((size_t)m * k * sizeof(*a));
+  double* tau = malloc(k * sizeof(*tau));
+  for (unsigned int i = 0; i < m; i++) {
+    for (unsigned int j = 0; j < k; j++) a[i + (size_t)j * m] = g->values[i][j];
+  }
+  householder_qr(a, m, k, tau);
+  haar_job job = {a, tau, m, k, g};
+  unsigned long long col_flops = (unsigned long long)m * k;
+  parallel_for(k, (unsigned int)(GEMM_TASK_FLOPS / (col_flops + 1)) + 1, haar_range, &job);
+  free(a);
+  free(tau);
+  return g;
+}
+
+mat* mat_random_orthogonal(mat_rng* rng, unsigned int n) {
+  if (!rng) {
+    fprintf(stderr, "Random orthogonal matrix needs a generator\n");
+    return NULL;
+  }
+  return haar_columns(rng, n, n);
+}
+
+// U * diag(s) * V^T through the GEMM kernel
+static mat* scaled_product(mat* u, const double* s, mat* v) {
+  unsigned int k = u->num_cols;
+  mat* us = mat_cp(u);
+  for (unsigned int i = 0; i < us->num_rows; i++) {
+    for (unsigned int j = 0; j < k; j++) us->values[i][j] *= s[j];
+  }
+  mat* vt = mat_transpose(v);
+  mat* a = new_mat(u->num_rows, v->num_rows);
+  gemm(a->values, us->values, vt->values, u->num_rows, k, v->num_rows);
+  free_mat(us);
+  free_mat(vt);
+  return a;
+}
+
+// values from 1 down to 1 / cond, evenly spaced on a log scale
+static double* geometric_spectrum(unsigned int k, double cond) {
+  double* s = malloc(k * sizeof(*s));
+  for (unsigned int i = 0; i < k; i++) s[i] = k > 1 ? pow(cond, -(double)i / (k - 1)) : 1.0;
+  return s;
+}
+
+// m x n matrix U * diag(s) * V^T with Haar U, V and singular values from 1
+// to 1 / cond, so its 2-norm condition number is cond
+mat* mat_random_cond(mat_rng* rng, unsigned int num_rows, unsigned int num_cols, double cond) {
+  if (!rng || !(cond >= 1.0) || num_rows == 0 || num_cols == 0) {
+    fprintf(stderr, "Random matrix with given condition needs a generator and cond >= 1\n");
+    return NULL;
+  }
+  unsigned int k = num_rows < num_cols ? num_rows : num_cols;
+  mat* u = haar_columns(rng, num_rows, k);
+  mat* v = haar_columns(rng, num_cols, k);
+  double* s = geometric_spectrum(k, cond);
+  mat* a = scaled_product(u, s, v);
+  free(s);
+  free_mat(u);
+  free_mat(v);
+  return a;
+}
+
+// symmetric positive definite Q * diag(l) * Q^T with eigenvalues from 1 to 1 / cond
+mat* mat_random_spd(mat_rng* rng, unsigned int n, double cond) {
+  if (!rng || !(cond >= 1.0) || n == 0) {
+    fprintf(stderr, "Random SPD matrix needs a generator and cond >= 1\n");
+    return NULL;
+  }
+  mat* q = haar_columns(rng, n, n);
+  double* l = geometric_spectrum(n, cond);
+  mat* a = scaled_product(q, l, q);
+  // exact symmetry, the two triangles differ by rounding otherwise
+  for (unsigned int i = 0; i < n; i++) {
+    for (unsigned int j = 0; j < i; j++) {
+      double avg = 0.5 * (a->values[i][j] + a->values[j][i]);
+      a->values[i][j] = avg;
+      a->values[j][i] = avg;
+    }
+  }
+  free(l);
+  free_mat(q);
+  return a;
+}
+
+typedef struct {
+  mat_rng rng;
+  mat* m;
+  unsigned int lower;
+  unsigned int upper;
+  double min;
+  double max;
+} band_fill_job;
+
+static void band_fill_range(void* arg, unsigned int begin, unsigned int end) {
+  band_fill_job* job = (band_fill_job*)arg;
+  unsigned int n = job->m->num_cols;
+  for (unsigned int i = begin; i < end; i++) {
+    unsigned int lo = i > job->lower ? i - job->lower : 0;
+    unsigned int hi = n - 1 - i > job->upper ? i + job->upper : n - 1;
+    mat_rng rng = job->rng;
+    mat_rng_skip(&rng, (unsigned long long)i * n + lo);
+    mat_rng_fill(&rng, job->m->values[i] + lo, hi - lo + 1, job->min, job->max);
+  }
+}
+
+// n x n with uniform entries on the band i - lower <= j <= i + upper, zero elsewhere
+mat* mat_random_banded(mat_rng* rng, unsigned int n, unsigned int lower, unsigned int upper, double min, double max) {
+  if (!rng) {
+    fprintf(stderr, "Random banded matrix needs a generator\n");
+    return NULL;
+  }
+  mat* m = new_mat(n, n);
+  band_fill_job job = {*rng, m, lower, upper, min, max};
+  unsigned long long width = (unsigned long long)lower + upper + 1;
+  parallel_for(n, (unsigned int)(65536 / (width < n ? width : n)) + 1, band_fill_range, &job);
+  mat_rng_skip(rng, (unsigned long long)n * n);
+  return m;
+}
+
+typedef struct {
+  mat_rng rng;
+  spmat* s;
+  double density;
+  unsigned int kmax;            // most entries a row can get
+  unsigned long long budget;    // stream positions reserved per row
+  double min;
+  double max;
+} sparse_fill_job;
+
+// entries in row i: floor(density * cols) plus one with the fractional probability
+static unsigned int sparse_row_count(sparse_fill_job* job, unsigned int i) {
+  double want = job->density * job->s->num_cols;
+  unsigned int k = (unsigned int)want;
+  mat_rng rng = job->rng;
+  mat_rng_skip(&rng, i * job->budget);
+  if (k < job->s->num_cols && mat_rng_uniform(&rng) < want - k) k++;
+  return k;
+}
+
+static void sparse_count_range(void* arg, unsigned int begin, unsigned int end) {
+  sparse_fill_job* job = (sparse_fill_job*)arg;
+  for (unsigned int i = begin; i < end; i++) job->s->row_ptr[i + 1] = sparse_row_count(job, i);
+}
+
+static int cmp_uint(const void* a, const void* b) {
+  unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+  return (x > y) - (x < y);
+}
+
+// distinct columns by Floyd's sampling, then sorted, then the values
+static void sparse_fill_range(void* arg, unsigned int begin, unsigned int end) {
+  sparse_fill_job* job = (sparse_fill_job*)arg;
+  spmat* s = job->s;
+  unsigned int n = s->num_cols;
+  unsigned char* taken = calloc(n, 1);
+  for (unsigned int i = begin; i < end; i++) {
+    unsigned long long b = s->row_ptr[i];
+    unsigned int k = (unsigned int)(s->row_ptr[i + 1] - b);
+    unsigned int* cols = s->col_idx + b;
+    mat_rng rng = job->rng;
+    mat_rng_skip(&rng, i * job->budget + 1);
+    for (unsigned int t = 0; t < k; t++) {
+      unsigned int j = n - k + t;
+      unsigned int c = (unsigned int)(mat_rng_uniform(&rng) * ((double)j + 1.0));
+      if (c > j) c = j;
+      if (taken[c]) c = j;
+      taken[c] = 1;
+      cols[t] = c;
+    }
+    if (k > n / 16) {
+      unsigned int t = 0;
+      for (unsigned int c = 0; c < n; c++) {
+        if (taken[c]) cols[t++] = c;
+      }
+    } else {
+      qsort(cols, k, sizeof(*cols), cmp_uint);
+    }
+    for (unsigned int t = 0; t < k; t++) taken[cols[t]] = 0;
+    mat_rng_skip(&rng, job->kmax - k);
+    mat_rng_fill(&rng, s->values + b, k, job->min, job->max);
+  }
+  free(taken);
+}
+
+// sparse matrix whose rows hold density * cols uniform entries at random
+// positions (rounded up or down at random, so the expected density is exact)
+spmat* spmat_random(mat_rng* rng, unsigned int num_rows, unsigned int num_cols, double density, double min, double max) {
+  if (!rng || num_rows == 0 || num_cols == 0 || !(density >= 0.0 && density <= 1.0)) {
+    fprintf(stderr, "Random sparse matrix needs a generator and a density in [0, 1]\n");
+    return NULL;
+  }
+  unsigned int kmax = (unsigned int)ceil(density * num_cols);
+  if (kmax > num_cols) kmax = num_cols;
+  sparse_fill_job job = {*rng, NULL, density, kmax, 2ull * kmax + 1, min, max};
+  spmat* s = calloc(1, sizeof(*s));
+  s->num_rows = num_rows;
+  s->num_cols = num_cols;
+  s->row_ptr = calloc((size_t)num_rows + 1, sizeof(*s->row_ptr));
+  job.s = s;
+  parallel_for(num_rows, 4096, sparse_count_range, &job);
+  for (unsigned int i = 0; i < num_rows; i++) s->row_ptr[i + 1] += s->row_ptr[i];
+  s->nnz = s->row_ptr[num_rows];
+  s->col_idx = malloc((s->nnz ? s->nnz : 1) * sizeof(*s->col_idx));
+  s->values = malloc((s->nnz ? s->nnz : 1) * sizeof(*s->values));
+  unsigned int grain = (unsigned int)(65536 / (kmax + 1)) + 1;
+  parallel_for(num_rows, grain, sparse_fill_range, &job);
+  mat_rng_skip(rng, num_rows * job.budget);
+  return s;
+}
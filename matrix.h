@@ -10,17 +10,73 @@ typedef struct{
   unsigned int num_cols;
   double** values;
   int is_square;
+  void* map_base;   //set when values point into a read-only file mapping
+  size_t map_len;
+  void* region_base;  //set when the rows share one writable mapping (large matrices, see mat_alloc_large)
+  size_t region_len;
 }mat;
 
+//counter-based random stream (Philox4x32-10): value k depends only on key, stream and k
+typedef struct{
+  unsigned long long key;       //seed
+  unsigned long long stream;    //independent sequence under the same seed
+  unsigned long long position;  //values drawn so far
+}mat_rng;
+
+//runtime: one shared worker pool for every parallel kernel. The thread count
+//comes from mat_runtime_init, else JABR_NUM_THREADS, else the online CPUs;
+//JABR_PIN=1 pins the workers to cores. mat_runtime_init and mat_runtime_shutdown
+//refuse to run from inside a parallel kernel, where they would deadlock
+int mat_runtime_init(unsigned int num_threads, int pin);
+void mat_runtime_shutdown(void);
+unsigned int mat_runtime_threads(void);
+int mat_runtime_serial(int serial);
+
+//placement of large matrices: one mapping, optionally on huge pages, with its
+//pages first touched by the pool (default), interleaved over NUMA nodes, or on one node
+#define MAT_ALLOC_FIRST_TOUCH 0
+#define MAT_ALLOC_INTERLEAVE 1
+#define MAT_ALLOC_NODE 2
+int mat_alloc_policy(int policy, int node);
+int mat_alloc_large(size_t min_bytes, int huge_pages);
+
 //constructor function for the matrix
 mat* new_mat(unsigned int num_rows,unsigned int num_cols);
 void free_mat(mat* matrix);
 mat* random_mat(unsigned int num_rows, unsigned int num_cols, double min, double max);
+void mat_seed(unsigned long long seed);
+void mat_rng_seed(mat_rng* rng, unsigned long long seed, unsigned long long stream);
+double mat_rng_uniform(mat_rng* rng);
+void mat_rng_skip(mat_rng* rng, unsigned long long n);
+void mat_rng_fill(mat_rng* rng, double* dst, size_t n, double min, double max);
+mat* mat_random_rng(mat_rng* rng, unsigned int num_rows, unsigned int num_cols, double min, double max);
 mat* square_mat(unsigned int size);
 mat* random_square_mat(unsigned int size, double min, double max);
 mat* eye_mat(unsigned int size);
 mat* mat_cp(mat* matrix);
 mat* read_from_filef(FILE* f);
+//text without a header: one row per line, values separated by whitespace or commas
+mat* mat_read_text(FILE* f);
+mat* mat_parse_text(const char* text, size_t len);
+//binary format: versioned header followed by the row-major doubles
+int mat_save_binary(mat* matrix, const char* path);
+mat* mat_load_binary(const char* path);
+mat* mat_map_binary(const char* path, int verify);
+//NumPy .npy files: float32/float64, C or Fortran order, 1-D arrays load as columns
+int mat_save_npy(mat* matrix, const char* path);
+mat* mat_load_npy(const char* path);
+mat* mat_map_npy(const char* path);
+//compressed binary format: blocks of rows, byte-shuffled and LZ-compressed, decoded in parallel
+int mat_save_compressed(mat* matrix, const char* path, unsigned int block_rows);
+mat* mat_load_compressed(const char* path);
+mat* mat_load_compressed_rows(const char* path, unsigned int row0, unsigned int count);
+//streaming fixed-size row blocks from text (headerless or read_from_filef style), binary or .npy
+//files, read ahead on a background thread
+typedef struct mat_reader mat_reader;
+mat_reader* mat_reader_open(const char* path, unsigned int block_rows);
+unsigned int mat_reader_cols(mat_reader* r);
+mat* mat_reader_next(mat_reader* r);
+int mat_reader_close(mat_reader* r);
 
 
 //matrix equality
@@ -30,6 +86,10 @@ int mat_equal(mat* m1,  mat* m2, double tolerance);
 //print the matrix
 void mat_print(mat* matrix);
 void mat_printf(mat* matrix, const char* fmt);
+//fast output: shortest round-trip decimals, rows formatted in parallel and written in order
+int mat_format_double(double v, char* buf);
+int mat_fwrite_text(mat* matrix, FILE* f, char delim);
+int mat_write_text_fd(mat* matrix, int fd, char delim);
 
 //retrieving a row/col 
 mat* get_col_mat(mat* matrix, unsigned int col);
@@ -94,10 +154,174 @@ mat* mat_to_rref(mat* m);
 int mat_lup_decomp(mat* A, mat** L, mat** U, mat** P);
 mat* mat_lup_solve(mat* L, mat* U, mat* P, mat* b);
 double mat_det_lup(mat* L, mat* U, mat* P);
+//single precision LU refined to double accuracy, falls back to double if refinement stalls
+mat* mat_lup_solve_mixed(mat* A, mat* b, int* iterations);
+
+//out-of-core LU for matrices larger than memory, stored in a file as column panels
+typedef struct{
+  int fd;                   //backing file
+  char* path;
+  unsigned int n;           //matrix is n x n
+  unsigned int panel_cols;  //columns per panel
+  unsigned int* piv;        //row interchanges of the factorization
+  int factored;
+}mat_ooc;
+
+mat_ooc* mat_ooc_create(const char* path, unsigned int n, unsigned int panel_cols);
+mat_ooc* mat_ooc_create_budget(const char* path, unsigned int n, size_t mem_bytes);
+int mat_ooc_set_rows(mat_ooc* m, unsigned int row0, mat* rows);
+mat* mat_ooc_get_rows(mat_ooc* m, unsigned int row0, unsigned int count);
+int mat_ooc_lu(mat_ooc* m);
+mat* mat_ooc_solve(mat_ooc* m, mat* b);
+void mat_ooc_close(mat_ooc* m, int remove_file);
+
+//Cholesky decomposition A = L*L^T
+int mat_chol_decomp(mat* A, mat** L);
+mat* mat_chol_solve(mat* L, mat* b);
 
 //QR decomposition
 int mat_qr_decomp(mat* A, mat** Q, mat** R);
 mat* mat_qr_solve(mat* Q, mat* R, mat* b);
 mat* mat_transpose(mat* matrix);
 
+//rank-revealing QR with column pivoting (blocked QP3), A*P = Q*R
+int mat_qrcp_decomp(mat* A, mat** Q, mat** R, mat** P, unsigned int* rank);
+mat* mat_qrcp_solve(mat* Q, mat* R, mat* P, unsigned int rank, mat* b);
+
+//O(n^2) rank-one updates of existing factors, modified in place
+int mat_chol_update(mat* L, mat* x);
+int mat_chol_downdate(mat* L, mat* x);
+int mat_lup_update(mat* L, mat* U, mat* P, mat* u, mat* v);
+int mat_qr_update(mat* Q, mat* R, mat* u, mat* v);
+//row append/delete for thin QR, Q and R are replaced
+int mat_qr_insert_row(mat** Q, mat** R, unsigned int row, mat* a);
+int mat_qr_delete_row(mat** Q, mat** R, unsigned int row);
+
+//O(n^2) reciprocal condition estimates (1-norm) from existing factors, anorm = mat_norm1(A)
+double mat_norm1(mat* A);
+double mat_lup_rcond(mat* L, mat* U, mat* P, double anorm);
+double mat_chol_rcond(mat* L, double anorm);
+double mat_qr_rcond(mat* R);
+
+//integer powers (binary exponentiation) and the matrix exponential (scaling and squaring Pade;
+//NULL for non-finite input or a singular Pade denominator)
+mat* mat_pow(mat* A, unsigned int p);
+mat* mat_expm(mat* A);
+
+//symmetric eigen decomposition (tridiagonal reduction + divide and conquer)
+int mat_sym_eig(mat* A, mat** evals, mat** evecs);
+//general eigenvalues (Hessenberg reduction + Francis double-shift QR), evals is n x 2 (re, im)
+int mat_hessenberg(mat* A, mat** H, mat** Q);
+int mat_eig(mat* A, mat** evals, mat** T, mat** Z);
+//singular value decomposition (parallel one-sided Jacobi), U and V NULL for values only;
+//returns 0 and leaves the outputs unset if the sweeps do not converge
+int mat_svd(mat* A, mat** U, mat** S, mat** V, int full);
+
+//randomized range finder and truncated SVD, opts == NULL takes the defaults
+typedef struct{
+  unsigned int oversample;    //extra sketch columns beyond the rank (default 10)
+  unsigned int power_iters;   //power iterations, more for slowly decaying spectra (default 2)
+  unsigned long long seed;    //seed of the Gaussian sketch, drawn from mat_rng stream 0 (default 0)
+}mat_rsvd_opts;
+
+mat* mat_range_finder(mat* A, unsigned int l, const mat_rsvd_opts* opts);
+int mat_rsvd(mat* A, unsigned int k, const mat_rsvd_opts* opts, mat** U, mat** S, mat** V);
+
+//tall-skinny QR, Q is never formed
+typedef struct{
+  unsigned int num_cols;          //columns of A
+  unsigned int num_rhs;           //columns of b
+  unsigned long long rows_seen;   //rows absorbed so far
+  double* r;                      //triangular factor of [A b], row-major
+}mat_tsqr;
+
+int mat_tsqr_decomp(mat* A, mat** R);
+mat* mat_tsqr_lstsq(mat* A, mat* b);
+mat_tsqr* mat_tsqr_begin(unsigned int num_cols, unsigned int num_rhs);
+int mat_tsqr_push(mat_tsqr* state, mat* A_rows, mat* b_rows);
+mat* mat_tsqr_r(mat_tsqr* state);
+mat* mat_tsqr_solve(mat_tsqr* state);
+void mat_tsqr_free(mat_tsqr* state);
+
+//linear operator y = A*x, used by the matrix-free solvers
+typedef struct{
+  unsigned int n;                                          //operator is n x n
+  void (*apply)(void* ctx, const double* x, double* y);    //computes y = A*x
+  void* ctx;                                               //user data passed to apply
+  void (*destroy)(void* ctx);                              //frees ctx, NULL for user operators
+}mat_op;
+
+//options for the iterative solvers, zero fields take the defaults
+typedef struct{
+  unsigned int max_iter;  //iteration limit (default max(n, 1000))
+  unsigned int restart;   //GMRES restart length (default 30)
+  double tol;             //stop when ||b - Ax|| <= tol * ||b|| (default 1e-10)
+}mat_krylov_opts;
+
+//convergence statistics reported by the iterative solvers
+typedef struct{
+  unsigned int iterations;
+  unsigned int matvecs;
+  double residual;        //final ||b - Ax||
+  double rel_residual;    //residual / ||b||
+  int converged;
+}mat_krylov_stats;
+
+//iterative solvers, x0 == NULL starts from zero, M == NULL means no preconditioner
+mat_op mat_op_from_mat(mat* A);
+int mat_precond_jacobi(mat* A, mat_op* M);
+int mat_precond_ilu0(mat* A, mat_op* M);
+void mat_precond_free(mat_op* M);
+mat* mat_cg(mat_op* A, mat* b, mat* x0, mat_op* M, const mat_krylov_opts* opts, mat_krylov_stats* stats);
+mat* mat_bicgstab(mat_op* A, mat* b, mat* x0, mat_op* M, const mat_krylov_opts* opts, mat_krylov_stats* stats);
+mat* mat_gmres(mat_op* A, mat* b, mat* x0, mat_op* M, const mat_krylov_opts* opts, mat_krylov_stats* stats);
+
+//which end of the spectrum the restarted eigensolvers look for
+#define MAT_EIGS_LARGEST 0        //largest (real part)
+#define MAT_EIGS_SMALLEST 1       //smallest (real part)
+#define MAT_EIGS_LARGEST_MAG 2    //largest magnitude
+
+//options for the restarted eigensolvers, zero fields take the defaults
+typedef struct{
+  unsigned int basis;         //Krylov basis size m, memory is n x (m + 1) (default max(2k + 1, 20))
+  unsigned int max_restarts;  //restart cycles (default 500)
+  unsigned int reorth;        //2 reorthogonalizes every step, 1 only on cancellation (default 2)
+  int which;                  //MAT_EIGS_* (default MAT_EIGS_LARGEST)
+  double tol;                 //residual <= tol * largest Ritz value (default 1e-10)
+}mat_eigs_opts;
+
+//k eigenpairs of large operators: thick-restart Lanczos (symmetric) and restarted Arnoldi (general)
+int mat_lanczos(mat_op* A, unsigned int k, const mat_eigs_opts* opts, mat** evals, mat** evecs, mat_krylov_stats* stats);
+int mat_arnoldi(mat_op* A, unsigned int k, const mat_eigs_opts* opts, mat** evals, mat** evecs, mat_krylov_stats* stats);
+
+//sparse matrix in compressed sparse row form
+typedef struct{
+  unsigned int num_rows;
+  unsigned int num_cols;
+  unsigned long long nnz;
+  unsigned long long* row_ptr;  //row i holds entries row_ptr[i] .. row_ptr[i + 1] - 1
+  unsigned int* col_idx;        //column of each entry, increasing within a row
+  double* values;
+}spmat;
+
+void free_spmat(spmat* A);
+spmat* spmat_from_mat(mat* A);
+mat* spmat_to_mat(spmat* A);
+mat* spmat_dot(spmat* A, mat* B);
+mat_op spmat_op(spmat* A);
+
+//Matrix Market: coordinate or array, real/integer/pattern, general/symmetric/skew-symmetric
+mat* mat_read_mm(FILE* f);
+spmat* spmat_read_mm(FILE* f);
+int mat_write_mm(mat* A, FILE* f);
+int spmat_write_mm(spmat* A, FILE* f);
+
+//structured random matrices for benchmarks and stress tests, drawn from a mat_rng
+mat* mat_random_normal(mat_rng* rng, unsigned int num_rows, unsigned int num_cols, double mean, double stddev);
+mat* mat_random_orthogonal(mat_rng* rng, unsigned int n);
+mat* mat_random_cond(mat_rng* rng, unsigned int num_rows, unsigned int num_cols, double cond);
+mat* mat_random_spd(mat_rng* rng, unsigned int n, double cond);
+mat* mat_random_banded(mat_rng* rng, unsigned int n, unsigned int lower, unsigned int upper, double min, double max);
+spmat* spmat_random(mat_rng* rng, unsigned int num_rows, unsigned int num_cols, double density, double min, double max);
+
 #endif
\ No newline at end of file
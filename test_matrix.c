@@ -4,6 +4,10 @@
 #include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <float.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 
 #define EPSILON 1e-9
 #define TEST_PASSED 1
@@ -1613,6 +1617,2319 @@ void test_mat_qr_solve() {
     free_mat(Ax2);
 }
 
+// 1D Poisson matrix: tridiagonal SPD with 2 on the diagonal and -1 off it
+static mat* poisson_mat(unsigned int n) {
+    mat* A = new_mat(n, n);
+    for (unsigned int i = 0; i < n; i++) {
+        A->values[i][i] = 2.0;
+        if (i > 0) A->values[i][i - 1] = -1.0;
+        if (i + 1 < n) A->values[i][i + 1] = -1.0;
+    }
+    return A;
+}
+
+static double residual_norm(mat* A, mat* x, mat* b) {
+    mat* Ax = mat_dot_r(A, x);
+    double sum = 0.0;
+    for (unsigned int i = 0; i < b->num_rows; i++) {
+        double d = Ax->values[i][0] - b->values[i][0];
+        sum += d * d;
+    }
+    free_mat(Ax);
+    return sqrt(sum);
+}
+
+// matrix-free operator for the same 1D Poisson stencil
+static void poisson_apply(void* ctx, const double* x, double* y) {
+    unsigned int n = *(unsigned int*)ctx;
+    for (unsigned int i = 0; i < n; i++) {
+        y[i] = 2.0 * x[i];
+        if (i > 0) y[i] -= x[i - 1];
+        if (i + 1 < n) y[i] -= x[i + 1];
+    }
+}
+
+void test_mat_cg() {
+    printf("\n--- Testing mat_cg ---\n");
+
+    unsigned int n = 20;
+    mat* A = poisson_mat(n);
+    mat* b = new_mat(n, 1);
+    for (unsigned int i = 0; i < n; i++) b->values[i][0] = 1.0 + i;
+
+    mat_op op = mat_op_from_mat(A);
+    mat_krylov_stats stats;
+    mat* x = mat_cg(&op, b, NULL, NULL, NULL, &stats);
+    test_assert(x != NULL, "mat_cg returns a solution");
+    test_assert(stats.converged, "mat_cg converges on SPD system");
+    test_assert(stats.iterations <= n, "mat_cg converges within n iterations");
+    test_assert(residual_norm(A, x, b) < 1e-8, "mat_cg solution satisfies Ax = b");
+
+    // warm start from the solution needs no iterations
+    mat_krylov_stats warm;
+    mat* x2 = mat_cg(&op, b, x, NULL, NULL, &warm);
+    test_assert(warm.iterations == 0 && warm.converged, "mat_cg warm start from solution stops immediately");
+
+    // matrix-free operator with Jacobi preconditioner
+    mat_op free_op = { n, poisson_apply, &n, NULL };
+    mat_op M;
+    test_assert(mat_precond_jacobi(A, &M) == 1, "mat_precond_jacobi builds preconditioner");
+    mat* x3 = mat_cg(&free_op, b, NULL, &M, NULL, &stats);
+    test_assert(stats.converged && mat_equal(x, x3, 1e-7), "mat_cg works with matrix-free operator");
+    mat_precond_free(&M);
+
+    mat* bad_b = new_mat(n + 1, 1);
+    test_assert(mat_cg(&op, bad_b, NULL, NULL, NULL, NULL) == NULL, "mat_cg returns NULL for mismatched b");
+
+    // preconditioner built for a different size is rejected by every solver
+    mat* A_small = poisson_mat(n - 1);
+    mat_op M_small;
+    mat_precond_jacobi(A_small, &M_small);
+    test_assert(mat_cg(&op, b, NULL, &M_small, NULL, NULL) == NULL &&
+                mat_bicgstab(&op, b, NULL, &M_small, NULL, NULL) == NULL &&
+                mat_gmres(&op, b, NULL, &M_small, NULL, NULL) == NULL,
+                "Krylov solvers return NULL for mismatched preconditioner");
+    mat_precond_free(&M_small);
+    free_mat(A_small);
+
+    free_mat(A);
+    free_mat(b);
+    free_mat(x);
+    free_mat(x2);
+    free_mat(x3);
+    free_mat(bad_b);
+}
+
+void test_mat_bicgstab() {
+    printf("\n--- Testing mat_bicgstab ---\n");
+
+    // nonsymmetric convection-diffusion style matrix
+    unsigned int n = 25;
+    mat* A = poisson_mat(n);
+    for (unsigned int i = 0; i + 1 < n; i++) A->values[i][i + 1] = -0.5;
+    mat* b = new_mat(n, 1);
+    for (unsigned int i = 0; i < n; i++) b->values[i][0] = sin(0.3 * i);
+
+    mat_op op = mat_op_from_mat(A);
+    mat_krylov_stats stats;
+    mat* x = mat_bicgstab(&op, b, NULL, NULL, NULL, &stats);
+    test_assert(x != NULL && stats.converged, "mat_bicgstab converges on nonsymmetric system");
+    test_assert(residual_norm(A, x, b) < 1e-8, "mat_bicgstab solution satisfies Ax = b");
+
+    mat_op M;
+    test_assert(mat_precond_ilu0(A, &M) == 1, "mat_precond_ilu0 builds preconditioner");
+    mat_krylov_stats pstats;
+    mat* xp = mat_bicgstab(&op, b, NULL, &M, NULL, &pstats);
+    // ILU(0) of a tridiagonal matrix is exact, so one iteration suffices
+    test_assert(pstats.converged && pstats.iterations <= 2, "mat_bicgstab with ILU(0) converges quickly");
+    test_assert(mat_equal(x, xp, 1e-7), "preconditioned and plain BiCGSTAB agree");
+    mat_precond_free(&M);
+
+    free_mat(A);
+    free_mat(b);
+    free_mat(x);
+    free_mat(xp);
+}
+
+void test_mat_gmres() {
+    printf("\n--- Testing mat_gmres ---\n");
+
+    unsigned int n = 30;
+    mat* A = poisson_mat(n);
+    for (unsigned int i = 0; i < n; i++) A->values[i][i] = 4.0;
+    for (unsigned int i = 1; i < n; i++) A->values[i][i - 1] = -1.5;
+    mat* b = new_mat(n, 1);
+    for (unsigned int i = 0; i < n; i++) b->values[i][0] = 1.0;
+
+    mat_op op = mat_op_from_mat(A);
+    mat_krylov_stats stats;
+    mat* x = mat_gmres(&op, b, NULL, NULL, NULL, &stats);
+    test_assert(x != NULL && stats.converged, "mat_gmres converges");
+    test_assert(residual_norm(A, x, b) < 1e-8, "mat_gmres solution satisfies Ax = b");
+
+    // short restart cycles still reach the same solution
+    mat_krylov_opts opts = { 0, 5, 1e-10 };
+    mat_krylov_stats rstats;
+    mat* xr = mat_gmres(&op, b, NULL, NULL, &opts, &rstats);
+    test_assert(rstats.converged && mat_equal(x, xr, 1e-6), "mat_gmres(5) converges with restarts");
+
+    mat_op M;
+    mat_precond_ilu0(A, &M);
+    mat_krylov_stats pstats;
+    mat* xp = mat_gmres(&op, b, NULL, &M, NULL, &pstats);
+    test_assert(pstats.converged && pstats.iterations < stats.iterations, "ILU(0) reduces GMRES iterations");
+    mat_precond_free(&M);
+
+    free_mat(A);
+    free_mat(b);
+    free_mat(x);
+    free_mat(xr);
+    free_mat(xp);
+}
+
+void test_mat_lup_solve_mixed() {
+    printf("\n--- Testing mat_lup_solve_mixed ---\n");
+
+    // well-conditioned, diagonally dominant system with known solution
+    unsigned int n = 40;
+    mat* A = random_square_mat(n, -1.0, 1.0);
+    for (unsigned int i = 0; i < n; i++) A->values[i][i] += n;
+    mat* x_true = new_mat(n, 1);
+    for (unsigned int i = 0; i < n; i++) x_true->values[i][0] = 1.0 / (i + 1);
+    mat* b = mat_dot_r(A, x_true);
+
+    int iters = -2;
+    mat* x = mat_lup_solve_mixed(A, b, &iters);
+    test_assert(x != NULL, "mat_lup_solve_mixed returns a solution");
+    test_assert(iters >= 0, "mat_lup_solve_mixed converges by refinement");
+    test_assert(mat_equal(x, x_true, 1e-13), "mat_lup_solve_mixed reaches double accuracy");
+
+    // Hilbert matrix is too ill-conditioned for single precision: must fall back
+    unsigned int h = 10;
+    mat* H = new_mat(h, h);
+    for (unsigned int i = 0; i < h; i++) {
+        for (unsigned int j = 0; j < h; j++) H->values[i][j] = 1.0 / (i + j + 1);
+    }
+    mat* hb = new_mat(h, 1);
+    for (unsigned int i = 0; i < h; i++) hb->values[i][0] = 1.0;
+    mat* hx = mat_lup_solve_mixed(H, hb, &iters);
+    test_assert(hx != NULL && iters == -1, "mat_lup_solve_mixed falls back for ill-conditioned matrix");
+    test_assert(residual_norm(H, hx, hb) < 1e-6, "fallback solution satisfies Ax = b");
+
+    mat* bad = new_mat(n + 1, 1);
+    test_assert(mat_lup_solve_mixed(A, bad, NULL) == NULL, "mat_lup_solve_mixed returns NULL for mismatched b");
+
+    free_mat(A);
+    free_mat(x_true);
+    free_mat(b);
+    free_mat(x);
+    free_mat(H);
+    free_mat(hb);
+    free_mat(hx);
+    free_mat(bad);
+}
+
+// largest absolute entry of A*V - V*diag(evals)
+static double eig_residual(mat* A, mat* evals, mat* V) {
+    mat* AV = mat_dot_r(A, V);
+    double worst = 0.0;
+    for (unsigned int i = 0; i < A->num_rows; i++) {
+        for (unsigned int j = 0; j < V->num_cols; j++) {
+            double r = fabs(AV->values[i][j] - V->values[i][j] * evals->values[j][0]);
+            if (r > worst) worst = r;
+        }
+    }
+    free_mat(AV);
+    return worst;
+}
+
+// largest deviation of V^T * V from the identity
+static double orth_error(mat* V) {
+    mat* Vt = mat_transpose(V);
+    mat* VtV = mat_dot_r(Vt, V);
+    double worst = 0.0;
+    for (unsigned int i = 0; i < VtV->num_rows; i++) {
+        for (unsigned int j = 0; j < VtV->num_cols; j++) {
+            double r = fabs(VtV->values[i][j] - (i == j ? 1.0 : 0.0));
+            if (r > worst) worst = r;
+        }
+    }
+    free_mat(Vt);
+    free_mat(VtV);
+    return worst;
+}
+
+void test_mat_sym_eig() {
+    printf("\n--- Testing mat_sym_eig ---\n");
+
+    // small matrix with known eigenvalues 1, 3
+    mat* A2 = new_mat(2, 2);
+    A2->values[0][0] = 2.0; A2->values[0][1] = 1.0;
+    A2->values[1][0] = 1.0; A2->values[1][1] = 2.0;
+    mat* ev2 = NULL, * V2 = NULL;
+    test_assert(mat_sym_eig(A2, &ev2, &V2) == 1, "mat_sym_eig returns 1 for success");
+    test_assert(fabs(ev2->values[0][0] - 1.0) < EPSILON && fabs(ev2->values[1][0] - 3.0) < EPSILON,
+                "mat_sym_eig finds eigenvalues in ascending order");
+
+    // random symmetric matrix large enough for blocking and divide and conquer
+    unsigned int n = 150;
+    mat* R = random_square_mat(n, -1.0, 1.0);
+    mat* A = new_mat(n, n);
+    for (unsigned int i = 0; i < n; i++) {
+        for (unsigned int j = 0; j <= i; j++) {
+            A->values[i][j] = A->values[j][i] = R->values[i][j];
+        }
+    }
+    mat* ev = NULL, * V = NULL;
+    mat_sym_eig(A, &ev, &V);
+    test_assert(eig_residual(A, ev, V) < 1e-10, "mat_sym_eig satisfies A*V = V*D");
+    test_assert(orth_error(V) < 1e-10, "mat_sym_eig eigenvectors are orthonormal");
+
+    int sorted = 1;
+    for (unsigned int i = 1; i < n; i++) {
+        if (ev->values[i][0] < ev->values[i - 1][0]) sorted = 0;
+    }
+    test_assert(sorted, "mat_sym_eig eigenvalues are sorted");
+
+    mat* ev_only = NULL;
+    test_assert(mat_sym_eig(A, &ev_only, NULL) == 1, "mat_sym_eig supports eigenvalues-only mode");
+    test_assert(mat_equal(ev, ev_only, 1e-10), "eigenvalues-only mode agrees with full mode");
+
+    // cycle graph Laplacian: repeated eigenvalues 2 - 2cos(2 pi k / n) exercise deflation
+    unsigned int c = 80;
+    mat* Lc = new_mat(c, c);
+    for (unsigned int i = 0; i < c; i++) {
+        Lc->values[i][i] = 2.0;
+        Lc->values[i][(i + 1) % c] = -1.0;
+        Lc->values[(i + 1) % c][i] = -1.0;
+    }
+    mat* evc = NULL, * Vc = NULL;
+    mat_sym_eig(Lc, &evc, &Vc);
+    test_assert(fabs(evc->values[0][0]) < 1e-10 && fabs(evc->values[c - 1][0] - 4.0) < 1e-10,
+                "mat_sym_eig finds extreme Laplacian eigenvalues");
+    test_assert(eig_residual(Lc, evc, Vc) < 1e-10 && orth_error(Vc) < 1e-10,
+                "mat_sym_eig handles repeated eigenvalues");
+
+    mat* bad = new_mat(2, 3);
+    mat* evb = NULL;
+    test_assert(mat_sym_eig(bad, &evb, NULL) == 0, "mat_sym_eig returns 0 for non-square matrix");
+
+    free_mat(A2);
+    free_mat(ev2);
+    free_mat(V2);
+    free_mat(R);
+    free_mat(A);
+    free_mat(ev);
+    free_mat(V);
+    free_mat(ev_only);
+    free_mat(Lc);
+    free_mat(evc);
+    free_mat(Vc);
+    free_mat(bad);
+}
+
+void test_mat_hessenberg() {
+    printf("\n--- Testing mat_hessenberg ---\n");
+
+    unsigned int n = 8;
+    mat* A = random_square_mat(n, -1.0, 1.0);
+    mat* H = NULL, * Q = NULL;
+    test_assert(mat_hessenberg(A, &H, &Q) == 1, "mat_hessenberg returns 1 for success");
+
+    int hess = 1;
+    for (unsigned int i = 2; i < n; i++) {
+        for (unsigned int j = 0; j + 1 < i; j++) {
+            if (H->values[i][j] != 0.0) hess = 0;
+        }
+    }
+    test_assert(hess, "mat_hessenberg result is upper Hessenberg");
+    test_assert(orth_error(Q) < 1e-12, "mat_hessenberg Q is orthogonal");
+
+    mat* QH = mat_dot_r(Q, H);
+    mat* Qt = mat_transpose(Q);
+    mat* QHQt = mat_dot_r(QH, Qt);
+    test_assert(mat_equal(A, QHQt, 1e-12), "mat_hessenberg satisfies A = Q*H*Q^T");
+
+    free_mat(A);
+    free_mat(H);
+    free_mat(Q);
+    free_mat(QH);
+    free_mat(Qt);
+    free_mat(QHQt);
+}
+
+void test_mat_eig() {
+    printf("\n--- Testing mat_eig ---\n");
+
+    // rotation generator has eigenvalues +i and -i
+    mat* R = new_mat(2, 2);
+    R->values[0][1] = -1.0;
+    R->values[1][0] = 1.0;
+    mat* ev = NULL;
+    test_assert(mat_eig(R, &ev, NULL, NULL) == 1, "mat_eig returns 1 for success");
+    test_assert(fabs(ev->values[0][0]) < EPSILON && fabs(ev->values[0][1] - 1.0) < EPSILON &&
+                fabs(ev->values[1][1] + 1.0) < EPSILON, "mat_eig returns complex conjugate pair");
+
+    // companion matrix of (x-1)(x-2)(x-3) = x^3 - 6x^2 + 11x - 6
+    mat* C = new_mat(3, 3);
+    C->values[0][0] = 6.0; C->values[0][1] = -11.0; C->values[0][2] = 6.0;
+    C->values[1][0] = 1.0;
+    C->values[2][1] = 1.0;
+    mat* evc = NULL;
+    mat_eig(C, &evc, NULL, NULL);
+    int found[3] = {0, 0, 0};
+    for (unsigned int i = 0; i < 3; i++) {
+        for (unsigned int k = 0; k < 3; k++) {
+            if (fabs(evc->values[i][0] - (k + 1)) < 1e-8 && fabs(evc->values[i][1]) < 1e-8) found[k] = 1;
+        }
+    }
+    test_assert(found[0] && found[1] && found[2], "mat_eig finds real roots of companion matrix");
+
+    // random matrix: real Schur form A = Z*T*Z^T and trace = sum of eigenvalues
+    unsigned int n = 60;
+    mat* A = random_square_mat(n, -1.0, 1.0);
+    mat* eva = NULL, * T = NULL, * Z = NULL;
+    test_assert(mat_eig(A, &eva, &T, &Z) == 1, "mat_eig computes Schur form");
+    test_assert(orth_error(Z) < 1e-12, "mat_eig Schur vectors are orthogonal");
+    mat* ZT = mat_dot_r(Z, T);
+    mat* Zt = mat_transpose(Z);
+    mat* ZTZt = mat_dot_r(ZT, Zt);
+    test_assert(mat_equal(A, ZTZt, 1e-11), "mat_eig satisfies A = Z*T*Z^T");
+
+    int quasi = 1;
+    for (unsigned int i = 2; i < n; i++) {
+        for (unsigned int j = 0; j + 1 < i; j++) {
+            if (T->values[i][j] != 0.0) quasi = 0;
+        }
+        if (T->values[i][i - 1] != 0.0 && T->values[i - 1][i - 2] != 0.0) quasi = 0;
+    }
+    test_assert(quasi, "mat_eig T is quasi upper triangular");
+
+    double trace = 0.0, sum_re = 0.0, sum_im = 0.0;
+    for (unsigned int i = 0; i < n; i++) {
+        trace += A->values[i][i];
+        sum_re += eva->values[i][0];
+        sum_im += eva->values[i][1];
+    }
+    test_assert(fabs(trace - sum_re) < 1e-10 && fabs(sum_im) < 1e-10, "mat_eig eigenvalues sum to trace");
+
+    mat* ev_only = NULL;
+    mat_eig(A, &ev_only, NULL, NULL);
+    double worst = 0.0;
+    for (unsigned int i = 0; i < n; i++) {
+        double best = 1e300;
+        for (unsigned int j = 0; j < n; j++) {
+            double d = hypot(ev_only->values[i][0] - eva->values[j][0], ev_only->values[i][1] - eva->values[j][1]);
+            if (d < best) best = d;
+        }
+        if (best > worst) worst = best;
+    }
+    test_assert(worst < 1e-10, "mat_eig eigenvalues-only mode agrees with Schur mode");
+
+    free_mat(R);
+    free_mat(ev);
+    free_mat(C);
+    free_mat(evc);
+    free_mat(A);
+    free_mat(eva);
+    free_mat(T);
+    free_mat(Z);
+    free_mat(ZT);
+    free_mat(Zt);
+    free_mat(ZTZt);
+    free_mat(ev_only);
+}
+
+// largest entry of |A - U*diag(S)*V^T|
+static double svd_error(mat* A, mat* U, mat* S, mat* V) {
+    mat* US = mat_cp(U);
+    for (unsigned int j = 0; j < S->num_rows && j < US->num_cols; j++) {
+        mat_col_mult_r(US, j, S->values[j][0]);
+    }
+    for (unsigned int j = S->num_rows; j < US->num_cols; j++) {
+        mat_col_mult_r(US, j, 0.0);
+    }
+    unsigned int k = US->num_cols < V->num_cols ? US->num_cols : V->num_cols;
+    double worst = 0.0;
+    for (unsigned int i = 0; i < A->num_rows; i++) {
+        for (unsigned int j = 0; j < A->num_cols; j++) {
+            double sum = 0.0;
+            for (unsigned int l = 0; l < k; l++) sum += US->values[i][l] * V->values[j][l];
+            if (fabs(sum - A->values[i][j]) > worst) worst = fabs(sum - A->values[i][j]);
+        }
+    }
+    free_mat(US);
+    return worst;
+}
+
+void test_mat_svd() {
+    printf("\n--- Testing mat_svd ---\n");
+
+    // diagonal matrix: singular values are the sorted absolute diagonal
+    mat* D = new_mat(3, 3);
+    D->values[0][0] = 1.0; D->values[1][1] = -5.0; D->values[2][2] = 3.0;
+    mat* Sd = NULL;
+    test_assert(mat_svd(D, NULL, &Sd, NULL, 0) == 1, "mat_svd returns 1 for success");
+    test_assert(fabs(Sd->values[0][0] - 5.0) < EPSILON && fabs(Sd->values[1][0] - 3.0) < EPSILON &&
+                fabs(Sd->values[2][0] - 1.0) < EPSILON, "mat_svd values-only mode finds sorted singular values");
+
+    // tall matrix, thin and full
+    mat* A = random_mat(60, 15, -1.0, 1.0);
+    mat* U = NULL, * S = NULL, * V = NULL;
+    mat_svd(A, &U, &S, &V, 0);
+    test_assert(U->num_rows == 60 && U->num_cols == 15 && V->num_rows == 15 && V->num_cols == 15,
+                "mat_svd thin factors have correct dimensions");
+    test_assert(svd_error(A, U, S, V) < 1e-12, "mat_svd thin satisfies A = U*S*V^T");
+    test_assert(orth_error(U) < 1e-12 && orth_error(V) < 1e-12, "mat_svd singular vectors are orthonormal");
+
+    mat* Uf = NULL, * Sf = NULL, * Vf = NULL;
+    mat_svd(A, &Uf, &Sf, &Vf, 1);
+    test_assert(Uf->num_rows == 60 && Uf->num_cols == 60, "mat_svd full U is square");
+    test_assert(orth_error(Uf) < 1e-12 && svd_error(A, Uf, Sf, Vf) < 1e-12, "mat_svd full U is orthogonal and reconstructs A");
+
+    // singular values squared are the eigenvalues of A^T A
+    mat* At = mat_transpose(A);
+    mat* AtA = mat_dot_r(At, A);
+    mat* ev = NULL;
+    mat_sym_eig(AtA, &ev, NULL);
+    int match = 1;
+    for (unsigned int i = 0; i < 15; i++) {
+        if (fabs(S->values[i][0] * S->values[i][0] - ev->values[14 - i][0]) > 1e-9) match = 0;
+    }
+    test_assert(match, "mat_svd singular values match eigenvalues of A^T A");
+
+    // wide, rank-deficient matrix (third row = first + second)
+    mat* W = random_mat(3, 20, -1.0, 1.0);
+    for (unsigned int j = 0; j < 20; j++) W->values[2][j] = W->values[0][j] + W->values[1][j];
+    mat* Uw = NULL, * Sw = NULL, * Vw = NULL;
+    mat_svd(W, &Uw, &Sw, &Vw, 0);
+    test_assert(Uw->num_rows == 3 && Uw->num_cols == 3 && Vw->num_rows == 20 && Vw->num_cols == 3,
+                "mat_svd wide thin factors have correct dimensions");
+    test_assert(fabs(Sw->values[2][0]) < 1e-12, "mat_svd detects rank deficiency");
+    test_assert(svd_error(W, Uw, Sw, Vw) < 1e-12 && orth_error(Vw) < 1e-12, "mat_svd wide rank-deficient reconstructs A");
+
+    free_mat(D);
+    free_mat(Sd);
+    free_mat(A);
+    free_mat(U);
+    free_mat(S);
+    free_mat(V);
+    free_mat(Uf);
+    free_mat(Sf);
+    free_mat(Vf);
+    free_mat(At);
+    free_mat(AtA);
+    free_mat(ev);
+    free_mat(W);
+    free_mat(Uw);
+    free_mat(Sw);
+    free_mat(Vw);
+
+    // exactly rank-1, tall and wide: the null-space columns sit at roundoff
+    // level and must not keep the sweeps going
+    unsigned int shapes[2][2] = {{100, 33}, {13, 40}};
+    for (int t = 0; t < 2; t++) {
+        mat* u = random_mat(shapes[t][0], 1, -1.0, 1.0);
+        mat* v = random_mat(1, shapes[t][1], -1.0, 1.0);
+        mat* R1 = mat_dot_r(u, v);
+        mat* Ur = NULL, * Sr = NULL, * Vr = NULL;
+        test_assert(mat_svd(R1, &Ur, &Sr, &Vr, 0) == 1, "mat_svd converges on a rank-1 matrix");
+        test_assert(Sr->values[1][0] < 1e-12 * Sr->values[0][0] && svd_error(R1, Ur, Sr, Vr) < 1e-12,
+                    "mat_svd rank-1 factors reconstruct A");
+        free_mat(u);
+        free_mat(v);
+        free_mat(R1);
+        free_mat(Ur);
+        free_mat(Sr);
+        free_mat(Vr);
+    }
+
+    // thin SVD of a very tall, rank-deficient matrix: U is m x n and the
+    // completed column must not need an m x m workspace (320 GB here)
+    mat* T = random_mat(200000, 3, -1.0, 1.0);
+    for (unsigned int i = 0; i < T->num_rows; i++) T->values[i][2] = T->values[i][0];
+    mat* Ut = NULL, * St = NULL, * Vt = NULL;
+    test_assert(mat_svd(T, &Ut, &St, &Vt, 0) == 1 && Ut->num_rows == 200000 && Ut->num_cols == 3,
+                "mat_svd thin tall-skinny U is m x n");
+    test_assert(orth_error(Ut) < 1e-12 && svd_error(T, Ut, St, Vt) < 1e-10,
+                "mat_svd tall-skinny completed U is orthonormal and reconstructs A");
+    free_mat(T);
+    free_mat(Ut);
+    free_mat(St);
+    free_mat(Vt);
+}
+
+void test_mat_tsqr() {
+    printf("\n--- Testing mat_tsqr ---\n");
+
+    // 1000 rows span several leaf blocks of the reduction tree
+    mat* A = random_mat(1000, 7, -1.0, 1.0);
+    mat* b = random_mat(1000, 2, -1.0, 1.0);
+
+    mat* R = NULL;
+    test_assert(mat_tsqr_decomp(A, &R) == 1, "mat_tsqr_decomp returns 1 for success");
+    mat* At = mat_transpose(A);
+    mat* AtA = mat_dot_r(At, A);
+    mat* Rt = mat_transpose(R);
+    mat* RtR = mat_dot_r(Rt, R);
+    int upper = 1;
+    for (unsigned int i = 1; i < 7; i++) {
+        for (unsigned int j = 0; j < i; j++) {
+            if (R->values[i][j] != 0.0) upper = 0;
+        }
+    }
+    test_assert(upper, "mat_tsqr_decomp R is upper triangular");
+    test_assert(mat_equal(RtR, AtA, 1e-9), "mat_tsqr_decomp satisfies R^T*R = A^T*A");
+
+    // least squares: the residual is orthogonal to the columns of A
+    mat* x = mat_tsqr_lstsq(A, b);
+    test_assert(x != NULL && x->num_rows == 7 && x->num_cols == 2, "mat_tsqr_lstsq returns n x k solution");
+    mat* Ax = mat_dot_r(A, x);
+    mat* res = mat_sub(Ax, b);
+    mat* normal = mat_dot_r(At, res);
+    double worst = 0.0;
+    for (unsigned int i = 0; i < 7; i++) {
+        for (unsigned int j = 0; j < 2; j++) {
+            if (fabs(normal->values[i][j]) > worst) worst = fabs(normal->values[i][j]);
+        }
+    }
+    test_assert(worst < 1e-10, "mat_tsqr_lstsq satisfies the normal equations");
+
+    // consistent system is solved exactly
+    mat* xt = random_mat(7, 1, -1.0, 1.0);
+    mat* bt = mat_dot_r(A, xt);
+    mat* xs = mat_tsqr_lstsq(A, bt);
+    test_assert(mat_equal(xs, xt, 1e-10), "mat_tsqr_lstsq recovers exact solution");
+
+    // streaming row chunks gives the same answer
+    mat_tsqr* state = mat_tsqr_begin(7, 2);
+    int pushed = 1;
+    for (unsigned int start = 0; start < 1000; start += 137) {
+        unsigned int count = 1000 - start < 137 ? 1000 - start : 137;
+        mat* Ac = new_mat(count, 7);
+        mat* bc = new_mat(count, 2);
+        for (unsigned int i = 0; i < count; i++) {
+            for (unsigned int j = 0; j < 7; j++) Ac->values[i][j] = A->values[start + i][j];
+            for (unsigned int j = 0; j < 2; j++) bc->values[i][j] = b->values[start + i][j];
+        }
+        pushed &= mat_tsqr_push(state, Ac, bc);
+        free_mat(Ac);
+        free_mat(bc);
+    }
+    test_assert(pushed && state->rows_seen == 1000, "mat_tsqr_push absorbs every chunk");
+    mat* xstream = mat_tsqr_solve(state);
+    test_assert(mat_equal(xstream, x, 1e-10), "mat_tsqr streaming solution matches in-memory solution");
+    mat* Rs = mat_tsqr_r(state);
+    mat* Rst = mat_transpose(Rs);
+    mat* RstRs = mat_dot_r(Rst, Rs);
+    test_assert(mat_equal(RstRs, AtA, 1e-9), "mat_tsqr_r streaming factor satisfies R^T*R = A^T*A");
+
+    // invalid inputs
+    mat* wide = new_mat(3, 5);
+    mat* Rw = NULL;
+    test_assert(mat_tsqr_decomp(wide, &Rw) == 0, "mat_tsqr_decomp returns 0 for wide matrix");
+    test_assert(mat_tsqr_lstsq(A, xt) == NULL, "mat_tsqr_lstsq returns NULL for mismatched b");
+    mat* Abad = new_mat(4, 6);
+    test_assert(mat_tsqr_push(state, Abad, NULL) == 0, "mat_tsqr_push rejects chunk with wrong width");
+    mat_tsqr* few = mat_tsqr_begin(7, 1);
+    test_assert(mat_tsqr_solve(few) == NULL, "mat_tsqr_solve returns NULL before enough rows");
+
+    mat_tsqr_free(state);
+    mat_tsqr_free(few);
+    free_mat(A);
+    free_mat(b);
+    free_mat(R);
+    free_mat(At);
+    free_mat(AtA);
+    free_mat(Rt);
+    free_mat(RtR);
+    free_mat(x);
+    free_mat(Ax);
+    free_mat(res);
+    free_mat(normal);
+    free_mat(xt);
+    free_mat(bt);
+    free_mat(xs);
+    free_mat(xstream);
+    free_mat(Rs);
+    free_mat(Rst);
+    free_mat(RstRs);
+    free_mat(wide);
+    free_mat(Abad);
+}
+
+// largest entry of |X*Y^T - A|, Y == NULL means X*X^T
+static double product_error(mat* X, mat* Y, mat* A) {
+    mat* Yt = mat_transpose(Y ? Y : X);
+    mat* XY = mat_dot_r(X, Yt);
+    double worst = 0.0;
+    for (unsigned int i = 0; i < A->num_rows; i++) {
+        for (unsigned int j = 0; j < A->num_cols; j++) {
+            double r = fabs(XY->values[i][j] - A->values[i][j]);
+            if (r > worst) worst = r;
+        }
+    }
+    free_mat(Yt);
+    free_mat(XY);
+    return worst;
+}
+
+// M += sign * u*v^T
+static void add_outer(mat* M, mat* u, mat* v, double sign) {
+    for (unsigned int i = 0; i < M->num_rows; i++) {
+        for (unsigned int j = 0; j < M->num_cols; j++) {
+            M->values[i][j] += sign * u->values[i][0] * v->values[j][0];
+        }
+    }
+}
+
+static int is_upper(mat* R) {
+    for (unsigned int i = 1; i < R->num_rows; i++) {
+        for (unsigned int j = 0; j < i && j < R->num_cols; j++) {
+            if (R->values[i][j] != 0.0) return 0;
+        }
+    }
+    return 1;
+}
+
+void test_mat_chol() {
+    printf("\n--- Testing mat_chol ---\n");
+
+    // SPD matrix B^T B + n I
+    mat* B = random_mat(12, 12, -1.0, 1.0);
+    mat* Bt = mat_transpose(B);
+    mat* A = mat_dot_r(Bt, B);
+    for (unsigned int i = 0; i < 12; i++) A->values[i][i] += 12.0;
+
+    mat* L = NULL;
+    test_assert(mat_chol_decomp(A, &L) == 1, "mat_chol_decomp returns 1 for SPD matrix");
+    mat* Lt = mat_transpose(L);
+    test_assert(is_upper(Lt) && product_error(L, NULL, A) < 1e-12, "mat_chol_decomp satisfies A = L*L^T");
+
+    mat* b = random_mat(12, 1, -1.0, 1.0);
+    mat* x = mat_chol_solve(L, b);
+    test_assert(x != NULL && residual_norm(A, x, b) < 1e-12, "mat_chol_solve finds correct solution");
+
+    // update then downdate restores the original factor
+    mat* u = random_mat(12, 1, -1.0, 1.0);
+    test_assert(mat_chol_update(L, u) == 1, "mat_chol_update returns 1 for success");
+    add_outer(A, u, u, 1.0);
+    test_assert(product_error(L, NULL, A) < 1e-11, "mat_chol_update satisfies L*L^T = A + u*u^T");
+    test_assert(mat_chol_downdate(L, u) == 1, "mat_chol_downdate returns 1 for success");
+    add_outer(A, u, u, -1.0);
+    int positive = 1;
+    for (unsigned int i = 0; i < 12; i++) {
+        if (L->values[i][i] <= 0.0) positive = 0;
+    }
+    test_assert(positive && product_error(L, NULL, A) < 1e-11, "mat_chol_downdate satisfies L*L^T = A - u*u^T");
+
+    // downdating past positive definiteness is refused and leaves L unchanged
+    mat* big = new_mat(12, 1);
+    big->values[0][0] = 100.0;
+    mat* Lcp = mat_cp(L);
+    test_assert(mat_chol_downdate(L, big) == 0 && mat_equal(L, Lcp, 0.0), "mat_chol_downdate rejects indefinite result");
+
+    mat* indef = eye_mat(3);
+    indef->values[1][1] = -1.0;
+    mat* Li = NULL;
+    test_assert(mat_chol_decomp(indef, &Li) == 0, "mat_chol_decomp returns 0 for indefinite matrix");
+
+    free_mat(B);
+    free_mat(Bt);
+    free_mat(A);
+    free_mat(L);
+    free_mat(Lt);
+    free_mat(b);
+    free_mat(x);
+    free_mat(u);
+    free_mat(big);
+    free_mat(Lcp);
+    free_mat(indef);
+}
+
+void test_mat_lup_update() {
+    printf("\n--- Testing mat_lup_update ---\n");
+
+    mat* A = random_mat(10, 10, -1.0, 1.0);
+    for (unsigned int i = 0; i < 10; i++) A->values[i][i] += 5.0;
+    mat* L = NULL, * U = NULL, * P = NULL;
+    mat_lup_decomp(A, &L, &U, &P);
+    mat* u = random_mat(10, 1, -1.0, 1.0);
+    mat* v = random_mat(10, 1, -1.0, 1.0);
+    test_assert(mat_lup_update(L, U, P, u, v) == 1, "mat_lup_update returns 1 for success");
+    add_outer(A, u, v, 1.0);
+    mat* PA = mat_dot_r(P, A);
+    mat* Ut = mat_transpose(U);
+    test_assert(product_error(L, Ut, PA) < 1e-12, "mat_lup_update satisfies P*(A + u*v^T) = L*U");
+
+    // the updated factors solve the updated system
+    mat* b = random_mat(10, 1, -1.0, 1.0);
+    mat* x = mat_lup_solve(L, U, P, b);
+    test_assert(x != NULL && residual_norm(A, x, b) < 1e-12, "mat_lup_update factors solve updated system");
+
+    // an update that makes the matrix singular is reported
+    mat* S = eye_mat(2);
+    mat* Ls = NULL, * Us = NULL, * Ps = NULL;
+    mat_lup_decomp(S, &Ls, &Us, &Ps);
+    mat* e = new_mat(2, 1);
+    e->values[0][0] = 1.0;
+    mat* me = new_mat(2, 1);
+    me->values[0][0] = -1.0;
+    test_assert(mat_lup_update(Ls, Us, Ps, e, me) == 0, "mat_lup_update returns 0 when a pivot vanishes");
+
+    free_mat(A);
+    free_mat(L);
+    free_mat(U);
+    free_mat(P);
+    free_mat(u);
+    free_mat(v);
+    free_mat(PA);
+    free_mat(Ut);
+    free_mat(b);
+    free_mat(x);
+    free_mat(S);
+    free_mat(Ls);
+    free_mat(Us);
+    free_mat(Ps);
+    free_mat(e);
+    free_mat(me);
+}
+
+void test_mat_qr_update() {
+    printf("\n--- Testing mat_qr_update ---\n");
+
+    mat* A = random_mat(15, 6, -1.0, 1.0);
+    mat* Q = NULL, * R = NULL;
+    mat_qr_decomp(A, &Q, &R);
+
+    // rank-one update with u partly outside range(Q)
+    mat* u = random_mat(15, 1, -1.0, 1.0);
+    mat* v = random_mat(6, 1, -1.0, 1.0);
+    test_assert(mat_qr_update(Q, R, u, v) == 1, "mat_qr_update returns 1 for success");
+    add_outer(A, u, v, 1.0);
+    mat* Rt = mat_transpose(R);
+    test_assert(is_upper(R) && product_error(Q, Rt, A) < 1e-12, "mat_qr_update satisfies Q*R = A + u*v^T");
+    test_assert(orth_error(Q) < 1e-12, "mat_qr_update keeps Q orthonormal");
+
+    // square case: u always lies in range(Q)
+    mat* As = random_mat(5, 5, -1.0, 1.0);
+    mat* Qs = NULL, * Rs = NULL;
+    mat_qr_decomp(As, &Qs, &Rs);
+    mat* us = random_mat(5, 1, -1.0, 1.0);
+    mat* vs = random_mat(5, 1, -1.0, 1.0);
+    mat_qr_update(Qs, Rs, us, vs);
+    add_outer(As, us, vs, 1.0);
+    mat* Rst = mat_transpose(Rs);
+    test_assert(product_error(Qs, Rst, As) < 1e-12 && orth_error(Qs) < 1e-12, "mat_qr_update works for square Q");
+
+    // insert a row in the middle
+    mat* a = random_mat(1, 6, -1.0, 1.0);
+    test_assert(mat_qr_insert_row(&Q, &R, 4, a) == 1, "mat_qr_insert_row returns 1 for success");
+    mat* rows[3];
+    rows[0] = new_mat(4, 6);
+    rows[1] = a;
+    rows[2] = new_mat(11, 6);
+    for (unsigned int i = 0; i < 15; i++) {
+        for (unsigned int j = 0; j < 6; j++) {
+            if (i < 4) rows[0]->values[i][j] = A->values[i][j];
+            else rows[2]->values[i - 4][j] = A->values[i][j];
+        }
+    }
+    mat* Ai = mat_vert_cat(3, rows);
+    mat* Rit = mat_transpose(R);
+    test_assert(Q->num_rows == 16 && is_upper(R) && product_error(Q, Rit, Ai) < 1e-12,
+                "mat_qr_insert_row satisfies Q*R = A with inserted row");
+    test_assert(orth_error(Q) < 1e-12, "mat_qr_insert_row keeps Q orthonormal");
+
+    // deleting the same row gives back the updated A
+    test_assert(mat_qr_delete_row(&Q, &R, 4) == 1, "mat_qr_delete_row returns 1 for success");
+    mat* Rdt = mat_transpose(R);
+    test_assert(Q->num_rows == 15 && is_upper(R) && product_error(Q, Rdt, A) < 1e-12,
+                "mat_qr_delete_row satisfies Q*R = A without the row");
+    test_assert(orth_error(Q) < 1e-12, "mat_qr_delete_row keeps Q orthonormal");
+    test_assert(mat_qr_delete_row(&Qs, &Rs, 0) == 0, "mat_qr_delete_row returns 0 when too few rows remain");
+
+    // high-leverage rows: row 3 scaled up, and finally the only row touching
+    // column 0, which puts e_3 inside range(Q)
+    double scales[3] = {30.0, 300.0, 0.0};
+    for (int t = 0; t < 3; t++) {
+        mat* H = random_mat(12, 4, -1.0, 1.0);
+        if (scales[t] > 0.0) {
+            mat_row_mult_r(H, 3, scales[t]);
+        } else {
+            for (unsigned int i = 0; i < 12; i++) H->values[i][0] = (i == 3) ? 2.0 : 0.0;
+        }
+        mat* Qh = NULL, * Rh = NULL;
+        mat_qr_decomp(H, &Qh, &Rh);
+        test_assert(mat_qr_delete_row(&Qh, &Rh, 3) == 1, "mat_qr_delete_row handles a high-leverage row");
+        mat* Hd = mat_remove_row(H, 3);
+        mat* Rht = mat_transpose(Rh);
+        // downdating a dominant row is conditioned like scale^2, hence 1e-9
+        test_assert(is_upper(Rh) && product_error(Qh, Rht, Hd) < 1e-9 && orth_error(Qh) < 1e-12,
+                    "mat_qr_delete_row of a high-leverage row reconstructs A");
+        free_mat(H);
+        free_mat(Qh);
+        free_mat(Rh);
+        free_mat(Hd);
+        free_mat(Rht);
+    }
+
+    free_mat(A);
+    free_mat(Q);
+    free_mat(R);
+    free_mat(u);
+    free_mat(v);
+    free_mat(Rt);
+    free_mat(As);
+    free_mat(Qs);
+    free_mat(Rs);
+    free_mat(us);
+    free_mat(vs);
+    free_mat(Rst);
+    free_mat(a);
+    free_mat(rows[0]);
+    free_mat(rows[2]);
+    free_mat(Ai);
+    free_mat(Rit);
+    free_mat(Rdt);
+}
+
+void test_mat_qrcp() {
+    printf("\n--- Testing mat_qrcp ---\n");
+
+    // rank 5 matrix built as a 40 x 5 times 5 x 12 product
+    mat* B = random_mat(40, 5, -1.0, 1.0);
+    mat* C = random_mat(5, 12, -1.0, 1.0);
+    mat* A = mat_dot_r(B, C);
+    mat* Q = NULL, * R = NULL, * P = NULL;
+    unsigned int rank = 0;
+    test_assert(mat_qrcp_decomp(A, &Q, &R, &P, &rank) == 1, "mat_qrcp_decomp returns 1 for success");
+    test_assert(rank == 5, "mat_qrcp_decomp detects numerical rank of rank-deficient matrix");
+    mat* AP = mat_dot_r(A, P);
+    mat* Rt = mat_transpose(R);
+    test_assert(Q->num_rows == 40 && Q->num_cols == 12 && product_error(Q, Rt, AP) < 1e-12,
+                "mat_qrcp_decomp satisfies A*P = Q*R");
+    test_assert(orth_error(Q) < 1e-12 && is_upper(R), "mat_qrcp_decomp Q is orthonormal and R upper triangular");
+    int decreasing = 1;
+    for (unsigned int i = 1; i < 12; i++) {
+        if (fabs(R->values[i][i]) > fabs(R->values[i - 1][i - 1]) * (1.0 + 1e-12)) decreasing = 0;
+    }
+    test_assert(decreasing, "mat_qrcp_decomp diagonal of R is non-increasing");
+
+    // basic solution: normal equations hold and only rank entries are nonzero
+    mat* b = random_mat(40, 1, -1.0, 1.0);
+    mat* x = mat_qrcp_solve(Q, R, P, rank, b);
+    mat* At = mat_transpose(A);
+    mat* Ax = mat_dot_r(A, x);
+    mat* res = mat_sub(Ax, b);
+    mat* normal = mat_dot_r(At, res);
+    double worst = 0.0;
+    unsigned int nonzero = 0;
+    for (unsigned int i = 0; i < 12; i++) {
+        if (fabs(normal->values[i][0]) > worst) worst = fabs(normal->values[i][0]);
+        if (x->values[i][0] != 0.0) nonzero++;
+    }
+    test_assert(worst < 1e-10 && nonzero == 5, "mat_qrcp_solve returns basic least-squares solution");
+
+    // full-rank matrix wider than one block agrees with TSQR
+    mat* F = random_mat(120, 70, -1.0, 1.0);
+    mat* Qf = NULL, * Rf = NULL, * Pf = NULL;
+    unsigned int rank_f = 0;
+    mat_qrcp_decomp(F, &Qf, &Rf, &Pf, &rank_f);
+    mat* FP = mat_dot_r(F, Pf);
+    mat* Rft = mat_transpose(Rf);
+    test_assert(rank_f == 70 && product_error(Qf, Rft, FP) < 1e-12 && orth_error(Qf) < 1e-12,
+                "mat_qrcp_decomp blocked path factors full-rank matrix");
+    mat* bf = random_mat(120, 1, -1.0, 1.0);
+    mat* xf = mat_qrcp_solve(Qf, Rf, Pf, rank_f, bf);
+    mat* xt = mat_tsqr_lstsq(F, bf);
+    test_assert(mat_equal(xf, xt, 1e-10), "mat_qrcp_solve matches TSQR least squares for full rank");
+
+    // wide matrix: k = min(m, n)
+    mat* W = random_mat(4, 9, -1.0, 1.0);
+    mat* Qw = NULL, * Rw = NULL, * Pw = NULL;
+    unsigned int rank_w = 0;
+    mat_qrcp_decomp(W, &Qw, &Rw, &Pw, &rank_w);
+    mat* WP = mat_dot_r(W, Pw);
+    mat* Rwt = mat_transpose(Rw);
+    test_assert(rank_w == 4 && Rw->num_rows == 4 && Rw->num_cols == 9 && product_error(Qw, Rwt, WP) < 1e-12,
+                "mat_qrcp_decomp handles wide matrices");
+    mat* bw = random_mat(3, 1, -1.0, 1.0);
+    test_assert(mat_qrcp_solve(Qw, Rw, Pw, rank_w, bw) == NULL, "mat_qrcp_solve returns NULL for invalid dimensions");
+
+    free_mat(B);
+    free_mat(C);
+    free_mat(A);
+    free_mat(Q);
+    free_mat(R);
+    free_mat(P);
+    free_mat(AP);
+    free_mat(Rt);
+    free_mat(b);
+    free_mat(x);
+    free_mat(At);
+    free_mat(Ax);
+    free_mat(res);
+    free_mat(normal);
+    free_mat(F);
+    free_mat(Qf);
+    free_mat(Rf);
+    free_mat(Pf);
+    free_mat(FP);
+    free_mat(Rft);
+    free_mat(bf);
+    free_mat(xf);
+    free_mat(xt);
+    free_mat(W);
+    free_mat(Qw);
+    free_mat(Rw);
+    free_mat(Pw);
+    free_mat(WP);
+    free_mat(Rwt);
+    free_mat(bw);
+}
+
+// exact ||A^-1||_1 by solving for every column of the inverse
+static double inv_norm1_exact(mat* L, mat* U, mat* P) {
+    unsigned int n = L->num_rows;
+    double norm = 0.0;
+    for (unsigned int j = 0; j < n; j++) {
+        mat* e = new_mat(n, 1);
+        e->values[j][0] = 1.0;
+        mat* col = mat_lup_solve(L, U, P, e);
+        double sum = 0.0;
+        for (unsigned int i = 0; i < n; i++) sum += fabs(col->values[i][0]);
+        if (sum > norm) norm = sum;
+        free_mat(e);
+        free_mat(col);
+    }
+    return norm;
+}
+
+void test_mat_rcond() {
+    printf("\n--- Testing mat_rcond ---\n");
+
+    mat* N = new_mat(2, 2);
+    N->values[0][0] = 1.0; N->values[0][1] = -7.0;
+    N->values[1][0] = 2.0; N->values[1][1] = 3.0;
+    test_assert(fabs(mat_norm1(N) - 10.0) < EPSILON, "mat_norm1 is the maximum column sum");
+
+    // the estimate never exceeds the true condition number and is close to it
+    mat* A = random_mat(30, 30, -1.0, 1.0);
+    double anorm = mat_norm1(A);
+    mat* L = NULL, * U = NULL, * P = NULL;
+    mat_lup_decomp(A, &L, &U, &P);
+    double rcond = mat_lup_rcond(L, U, P, anorm);
+    double exact = 1.0 / (anorm * inv_norm1_exact(L, U, P));
+    test_assert(rcond >= exact * (1.0 - 1e-10) && rcond <= 3.0 * exact, "mat_lup_rcond is within a factor of 3 of the true value");
+
+    // Hilbert matrix is badly conditioned
+    mat* H = new_mat(10, 10);
+    for (unsigned int i = 0; i < 10; i++) {
+        for (unsigned int j = 0; j < 10; j++) H->values[i][j] = 1.0 / (i + j + 1);
+    }
+    mat* Lh = NULL, * Uh = NULL, * Ph = NULL;
+    mat_lup_decomp(H, &Lh, &Uh, &Ph);
+    test_assert(mat_lup_rcond(Lh, Uh, Ph, mat_norm1(H)) < 1e-12, "mat_lup_rcond flags ill-conditioned matrix");
+
+    // Cholesky on the Hilbert matrix, identity is perfectly conditioned
+    mat* Lc = NULL;
+    mat_chol_decomp(H, &Lc);
+    double rc = mat_chol_rcond(Lc, mat_norm1(H));
+    test_assert(rc > 0.0 && rc < 1e-12, "mat_chol_rcond flags ill-conditioned matrix");
+    mat* I = eye_mat(6);
+    mat* Li = NULL;
+    mat_chol_decomp(I, &Li);
+    test_assert(fabs(mat_chol_rcond(Li, 1.0) - 1.0) < EPSILON, "mat_chol_rcond is 1 for identity");
+
+    // QR: diagonal R has exact estimate min|r_ii| / max|r_ii|
+    mat* R = new_mat(3, 3);
+    R->values[0][0] = 4.0; R->values[1][1] = -2.0; R->values[2][2] = 0.5;
+    test_assert(fabs(mat_qr_rcond(R) - 0.125) < EPSILON, "mat_qr_rcond is exact for diagonal R");
+    mat* Q = NULL, * Rq = NULL;
+    mat_qr_decomp(A, &Q, &Rq);
+    double rq = mat_qr_rcond(Rq);
+    test_assert(rq > exact / 30.0 && rq < exact * 30.0, "mat_qr_rcond agrees with LU estimate to within a factor of n");
+
+    // singular factors
+    U->values[5][5] = 0.0;
+    test_assert(mat_lup_rcond(L, U, P, anorm) == 0.0, "mat_lup_rcond returns 0 for singular U");
+    test_assert(mat_lup_rcond(L, R, P, anorm) < 0.0, "mat_lup_rcond returns -1 for mismatched factors");
+
+    free_mat(N);
+    free_mat(A);
+    free_mat(L);
+    free_mat(U);
+    free_mat(P);
+    free_mat(H);
+    free_mat(Lh);
+    free_mat(Uh);
+    free_mat(Ph);
+    free_mat(Lc);
+    free_mat(I);
+    free_mat(Li);
+    free_mat(R);
+    free_mat(Q);
+    free_mat(Rq);
+}
+
+void test_mat_pow() {
+    printf("\n--- Testing mat_pow ---\n");
+
+    mat* A = random_mat(7, 7, -1.0, 1.0);
+    mat* P0 = mat_pow(A, 0);
+    mat* I = eye_mat(7);
+    test_assert(mat_equal(P0, I, 0.0), "mat_pow with exponent 0 returns identity");
+    mat* P1 = mat_pow(A, 1);
+    test_assert(mat_equal(P1, A, 0.0), "mat_pow with exponent 1 returns a copy");
+
+    // compare against repeated multiplication
+    mat* chain = mat_cp(A);
+    for (unsigned int i = 1; i < 13; i++) {
+        mat* next = mat_dot_r(chain, A);
+        free_mat(chain);
+        chain = next;
+    }
+    mat* P13 = mat_pow(A, 13);
+    test_assert(mat_equal(P13, chain, 1e-10), "mat_pow matches repeated multiplication");
+
+    // Fibonacci numbers from [[1 1] [1 0]]^n
+    mat* F = new_mat(2, 2);
+    F->values[0][0] = 1.0; F->values[0][1] = 1.0; F->values[1][0] = 1.0;
+    mat* F30 = mat_pow(F, 30);
+    test_assert(F30->values[0][1] == 832040.0, "mat_pow computes Fibonacci number exactly");
+
+    mat* R = new_mat(2, 3);
+    test_assert(mat_pow(R, 2) == NULL, "mat_pow returns NULL for non-square matrix");
+
+    free_mat(A);
+    free_mat(P0);
+    free_mat(I);
+    free_mat(P1);
+    free_mat(chain);
+    free_mat(P13);
+    free_mat(F);
+    free_mat(F30);
+    free_mat(R);
+}
+
+void test_mat_expm() {
+    printf("\n--- Testing mat_expm ---\n");
+
+    // diagonal: exponentials of the entries
+    mat* D = new_mat(3, 3);
+    D->values[0][0] = 1.0; D->values[1][1] = -2.0; D->values[2][2] = 0.001;
+    mat* ED = mat_expm(D);
+    test_assert(fabs(ED->values[0][0] - exp(1.0)) < 1e-14 && fabs(ED->values[1][1] - exp(-2.0)) < 1e-14 &&
+                fabs(ED->values[2][2] - exp(0.001)) < 1e-14 && ED->values[0][1] == 0.0,
+                "mat_expm of diagonal matrix exponentiates the diagonal");
+
+    // rotation generator: exp([[0 -t] [t 0]]) = [[cos -sin] [sin cos]], large t needs scaling
+    double ts[3] = {0.01, 1.5, 40.0};
+    int rotation_ok = 1;
+    for (unsigned int k = 0; k < 3; k++) {
+        mat* G = new_mat(2, 2);
+        G->values[0][1] = -ts[k];
+        G->values[1][0] = ts[k];
+        mat* E = mat_expm(G);
+        if (fabs(E->values[0][0] - cos(ts[k])) > 1e-12 || fabs(E->values[1][0] - sin(ts[k])) > 1e-12 ||
+            fabs(E->values[0][1] + sin(ts[k])) > 1e-12) rotation_ok = 0;
+        free_mat(G);
+        free_mat(E);
+    }
+    test_assert(rotation_ok, "mat_expm of rotation generator gives rotation at all scales");
+
+    // nilpotent: exp(N) = I + N + N^2/2
+    mat* N = new_mat(3, 3);
+    N->values[0][1] = 2.0; N->values[1][2] = 3.0;
+    mat* EN = mat_expm(N);
+    test_assert(fabs(EN->values[0][2] - 3.0) < 1e-13 && fabs(EN->values[0][1] - 2.0) < 1e-13 &&
+                fabs(EN->values[0][0] - 1.0) < 1e-13, "mat_expm of nilpotent matrix is a finite series");
+
+    // exp(A) * exp(-A) = I
+    mat* A = random_mat(12, 12, -2.0, 2.0);
+    mat* mA = mat_cp(A);
+    for (unsigned int i = 0; i < 12; i++) {
+        for (unsigned int j = 0; j < 12; j++) mA->values[i][j] = -A->values[i][j];
+    }
+    mat* E1 = mat_expm(A);
+    mat* E2 = mat_expm(mA);
+    mat* prod = mat_dot_r(E1, E2);
+    mat* I = eye_mat(12);
+    test_assert(mat_equal(prod, I, 1e-9), "mat_expm(A) * mat_expm(-A) = I");
+
+    mat* R = new_mat(2, 3);
+    test_assert(mat_expm(R) == NULL, "mat_expm returns NULL for non-square matrix");
+    mat* bad = mat_cp(A);
+    bad->values[3][4] = NAN;
+    test_assert(mat_expm(bad) == NULL, "mat_expm returns NULL for NaN input");
+    bad->values[3][4] = INFINITY;
+    test_assert(mat_expm(bad) == NULL, "mat_expm returns NULL for infinite input");
+    free_mat(bad);
+
+    free_mat(D);
+    free_mat(ED);
+    free_mat(N);
+    free_mat(EN);
+    free_mat(A);
+    free_mat(mA);
+    free_mat(E1);
+    free_mat(E2);
+    free_mat(prod);
+    free_mat(I);
+    free_mat(R);
+}
+
+void test_mat_rsvd() {
+    printf("\n--- Testing mat_rsvd ---\n");
+
+    // rank 6 matrix plus tiny noise
+    mat* B = random_mat(150, 6, -1.0, 1.0);
+    mat* C = random_mat(6, 90, -1.0, 1.0);
+    mat* A = mat_dot_r(B, C);
+    mat* noise = random_mat(150, 90, -1e-10, 1e-10);
+    mat_add_r(A, noise);
+
+    // range finder captures the column space
+    mat* Q = mat_range_finder(A, 8, NULL);
+    test_assert(Q != NULL && Q->num_rows == 150 && Q->num_cols == 8 && orth_error(Q) < 1e-12,
+                "mat_range_finder returns orthonormal basis");
+    mat* Qt = mat_transpose(Q);
+    mat* QtA = mat_dot_r(Qt, A);
+    mat* QQtA = mat_dot_r(Q, QtA);
+    test_assert(mat_equal(QQtA, A, 1e-8), "mat_range_finder basis captures range of low-rank matrix");
+
+    // truncated SVD agrees with the dense SVD
+    mat* U = NULL, * S = NULL, * V = NULL;
+    test_assert(mat_rsvd(A, 6, NULL, &U, &S, &V) == 1, "mat_rsvd returns 1 for success");
+    test_assert(U->num_rows == 150 && U->num_cols == 6 && S->num_rows == 6 && V->num_rows == 90 && V->num_cols == 6,
+                "mat_rsvd factors have correct dimensions");
+    mat* Sd = NULL;
+    mat_svd(A, NULL, &Sd, NULL, 0);
+    int match = 1;
+    for (unsigned int i = 0; i < 6; i++) {
+        if (fabs(S->values[i][0] - Sd->values[i][0]) > 1e-8 * Sd->values[0][0]) match = 0;
+    }
+    test_assert(match, "mat_rsvd singular values match dense SVD");
+    test_assert(orth_error(U) < 1e-12 && orth_error(V) < 1e-12 && svd_error(A, U, S, V) < 1e-8,
+                "mat_rsvd reconstructs low-rank matrix");
+
+    // same seed gives the same sketch, power iterations are optional
+    mat_rsvd_opts opts = {4, 0, 7};
+    mat* Q1 = mat_range_finder(A, 8, &opts);
+    mat* Q2 = mat_range_finder(A, 8, &opts);
+    test_assert(mat_equal(Q1, Q2, 0.0), "mat_range_finder is reproducible for a fixed seed");
+
+    test_assert(mat_range_finder(A, 100, NULL) == NULL, "mat_range_finder returns NULL for oversized sketch");
+    mat* Ux = NULL, * Sx = NULL, * Vx = NULL;
+    test_assert(mat_rsvd(A, 0, NULL, &Ux, &Sx, &Vx) == 0, "mat_rsvd returns 0 for zero rank");
+
+    // short and very wide: the sketch is l x n with n >> l, and factoring it
+    // must not build an n x n workspace
+    mat* Bw = random_mat(40, 4, -1.0, 1.0);
+    mat* Cw = random_mat(4, 60000, -1.0, 1.0);
+    mat* Aw = mat_dot_r(Bw, Cw);
+    mat* Uw = NULL, * Sw = NULL, * Vw = NULL;
+    test_assert(mat_rsvd(Aw, 4, NULL, &Uw, &Sw, &Vw) == 1 && Vw->num_rows == 60000 && Vw->num_cols == 4,
+                "mat_rsvd handles a wide matrix with n >> l");
+    test_assert(orth_error(Uw) < 1e-12 && orth_error(Vw) < 1e-12 && svd_error(Aw, Uw, Sw, Vw) < 1e-10,
+                "mat_rsvd wide factors reconstruct A");
+
+    free_mat(B);
+    free_mat(C);
+    free_mat(A);
+    free_mat(noise);
+    free_mat(Q);
+    free_mat(Qt);
+    free_mat(QtA);
+    free_mat(QQtA);
+    free_mat(U);
+    free_mat(S);
+    free_mat(V);
+    free_mat(Sd);
+    free_mat(Q1);
+    free_mat(Q2);
+    free_mat(Bw);
+    free_mat(Cw);
+    free_mat(Aw);
+    free_mat(Uw);
+    free_mat(Sw);
+    free_mat(Vw);
+}
+
+void test_mat_lanczos() {
+    printf("\n--- Testing mat_lanczos ---\n");
+
+    // 1D Laplacian: eigenvalues 2 - 2 cos(j pi / (n + 1))
+    unsigned int n = 200;
+    double pi = acos(-1.0);
+    mat* P = poisson_mat(n);
+    mat_op op = mat_op_from_mat(P);
+    mat* evals = NULL, * evecs = NULL;
+    mat_krylov_stats stats;
+    test_assert(mat_lanczos(&op, 4, NULL, &evals, &evecs, &stats) == 1, "mat_lanczos returns 1 for success");
+    int match = 1;
+    for (unsigned int j = 0; j < 4; j++) {
+        double exact = 2.0 - 2.0 * cos((n - j) * pi / (n + 1));
+        if (fabs(evals->values[j][0] - exact) > 1e-8) match = 0;
+    }
+    test_assert(stats.converged && match, "mat_lanczos finds largest eigenvalues of Laplacian");
+    test_assert(eig_residual(P, evals, evecs) < 1e-6 && orth_error(evecs) < 1e-10,
+                "mat_lanczos eigenvectors satisfy A*v = lambda*v");
+
+    // smallest end, matrix-free operator, single Gram-Schmidt pass
+    mat_op free_op = {n, poisson_apply, &n, NULL};
+    mat_eigs_opts opts = {30, 0, 1, MAT_EIGS_SMALLEST, 1e-10};
+    mat* small = NULL;
+    mat_lanczos(&free_op, 3, &opts, &small, NULL, &stats);
+    match = 1;
+    for (unsigned int j = 0; j < 3; j++) {
+        double exact = 2.0 - 2.0 * cos((j + 1) * pi / (n + 1));
+        if (fabs(small->values[j][0] - exact) > 1e-8) match = 0;
+    }
+    test_assert(stats.converged && match, "mat_lanczos finds smallest eigenvalues with matrix-free operator");
+
+    // agrees with the dense solver on a random symmetric matrix
+    mat* B = random_mat(60, 60, -1.0, 1.0);
+    mat* Bt = mat_transpose(B);
+    mat* S = mat_add(B, Bt);
+    mat_op sop = mat_op_from_mat(S);
+    mat_eigs_opts mag = {0, 0, 0, MAT_EIGS_LARGEST_MAG, 0.0};
+    mat* sv = NULL;
+    mat_lanczos(&sop, 2, &mag, &sv, NULL, NULL);
+    mat* dense = NULL;
+    mat_sym_eig(S, &dense, NULL);
+    double top = fabs(dense->values[0][0]) > fabs(dense->values[59][0]) ? dense->values[0][0] : dense->values[59][0];
+    test_assert(fabs(sv->values[0][0] - top) < 1e-8, "mat_lanczos largest magnitude matches dense solver");
+
+    mat* none = NULL;
+    test_assert(mat_lanczos(&op, 0, NULL, &none, NULL, NULL) == 0 && mat_lanczos(&op, n, NULL, &none, NULL, NULL) == 0,
+                "mat_lanczos returns 0 for invalid k");
+
+    free_mat(P);
+    free_mat(evals);
+    free_mat(evecs);
+    free_mat(small);
+    free_mat(B);
+    free_mat(Bt);
+    free_mat(S);
+    free_mat(sv);
+    free_mat(dense);
+}
+
+void test_mat_arnoldi() {
+    printf("\n--- Testing mat_arnoldi ---\n");
+
+    // nonsymmetric matrix with known spectrum: block diagonal with a rotation block
+    // (eigenvalues 5 +- 2i), a dominant real eigenvalue 8 and small diagonal entries
+    unsigned int n = 80;
+    mat* D = new_mat(n, n);
+    D->values[0][0] = 8.0;
+    D->values[1][1] = 5.0; D->values[1][2] = -2.0;
+    D->values[2][1] = 2.0; D->values[2][2] = 5.0;
+    for (unsigned int i = 3; i < n; i++) D->values[i][i] = (double)(i % 7) * 0.3 - 1.0;
+    // similarity transform by a well-conditioned random matrix keeps the spectrum
+    mat* X = random_mat(n, n, -0.1, 0.1);
+    for (unsigned int i = 0; i < n; i++) X->values[i][i] += 1.0;
+    mat* Lx = NULL, * Ux = NULL, * Px = NULL;
+    mat_lup_decomp(X, &Lx, &Ux, &Px);
+    mat* XD = mat_dot_r(X, D);
+    mat* Xinv = new_mat(n, n);
+    for (unsigned int j = 0; j < n; j++) {
+        mat* e = new_mat(n, 1);
+        e->values[j][0] = 1.0;
+        mat* col = mat_lup_solve(Lx, Ux, Px, e);
+        for (unsigned int i = 0; i < n; i++) Xinv->values[i][j] = col->values[i][0];
+        free_mat(e);
+        free_mat(col);
+    }
+    mat* A = mat_dot_r(XD, Xinv);
+
+    mat_op op = mat_op_from_mat(A);
+    mat_eigs_opts opts = {0, 0, 0, MAT_EIGS_LARGEST_MAG, 0.0};
+    mat* evals = NULL, * evecs = NULL;
+    mat_krylov_stats stats;
+    test_assert(mat_arnoldi(&op, 2, &opts, &evals, &evecs, &stats) == 1, "mat_arnoldi returns 1 for success");
+    test_assert(stats.converged && evals->num_rows == 3, "mat_arnoldi keeps conjugate pair together");
+    test_assert(fabs(evals->values[0][0] - 8.0) < 1e-8 && fabs(evals->values[0][1]) < 1e-8 &&
+                fabs(evals->values[1][0] - 5.0) < 1e-8 && fabs(evals->values[1][1] - 2.0) < 1e-8 &&
+                fabs(evals->values[2][1] + 2.0) < 1e-8, "mat_arnoldi finds dominant real and complex eigenvalues");
+
+    // real eigenvector: A x = 8 x; complex pair: A (xr + i xi) = (5 + 2i)(xr + i xi)
+    mat* Av = mat_dot_r(A, evecs);
+    double worst = 0.0;
+    for (unsigned int i = 0; i < n; i++) {
+        double r0 = Av->values[i][0] - 8.0 * evecs->values[i][0];
+        double rr = Av->values[i][1] - (5.0 * evecs->values[i][1] - 2.0 * evecs->values[i][2]);
+        double ri = Av->values[i][2] - (2.0 * evecs->values[i][1] + 5.0 * evecs->values[i][2]);
+        worst = fmax(worst, fmax(fabs(r0), fmax(fabs(rr), fabs(ri))));
+    }
+    test_assert(worst < 1e-7, "mat_arnoldi eigenvectors satisfy A*v = lambda*v");
+
+    // largest real part on a symmetric problem agrees with Lanczos
+    mat* P = poisson_mat(100);
+    mat_op pop = mat_op_from_mat(P);
+    mat* ea = NULL, * el = NULL;
+    mat_arnoldi(&pop, 3, NULL, &ea, NULL, NULL);
+    mat_lanczos(&pop, 3, NULL, &el, NULL, NULL);
+    int match = 1;
+    for (unsigned int j = 0; j < 3; j++) {
+        if (fabs(ea->values[j][0] - el->values[j][0]) > 1e-8 || ea->values[j][1] != 0.0) match = 0;
+    }
+    test_assert(match, "mat_arnoldi matches mat_lanczos on symmetric operator");
+
+    free_mat(D);
+    free_mat(X);
+    free_mat(Lx);
+    free_mat(Ux);
+    free_mat(Px);
+    free_mat(XD);
+    free_mat(Xinv);
+    free_mat(A);
+    free_mat(evals);
+    free_mat(evecs);
+    free_mat(Av);
+    free_mat(P);
+    free_mat(ea);
+    free_mat(el);
+}
+
+void test_mat_ooc_lu() {
+    printf("\n--- Testing mat_ooc_lu ---\n");
+
+    // 150 x 150 in panels of 16 columns (last panel narrower)
+    unsigned int n = 150;
+    mat* A = random_mat(n, n, -1.0, 1.0);
+    mat* b = random_mat(n, 3, -1.0, 1.0);
+    mat_ooc* m = mat_ooc_create("test_ooc.tmp", n, 16);
+    test_assert(m != NULL && m->panel_cols == 16, "mat_ooc_create opens backing file");
+
+    // write in two row blocks, read a slice back
+    mat* top = new_mat(70, n);
+    mat* bottom = new_mat(80, n);
+    for (unsigned int i = 0; i < n; i++) {
+        memcpy(i < 70 ? top->values[i] : bottom->values[i - 70], A->values[i], n * sizeof(double));
+    }
+    test_assert(mat_ooc_set_rows(m, 0, top) == 1 && mat_ooc_set_rows(m, 70, bottom) == 1,
+                "mat_ooc_set_rows writes row blocks");
+    mat* back = mat_ooc_get_rows(m, 70, 80);
+    test_assert(mat_equal(back, bottom, 0.0), "mat_ooc_get_rows reads rows back");
+
+    // factor and solve several right-hand sides
+    test_assert(mat_ooc_solve(m, b) == NULL, "mat_ooc_solve returns NULL before factorization");
+    test_assert(mat_ooc_lu(m) == 1, "mat_ooc_lu returns 1 for success");
+    mat* x = mat_ooc_solve(m, b);
+    mat* Ax = mat_dot_r(A, x);
+    test_assert(x != NULL && x->num_rows == n && x->num_cols == 3 && mat_equal(Ax, b, 1e-10),
+                "mat_ooc_solve solves A x = b");
+
+    // the factors are readable: first row of U is the pivot row of A
+    mat* u0 = mat_ooc_get_rows(m, 0, 1);
+    double amax = 0.0;
+    for (unsigned int i = 0; i < n; i++) if (fabs(A->values[i][0]) > amax) amax = fabs(A->values[i][0]);
+    test_assert(u0 != NULL && fabs(u0->values[0][0]) == amax, "mat_ooc_lu uses partial pivoting");
+
+    // invalid input
+    mat* wrong = new_mat(n - 1, 1);
+    test_assert(mat_ooc_solve(m, wrong) == NULL, "mat_ooc_solve rejects mismatched right-hand side");
+    test_assert(mat_ooc_set_rows(m, 100, bottom) == 0, "mat_ooc_set_rows rejects rows past the end");
+    test_assert(mat_ooc_create(NULL, n, 16) == NULL, "mat_ooc_create rejects NULL path");
+    mat_ooc_close(m, 1);
+    test_assert(access("test_ooc.tmp", F_OK) != 0, "mat_ooc_close removes backing file");
+
+    free_mat(A);
+    free_mat(b);
+    free_mat(top);
+    free_mat(bottom);
+    free_mat(back);
+    free_mat(x);
+    free_mat(Ax);
+    free_mat(u0);
+    free_mat(wrong);
+
+    // panels sized from a memory budget; more than one block of rows goes
+    // through the trailing gemm update
+    unsigned int nb = 1100;
+    mat_ooc* mb = mat_ooc_create_budget("test_ooc.tmp", nb, (size_t)5 * nb * sizeof(double) * 50);
+    test_assert(mb != NULL && mb->panel_cols == 50, "mat_ooc_create_budget sizes the panels");
+    mat* Ab = random_mat(nb, nb, -1.0, 1.0);
+    mat* bb = random_mat(nb, 1, -1.0, 1.0);
+    mat_ooc_set_rows(mb, 0, Ab);
+    mat_ooc_lu(mb);
+    mat* xb = mat_ooc_solve(mb, bb);
+    mat* Axb = mat_dot_r(Ab, xb);
+    test_assert(xb != NULL && mat_equal(Axb, bb, 1e-9), "budgeted out-of-core LU solves A x = b");
+    mat_ooc_close(mb, 1);
+    test_assert(mat_ooc_create_budget("test_ooc.tmp", nb, 1000) == NULL, "mat_ooc_create_budget rejects a budget below one panel");
+    free_mat(Ab);
+    free_mat(bb);
+    free_mat(xb);
+    free_mat(Axb);
+}
+
+void test_mat_read_text() {
+    printf("\n--- Testing mat_read_text ---\n");
+
+    // header format, values may wrap lines
+    FILE* f = tmpfile();
+    fprintf(f, "2 3\n1 2.5 -3\n4e2\n5, 6\n");
+    rewind(f);
+    mat* A = read_from_filef(f);
+    fclose(f);
+    test_assert(A != NULL && A->num_rows == 2 && A->num_cols == 3, "read_from_filef reads header dimensions");
+    test_assert(A->values[0][1] == 2.5 && A->values[0][2] == -3.0 && A->values[1][0] == 400.0 &&
+                A->values[1][2] == 6.0, "read_from_filef reads values");
+
+    // CSV and whitespace without a header, CRLF line endings, blank lines
+    const char* csv = "0.1,-2.5e-3,  7\r\n\r\n1e22,+3,0.0000000000000000000001\r\n";
+    mat* B = mat_parse_text(csv, strlen(csv));
+    test_assert(B != NULL && B->num_rows == 2 && B->num_cols == 3, "mat_parse_text infers shape from lines");
+    test_assert(B->values[0][0] == 0.1 && B->values[0][1] == -2.5e-3 && B->values[1][0] == 1e22 &&
+                B->values[1][2] == 1e-22, "mat_parse_text rounds decimal inputs correctly");
+
+    // long mantissas and special values take the slow path
+    const char* slow = "3.14159265358979323846264338 1e-400 inf\n-nan 1.7976931348623157e308 123456789012345678901234\n";
+    mat* C = mat_parse_text(slow, strlen(slow));
+    test_assert(C != NULL && C->values[0][0] == 3.14159265358979323846264338 && C->values[0][1] == 0.0 &&
+                isinf(C->values[0][2]) && isnan(C->values[1][0]) && C->values[1][1] == DBL_MAX &&
+                C->values[1][2] == 123456789012345678901234.0, "mat_parse_text handles long and special values");
+
+    // round trip of a large matrix, split across parse chunks
+    mat* R = random_mat(3000, 40, -1e3, 1e3);
+    f = tmpfile();
+    for (unsigned int i = 0; i < R->num_rows; i++) {
+        for (unsigned int j = 0; j < R->num_cols; j++) fprintf(f, j ? ",%.17g" : "%.17g", R->values[i][j]);
+        fprintf(f, "\n");
+    }
+    rewind(f);
+    mat* R2 = mat_read_text(f);
+    fclose(f);
+    test_assert(R2 != NULL && mat_equal(R, R2, 0.0), "mat_read_text round-trips a large matrix exactly");
+
+    // malformed input
+    test_assert(mat_parse_text("1 2\n3\n", 6) == NULL, "mat_parse_text rejects ragged rows");
+    test_assert(mat_parse_text("1 x\n", 4) == NULL, "mat_parse_text rejects non-numeric values");
+    test_assert(mat_parse_text(" \n\n", 3) == NULL, "mat_parse_text rejects empty input");
+    f = tmpfile();
+    fprintf(f, "2 2\n1 2 3\n");
+    rewind(f);
+    test_assert(read_from_filef(f) == NULL, "read_from_filef rejects a short value list");
+    fclose(f);
+    f = tmpfile();
+    fprintf(f, "-1 2\n1 2\n");
+    rewind(f);
+    test_assert(read_from_filef(f) == NULL, "read_from_filef rejects invalid dimensions");
+    fclose(f);
+
+    // consecutive matrices in one stream, each read leaves the rest in place
+    f = tmpfile();
+    fprintf(f, "2 2\n1 2\n3 4\n1 3 0x1p3, 5 -6\ntrailer");
+    rewind(f);
+    mat* S1 = read_from_filef(f);
+    mat* S2 = read_from_filef(f);
+    char rest[16] = "";
+    test_assert(fscanf(f, "%15s", rest) == 1 && strcmp(rest, "trailer") == 0,
+                "read_from_filef leaves the stream after the last value");
+    fclose(f);
+    test_assert(S1 != NULL && S1->num_rows == 2 && S1->values[1][1] == 4.0 &&
+                S2 != NULL && S2->num_rows == 1 && S2->num_cols == 3 && S2->values[0][2] == -6.0,
+                "read_from_filef reads consecutive matrices from one stream");
+    test_assert(S2 != NULL && S2->values[0][0] == 8.0, "hexadecimal floats are parsed by strtod");
+    free_mat(S1);
+    free_mat(S2);
+
+    free_mat(A);
+    free_mat(B);
+    free_mat(C);
+    free_mat(R);
+    free_mat(R2);
+}
+
+void test_mat_binary() {
+    printf("\n--- Testing mat_save_binary / mat_map_binary ---\n");
+
+    mat* A = random_mat(37, 23, -1.0, 1.0);
+    A->values[3][4] = NAN;
+    test_assert(mat_save_binary(A, "test_mat.bin") == 1, "mat_save_binary returns 1 for success");
+
+    // copying load and zero-copy map both reproduce the bits
+    mat* B = mat_load_binary("test_mat.bin");
+    mat* M = mat_map_binary("test_mat.bin", 1);
+    int same = B != NULL && M != NULL && B->num_rows == 37 && M->num_cols == 23 && !M->is_square;
+    for (unsigned int i = 0; same && i < 37; i++) {
+        same = memcmp(A->values[i], B->values[i], 23 * sizeof(double)) == 0 &&
+               memcmp(A->values[i], M->values[i], 23 * sizeof(double)) == 0;
+    }
+    test_assert(same, "binary load and map reproduce values exactly");
+    test_assert(M->map_base != NULL && ((size_t)M->values[0] % 64) == 0, "mapped data is aligned in place");
+    mat* Mt = mat_transpose(M);
+    mat* MMt = mat_dot_r(M, Mt);
+    mat* Bt = mat_transpose(B);
+    mat* BBt = mat_dot_r(B, Bt);
+    test_assert(mat_equal(MMt, BBt, 0.0), "mapped matrix works as an operand");
+
+    // a flipped data byte fails the checksum unless verification is skipped
+    FILE* f = fopen("test_mat.bin", "r+b");
+    fseek(f, 64 + 100, SEEK_SET);
+    int byte = fgetc(f);
+    fseek(f, 64 + 100, SEEK_SET);
+    fputc(byte ^ 1, f);
+    fclose(f);
+    test_assert(mat_load_binary("test_mat.bin") == NULL, "mat_load_binary detects corrupted data");
+    test_assert(mat_map_binary("test_mat.bin", 1) == NULL, "mat_map_binary detects corrupted data when verifying");
+    mat* U = mat_map_binary("test_mat.bin", 0);
+    test_assert(U != NULL, "mat_map_binary skips the checksum when not verifying");
+
+    // truncated file and wrong magic
+    size_t full = 64 + 8 * 37 * 23;
+    char* bytes = malloc(full);
+    f = fopen("test_mat.bin", "rb");
+    size_t got = fread(bytes, 1, full, f);
+    fclose(f);
+    f = fopen("test_mat.bin", "wb");
+    fwrite(bytes, 1, full - 8, f);
+    fclose(f);
+    free(bytes);
+    test_assert(got == full && mat_map_binary("test_mat.bin", 0) == NULL, "mat_map_binary rejects truncated file");
+    f = fopen("test_mat.bin", "r+b");
+    fputc('X', f);
+    fclose(f);
+    test_assert(mat_load_binary("test_mat.bin") == NULL, "mat_load_binary rejects bad magic");
+    test_assert(mat_load_binary("does_not_exist.bin") == NULL, "mat_load_binary fails for missing file");
+    unlink("test_mat.bin");
+
+    free_mat(A);
+    free_mat(B);
+    free_mat(M);
+    free_mat(U);
+    free_mat(Mt);
+    free_mat(MMt);
+    free_mat(Bt);
+    free_mat(BBt);
+}
+
+void test_matrix_market() {
+    printf("\n--- Testing Matrix Market I/O ---\n");
+
+    // coordinate symmetric with a comment, blank line and duplicate entry
+    FILE* f = tmpfile();
+    fprintf(f, "%%%%MatrixMarket matrix coordinate real symmetric\n%% comment\n\n"
+               "3 3 5\n1 1 4.0\n2 1 -1\n3 2 -1.5\n3 3 2e0\n3 3 1\n");
+    rewind(f);
+    mat* D = mat_read_mm(f);
+    rewind(f);
+    spmat* S = spmat_read_mm(f);
+    fclose(f);
+    double expect[3][3] = {{4.0, -1.0, 0.0}, {-1.0, 0.0, -1.5}, {0.0, -1.5, 3.0}};
+    int match = D != NULL;
+    for (unsigned int i = 0; match && i < 3; i++) {
+        for (unsigned int j = 0; j < 3; j++) match = match && D->values[i][j] == expect[i][j];
+    }
+    test_assert(match, "mat_read_mm expands symmetric coordinate file");
+    test_assert(S != NULL && S->nnz == 6 && S->row_ptr[3] == 6 && S->col_idx[0] == 0 && S->col_idx[1] == 1,
+                "spmat_read_mm builds sorted CSR and sums duplicates");
+    mat* SD = spmat_to_mat(S);
+    test_assert(mat_equal(SD, D, 0.0), "spmat_to_mat matches dense read");
+
+    // one long row in descending column order, with a duplicate at the end
+    unsigned int k = 50000;
+    f = tmpfile();
+    fprintf(f, "%%%%MatrixMarket matrix coordinate real general\n2 %u %u\n", k, k + 1);
+    for (unsigned int j = k; j >= 1; j--) fprintf(f, "2 %u %u\n", j, j);
+    fprintf(f, "2 1 0.5\n");
+    rewind(f);
+    spmat* Long = spmat_read_mm(f);
+    fclose(f);
+    int sorted = Long != NULL && Long->nnz == k && Long->row_ptr[1] == 0;
+    for (unsigned int t = 0; sorted && t < k; t++) {
+        sorted = Long->col_idx[t] == t && Long->values[t] == (t == 0 ? 1.5 : t + 1.0);
+    }
+    test_assert(sorted, "spmat_read_mm sorts a long reversed row");
+    free_spmat(Long);
+
+    // pattern, skew-symmetric array and integer fields
+    f = tmpfile();
+    fprintf(f, "%%%%MatrixMarket matrix coordinate pattern general\n2 3 2\n1 3\n2 1\n");
+    rewind(f);
+    mat* P = mat_read_mm(f);
+    fclose(f);
+    test_assert(P != NULL && P->values[0][2] == 1.0 && P->values[1][0] == 1.0 && P->values[0][0] == 0.0,
+                "mat_read_mm reads pattern entries as ones");
+    f = tmpfile();
+    fprintf(f, "%%%%MatrixMarket matrix array integer skew-symmetric\n3 3\n1\n2\n3\n");
+    rewind(f);
+    mat* K = mat_read_mm(f);
+    fclose(f);
+    test_assert(K != NULL && K->values[1][0] == 1.0 && K->values[0][1] == -1.0 && K->values[2][1] == 3.0 &&
+                K->values[1][2] == -3.0 && K->values[1][1] == 0.0, "mat_read_mm reads skew-symmetric array");
+
+    // dense and sparse round trips
+    mat* A = random_mat(7, 5, -1.0, 1.0);
+    A->values[2][3] = 0.0;
+    f = tmpfile();
+    test_assert(mat_write_mm(A, f) == 1, "mat_write_mm returns 1 for success");
+    rewind(f);
+    mat* A2 = mat_read_mm(f);
+    fclose(f);
+    test_assert(A2 != NULL && mat_equal(A, A2, 0.0), "array format round-trips exactly");
+    spmat* SA = spmat_from_mat(A);
+    test_assert(SA->nnz == 34, "spmat_from_mat drops zeros");
+    f = tmpfile();
+    test_assert(spmat_write_mm(SA, f) == 1, "spmat_write_mm returns 1 for success");
+    rewind(f);
+    spmat* SA2 = spmat_read_mm(f);
+    fclose(f);
+    mat* A3 = SA2 ? spmat_to_mat(SA2) : NULL;
+    test_assert(A3 != NULL && mat_equal(A, A3, 0.0), "coordinate format round-trips exactly");
+
+    // sparse products and the operator adapter
+    mat* B = random_mat(5, 2, -1.0, 1.0);
+    mat* Y = spmat_dot(SA, B);
+    mat* Yd = mat_dot_r(A, B);
+    test_assert(mat_equal(Y, Yd, 1e-14), "spmat_dot matches dense product");
+    mat_op op = spmat_op(S);
+    mat* b = new_mat(3, 1);
+    b->values[0][0] = 1.0;
+    mat* x = mat_gmres(&op, b, NULL, NULL, NULL, NULL);
+    mat* r = mat_dot_r(D, x);
+    test_assert(x != NULL && mat_equal(r, b, 1e-9), "spmat_op drives the iterative solvers");
+    test_assert(spmat_op(SA).n == 0, "spmat_op rejects non-square matrix");
+
+    // malformed input
+    f = tmpfile();
+    fprintf(f, "%%%%MatrixMarket matrix coordinate real general\n2 2 2\n1 1 1.0\n3 1 2.0\n");
+    rewind(f);
+    test_assert(mat_read_mm(f) == NULL, "mat_read_mm rejects out of range index");
+    fclose(f);
+    f = tmpfile();
+    fprintf(f, "%%%%MatrixMarket matrix coordinate complex general\n1 1 1\n1 1 1 0\n");
+    rewind(f);
+    test_assert(spmat_read_mm(f) == NULL, "spmat_read_mm rejects complex field");
+    fclose(f);
+    f = tmpfile();
+    fprintf(f, "%%%%MatrixMarket matrix array real general\n2 2\n1\n2\n3\n");
+    rewind(f);
+    test_assert(mat_read_mm(f) == NULL, "mat_read_mm rejects short array");
+    fclose(f);
+    f = tmpfile();
+    fprintf(f, "1 1\n1.0\n");
+    rewind(f);
+    test_assert(mat_read_mm(f) == NULL, "mat_read_mm requires the header");
+    fclose(f);
+
+    free_mat(D);
+    free_spmat(S);
+    free_mat(SD);
+    free_mat(P);
+    free_mat(K);
+    free_mat(A);
+    free_mat(A2);
+    free_spmat(SA);
+    free_spmat(SA2);
+    free_mat(A3);
+    free_mat(B);
+    free_mat(Y);
+    free_mat(Yd);
+    free_mat(b);
+    free_mat(x);
+    free_mat(r);
+}
+
+// writes a version 1.0 .npy file with the given header dict and raw payload
+static void write_npy(const char* path, const char* dict, const void* data, size_t bytes) {
+    char header[128];
+    size_t dlen = strlen(dict);
+    size_t hlen = (10 + dlen + 1 + 63) / 64 * 64 - 10;
+    memset(header, ' ', sizeof(header));
+    memcpy(header, dict, dlen);
+    header[hlen - 1] = '\n';
+    unsigned char pre[10] = {0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0, (unsigned char)hlen, 0};
+    FILE* f = fopen(path, "wb");
+    fwrite(pre, 1, 10, f);
+    fwrite(header, 1, hlen, f);
+    fwrite(data, 1, bytes, f);
+    fclose(f);
+}
+
+void test_mat_npy() {
+    printf("\n--- Testing .npy I/O ---\n");
+
+    // float64 C order round trip, mapped in place
+    mat* A = random_mat(9, 4, -1.0, 1.0);
+    test_assert(mat_save_npy(A, "test_mat.npy") == 1, "mat_save_npy returns 1 for success");
+    mat* B = mat_load_npy("test_mat.npy");
+    mat* M = mat_map_npy("test_mat.npy");
+    test_assert(B != NULL && mat_equal(A, B, 0.0), "mat_load_npy round-trips float64");
+    test_assert(M != NULL && M->map_base != NULL && mat_equal(A, M, 0.0), "mat_map_npy maps native float64 in place");
+
+    // float32 Fortran order is converted and transposed into place
+    float f32[6] = {1.0f, 2.0f, 3.0f, 4.5f, 5.0f, 6.0f};
+    write_npy("test_mat.npy", "{'descr': '<f4', 'fortran_order': True, 'shape': (2, 3), }", f32, sizeof(f32));
+    mat* F = mat_map_npy("test_mat.npy");
+    test_assert(F != NULL && F->map_base == NULL && F->num_rows == 2 && F->num_cols == 3 &&
+                F->values[0][1] == 3.0 && F->values[1][1] == 4.5 && F->values[1][2] == 6.0,
+                "mat_map_npy falls back to converting float32 Fortran order");
+
+    // big-endian float64 vector becomes a column
+    double be[3] = {1.5, -2.0, 1e300};
+    unsigned char swapped[24];
+    for (int k = 0; k < 3; k++) {
+        unsigned char* src = (unsigned char*)&be[k];
+        for (int b = 0; b < 8; b++) swapped[k * 8 + b] = src[7 - b];
+    }
+    write_npy("test_mat.npy", "{'descr': '>f8', 'fortran_order': False, 'shape': (3,), }", swapped, sizeof(swapped));
+    mat* V = mat_load_npy("test_mat.npy");
+    test_assert(V != NULL && V->num_rows == 3 && V->num_cols == 1 && V->values[0][0] == 1.5 &&
+                V->values[1][0] == -2.0 && V->values[2][0] == 1e300, "mat_load_npy reads big-endian vector");
+
+    // unsupported dtypes, shapes and truncated payloads
+    write_npy("test_mat.npy", "{'descr': '<i8', 'fortran_order': False, 'shape': (3,), }", swapped, sizeof(swapped));
+    test_assert(mat_load_npy("test_mat.npy") == NULL, "mat_load_npy rejects integer dtype");
+    write_npy("test_mat.npy", "{'descr': '<f8', 'fortran_order': False, 'shape': (1, 1, 3), }", be, sizeof(be));
+    test_assert(mat_load_npy("test_mat.npy") == NULL, "mat_load_npy rejects three dimensions");
+    write_npy("test_mat.npy", "{'descr': '<f8', 'fortran_order': False, 'shape': (2, 2), }", be, sizeof(be));
+    test_assert(mat_load_npy("test_mat.npy") == NULL && mat_map_npy("test_mat.npy") == NULL,
+                "truncated .npy payload is rejected");
+    test_assert(mat_load_npy("does_not_exist.npy") == NULL, "mat_load_npy fails for missing file");
+    // a huge shape over a tiny payload is rejected before allocating
+    write_npy("test_mat.npy", "{'descr': '<f8', 'fortran_order': False, 'shape': (3000000000, 3000000000), }",
+              be, sizeof(be));
+    test_assert(mat_load_npy("test_mat.npy") == NULL && mat_reader_open("test_mat.npy", 0) == NULL,
+                ".npy shape larger than the file is rejected");
+    unlink("test_mat.npy");
+
+    free_mat(A);
+    free_mat(B);
+    free_mat(M);
+    free_mat(F);
+    free_mat(V);
+}
+
+void test_mat_fwrite_text() {
+    printf("\n--- Testing mat_format_double / mat_fwrite_text ---\n");
+
+    // shortest forms and special values
+    char buf[32];
+    double values[] = {0.1, -2.5, 1e22, 5e-324, 1.7976931348623157e308, 0.00015, 123456789.0, 1e-7};
+    const char* expect[] = {"0.1", "-2.5", "1e22", "5e-324", "1.7976931348623157e308",
+                            "0.00015", "123456789", "1e-7"};
+    int same = 1;
+    for (int k = 0; k < 8; k++) {
+        mat_format_double(values[k], buf);
+        if (strcmp(buf, expect[k]) != 0) same = 0;
+    }
+    test_assert(same, "mat_format_double writes shortest decimal forms");
+    mat_format_double(-0.0, buf);
+    int neg_zero = strcmp(buf, "-0") == 0;
+    mat_format_double(NAN, buf);
+    test_assert(neg_zero && strcmp(buf, "nan") == 0, "mat_format_double handles signed zero and NaN");
+
+    // every value reads back to the same bits
+    int round_trip = 1;
+    for (unsigned int k = 0; k < 20000; k++) {
+        double v = ((double)rand() / RAND_MAX - 0.5) * pow(10.0, (double)(k % 600) - 300.0);
+        mat_format_double(v, buf);
+        if (strtod(buf, NULL) != v) round_trip = 0;
+    }
+    test_assert(round_trip, "mat_format_double output round-trips through strtod");
+
+    // stream output, split over several write batches, reads back exactly
+    mat* A = random_mat(1500, 30, -1e5, 1e5);
+    FILE* f = tmpfile();
+    test_assert(mat_fwrite_text(A, f, ',') == 1, "mat_fwrite_text returns 1 for success");
+    rewind(f);
+    mat* B = mat_read_text(f);
+    fclose(f);
+    test_assert(B != NULL && mat_equal(A, B, 0.0), "mat_fwrite_text output reads back exactly");
+
+    // descriptor output
+    int fd = open("test_out.txt", O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    test_assert(mat_write_text_fd(A, fd, '\t') == 1, "mat_write_text_fd returns 1 for success");
+    close(fd);
+    f = fopen("test_out.txt", "r");
+    mat* C = mat_read_text(f);
+    fclose(f);
+    unlink("test_out.txt");
+    test_assert(C != NULL && mat_equal(A, C, 0.0), "mat_write_text_fd output reads back exactly");
+    test_assert(mat_fwrite_text(A, stdout, ';') == 0, "mat_fwrite_text rejects unsupported delimiter");
+
+    free_mat(A);
+    free_mat(B);
+    free_mat(C);
+}
+
+void test_mat_reader() {
+    printf("\n--- Testing mat_reader ---\n");
+
+    // binary source, blocks feed TSQR and a Gram matrix accumulation
+    mat* A = random_mat(1000, 6, -1.0, 1.0);
+    mat_save_binary(A, "test_stream.bin");
+    mat_reader* r = mat_reader_open("test_stream.bin", 64);
+    test_assert(r != NULL && mat_reader_cols(r) == 6, "mat_reader_open detects binary source");
+    mat_tsqr* state = mat_tsqr_begin(6, 0);
+    mat* G = new_mat(6, 6);
+    unsigned int rows = 0, blocks = 0;
+    mat* b;
+    while ((b = mat_reader_next(r)) != NULL) {
+        mat_tsqr_push(state, b, NULL);
+        for (unsigned int i = 0; i < b->num_rows; i++) {
+            for (unsigned int p = 0; p < 6; p++) {
+                for (unsigned int q = 0; q < 6; q++) G->values[p][q] += b->values[i][p] * b->values[i][q];
+            }
+        }
+        rows += b->num_rows;
+        blocks++;
+    }
+    test_assert(mat_reader_close(r) == 1 && rows == 1000 && blocks == 16, "mat_reader streams all rows in blocks");
+    mat* At = mat_transpose(A);
+    mat* AtA = mat_dot_r(At, A);
+    test_assert(mat_equal(G, AtA, 1e-9), "streamed Gram matrix matches A^T A");
+    mat* R = mat_tsqr_r(state);
+    mat* Rt = mat_transpose(R);
+    mat* RtR = mat_dot_r(Rt, R);
+    test_assert(mat_equal(RtR, AtA, 1e-9), "streamed TSQR factor matches A^T A");
+
+    // text source with blank lines, read in odd-sized blocks
+    FILE* f = fopen("test_stream.txt", "w");
+    mat_fwrite_text(A, f, ',');
+    fprintf(f, "\n\n");
+    fclose(f);
+    r = mat_reader_open("test_stream.txt", 333);
+    int same = r != NULL && mat_reader_cols(r) == 6;
+    rows = 0;
+    while (same && (b = mat_reader_next(r)) != NULL) {
+        for (unsigned int i = 0; i < b->num_rows; i++) {
+            if (memcmp(b->values[i], A->values[rows + i], 6 * sizeof(double)) != 0) same = 0;
+        }
+        rows += b->num_rows;
+    }
+    test_assert(mat_reader_close(r) == 1 && same && rows == 1000, "mat_reader streams text rows exactly");
+
+    // .npy source, stopped early
+    mat_save_npy(A, "test_stream.npy");
+    r = mat_reader_open("test_stream.npy", 100);
+    b = mat_reader_next(r);
+    test_assert(b != NULL && b->num_rows == 100 && b->values[99][5] == A->values[99][5],
+                "mat_reader streams .npy rows");
+    test_assert(mat_reader_close(r) == 1, "mat_reader_close stops reading early");
+
+    // headered text as read_from_filef reads it, values wrapping lines
+    f = fopen("test_stream.txt", "w");
+    fprintf(f, "2 2\n1 2\n3 4\n");
+    fclose(f);
+    r = mat_reader_open("test_stream.txt", 0);
+    b = mat_reader_next(r);
+    test_assert(r != NULL && mat_reader_cols(r) == 2 && b != NULL && b->num_rows == 2 && b->values[0][0] == 1.0 &&
+                b->values[1][1] == 4.0 && mat_reader_next(r) == NULL, "mat_reader reads the rows cols header");
+    test_assert(mat_reader_close(r) == 1, "mat_reader_close accepts a complete headered file");
+    f = fopen("test_stream.txt", "w");
+    fprintf(f, "3 2\n1 2 3\n4\n\n5 6\n");
+    fclose(f);
+    r = mat_reader_open("test_stream.txt", 2);
+    mat* b1 = mat_reader_next(r);
+    int wrapped = b1 != NULL && b1->num_rows == 2 && b1->values[1][0] == 3.0 && b1->values[1][1] == 4.0;
+    mat* b2 = mat_reader_next(r);
+    wrapped = wrapped && b2 != NULL && b2->num_rows == 1 && b2->values[0][1] == 6.0 && mat_reader_next(r) == NULL;
+    test_assert(mat_reader_close(r) == 1 && wrapped, "mat_reader reads headered values that wrap lines");
+    f = fopen("test_stream.txt", "w");
+    fprintf(f, "2 2\n1 2\n3 4 5\n");
+    fclose(f);
+    r = mat_reader_open("test_stream.txt", 0);
+    test_assert(mat_reader_next(r) == NULL && mat_reader_close(r) == 0, "mat_reader_close reports values beyond the header");
+
+    // a bad line ends the stream with an error
+    f = fopen("test_stream.txt", "w");
+    fprintf(f, "1.5 2\n3 4\n5\n");
+    fclose(f);
+    r = mat_reader_open("test_stream.txt", 2);
+    b = mat_reader_next(r);
+    test_assert(b != NULL && b->num_rows == 2, "mat_reader returns rows before the error");
+    test_assert(mat_reader_next(r) == NULL && mat_reader_close(r) == 0, "mat_reader_close reports a malformed source");
+    test_assert(mat_reader_open("does_not_exist.txt", 4) == NULL, "mat_reader_open fails for missing file");
+    unlink("test_stream.bin");
+    unlink("test_stream.txt");
+    unlink("test_stream.npy");
+
+    mat_tsqr_free(state);
+    free_mat(A);
+    free_mat(G);
+    free_mat(At);
+    free_mat(AtA);
+    free_mat(R);
+    free_mat(Rt);
+    free_mat(RtR);
+}
+
+void test_mat_compressed() {
+    printf("\n--- Testing compressed binary format ---\n");
+
+    // repeated values and smooth columns compress well and round-trip exactly
+    mat* A = new_mat(2000, 12);
+    for (unsigned int i = 0; i < 2000; i++) {
+        for (unsigned int j = 0; j < 12; j++) A->values[i][j] = j < 6 ? (double)(i / 100) : 0.25 * j + 1e-3 * (i / 10);
+    }
+    A->values[7][3] = NAN;
+    test_assert(mat_save_compressed(A, "test_mat.jz", 150) == 1, "mat_save_compressed returns 1 for success");
+    FILE* f = fopen("test_mat.jz", "rb");
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    test_assert(size < 2000 * 12 * 8 / 4, "compressed file is several times smaller");
+    mat* B = mat_load_compressed("test_mat.jz");
+    int same = B != NULL && B->num_rows == 2000 && B->num_cols == 12;
+    for (unsigned int i = 0; same && i < 2000; i++) same = memcmp(A->values[i], B->values[i], 12 * sizeof(double)) == 0;
+    test_assert(same, "mat_load_compressed restores the exact bits");
+
+    // partial load across block boundaries
+    mat* P = mat_load_compressed_rows("test_mat.jz", 140, 400);
+    same = P != NULL && P->num_rows == 400;
+    for (unsigned int i = 0; same && i < 400; i++) same = memcmp(A->values[140 + i], P->values[i], 12 * sizeof(double)) == 0;
+    test_assert(same, "mat_load_compressed_rows decodes a row range");
+    test_assert(mat_load_compressed_rows("test_mat.jz", 1900, 101) == NULL, "mat_load_compressed_rows rejects rows past the end");
+
+    // incompressible data is stored raw
+    mat* R = random_mat(300, 7, -1.0, 1.0);
+    mat_save_compressed(R, "test_mat.jz", 0);
+    mat* R2 = mat_load_compressed("test_mat.jz");
+    test_assert(R2 != NULL && mat_equal(R, R2, 0.0), "random matrix round-trips");
+
+    // corrupted block is detected
+    mat_save_compressed(A, "test_mat.jz", 150);
+    f = fopen("test_mat.jz", "r+b");
+    fseek(f, 100, SEEK_SET);
+    int byte = fgetc(f);
+    fseek(f, 100, SEEK_SET);
+    fputc(byte ^ 0x10, f);
+    fclose(f);
+    test_assert(mat_load_compressed("test_mat.jz") == NULL, "mat_load_compressed detects corruption");
+    mat* tail = mat_load_compressed_rows("test_mat.jz", 1800, 200);
+    test_assert(tail != NULL && tail->values[199][11] == A->values[1999][11],
+                "undamaged blocks still load");
+
+    // a valid small file whose header claims a huge shape is rejected before
+    // the matrix is allocated
+    mat* small = new_mat(2, 2);
+    mat_save_compressed(small, "test_mat.jz", 0);
+    unsigned int huge_block = 4000000000u;
+    unsigned long long huge_dim = 3000000000ull;
+    f = fopen("test_mat.jz", "r+b");
+    fseek(f, 12, SEEK_SET);
+    fwrite(&huge_block, sizeof(huge_block), 1, f);
+    fwrite(&huge_dim, sizeof(huge_dim), 1, f);
+    fwrite(&huge_dim, sizeof(huge_dim), 1, f);
+    fclose(f);
+    test_assert(mat_load_compressed("test_mat.jz") == NULL, "mat_load_compressed rejects a shape larger than the file");
+    test_assert(mat_load_compressed_rows("test_mat.jz", 0, 1) == NULL, "mat_load_compressed_rows rejects a shape larger than the file");
+    free_mat(small);
+
+    unlink("test_mat.jz");
+    test_assert(mat_load_compressed("test_mat.jz") == NULL, "mat_load_compressed fails for missing file");
+
+    free_mat(A);
+    free_mat(B);
+    free_mat(P);
+    free_mat(R);
+    free_mat(R2);
+    free_mat(tail);
+}
+
+void test_mat_rng() {
+    printf("\n--- Testing mat_rng ---\n");
+
+    // bulk fill, single draws and jump-ahead all index the same sequence
+    mat_rng a, b;
+    mat_rng_seed(&a, 42, 0);
+    mat_rng_seed(&b, 42, 0);
+    double bulk[101];
+    mat_rng_fill(&a, bulk, 101, 0.0, 1.0);
+    int same = 1;
+    for (int k = 0; k < 101; k++) same = same && mat_rng_uniform(&b) == bulk[k];
+    test_assert(same && a.position == 101 && b.position == 101, "mat_rng_fill matches repeated mat_rng_uniform");
+    mat_rng_seed(&b, 42, 0);
+    mat_rng_skip(&b, 57);
+    double tail[44];
+    mat_rng_fill(&b, tail, 44, 0.0, 1.0);
+    test_assert(memcmp(tail, bulk + 57, sizeof(tail)) == 0, "mat_rng_skip jumps ahead exactly");
+
+    // streams and seeds are independent; values stay in range
+    mat_rng_seed(&b, 42, 1);
+    int differs = mat_rng_uniform(&b) != bulk[0];
+    mat_rng_seed(&b, 43, 0);
+    differs = differs && mat_rng_uniform(&b) != bulk[0];
+    test_assert(differs, "different seeds and streams give different sequences");
+    mat_rng_seed(&a, 7, 3);
+    mat* R = mat_random_rng(&a, 300, 301, -2.0, 5.0);
+    double lo = 5.0, hi = -2.0, mean = 0.0;
+    for (unsigned int i = 0; i < 300; i++) {
+        for (unsigned int j = 0; j < 301; j++) {
+            double v = R->values[i][j];
+            if (v < lo) lo = v;
+            if (v > hi) hi = v;
+            mean += v;
+        }
+    }
+    mean /= 300.0 * 301.0;
+    test_assert(lo >= -2.0 && hi < 5.0 && fabs(mean - 1.5) < 0.02, "mat_random_rng fills the requested range");
+
+    // rows of a parallel fill continue the stream in row-major order
+    mat_rng_seed(&b, 7, 3);
+    mat_rng_skip(&b, 250 * 301 + 17);
+    test_assert(-2.0 + 7.0 * mat_rng_uniform(&b) == R->values[250][17], "parallel fill is position-exact");
+
+    // mat_seed makes random_mat reproducible
+    mat_seed(2024);
+    mat* X = random_mat(40, 30, -1.0, 1.0);
+    mat_seed(2024);
+    mat* Y = random_mat(40, 30, -1.0, 1.0);
+    mat* Z = random_mat(40, 30, -1.0, 1.0);
+    test_assert(mat_equal(X, Y, 0.0) && !mat_equal(Y, Z, 0.0), "mat_seed restarts the random_mat sequence");
+
+    free_mat(R);
+    free_mat(X);
+    free_mat(Y);
+    free_mat(Z);
+}
+
+void test_structured_random() {
+    printf("\n--- Testing structured random matrices ---\n");
+    mat_rng rng;
+    mat_rng_seed(&rng, 11, 0);
+
+    // normal entries have the requested moments
+    mat* N = mat_random_normal(&rng, 200, 250, 3.0, 2.0);
+    double mean = 0.0, var = 0.0;
+    for (unsigned int i = 0; i < 200; i++) {
+        for (unsigned int j = 0; j < 250; j++) mean += N->values[i][j];
+    }
+    mean /= 50000.0;
+    for (unsigned int i = 0; i < 200; i++) {
+        for (unsigned int j = 0; j < 250; j++) var += (N->values[i][j] - mean) * (N->values[i][j] - mean);
+    }
+    var /= 50000.0;
+    test_assert(fabs(mean - 3.0) < 0.05 && fabs(var - 4.0) < 0.1 && rng.position == 50000,
+                "mat_random_normal has the requested mean and variance");
+
+    // Haar orthogonal
+    mat* Q = mat_random_orthogonal(&rng, 60);
+    test_assert(Q != NULL && orth_error(Q) < 1e-12, "mat_random_orthogonal is orthogonal");
+
+    // prescribed condition number
+    mat* C = mat_random_cond(&rng, 50, 30, 1e6);
+    mat* S = NULL;
+    mat_svd(C, NULL, &S, NULL, 0);
+    test_assert(fabs(S->values[0][0] - 1.0) < 1e-10 && fabs(S->values[0][0] / S->values[29][0] - 1e6) < 1e-3,
+                "mat_random_cond has the requested condition number");
+
+    // SPD, exactly symmetric, factors with Cholesky
+    mat* A = mat_random_spd(&rng, 40, 100.0);
+    mat* At = mat_transpose(A);
+    mat* L = NULL;
+    test_assert(A != NULL && mat_equal(A, At, 0.0) && mat_chol_decomp(A, &L) == 1, "mat_random_spd is SPD");
+
+    // banded
+    mat* B = mat_random_banded(&rng, 30, 2, 1, -1.0, 1.0);
+    int band_ok = 1;
+    for (unsigned int i = 0; i < 30; i++) {
+        for (unsigned int j = 0; j < 30; j++) {
+            int inside = (int)j >= (int)i - 2 && (int)j <= (int)i + 1;
+            if (inside == (B->values[i][j] == 0.0)) band_ok = 0;
+        }
+    }
+    test_assert(band_ok, "mat_random_banded fills exactly the band");
+
+    // sparse with given density, sorted distinct columns
+    spmat* P = spmat_random(&rng, 500, 400, 0.0125, -1.0, 1.0);
+    int sorted = 1;
+    for (unsigned int i = 0; i < 500; i++) {
+        for (unsigned long long k = P->row_ptr[i] + 1; k < P->row_ptr[i + 1]; k++) {
+            if (P->col_idx[k] <= P->col_idx[k - 1]) sorted = 0;
+        }
+    }
+    test_assert(sorted && P->nnz == 2500, "spmat_random has the requested density and distinct sorted columns");
+    spmat* D = spmat_random(&rng, 50, 40, 0.3, 0.0, 1.0);
+    test_assert(D != NULL && D->nnz > 500 && D->nnz < 700, "spmat_random rounds fractional row counts at random");
+
+    // the same seed reproduces every generator
+    mat_rng again;
+    mat_rng_seed(&again, 11, 0);
+    mat* N2 = mat_random_normal(&again, 200, 250, 3.0, 2.0);
+    mat* Q2 = mat_random_orthogonal(&again, 60);
+    test_assert(mat_equal(N, N2, 0.0) && mat_equal(Q, Q2, 0.0), "structured generators are reproducible");
+    test_assert(mat_random_spd(&rng, 5, 0.5) == NULL, "mat_random_spd rejects cond < 1");
+
+    free_mat(N);
+    free_mat(Q);
+    free_mat(C);
+    free_mat(S);
+    free_mat(A);
+    free_mat(At);
+    free_mat(L);
+    free_mat(B);
+    free_spmat(P);
+    free_spmat(D);
+    free_mat(N2);
+    free_mat(Q2);
+}
+
+void test_mat_runtime() {
+    printf("\n--- Testing shared runtime ---\n");
+    mat_rng rng;
+    mat_rng_seed(&rng, 48, 0);
+    mat* A = mat_random_normal(&rng, 300, 200, 0.0, 1.0);
+    mat* B = mat_random_normal(&rng, 200, 250, 0.0, 1.0);
+
+    test_assert(mat_runtime_init(4, 0) == 1 && mat_runtime_threads() == 4, "mat_runtime_init sets the thread count");
+    mat* P4 = mat_dot_r(A, B);
+
+    // per-thread opt-out runs the same kernels on the caller alone
+    int previous = mat_runtime_serial(1);
+    mat* P1 = mat_dot_r(A, B);
+    test_assert(previous == 0 && mat_runtime_serial(previous) == 1, "mat_runtime_serial returns the previous setting");
+    test_assert(P4 != NULL && P1 != NULL && mat_equal(P4, P1, 0.0), "serial and pooled results are identical");
+
+    // shutdown, then lazy restart on the next kernel
+    mat_runtime_shutdown();
+    mat* P2 = mat_dot_r(A, B);
+    test_assert(P2 != NULL && mat_equal(P4, P2, 0.0), "kernels restart the pool after shutdown");
+
+    // pinned pool gives the same answer
+    test_assert(mat_runtime_init(3, 1) == 1 && mat_runtime_threads() == 3, "mat_runtime_init with pinning");
+    mat* P3 = mat_dot_r(A, B);
+    test_assert(P3 != NULL && mat_equal(P4, P3, 0.0), "pinned pool results are identical");
+
+    // nested kernels (SVD runs GEMMs inside parallel ranges) stay correct
+    mat* S = NULL;
+    test_assert(mat_svd(A, NULL, &S, NULL, 0) == 1 && S != NULL, "nested parallel kernels complete");
+
+    // a forked child has none of the workers and must start its own pool
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        alarm(10);
+        mat* C = mat_dot_r(A, B);
+        _exit(C != NULL && mat_equal(P4, C, 0.0) ? 0 : 1);
+    }
+    int status = 0;
+    test_assert(child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+                "kernels run in a forked child of a pooled process");
+
+    mat_runtime_shutdown();
+    free_mat(A);
+    free_mat(B);
+    free_mat(P4);
+    free_mat(P1);
+    free_mat(P2);
+    free_mat(P3);
+    free_mat(S);
+}
+
+void test_parallel_elementwise() {
+    printf("\n--- Testing parallel elementwise operations ---\n");
+    mat_runtime_init(4, 0);
+    mat_rng rng;
+    mat_rng_seed(&rng, 49, 0);
+    // large enough to be split across the pool, with an odd shape
+    unsigned int r = 517, c = 1031;
+    mat* A = mat_random_rng(&rng, r, c, -1.0, 1.0);
+    mat* B = mat_random_rng(&rng, r, c, -1.0, 1.0);
+
+    mat* C = mat_cp(A);
+    mat_add_r(C, B);
+    mat* D = mat_sub(A, B);
+    mat* E = mat_smult(A, -2.5);
+    int ok = 1;
+    for (unsigned int i = 0; i < r; i++) {
+        for (unsigned int j = 0; j < c; j++) {
+            ok &= C->values[i][j] == A->values[i][j] + B->values[i][j];
+            ok &= D->values[i][j] == A->values[i][j] - B->values[i][j];
+            ok &= E->values[i][j] == A->values[i][j] * -2.5;
+        }
+    }
+    test_assert(ok, "parallel add, sub and smult match the elementwise definition");
+
+    set_mat_val(C, 3.25);
+    ok = 1;
+    for (unsigned int i = 0; i < r; i++) {
+        for (unsigned int j = 0; j < c; j++) ok &= C->values[i][j] == 3.25;
+    }
+    test_assert(ok, "parallel set_mat_val fills every cell");
+
+    mat* T = mat_transpose(A);
+    ok = T->num_rows == c && T->num_cols == r;
+    for (unsigned int i = 0; i < r && ok; i++) {
+        for (unsigned int j = 0; j < c; j++) ok &= T->values[j][i] == A->values[i][j];
+    }
+    test_assert(ok, "parallel tiled transpose");
+
+    mat* arr[3] = {A, B, E};
+    mat* H = mat_hor_cat(3, arr);
+    mat* V = mat_vert_cat(3, arr);
+    ok = H->num_cols == 3 * c && V->num_rows == 3 * r;
+    for (unsigned int i = 0; i < r && ok; i++) {
+        for (unsigned int j = 0; j < c; j++) {
+            ok &= H->values[i][j] == A->values[i][j] && H->values[i][c + j] == B->values[i][j] &&
+                  H->values[i][2 * c + j] == E->values[i][j];
+            ok &= V->values[i][j] == A->values[i][j] && V->values[r + i][j] == B->values[i][j] &&
+                  V->values[2 * r + i][j] == E->values[i][j];
+        }
+    }
+    test_assert(ok, "parallel horizontal and vertical concatenation");
+
+    mat_runtime_shutdown();
+    free_mat(A);
+    free_mat(B);
+    free_mat(C);
+    free_mat(D);
+    free_mat(E);
+    free_mat(T);
+    free_mat(H);
+    free_mat(V);
+}
+
+void test_mat_alloc_policy() {
+    printf("\n--- Testing allocation policy ---\n");
+    mat_runtime_init(4, 0);
+    // route anything of 64 KB and up through the placed allocation
+    test_assert(mat_alloc_large(65536, 1) == 1, "mat_alloc_large sets the threshold");
+    mat* small = new_mat(10, 10);
+    test_assert(small->region_base == NULL, "small matrices keep the per-row allocation");
+
+    int policies[3] = {MAT_ALLOC_FIRST_TOUCH, MAT_ALLOC_INTERLEAVE, MAT_ALLOC_NODE};
+    const char* names[3] = {"first touch", "interleave", "node 0"};
+    for (int p = 0; p < 3; p++) {
+        char msg[128];
+        test_assert(mat_alloc_policy(policies[p], 0) == 1, "mat_alloc_policy accepts a valid policy");
+        mat* A = new_mat(300, 257);
+        int zero = A->region_base != NULL && A->map_base == NULL;
+        for (unsigned int i = 0; i < A->num_rows && zero; i++) {
+            for (unsigned int j = 0; j < A->num_cols; j++) zero &= A->values[i][j] == 0.0;
+        }
+        snprintf(msg, sizeof(msg), "%s allocation is mapped and zeroed", names[p]);
+        test_assert(zero, msg);
+
+        // placed matrices behave like any other
+        set_mat_val(A, 1.5);
+        mat* B = mat_cp(A);
+        mat_row_swap_r(B, 0, 299);
+        mat_add_r(B, A);
+        int ok = 1;
+        for (unsigned int i = 0; i < B->num_rows; i++) {
+            for (unsigned int j = 0; j < B->num_cols; j++) ok &= B->values[i][j] == 3.0;
+        }
+        snprintf(msg, sizeof(msg), "%s allocation works with the kernels", names[p]);
+        test_assert(ok, msg);
+        free_mat(A);
+        free_mat(B);
+    }
+
+    // a large load is writable memory; only a file mapping sets map_base
+    mat* N = new_mat(300, 257);
+    mat_save_npy(N, "test_alloc.npy");
+    mat* L = mat_load_npy("test_alloc.npy");
+    mat* Mp = mat_map_npy("test_alloc.npy");
+    test_assert(L != NULL && L->map_base == NULL && L->region_base != NULL, "large loaded matrices are not file mappings");
+    test_assert(Mp != NULL && Mp->map_base != NULL && Mp->region_base == NULL, "mat_map_npy marks the file mapping");
+    unlink("test_alloc.npy");
+    free_mat(N);
+    free_mat(L);
+    free_mat(Mp);
+
+    test_assert(mat_alloc_policy(MAT_ALLOC_NODE, 100000) == 0, "mat_alloc_policy rejects an unavailable node");
+    test_assert(mat_alloc_policy(7, 0) == 0, "mat_alloc_policy rejects an unknown policy");
+
+    // threshold 0 turns the placed allocation off
+    mat_alloc_large(0, 0);
+    mat* C = new_mat(300, 257);
+    test_assert(C->region_base == NULL, "mat_alloc_large(0) disables the placed allocation");
+
+    // restore the defaults
+    mat_alloc_policy(MAT_ALLOC_FIRST_TOUCH, 0);
+    mat_alloc_large((size_t)1 << 22, 1);
+    mat_runtime_shutdown();
+    free_mat(small);
+    free_mat(C);
+}
+
 int main() {
     printf("Running Matrix Library Tests\n");
     printf("============================\n");
@@ -1655,6 +3972,38 @@ int main() {
     test_mat_transpose();
     test_mat_qr_decomp();
     test_mat_qr_solve();
+    test_mat_cg();
+    test_mat_bicgstab();
+    test_mat_gmres();
+    test_mat_lup_solve_mixed();
+    test_mat_sym_eig();
+    test_mat_hessenberg();
+    test_mat_eig();
+    test_mat_svd();
+    test_mat_tsqr();
+    test_mat_chol();
+    test_mat_lup_update();
+    test_mat_qr_update();
+    test_mat_qrcp();
+    test_mat_rcond();
+    test_mat_pow();
+    test_mat_expm();
+    test_mat_rsvd();
+    test_mat_lanczos();
+    test_mat_arnoldi();
+    test_mat_ooc_lu();
+    test_mat_read_text();
+    test_mat_binary();
+    test_matrix_market();
+    test_mat_npy();
+    test_mat_fwrite_text();
+    test_mat_reader();
+    test_mat_compressed();
+    test_mat_rng();
+    test_structured_random();
+    test_mat_runtime();
+    test_parallel_elementwise();
+    test_mat_alloc_policy();
     
     print_test_summary();
     